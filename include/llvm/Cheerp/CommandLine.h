@@ -17,6 +17,8 @@
 extern llvm::cl::opt<std::string> WasmLoader;
 extern llvm::cl::opt<std::string> WasmFile;
 extern llvm::cl::opt<std::string> AsmJSMemFile;
+extern llvm::cl::opt<std::string> LazyDataFile;
+extern llvm::cl::list<std::string> LazyData;
 extern llvm::cl::opt<std::string> SourceMap;
 extern llvm::cl::opt<std::string> SourceMapPrefix;
 extern llvm::cl::opt<std::string> MakeModule;
@@ -24,6 +26,7 @@ extern llvm::cl::opt<bool> SourceMapStandAlone;
 extern llvm::cl::opt<bool> PrettyCode;
 extern llvm::cl::opt<bool> SymbolicGlobalsAsmJS;
 extern llvm::cl::opt<bool> NoRegisterize;
+extern llvm::cl::opt<bool> RegisterizeColoring;
 extern llvm::cl::opt<bool> NoNativeJavaScriptMath;
 extern llvm::cl::opt<bool> NoJavaScriptMathImul;
 extern llvm::cl::opt<bool> NoJavaScriptMathFround;
@@ -32,7 +35,21 @@ extern llvm::cl::opt<bool> MeasureTimeToMain;
 extern llvm::cl::opt<bool> ForceTypedArrays;
 extern llvm::cl::list<std::string> ReservedNames;
 extern llvm::cl::opt<unsigned> CheerpHeapSize;
+extern llvm::cl::opt<unsigned> CheerpHeapMaxSize;
+extern llvm::cl::opt<unsigned> CheerpStackSize;
 extern llvm::cl::opt<bool> CheerpNoICF;
+extern llvm::cl::opt<unsigned> CheerpMergeSimilarFunctions;
 extern llvm::cl::opt<bool> BoundsCheck;
+extern llvm::cl::opt<unsigned> CheerpThreads;
+extern llvm::cl::opt<std::string> WasmCacheDir;
+extern llvm::cl::opt<bool> WasmStreaming;
+extern llvm::cl::opt<bool> WasmCacheModule;
+extern llvm::cl::opt<std::string> CheerpPassReport;
+extern llvm::cl::opt<bool> WasmNoPeephole;
+extern llvm::cl::opt<bool> WasmNoStructurizer;
+extern llvm::cl::opt<bool> CheerpProfileGenerate;
+extern llvm::cl::opt<std::string> CheerpProfileUse;
+extern llvm::cl::opt<std::string> CheerpInstrument;
+extern llvm::cl::opt<unsigned> CheerpInstrumentMinSize;
 
 #endif //_CHEERP_COMMAND_LINE_H
@@ -0,0 +1,81 @@
+//===-- Cheerp/FunctionProfile.h - Profile guided function layout ---------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_FUNCTION_PROFILE_H
+#define _CHEERP_FUNCTION_PROFILE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include <memory>
+
+namespace cheerp
+{
+
+/**
+ * Number of calls of the asm.js and wasm functions during a profiling run.
+ *
+ * A profile is a text file with a "<count> <function name>" line for each
+ * function, as returned by the cheerpProfileDump() helper of the builds
+ * instrumented by ProfileInstrumentation. Empty lines and lines starting
+ * with '#' are ignored.
+ */
+class FunctionProfile
+{
+public:
+	// Reads the profile at path, reports a fatal error if it is not valid
+	static std::unique_ptr<FunctionProfile> read(llvm::StringRef path);
+	// Adds the counts found in data, returns false if it is not valid
+	bool parse(llvm::StringRef data);
+
+	bool hasCount(const llvm::Function& F) const
+	{
+		return counts.count(F.getName());
+	}
+	// Returns 0 for the functions which are not in the profile
+	uint64_t getCount(const llvm::Function& F) const
+	{
+		return counts.lookup(F.getName());
+	}
+private:
+	llvm::StringMap<uint64_t> counts;
+};
+
+/**
+ * Count the calls of every asm.js and wasm function in an array in linear
+ * memory. The names of the functions, in the order of the counters, are
+ * listed in a named metadata node.
+ */
+class ProfileInstrumentation : public llvm::ModulePass
+{
+public:
+	static char ID;
+	static const char* const countersName;
+	static const char* const namesMetadataName;
+
+	explicit ProfileInstrumentation() : ModulePass(ID) { }
+	bool runOnModule(llvm::Module& M) override;
+	const char* getPassName() const override;
+
+	// Creates the counters of functions and lists their names. Without
+	// linear memory the counters are a typed array.
+	static llvm::GlobalVariable* createCounters(llvm::Module& M, llvm::ArrayRef<llvm::Function*> functions, bool inLinearMemory);
+	// Increments the i-th counter at the entry of F, returns the new count
+	static llvm::Value* addCounter(llvm::GlobalVariable* counters, llvm::Function& F, uint32_t i);
+};
+
+llvm::ModulePass* createProfileInstrumentationPass();
+
+}
+
+#endif //_CHEERP_FUNCTION_PROFILE_H
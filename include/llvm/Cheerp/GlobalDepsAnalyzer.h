@@ -146,6 +146,11 @@ public:
 	// Remove function from GDA's function list.
 	void eraseFunction(llvm::Function* F);
 
+	// Collect the functions used from outside of the IR, which can't be
+	// removed: the asm.js exports and imports, the constructors, the entry
+	// point and the methods exported to JS.
+	void collectExternallyUsedFunctions(const llvm::Module& M, std::unordered_set<const llvm::Function*>& functions) const;
+
 private:
 	typedef llvm::SmallSet<const llvm::GlobalValue*, 8> VisitedSet;
 	
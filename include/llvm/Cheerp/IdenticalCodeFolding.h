@@ -14,6 +14,7 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Cheerp/LinearMemoryHelper.h"
+#include "llvm/Cheerp/PointerAnalyzer.h"
 #include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/SmallSet.h"
 
@@ -34,44 +35,66 @@ struct function_pair_hash {
 /**
  * Determine which globals (variables and functions) can be folded since they
  * are identical.
+ *
+ * Functions are only folded with functions of the same section. Generic JS
+ * functions must use the same types, and their pointers must have the same
+ * kinds according to the PointerAnalyzer.
  */
 class IdenticalCodeFolding : public llvm::ModulePass
 {
 public:
 	static char ID;
 
-	IdenticalCodeFolding();
+	// The functions are hashed on numThreads threads, 0 means one per core
+	explicit IdenticalCodeFolding(unsigned numThreads = 1);
 
 	bool runOnModule(llvm::Module& ) override;
 
 	void getAnalysisUsage(llvm::AnalysisUsage& ) const override;
 
 private:
+	// The hash of a function body, and the functions it calls in the order
+	// they are compared by equivalentFunction()
+	struct FunctionHash
+	{
+		uint64_t hash;
+		std::vector<const llvm::Function*> callees;
+	};
+
 	const char* getPassName() const override;
-	uint64_t hashFunction(llvm::Function& F);
+	static FunctionHash hashFunction(const llvm::Function& F);
+	static uint64_t hashType(const llvm::Type* T, bool asmjs);
+	void hashFunctions(const std::vector<const llvm::Function*>& functions, std::vector<FunctionHash>& hashes) const;
 
 	bool equivalentFunction(const llvm::Function* A, const llvm::Function* B);
+	bool equivalentFunctionBody(const llvm::Function* A, const llvm::Function* B);
 	bool equivalentBlock(const llvm::BasicBlock* A, const llvm::BasicBlock* B);
 	bool equivalentInstruction(const llvm::Instruction* A, const llvm::Instruction* B);
 	bool equivalentOperand(const llvm::Value* A, const llvm::Value* B);
 	bool equivalentConstant(const llvm::Constant* A, const llvm::Constant* B);
 	bool equivalentType(const llvm::Type* A, const llvm::Type* B);
+	bool equivalentPointerKind(const llvm::Value* A, const llvm::Value* B);
 	bool equivalentGep(const llvm::GetElementPtrInst* A, const llvm::GetElementPtrInst* B);
-	bool ignoreInstruction(const llvm::Instruction* I);
+	static bool ignoreInstruction(const llvm::Instruction* I);
 	bool hasSameIntegerBitWidth(const llvm::Type* A, const llvm::Type* B);
-	bool isStaticIndirectFunction(const llvm::Value* A);
+	static bool isStaticIndirectFunction(const llvm::Value* A);
 
 	void mergeTwoFunctions(llvm::Function* F, llvm::Function* G);
 
 	const llvm::DataLayout *DL;
+	unsigned numThreads;
+	// Only available while folding generic JS functions
+	const PointerAnalyzer* PA;
+	// True while comparing asm.js functions
+	bool asmjs;
 
 	llvm::SmallSet<const llvm::PHINode*, 16> visitedPhis;
 	std::unordered_map<std::pair<const llvm::Function*, const llvm::Function*>, bool, function_pair_hash> functionEquivalence;
 };
 
-inline llvm::Pass* createIdenticalCodeFoldingPass()
+inline llvm::Pass* createIdenticalCodeFoldingPass(unsigned numThreads = 1)
 {
-	return new IdenticalCodeFolding;
+	return new IdenticalCodeFolding(numThreads);
 }
 
 class HashAccumulator64 {
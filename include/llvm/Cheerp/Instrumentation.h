@@ -0,0 +1,68 @@
+//===-- Cheerp/Instrumentation.h - Runtime profiling of the output --------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_INSTRUMENTATION_H
+#define _CHEERP_INSTRUMENTATION_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include <string>
+
+namespace cheerp
+{
+
+/**
+ * Instrument the functions so that the generated code can be profiled
+ * without readable names.
+ *
+ * The entries are counted with the counters of ProfileInstrumentation, so
+ * cheerpProfileDump() also works on instrumented builds. Functions smaller
+ * than minSize instructions are not counted: for them the counter would cost
+ * as much as the body.
+ *
+ * Every SamplePeriod calls of a counted function, the generated JS helper
+ * cheerpInstrumentSample() takes the JS/wasm stack trace and records the
+ * path of the call. There are no exit hooks, so frames unwound by an
+ * exception do not affect the samples.
+ *
+ * The symbol map, a JSON array with the name, mangled name and source
+ * location of every function, is written to symbolMapPath. The generated JS
+ * gets a cheerpInstrumentReport(symbols) helper which uses the parsed symbol
+ * map to build the flat profile and the call tree of the samples.
+ */
+class Instrumentation : public llvm::ModulePass
+{
+public:
+	static char ID;
+	static const uint32_t SamplePeriod = 1 << 16;
+	static const char* const sampleName;
+	static const char* const symbolsMetadataName;
+
+	explicit Instrumentation(llvm::StringRef symbolMapPath = llvm::StringRef(), uint32_t minSize = 0)
+		: ModulePass(ID), symbolMapPath(symbolMapPath), minSize(minSize)
+	{
+	}
+	bool runOnModule(llvm::Module& M) override;
+	const char* getPassName() const override;
+private:
+	std::string symbolMapPath;
+	uint32_t minSize;
+	bool isCounted(const llvm::Function& F) const;
+	llvm::Function* createSampleFunction(llvm::Module& M) const;
+	void writeSymbolMap(const std::vector<llvm::Function*>& functions) const;
+};
+
+llvm::ModulePass* createInstrumentationPass(llvm::StringRef symbolMapPath, uint32_t minSize);
+
+}
+
+#endif //_CHEERP_INSTRUMENTATION_H
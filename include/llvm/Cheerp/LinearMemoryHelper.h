@@ -14,9 +14,12 @@
 
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/Cheerp/FunctionProfile.h"
 #include "llvm/Cheerp/GlobalDepsAnalyzer.h"
+#include "llvm/Support/raw_ostream.h"
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 
 namespace cheerp
 {
@@ -48,7 +51,7 @@ public:
 	/**
 	 * Custom hash and compare functions for the FunctionTableInfoMap
 	 * Two types are considered equal if they are both void, floating point,
-	 * or (integer or pointer). Two function types are considered equal if
+	 * i64, or (integer or pointer). Two function types are considered equal if
 	 * they return equivalent types and they have parameters with equivalent
 	 * types in the same order
 	 */
@@ -60,6 +63,8 @@ public:
 			size_t hash = 31;
 			if (retTy->isVoidTy())
 				hash = hash*31 + std::hash<size_t>()(0);
+			else if (retTy->isIntegerTy(64))
+				hash = hash*31 + std::hash<size_t>()(4);
 			else if (retTy->isPointerTy() || retTy->isIntegerTy())
 				hash = hash*31 + std::hash<size_t>()(1);
 			else if (retTy->isDoubleTy())
@@ -68,7 +73,9 @@ public:
 				hash = hash*31 + std::hash<size_t>()(3);
 			for (const auto& pTy: fTy->params())
 			{
-				if (pTy->isPointerTy() || pTy->isIntegerTy())
+				if (pTy->isIntegerTy(64))
+					hash = hash*31 + std::hash<size_t>()(4);
+				else if (pTy->isPointerTy() || pTy->isIntegerTy())
 					hash = hash*31 + std::hash<size_t>()(1);
 				else if (pTy->isDoubleTy())
 					hash = hash*31 + std::hash<size_t>()(2);
@@ -84,14 +91,18 @@ public:
 		{
 			size_t r1 = 0, r2 = 0;
 			const llvm::Type* retTy = lhs->getReturnType();
-			if (retTy->isPointerTy() || retTy->isIntegerTy())
+			if (retTy->isIntegerTy(64))
+				r1 = 4;
+			else if (retTy->isPointerTy() || retTy->isIntegerTy())
 				r1 = 1;
 			else if (retTy->isDoubleTy())
 				r1 = 2;
 			else if (retTy->isFloatTy())
 				r1 = 3;
 			retTy = rhs->getReturnType();
-			if (retTy->isPointerTy() || retTy->isIntegerTy())
+			if (retTy->isIntegerTy(64))
+				r2 = 4;
+			else if (retTy->isPointerTy() || retTy->isIntegerTy())
 				r2 = 1;
 			else if (retTy->isDoubleTy())
 				r2 = 2;
@@ -103,13 +114,17 @@ public:
 			auto rit = rhs->param_begin();
 			for (;lit != lhs->param_end(); lit++,rit++)
 			{
-				if ((*lit)->isPointerTy() || (*lit)->isIntegerTy())
+				if ((*lit)->isIntegerTy(64))
+					r1 = 4;
+				else if ((*lit)->isPointerTy() || (*lit)->isIntegerTy())
 					r1 = 1;
 				else if ((*lit)->isDoubleTy())
 					r1 = 2;
 				else if ((*lit)->isFloatTy())
 					r1 = 3;
-				if ((*rit)->isPointerTy() || (*rit)->isIntegerTy())
+				if ((*rit)->isIntegerTy(64))
+					r2 = 4;
+				else if ((*rit)->isPointerTy() || (*rit)->isIntegerTy())
 					r2 = 1;
 				else if ((*rit)->isDoubleTy())
 					r2 = 2;
@@ -129,6 +144,10 @@ public:
 		{
 			table_name += 'v';
 		}
+		else if (ret->isIntegerTy(64))
+		{
+			table_name += 'j';
+		}
 		else if (ret->isIntegerTy() || ret->isPointerTy())
 		{
 			table_name += 'i';
@@ -143,7 +162,11 @@ public:
 		}
 		for (const auto& param : ft->params())
 		{
-			if (param->isIntegerTy() || param->isPointerTy())
+			if (param->isIntegerTy(64))
+			{
+				table_name += 'j';
+			}
+			else if (param->isIntegerTy() || param->isPointerTy())
 			{
 				table_name += 'i';
 			}
@@ -178,8 +201,12 @@ public:
 	typedef std::unordered_map<const llvm::FunctionType*, size_t,
 		FunctionSignatureHash,FunctionSignatureCmp> FunctionTypeIndicesMap;
 
-	LinearMemoryHelper(llvm::Module& module, FunctionAddressMode mode, GlobalDepsAnalyzer& GDA):
-		module(module), mode(mode), globalDeps(GDA)
+	// If stackSize is not zero the stack is placed right after the globals,
+	// otherwise it starts from the end of the memory. If profile is not null
+	// the functions are ordered by the number of calls it reports.
+	LinearMemoryHelper(llvm::Module& module, FunctionAddressMode mode, GlobalDepsAnalyzer& GDA,
+		uint32_t stackSize = 0, const FunctionProfile* profile = nullptr):
+		module(module), mode(mode), globalDeps(GDA), stackSize(stackSize), profile(profile)
 	{
 		addFunctions();
 		addGlobals();
@@ -190,6 +217,17 @@ public:
 	uint32_t getFunctionAddress(const llvm::Function* F) const;
 	bool functionHasAddress(const llvm::Function* F) const;
 	uint32_t getFunctionAddressMask(const llvm::FunctionType* Fty) const;
+	// Returns the initial value of the stack pointer, or 0 if the stack
+	// starts from the end of the memory
+	uint32_t getStackTop() const
+	{
+		return stackTop;
+	}
+	// Returns the first address after the globals and the stack
+	uint32_t getHeapStart() const
+	{
+		return heapStart;
+	}
 	const FunctionTableInfoMap& getFunctionTables() const
 	{
 		return functionTables;
@@ -225,6 +263,26 @@ public:
 		return functionTypes;
 	}
 
+	/**
+	 * i64 values cannot cross the boundary between wasm and JS, imports and
+	 * exports with i64 values in their signature use f64 values there
+	 * instead. Returns the signature used at the boundary for fTy, which is
+	 * fTy itself if no legalization is needed or not in wasm mode.
+	 */
+	const llvm::FunctionType* getLegalizedFunctionType(const llvm::FunctionType* fTy) const;
+
+	/**
+	 * Exported functions which need a wrapper to legalize their signature.
+	 * The wrappers get the function ids after all the other functions, in
+	 * this order.
+	 */
+	const std::vector<const llvm::Function*>& legalizedExports() const {
+		return legalizedExports_;
+	}
+
+	// Returns the id of the function exported for F, the wrapper if it has one
+	uint32_t getExportedFunctionId(const llvm::Function* F) const;
+
 	/**
 	 * Get a list of the asm.js global variables. This list excludes global
 	 * variables without an "asmjs" section.
@@ -243,6 +301,27 @@ public:
 	void compileConstantAsBytes(const llvm::Constant* c, bool asmjs, ByteListener* listener, int32_t offset=0) const;
 	bool isZeroInitializer(const llvm::Constant* c) const;
 	bool hasNonZeroInitialiser(const llvm::GlobalVariable* G) const;
+	/**
+	 * Globals listed in -cheerp-lazy-data are not part of the initial memory
+	 * image. They are placed after all the other globals, and their contents
+	 * are loaded separately when first requested.
+	 */
+	bool isLazyGlobal(const llvm::GlobalVariable* G) const
+	{
+		return lazyGlobals.count(G);
+	}
+	bool hasLazyGlobals() const
+	{
+		return !lazyGlobals.empty();
+	}
+	// Returns the address of the first lazily loaded global
+	uint32_t getLazyDataStart() const
+	{
+		return lazyDataStart;
+	}
+	// Writes the contents of the lazily loaded globals, as a contiguous image
+	// of the memory starting from getLazyDataStart()
+	void compileLazyData(llvm::raw_ostream& os) const;
 	struct GepListener
 	{
 		virtual void addValue(const llvm::Value* v, uint32_t size) = 0;
@@ -263,22 +342,29 @@ private:
 	llvm::Module& module;
 	FunctionAddressMode mode;
 	GlobalDepsAnalyzer& globalDeps;
+	uint32_t stackSize;
+	const FunctionProfile* profile;
 
 	FunctionTableInfoMap functionTables;
 	FunctionTableOrder functionTableOrder;
 	std::vector<const llvm::Function*> asmjsFunctions_;
 
 	std::unordered_map<const llvm::Function*, uint32_t> functionIds;
+	std::vector<const llvm::Function*> legalizedExports_;
+	std::unordered_map<const llvm::Function*, uint32_t> legalizedExportIds;
 	std::vector<const llvm::FunctionType*> functionTypes;
 	FunctionTypeIndicesMap functionTypeIndices;
 
 	std::vector<const llvm::GlobalVariable*> asmjsGlobals;
+	std::unordered_set<const llvm::GlobalVariable*> lazyGlobals;
 
 	FunctionAddressesMap functionAddresses;
 	GlobalAddressesMap globalAddresses;
 	// The next address available to allocate global variables.
 	// The heap space will start after the last global variable allocation
 	uint32_t heapStart{8};
+	uint32_t stackTop{0};
+	uint32_t lazyDataStart{0};
 };
 
 }
@@ -0,0 +1,106 @@
+//===-- Cheerp/PassReport.h - Time and memory report of the Cheerp passes -===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_PASS_REPORT_H
+#define _CHEERP_PASS_REPORT_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cheerp
+{
+
+/**
+ * Collect the wall time and the peak RSS growth of every pass of the Cheerp
+ * pipeline, together with the size of the module they processed, and write
+ * them as JSON.
+ *
+ * Passes are measured by the markers created with createPassReportMarker,
+ * which are scheduled between them. Code running inside a pass can be split
+ * further in named phases, and can attach counters to the current pass.
+ */
+class PassReport
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	// A nested measurement inside the current pass, ignored when the
+	// report is null
+	class Phase
+	{
+	public:
+		Phase(PassReport* report, llvm::StringRef name) : report(report)
+		{
+			if (report)
+				report->beginPhase(name);
+		}
+		~Phase()
+		{
+			if (report)
+				report->endPhase();
+		}
+	private:
+		PassReport* report;
+	};
+
+	// Ends the current pass, if any, and starts measuring name
+	void beginPass(llvm::StringRef name, const llvm::Module& M);
+	// Ends the current pass
+	void endPass(const llvm::Module& M);
+	void beginPhase(llvm::StringRef name);
+	void endPhase();
+	void addCounter(llvm::StringRef name, uint64_t value);
+
+	void writeJSON(llvm::raw_ostream& os) const;
+
+	// Peak resident set size of the process in KB, 0 if not available
+	static uint64_t getPeakRSS();
+
+private:
+	struct Measure
+	{
+		std::string name;
+		Clock::time_point start;
+		double wallMs;
+		uint64_t startRSS;
+		uint64_t peakRSSDelta;
+		void begin(llvm::StringRef n);
+		void end();
+	};
+	struct PassMeasure : Measure
+	{
+		uint32_t functions;
+		uint32_t instructions;
+		uint32_t instructionsAfter;
+		std::vector<Measure> phases;
+		std::vector<std::pair<std::string, uint64_t>> counters;
+	};
+	std::vector<PassMeasure> passes;
+	// Phases which are still open, as indexes in the phases of the last pass
+	std::vector<uint32_t> openPhases;
+	bool passOpen = false;
+};
+
+// Starts measuring passName in report when run
+llvm::ModulePass* createPassReportMarker(std::shared_ptr<PassReport> report, llvm::StringRef passName);
+// Ends the last measure and writes the report to fileName when run
+llvm::ModulePass* createPassReportWriter(std::shared_ptr<PassReport> report, llvm::StringRef fileName);
+
+}
+
+#endif //_CHEERP_PASS_REPORT_H
@@ -18,6 +18,7 @@
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/Support/Mutex.h"
 #include "llvm/Support/Timer.h"
 #include <unordered_map>
 #include <unordered_set>
@@ -290,10 +291,11 @@ class PointerAnalyzer : public llvm::ModulePass
 {
 public:
 	PointerAnalyzer() : 
-		ModulePass(ID)
+		ModulePass(ID),
 #ifndef NDEBUG
-		,fullyResolved(false)
+		fullyResolved(false),
 #endif //NDEBUG
+		kindCacheHits(0), kindCacheMisses(0), frozen(false)
 	{}
 
 	void prefetchFunc( const llvm::Function & ) const;
@@ -327,6 +329,16 @@ public:
 	void fullResolve();
 	// Compute all the offsets for REGULAR pointer which may be assumed constant
 	void computeConstantOffsets(const llvm::Module& M );
+	// Compute the kinds and the offsets of all the values used by the code and
+	// the globals. The queries afterwards only read the caches, so they do not
+	// take the lock and can be made from multiple threads at full speed.
+	void freeze(const llvm::Module& M );
+
+	// Number of queries answered from the cache of the pointer kinds, and
+	// the ones which required visiting the uses of the value. The queries
+	// after freezing are not counted.
+	uint64_t getKindCacheHits() const { return kindCacheHits; }
+	uint64_t getKindCacheMisses() const { return kindCacheMisses; }
 
 #ifndef NDEBUG
 	mutable bool fullyResolved;
@@ -375,9 +387,21 @@ public:
 	static POINTER_KIND getPointerKindForMemberImpl(const TypeAndIndex& baseAndIndex, PointerKindData& pointerKindData, AddressTakenMap& addressTakenCache);
 private:
 	const PointerConstantOffsetWrapper& getFinalPointerConstantOffsetWrapper(const llvm::Value*) const;
+	const llvm::ConstantInt* resolveConstantOffset(const PointerConstantOffsetWrapper& o, llvm::LLVMContext& C) const;
 	mutable PointerKindData pointerKindData;
 	mutable PointerOffsetData pointerOffsetData;
 	mutable AddressTakenMap addressTakenCache;
+	mutable uint64_t kindCacheHits;
+	mutable uint64_t kindCacheMisses;
+	// Resolving the offsets with constraints marks the visited constraints,
+	// so after freezing the results are looked up here instead
+	llvm::DenseMap<const llvm::Value*, const llvm::ConstantInt*> frozenOffsets;
+	std::map<TypeAndIndex, const llvm::ConstantInt*> frozenMemberOffsets;
+	bool frozen;
+	// The caches above are filled lazily by the const query methods, this
+	// mutex makes it safe to query the analyzer from multiple threads until
+	// it is frozen
+	mutable llvm::sys::SmartMutex<true> cacheMutex;
 };
 
 #ifndef NDEBUG
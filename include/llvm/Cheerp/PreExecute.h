@@ -34,8 +34,11 @@ public:
     size_t size;
     bool hasCookie;
     bool asmjs;
+    // Raw memory from malloc whose type could not be deduced, which is
+    // treated as an array of bytes
+    bool untyped;
 
-    AllocData() : globalValue(nullptr), allocType(nullptr), size(0), hasCookie(false), asmjs(false) { }
+    AllocData() : globalValue(nullptr), allocType(nullptr), size(0), hasCookie(false), asmjs(false), untyped(false) { }
 };
 
 class Allocator
@@ -78,15 +81,21 @@ public:
 
     std::map<llvm::GlobalVariable *, llvm::Constant *>  modifiedGlobals;
     std::map<char *, AllocData> typedAllocations;
-
-    explicit PreExecute() : llvm::ModulePass(ID) {
+    // The memory of the last global found by recordStore
+    char* lastStoredGlobalStart;
+    char* lastStoredGlobalEnd;
+    bool hasUntypedAllocations;
+
+    explicit PreExecute() : llvm::ModulePass(ID),
+            lastStoredGlobalStart(nullptr), lastStoredGlobalEnd(nullptr),
+            hasUntypedAllocations(false) {
     }
 
     const char* getPassName() const override;
     bool runOnModule(llvm::Module& m) override;
     bool runOnConstructor(llvm::Module& m, llvm::Function* c);
 
-    void recordStore(void* Addr);
+    void recordStore(void* Addr, llvm::Type* Ty);
     void recordTypedAllocation(llvm::Type *type, size_t size, char *buf, bool hasCookie, bool asmjs) {
         AllocData data;
         data.allocType = type;
@@ -61,7 +61,7 @@ public:
 
 	static char ID;
 	
-	explicit Registerize(bool useFloats = false, bool n = false) : ModulePass(ID), NoRegisterize(n), useFloats(useFloats)
+	explicit Registerize(bool useFloats = false, bool n = false, bool graphColoring = false, bool useInt64 = false) : ModulePass(ID), NoRegisterize(n), useFloats(useFloats), graphColoring(graphColoring), useInt64(useInt64)
 #ifndef NDEBUG
 			, RegistersAssigned(false)
 #endif
@@ -73,11 +73,16 @@ public:
 	
 	const char *getPassName() const override;
 
+	bool hasRegister(const llvm::Instruction* I) const
+	{
+		return registersMap.count(I);
+	}
 	uint32_t getRegisterId(const llvm::Instruction* I) const;
 	uint32_t getRegisterIdForEdge(const llvm::Instruction* I, const llvm::BasicBlock* fromBB, const llvm::BasicBlock* toBB) const;
 	uint32_t getSelfRefTmpReg(const llvm::Instruction* I, const llvm::BasicBlock* fromBB, const llvm::BasicBlock* toBB) const;
 
-	void assignRegisters(llvm::Module& M, cheerp::PointerAnalyzer& PA);
+	// Functions are processed on numThreads threads, 0 means one per core
+	void assignRegisters(llvm::Module& M, cheerp::PointerAnalyzer& PA, unsigned numThreads = 1);
 	void computeLiveRangeForAllocas(llvm::Function& F);
 	void invalidateLiveRangeForAllocas(llvm::Function& F);
 
@@ -88,12 +93,13 @@ public:
 	}
 
 	// Registers should have a consistent JS type
-	enum REGISTER_KIND { OBJECT=0, INTEGER, DOUBLE, FLOAT };
+	enum REGISTER_KIND { OBJECT=0, INTEGER, DOUBLE, FLOAT, INTEGER64 };
+	static const uint32_t REGISTER_KIND_COUNT = INTEGER64 + 1;
 
 	struct RegisterInfo
 	{
 		// Try to save bits, we may need more flags here
-		const REGISTER_KIND regKind : 2;
+		const REGISTER_KIND regKind : 3;
 		int needsSecondaryName : 1;
 		RegisterInfo(REGISTER_KIND k, bool n):regKind(k),needsSecondaryName(n)
 		{
@@ -167,9 +173,15 @@ private:
 			toBB=NULL;
 		}
 	};
-	EdgeContext edgeContext;
+	// The edge context is per-thread, so that functions can be compiled
+	// concurrently by different writers
+	static thread_local EdgeContext edgeContext;
 	bool NoRegisterize;
 	bool useFloats;
+	// Use the graph coloring allocator instead of the first fit one
+	bool graphColoring;
+	// Keep i64 values in their own registers in asm.js functions
+	bool useInt64;
 #ifndef NDEBUG
 	bool RegistersAssigned;
 #endif
@@ -299,6 +311,7 @@ private:
 	void handlePHI(llvm::Instruction& I, const LiveRangesTy& liveRanges, llvm::SmallVector<RegisterRange, 4>& registers, const PointerAnalyzer& PA);
 	uint32_t findOrCreateRegister(llvm::SmallVector<RegisterRange, 4>& registers, const InstructionLiveRange& range,
 					REGISTER_KIND kind, bool needsSecondaryName);
+	void colorRegisters(const LiveRangesTy& liveRanges, llvm::SmallVector<RegisterRange, 4>& registers, const PointerAnalyzer& PA);
 	bool addRangeToRegisterIfPossible(RegisterRange& regRange, const InstructionLiveRange& liveRange, REGISTER_KIND kind, bool needsSecondaryName);
 	void computeAllocaLiveRanges(AllocaSetTy& allocaSet, const InstIdMapTy& instIdMap);
 	typedef std::set<llvm::Instruction*, CompareInstructionByID> InstructionSetOrderedByID;
@@ -351,9 +364,10 @@ private:
 	};
 	UpAndMarkAllocaState doUpAndMarkForAlloca(AllocaBlocksState& blocksState, llvm::BasicBlock* BB, uint32_t upAndMarkId);
 	void assignRegistersToInstructions(llvm::Function& F, cheerp::PointerAnalyzer& PA);
+	void assignRegistersInParallel(llvm::Module& M, cheerp::PointerAnalyzer& PA, unsigned numThreads);
 };
 
-llvm::ModulePass *createRegisterizePass(bool useFloats, bool NoRegisterize);
+llvm::ModulePass *createRegisterizePass(bool useFloats, bool NoRegisterize, bool graphColoring = false, bool useInt64 = false);
 
 }
 
@@ -0,0 +1,85 @@
+//===-- Cheerp/SimilarFunctionMerging.h - Merge near identical functions --===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_SIMILAR_FUNCTION_MERGING_H
+#define _CHEERP_SIMILAR_FUNCTION_MERGING_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+namespace cheerp
+{
+
+/**
+ * Merge the asm.js functions which only differ in a few constant operands,
+ * like integers, globals or the called functions.
+ *
+ * The group of functions gets one shared body, which takes the differing
+ * operands as extra parameters after the original ones. The direct calls are
+ * redirected to the shared body, and the functions which are still used
+ * become thunks that call it with their own operands.
+ */
+class SimilarFunctionMerging : public llvm::ModulePass
+{
+public:
+	static char ID;
+
+	// At most maxParameters extra parameters are added to a shared body
+	explicit SimilarFunctionMerging(unsigned maxParameters = 0)
+		: ModulePass(ID), maxParameters(maxParameters)
+	{
+	}
+	bool runOnModule(llvm::Module& M) override;
+	void getAnalysisUsage(llvm::AnalysisUsage& AU) const override;
+	const char* getPassName() const override;
+private:
+	// An operand of a function body, as the index of the instruction in the
+	// instruction list and the index of the operand
+	typedef std::pair<uint32_t, uint32_t> OperandPosition;
+
+	// The body of a function in the order compared by similarFunctions()
+	struct FunctionBody
+	{
+		std::vector<llvm::Instruction*> instructions;
+		// The number of each argument, block and instruction
+		llvm::DenseMap<const llvm::Value*, uint32_t> locals;
+	};
+
+	// A function replaced by a call to the shared body
+	struct Thunk
+	{
+		llvm::Function* F;
+		llvm::Function* merged;
+		std::vector<llvm::Constant*> operands;
+	};
+
+	const FunctionBody& getBody(llvm::Function* F);
+	static uint64_t hashFunction(const FunctionBody& body);
+	// Returns true if B is A with different constants in the returned positions
+	bool similarFunctions(llvm::Function* A, llvm::Function* B, std::set<OperandPosition>& differences);
+	static bool canBeParameter(const llvm::Instruction* I, uint32_t operand, const llvm::Value* A, const llvm::Value* B);
+	void mergeFunctions(const std::vector<llvm::Function*>& functions, const std::set<OperandPosition>& parameters);
+	void redirectCalls(const Thunk& thunk);
+
+	unsigned maxParameters;
+	std::unordered_map<const llvm::Function*, FunctionBody> bodies;
+	std::vector<Thunk> thunks;
+};
+
+llvm::ModulePass* createSimilarFunctionMergingPass(unsigned maxParameters);
+
+}
+
+#endif //_CHEERP_SIMILAR_FUNCTION_MERGING_H
@@ -17,14 +17,35 @@
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include <map>
+#include <memory>
+#include <vector>
 
 namespace cheerp
 {
 
 class SourceMapGenerator
 {
+public:
+	/**
+	 * A segment recorded by a generator which does not write to the file.
+	 * The offset is relative to the beginning of the generated line, or to
+	 * the beginning of the recorded code for the first line.
+	 */
+	struct Segment
+	{
+		enum KIND { FUNCTION_NAME = 0, DEBUG_LOC, NEW_LINE, CODE_END };
+		KIND kind;
+		uint32_t lineOffset;
+		llvm::DISubprogram method;
+		const llvm::DebugLoc* debugLoc;
+		Segment(KIND kind, uint32_t lineOffset, llvm::DISubprogram method = llvm::DISubprogram(), const llvm::DebugLoc* debugLoc = nullptr):
+			kind(kind), lineOffset(lineOffset), method(method), debugLoc(debugLoc)
+		{
+		}
+	};
 private:
-	llvm::tool_output_file sourceMap;
+	// Null if the segments are recorded
+	std::unique_ptr<llvm::tool_output_file> sourceMap;
 	const std::string& sourceMapName;
 	const std::string& sourceMapPrefix;
 	llvm::LLVMContext& Ctx;
@@ -39,10 +60,19 @@ private:
 	const llvm::DebugLoc* currentDebugLoc;
 	bool standAlone;
 	bool lineBegin;
+	std::vector<Segment> recordedSegments;
 	void writeBase64VLQInt(int32_t i);
+	// Create a recorder, see createRecorder
+	explicit SourceMapGenerator(const SourceMapGenerator* parent);
 public:
 	// sourceMapName and sourceMapPrefix life spans should be longer than the one of the SourceMapGenerator
 	SourceMapGenerator(const std::string& sourceMapName, const std::string& sourceMapPrefix, bool standAlone, llvm::LLVMContext& C, std::error_code& ErrorCode);
+	/**
+	 * Create a generator which records the segments instead of writing them,
+	 * so that code can be generated out of order and on multiple threads.
+	 * The recorded segments are added to the map by appendSegments.
+	 */
+	static std::unique_ptr<SourceMapGenerator> createRecorder(const SourceMapGenerator& parent);
 	void setFunctionName(const llvm::DISubprogram &method);
 	void setDebugLoc(const llvm::DebugLoc* debugLoc);
 	const llvm::DebugLoc* getDebugLoc() const
@@ -54,6 +84,15 @@ public:
 	// TODO: It's not clear if the line offset in encoded in bytes or charathers
 	void addLineOffset(uint32_t o) { lineOffset+=o; }
 	void endFile();
+	/**
+	 * Return the segments recorded so far, terminated by a CODE_END segment
+	 * at the current offset, and start recording a new block of code
+	 */
+	std::vector<Segment> takeSegments();
+	/**
+	 * Add the segments of a block of code written at the current position
+	 */
+	void appendSegments(const std::vector<Segment>& segments);
 	std::string getSourceMapName() const;
 };
 
@@ -91,6 +91,12 @@ inline bool isGEP(const llvm::Value* v)
 	x("f64.max", 0xa5, "fmax") \
 	x("f64.copysign", 0xa6, "copysign") \
 
+// The memory operators, used by the runtime to grow the heap. They are
+// followed by a reserved immediate in the binary encoding.
+#define WASM_MEMORY_INTRINSIC_LIST(x) \
+	x("current_memory", 0x3f, "__wasm_current_memory") \
+	x("grow_memory", 0x40, "__wasm_grow_memory") \
+
 
 bool isWasmIntrinsic(const llvm::Function* F);
 
@@ -105,6 +111,27 @@ inline uint32_t getMaskForBitWidth(int width)
 	return (1 << width) - 1;
 }
 
+// Memory intrinsics which need more accesses than this are not expanded inline
+const static uint32_t MaxInlineMemIntrinsicAccesses = 16;
+
+/**
+ * Split a memcpy, memmove or memset of constant size in a sequence of
+ * accesses of decreasing width, no wider than maxWidth bytes. If
+ * allowUnaligned is false the accesses are also no wider than the alignment
+ * of the intrinsic. Returns false if the intrinsic should be lowered to a
+ * call instead: if the size or the memset value are not constant, if too
+ * many accesses are needed or if a memmove needs more than one.
+ */
+bool getInlineMemIntrinsicAccesses(const llvm::MemIntrinsic& MI, uint32_t maxWidth,
+		bool allowUnaligned, llvm::SmallVectorImpl<uint32_t>& widths);
+
+// The byte value of a memset replicated over width bytes
+inline uint64_t getMemsetPattern(const llvm::MemSetInst& MS, uint32_t width)
+{
+	uint64_t byte = llvm::cast<llvm::ConstantInt>(MS.getValue())->getZExtValue() & 0xff;
+	return byte * (UINT64_C(0x0101010101010101) >> (64 - 8 * width));
+}
+
 // Printable name of the llvm type - useful only for debugging
 std::string valueObjectName(const llvm::Value * v);
 
@@ -112,6 +139,14 @@ bool hasNonLoadStoreUses(const llvm::Value* v);
 
 llvm::Type* getGEPContainerType(const llvm::User* gep);
 
+// Writes s as a quoted JSON string
+void writeJSONString(llvm::raw_ostream& os, llvm::StringRef s);
+
+// Struct layouts, the sized flag of struct types and pointer types are created
+// lazily and cached. Create them now, so that the module types can be shared by
+// the threads which compile the functions.
+void prepareTypesForThreads(const llvm::Module& M);
+
 inline bool isFreeFunctionName(llvm::StringRef name)
 {
 	return name=="free" || name=="_ZdlPv" || name=="_ZdaPv";
@@ -0,0 +1,69 @@
+//===-- Cheerp/WasmBodyCache.h - On disk cache of wasm function bodies ----===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_WASM_BODY_CACHE_H
+#define _CHEERP_WASM_BODY_CACHE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Cheerp/GlobalDepsAnalyzer.h"
+#include "llvm/Cheerp/LinearMemoryHelper.h"
+#include "llvm/Cheerp/Registerize.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <memory>
+#include <string>
+
+namespace cheerp
+{
+
+/**
+ * Persist the encoded wasm body of each function in a directory, so that
+ * relinking a program only needs to compile the functions that changed.
+ *
+ * Every entry is named after a hash of all the state that contributes to the
+ * encoding of the body: the instructions of the function, the layout of the
+ * types it uses, the ids and addresses of the functions and globals it
+ * references, the signatures and JS imports it calls and the registers
+ * assigned to its instructions. A module wide
+ * hash, which covers the writer options, is mixed into every key.
+ *
+ * After construction the cache is immutable, so it can be shared by
+ * multiple threads.
+ */
+class WasmBodyCache
+{
+private:
+	const std::string dir;
+	const llvm::DataLayout& DL;
+	const LinearMemoryHelper& linearHelper;
+	const Registerize& registerize;
+	const GlobalDepsAnalyzer& globalDeps;
+	llvm::MD5::MD5Result moduleHash;
+
+public:
+	// writerState contains the writer options that affect every body
+	WasmBodyCache(const std::string& dir, const llvm::Module& M,
+			const LinearMemoryHelper& linearHelper, const Registerize& registerize,
+			const GlobalDepsAnalyzer& globalDeps, llvm::ArrayRef<uint32_t> writerState);
+
+	// Returns the path of the cache entry for F
+	std::string getEntryPath(const llvm::Function& F) const;
+	// Returns the cached body at path, or null if there is none
+	std::unique_ptr<llvm::MemoryBuffer> lookup(const std::string& path) const;
+	// Failures are ignored, the body will be compiled again next time
+	void store(const std::string& path, llvm::StringRef body) const;
+};
+
+}
+#endif
@@ -0,0 +1,66 @@
+//===-- Cheerp/WasmPeephole.h - Cleanup of the wasm function bodies -------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_WASM_PEEPHOLE_H
+#define _CHEERP_WASM_PEEPHOLE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <vector>
+
+namespace cheerp
+{
+
+/**
+ * Cleanup of the binary wasm function bodies, after they are generated.
+ *
+ * The writer emits the code of one LLVM instruction and of one Relooper
+ * block at a time, which leaves behind:
+ * - code after unconditional branches, returns and unreachable
+ * - branches, conditional branches and returns to the end that follows them
+ *   anyway
+ * - blocks and loops which are not the target of any branch, and empty ifs
+ * - set_local and tee_local of locals which are never read
+ * - if/else diamonds which only assign one of two values to a local
+ * - a few redundant pairs of instructions, like a set_local and a get_local of
+ *   the same local which end up next to each other
+ * This pass removes them, turning the diamonds into selects, and then
+ * removes the locals which are no longer used.
+ *
+ * The optimizer has no mutable state, a single instance can be shared by
+ * many threads.
+ */
+class WasmPeephole
+{
+public:
+	struct Signature
+	{
+		uint32_t params;
+		uint32_t results;
+	};
+	WasmPeephole(std::vector<Signature> functions, std::vector<Signature> types)
+		: functions(std::move(functions)), types(std::move(types))
+	{
+	}
+	// Writes to out the optimized version of body, the encoded locals and
+	// code of a function with signature sig. Returns false, without writing
+	// anything, if body contains code which is not understood.
+	bool optimize(llvm::StringRef body, const Signature& sig, llvm::raw_ostream& out) const;
+private:
+	// Signatures of the called functions, by function id
+	std::vector<Signature> functions;
+	// Signatures of the indirectly called functions, by type index
+	std::vector<Signature> types;
+};
+
+}
+
+#endif //_CHEERP_WASM_PEEPHOLE_H
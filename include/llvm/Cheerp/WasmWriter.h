@@ -12,17 +12,23 @@
 #ifndef _CHEERP_WAST_WRITER_H
 #define _CHEERP_WAST_WRITER_H
 
-#include <sstream>
+#include <memory>
+#include <vector>
 
 #include "llvm/Cheerp/GlobalDepsAnalyzer.h"
 #include "llvm/Cheerp/LinearMemoryHelper.h"
 #include "llvm/Cheerp/NameGenerator.h"
+#include "llvm/Cheerp/PassReport.h"
 #include "llvm/Cheerp/PointerAnalyzer.h"
 #include "llvm/Cheerp/Registerize.h"
+#include "llvm/Cheerp/WasmBodyCache.h"
+#include "llvm/Cheerp/WasmPeephole.h"
 #include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/raw_ostream.h"
 
 namespace cheerp
 {
@@ -36,9 +42,73 @@ enum CheerpMode {
 
 class CheerpWasmWriter;
 
-typedef std::iostream WasmBuffer;
+// A growable, contiguous byte buffer used to build the wasm module in
+// memory. The binary encoders append bytes directly to the storage, while the
+// textual format uses the usual raw_ostream operators. The stream is
+// unbuffered, so both kinds of writes can be freely mixed.
+class WasmBuffer : public llvm::raw_ostream {
+private:
+	std::vector<char> bytes;
+
+	void write_impl(const char* ptr, size_t size) override
+	{
+		bytes.insert(bytes.end(), ptr, ptr + size);
+	}
+	uint64_t current_pos() const override
+	{
+		return bytes.size();
+	}
+
+public:
+	WasmBuffer() : llvm::raw_ostream(/*unbuffered*/true)
+	{
+	}
+
+	void writeByte(uint8_t byte)
+	{
+		bytes.push_back(byte);
+	}
+	void writeBytes(const char* ptr, size_t size)
+	{
+		bytes.insert(bytes.end(), ptr, ptr + size);
+	}
+	void reserve(size_t size)
+	{
+		bytes.reserve(size);
+	}
+	const char* data() const
+	{
+		return bytes.data();
+	}
+	size_t size() const
+	{
+		return bytes.size();
+	}
+	llvm::StringRef str() const
+	{
+		return llvm::StringRef(bytes.data(), bytes.size());
+	}
+	// Free the storage of the buffer
+	void release()
+	{
+		std::vector<char>().swap(bytes);
+	}
 
-class Section : public std::stringstream {
+	// Reserve room for a ULEB128 encoded size that is not known yet, and
+	// return the position to pass to patchSizeULEB128.
+	size_t reserveSizeULEB128()
+	{
+		size_t pos = bytes.size();
+		bytes.resize(pos + 5);
+		return pos;
+	}
+	// Encode the number of bytes written after the reserved room at |pos|.
+	// The size uses the minimal encoding, and the following bytes are moved
+	// back when they do not need all the reserved room.
+	void patchSizeULEB128(size_t pos);
+};
+
+class Section : public WasmBuffer {
 private:
 	uint32_t sectionId;
 	const char* sectionName;
@@ -51,6 +121,7 @@ public:
 
 class CheerpWasmWriter
 {
+	friend class Section;
 private:
 	llvm::Module& module;
 	llvm::DataLayout targetData;
@@ -71,6 +142,9 @@ private:
 
 	// The wasm module heap size
 	uint32_t heapSize;
+	// The size the memory can grow to, the memory does not grow if this is
+	// not larger than heapSize
+	uint32_t maxHeapSize;
 
 	// If true, the Wasm file is loaded using a JavaScript loader. This allows
 	// FFI calls to methods outside of the Wasm file. When false, write
@@ -82,6 +156,32 @@ private:
 	// it will also add names to local variables inside functions.
 	bool prettyCode;
 
+	// Number of threads used to compile the function bodies in the code
+	// section. The output does not depend on this value.
+	unsigned numThreads;
+
+	// If not empty, the function bodies are cached in this directory and
+	// reused by later compilations.
+	std::string bodyCacheDir;
+
+	// If not null, the sections of the module are measured in this report
+	PassReport* report;
+
+	// If true, the function bodies are cleaned up by the peephole optimizer
+	bool usePeephole;
+
+	// If true, the reducible control flow is rendered by following the
+	// dominator tree instead of using the Relooper
+	bool useStructurizer;
+
+	// The peephole optimizer, built by compileCodeSection and shared by the
+	// writers of all the threads
+	std::shared_ptr<const WasmPeephole> peephole;
+
+	// Hash of the contents of every section, it identifies the build
+	llvm::MD5 outputHash;
+	std::string moduleHash;
+
 	// If true, a set_local instruction is buffered. This mechanism is used to
 	// combine set_local followed by a get_local into a tee_local. The
 	// setLocalId field tracks the instruction's immediate.
@@ -96,6 +196,10 @@ private:
 	// local variable.
 	std::vector<int> localMap;
 
+	// The f64 local holding the result of JS imports returning i64 values
+	// before it is converted, valid if the function calls any of them
+	uint32_t legalizedResultLocal;
+
 public:
 	const PointerAnalyzer & PA;
 	CheerpMode cheerpMode;
@@ -111,6 +215,12 @@ private:
 	void compileStartSection();
 	void compileElementSection();
 	void compileCodeSection();
+	void compileMethodsInParallel(std::vector<WasmBuffer>& bodies, const WasmBodyCache* cache);
+	void compileLegalizedExports(WasmBuffer& section);
+	// JS imports take and return f64 values in place of i64 ones
+	bool isLegalizedImport(const llvm::Function* F) const;
+	// Converts the f64 value in local to i64 without trapping
+	void encodeSaturatingF64ToI64(WasmBuffer& code, uint32_t local);
 	void compileDataSection();
 	void compileNameSection();
 
@@ -119,17 +229,26 @@ private:
 	void compileMethodParams(WasmBuffer& code, const llvm::FunctionType* F);
 	void compileMethodResult(WasmBuffer& code, const llvm::Type* F);
 	void compileMethod(WasmBuffer& code, const llvm::Function& F);
+	void compileMethodBody(WasmBuffer& code, const llvm::Function& F);
+	void compileMethodCached(WasmBuffer& code, const llvm::Function& F, const WasmBodyCache* cache);
 	void compileImport(WasmBuffer& code, const llvm::Function& F);
 	void compileGlobal(const llvm::GlobalVariable& G);
 	// Returns true if it has handled local assignent internally
 	bool compileInstruction(WasmBuffer& code, const llvm::Instruction& I);
 	bool compileInlineInstruction(WasmBuffer& code, const llvm::Instruction& I);
 	void compileGEP(WasmBuffer& code, const llvm::User* gepInst, bool standalone = false);
+	// Returns false if the intrinsic must be lowered to a library call
+	bool compileInlineMemIntrinsic(WasmBuffer& code, const llvm::MemIntrinsic& MI);
+	// Compiles the address of a load or store and returns the constant offset
+	// left for the memarg immediate
+	uint32_t compileLoadStorePointer(WasmBuffer& code, const llvm::Value* ptrOp);
+	// Folds an inlined load into the sext or zext ext, if possible
+	bool compileExtendingLoad(WasmBuffer& code, const llvm::Instruction& ext);
 	static const char* getIntegerPredicate(llvm::CmpInst::Predicate p);
 
 	struct WasmBytesWriter: public LinearMemoryHelper::ByteListener
 	{
-		std::ostream& code;
+		WasmBuffer& code;
 		const CheerpWasmWriter& writer;
 		WasmBytesWriter(WasmBuffer& code, const CheerpWasmWriter& writer)
 			: code(code), writer(writer)
@@ -161,9 +280,15 @@ public:
 			const NameGenerator& namegen,
 			llvm::LLVMContext& C,
 			unsigned heapSize,
+			unsigned maxHeapSize,
 			bool useWasmLoader,
 			bool prettyCode,
-			CheerpMode cheerpMode):
+			CheerpMode cheerpMode,
+			unsigned numThreads = 1,
+			const std::string& bodyCacheDir = std::string(),
+			PassReport* report = nullptr,
+			bool usePeephole = true,
+			bool useStructurizer = true):
 		module(m),
 		targetData(&m),
 		currentFun(NULL),
@@ -175,8 +300,14 @@ public:
 		usedGlobals(0),
 		stackTopGlobal(0),
 		heapSize(heapSize),
+		maxHeapSize(maxHeapSize),
 		useWasmLoader(useWasmLoader),
 		prettyCode(prettyCode),
+		numThreads(numThreads),
+		bodyCacheDir(bodyCacheDir),
+		report(report),
+		usePeephole(usePeephole),
+		useStructurizer(useStructurizer),
 		hasSetLocal(false),
 		setLocalId((uint32_t)-1),
 		PA(PA),
@@ -185,6 +316,11 @@ public:
 	{
 	}
 	void makeWasm();
+	// Returns the hash of the emitted module, valid after makeWasm
+	const std::string& getModuleHash() const
+	{
+		return moduleHash;
+	}
 	void compileBB(WasmBuffer& code, const llvm::BasicBlock& BB);
 	void compileDowncast(WasmBuffer& code, llvm::ImmutableCallSite callV);
 	void compileConstantExpr(WasmBuffer& code, const llvm::ConstantExpr* ce);
@@ -196,6 +332,7 @@ public:
 	void encodeBufferedSetLocal(WasmBuffer& code);
 	void encodeBinOp(const llvm::Instruction& I, WasmBuffer& code);
 	void encodeS32Inst(uint32_t opcode, const char* name, int32_t immediate, WasmBuffer& code);
+	void encodeS64Inst(uint32_t opcode, const char* name, int64_t immediate, WasmBuffer& code);
 	void encodeU32Inst(uint32_t opcode, const char* name, uint32_t immediate, WasmBuffer& code);
 	void encodeU32U32Inst(uint32_t opcode, const char* name, uint32_t i1, uint32_t i2, WasmBuffer& code);
 	void encodePredicate(const llvm::Type* ty, const llvm::CmpInst::Predicate predicate, WasmBuffer& code);
@@ -203,8 +340,8 @@ public:
 	void encodeLoad(const llvm::Type* ty, uint32_t offset, WasmBuffer& code);
 	void encodeWasmIntrinsic(WasmBuffer& code, const llvm::Function* F);
 	void encodeBranchTable(WasmBuffer& code, std::vector<uint32_t> table, int32_t defaultBlock);
-	void encodeDataSectionChunk(WasmBuffer& data, uint32_t address, const std::string& buf);
-	uint32_t encodeDataSectionChunks(WasmBuffer& data, uint32_t address, const std::string& buf);
+	void encodeDataSectionChunk(WasmBuffer& data, uint32_t address, llvm::StringRef buf);
+	uint32_t encodeDataSectionChunks(WasmBuffer& data, uint32_t address, llvm::StringRef buf);
 	bool tryEncodeFloatAsInt(WasmBuffer& code, const llvm::ConstantFP* f);
 	bool tryEncodeFloat64AsFloat32(WasmBuffer& code, const llvm::ConstantFP* f);
 	bool needsPointerKindConversion(const llvm::Instruction* phi, const llvm::Value* incoming);
@@ -12,11 +12,13 @@
 #ifndef _CHEERP_WRITER_H
 #define _CHEERP_WRITER_H
 
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Cheerp/AllocaMerging.h"
 #include "llvm/Cheerp/GlobalDepsAnalyzer.h"
 #include "llvm/Cheerp/LinearMemoryHelper.h"
 #include "llvm/Cheerp/NameGenerator.h"
+#include "llvm/Cheerp/PassReport.h"
 #include "llvm/Cheerp/PointerAnalyzer.h"
 #include "llvm/Cheerp/Registerize.h"
 #include "llvm/Cheerp/SourceMaps.h"
@@ -42,12 +44,16 @@ class NewLineHandler
 
 /**
  * Black magic to conditionally enable indented output
+ *
+ * The stream position is only needed for source maps, and the indentation
+ * is only tracked for readable output, so the minified output without source
+ * maps is written straight to the stream.
  */
 class ostream_proxy
 {
 public:
 	ostream_proxy( llvm::raw_ostream & s, SourceMapGenerator* g, bool readableOutput = false ) :
-		stream(s),
+		stream(&s),
 		sourceMapGenerator(g),
 		readableOutput(readableOutput),
 		newLine(true),
@@ -56,21 +62,21 @@ public:
 
 	friend ostream_proxy& operator<<( ostream_proxy & os, char c )
 	{
-		uint64_t begin = os.stream.tell();
-		os.write_indent(c);
-		uint64_t end = os.stream.tell();
+		uint32_t tabs = os.readableOutput ? os.write_indent(c) : 0;
+		*os.stream << c;
 		if(os.sourceMapGenerator)
-			os.sourceMapGenerator->addLineOffset(end-begin);
+			os.sourceMapGenerator->addLineOffset(tabs + 1);
 		return os;
 	}
 
+	// Identifiers are formatted once by the NameGenerator, and written here as
+	// a single string
 	friend ostream_proxy& operator<<( ostream_proxy & os, llvm::StringRef s )
 	{
-		uint64_t begin = os.stream.tell();
-		os.write_indent(s);
-		uint64_t end = os.stream.tell();
+		uint32_t tabs = os.readableOutput ? os.write_indent(s) : 0;
+		*os.stream << s;
 		if(os.sourceMapGenerator)
-			os.sourceMapGenerator->addLineOffset(end-begin);
+			os.sourceMapGenerator->addLineOffset(tabs + s.size());
 		return os;
 	}
 
@@ -80,26 +86,50 @@ public:
 			return os;
 		if(os.sourceMapGenerator)
 			os.sourceMapGenerator->finishLine();
-		os.stream << '\n';
+		*os.stream << '\n';
 		os.newLine = true;
 		return os;
 	}
 
+	// Integers are formatted here, so that their length is known
 	template<class T>
 	friend typename std::enable_if<
-		!std::is_convertible<T&&, llvm::StringRef>::value, // Use this only if T is not convertible to StringRef
+		std::is_integral<typename std::decay<T>::type>::value && (sizeof(T) > 1), // Characters and bools are not numbers
+		ostream_proxy&>::type operator<<( ostream_proxy & os, T t )
+	{
+		char buffer[24];
+		char* end = buffer + sizeof(buffer);
+		char* cur = end;
+		bool negative = std::is_signed<T>::value && static_cast<int64_t>(t) < 0;
+		uint64_t value = static_cast<uint64_t>(t);
+		if(negative)
+			value = 0 - value;
+		do
+		{
+			*--cur = '0' + value % 10;
+			value /= 10;
+		}
+		while(value);
+		if(negative)
+			*--cur = '-';
+		return os << llvm::StringRef(cur, end - cur);
+	}
+
+	template<class T>
+	friend typename std::enable_if<
+		!std::is_convertible<T&&, llvm::StringRef>::value && // Use this only if T is not convertible to StringRef
+		!(std::is_integral<typename std::decay<T>::type>::value && (sizeof(T) > 1)), // or an integer
 		ostream_proxy&>::type operator<<( ostream_proxy & os, T && t )
 	{
-		uint64_t begin = os.stream.tell();
+		uint64_t begin = os.sourceMapGenerator ? os.stream->tell() : 0;
 		if ( os.newLine && os.readableOutput )
 			for ( int i = 0; i < os.indentLevel; i++ )
-				os.stream << '\t';
+				*os.stream << '\t';
 
-		os.stream << std::forward<T>(t);
+		*os.stream << std::forward<T>(t);
 		os.newLine = false;
-		uint64_t end = os.stream.tell();
 		if(os.sourceMapGenerator)
-			os.sourceMapGenerator->addLineOffset(end-begin);
+			os.sourceMapGenerator->addLineOffset(os.stream->tell()-begin);
 		return os;
 	}
 
@@ -107,16 +137,24 @@ public:
 	// the 'syncRawStream' method to avoid breaking sourcemaps.
 	llvm::raw_ostream & getRawStream() const
 	{
-		return stream;
+		return *stream;
 	}
 
 	void syncRawStream(uint64_t beginVal)
 	{
-		uint64_t end = stream.tell();
+		uint64_t end = stream->tell();
 		if(sourceMapGenerator)
 			sourceMapGenerator->addLineOffset(end-beginVal);
 	}
 
+	// Write to another stream and source map generator, keeping the indentation state.
+	// This is used to generate code out of order into separate buffers.
+	void redirect(llvm::raw_ostream& s, SourceMapGenerator* g)
+	{
+		stream = &s;
+		sourceMapGenerator = g;
+	}
+
 private:
 
 	// Return true if we are closing a curly bracket, need to unindent by 1.
@@ -136,22 +174,23 @@ private:
 		return ans;
 	}
 
+	// Update the indentation and indent a new line, return the number of tabs
 	template<class T>
-	void write_indent(T && t)
+	uint32_t write_indent(T && t)
 	{
 		int oldIndent = indentLevel;
 		if (updateIndent( std::forward<T>(t) ) )
 			oldIndent--;
 
-		if ( newLine && readableOutput )
-			for ( int i = 0; i < oldIndent; i++ )
-				stream << '\t';
-
-		stream << std::forward<T>(t);
+		uint32_t tabs = 0;
+		if ( newLine )
+			for ( ; int(tabs) < oldIndent; tabs++ )
+				*stream << '\t';
 		newLine = false;
+		return tabs;
 	}
 
-	llvm::raw_ostream & stream;
+	llvm::raw_ostream * stream;
 	SourceMapGenerator* sourceMapGenerator;
 	bool readableOutput;
 	bool newLine;
@@ -169,6 +208,10 @@ private:
 	llvm::Module& module;
 	llvm::DataLayout targetData;
 	const llvm::Function* currentFun;
+	// Instructions of unsignedTruncationFunction which need to be truncated
+	// to be used as unsigned, see needsUnsignedTruncation
+	const llvm::Function* unsignedTruncationFunction;
+	llvm::DenseSet<const llvm::Value*> unsignedTruncationSet;
 	const PointerAnalyzer & PA;
 	Registerize & registerize;
 
@@ -209,6 +252,19 @@ private:
 	bool checkBounds;
 	// The name of the external wasm file, or empty if not present
 	const std::string& wasmFile;
+	// Flag to signal if the wasm module should be compiled while it is downloaded
+	bool wasmStreaming;
+	// The hash of the wasm module, used as the key of the compiled module
+	// cached in IndexedDB. Empty if the compiled module is not cached.
+	std::string wasmModuleHash;
+	// Flag to signal if the wasm memory can grow. The heap views are refreshed
+	// every time the execution returns from wasm code.
+	bool wasmGrowMemory;
+	// The name of the file with the contents of the lazily loaded globals,
+	// or empty if there are none
+	const std::string& lazyDataFile;
+	// If not null, the phases of makeJS are measured in this report
+	PassReport* report;
 	// Flag to signal if we should generate typed arrays when element type is
 	// double. Without this flag, normal arrays are used since they are
 	// currently faster on v8.
@@ -217,6 +273,9 @@ private:
 	bool symbolicGlobalsAsmJS;
 	// Flag to signal if we should emit readable or compressed output
 	bool readableOutput;
+	// Number of threads used to compile the methods, 0 means one per core.
+	// The output does not depend on this value.
+	unsigned numThreads;
 
 	/**
 	 * \addtogroup MemFunction methods to handle memcpy, memmove, mallocs and free (and alike)
@@ -231,6 +290,12 @@ private:
 	                    const llvm::Value* srcOrResetVal,
 	                    const llvm::Value* size);
 
+	/**
+	 * Expand small memcpy, memmove and memset in asm.js as heap accesses.
+	 * Returns false if the intrinsic must be lowered to a library call
+	 */
+	bool compileInlineMemIntrinsicAsmJS(const llvm::MemIntrinsic& MI);
+
 	/**
 	 * Copy baseSrc into baseDest
 	 */
@@ -398,6 +463,11 @@ private:
 	void compileMethodLocal(llvm::StringRef name, Registerize::REGISTER_KIND kind);
 	void compileMethodLocals(const llvm::Function& F, bool needsLabel);
 	void compileMethod(const llvm::Function& F);
+	/**
+	 * Compile the methods in order, possibly on multiple threads
+	 */
+	void compileMethods(const std::vector<const llvm::Function*>& functions);
+	void compileMethodsInParallel(const std::vector<const llvm::Function*>& functions);
 	/**
 	 * Helper structure for compiling globals
 	 */
@@ -428,6 +498,33 @@ private:
 	 * a file, usable from the browser and node
 	 */
 	void compileFetchBuffer();
+	void compileInstantiateWasm();
+	void compileInstantiateCachedWasm();
+	/**
+	 * Compile the helper that recreates the heap views after the wasm memory
+	 * has grown. It returns its argument, so that it can wrap calls into wasm.
+	 */
+	void compileRefreshHeapHelper();
+	/**
+	 * Compile cheerpLoadLazyData, which fetches the contents of the lazily
+	 * loaded globals the first time it is called. It returns a promise.
+	 */
+	void compileLoadLazyData();
+	/**
+	 * Compile an Int32Array view of the counters of an instrumented build
+	 */
+	void compileCountersView(const llvm::GlobalVariable& counters);
+	/**
+	 * Compile cheerpProfileDump, which returns the calls counted so far by an
+	 * instrumented build, in the format read by -cheerp-profile-use.
+	 */
+	void compileProfileDump(const llvm::GlobalVariable& counters);
+	/**
+	 * Compile cheerpInstrumentSample, which records the stack trace of the
+	 * sampled calls, and cheerpInstrumentReport, which builds the flat and
+	 * call tree profiles using the parsed symbol map.
+	 */
+	void compileInstrumentReport(const llvm::NamedMDNode& symbols, const llvm::GlobalVariable* counters);
 	/**
 	 * This method supports both ConstantArray and ConstantDataSequential
 	 */
@@ -449,8 +546,9 @@ private:
 	void compileClassConstructor(llvm::StructType* T);
 	void compileArrayClassType(llvm::Type* T);
 	void compileArrayPointerType();
-	bool needsUnsignedTruncation(std::unordered_set<const llvm::Value*> visited, const llvm::Value* v) const;
-	bool needsUnsignedTruncation(const llvm::Value* v) const;
+	bool needsUnsignedTruncation(const llvm::Value* v);
+	bool evaluateUnsignedTruncation(const llvm::Value* v) const;
+	void computeUnsignedTruncation(const llvm::Function& F);
 
 	/**
 	 * Methods implemented in Opcodes.cpp
@@ -521,10 +619,17 @@ public:
 			bool checkBounds,
 			bool compileGlobalsAddrAsmJS,
 			const std::string& wasmFile,
-			bool forceTypedArrays):
+			bool forceTypedArrays,
+			bool wasmStreaming,
+			llvm::StringRef wasmModuleHash,
+			bool wasmGrowMemory,
+			const std::string& lazyDataFile,
+			PassReport* report,
+			unsigned numThreads = 1):
 		module(m),
 		targetData(&m),
 		currentFun(NULL),
+		unsignedTruncationFunction(NULL),
 		PA(PA),
 		registerize(registerize),
 		globalDeps(gda),
@@ -550,9 +655,15 @@ public:
 		heapSize(heapSize),
 		checkBounds(checkBounds),
 		wasmFile(wasmFile),
+		wasmStreaming(wasmStreaming),
+		wasmModuleHash(wasmModuleHash),
+		wasmGrowMemory(wasmGrowMemory),
+		lazyDataFile(lazyDataFile),
+		report(report),
 		forceTypedArrays(forceTypedArrays),
 		symbolicGlobalsAsmJS(compileGlobalsAddrAsmJS),
 		readableOutput(readableOutput),
+		numThreads(numThreads),
 		stream(s, sourceMapGenerator, readableOutput)
 	{
 	}
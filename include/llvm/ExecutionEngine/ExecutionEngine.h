@@ -149,6 +149,9 @@ public:
   // This function is overridden by the interpreter
   virtual Function* getCurrentCaller() { return nullptr; }
   virtual Function* getCurrentFunction() { return nullptr; }
+  // Get the call instruction Depth frames above the current function, so 0 is
+  // the call to the current function, or nullptr if there is no such frame
+  virtual Instruction* getCallInstruction(unsigned Depth) { return nullptr; }
 
 protected:
   /// The list of Modules that we are JIT'ing from.  We use a SmallVector to
@@ -174,7 +177,7 @@ protected:
   /// abort.
   void *(*LazyFunctionCreator)(const std::string &);
 
-  void (*StoreListener)(void* Addr);
+  void (*StoreListener)(void* Addr, Type* Ty);
   void (*AllocaListener)(Type* Ty, uint32_t Size, void* Addr);
   void (*RetListener)(const std::vector<std::unique_ptr<char[]>>&);
 
@@ -435,6 +438,8 @@ public:
   /// Returns if the execution is known to have failed
   virtual bool hasFailed() const { return false; }
   virtual void resetFailed() { }
+  /// Stops the execution cleanly, as if it failed
+  virtual void setFailed() { }
 
   /// DisableLazyCompilation - When lazy compilation is off (the default), the
   /// JIT will eagerly compile every function reachable from the argument to
@@ -494,8 +499,9 @@ public:
     LazyFunctionCreator = P;
   }
 
-  /// InstallStoreListener - Listener to invoke on each store
-  void InstallStoreListener(void (*P)(void* Addr)) {
+  /// InstallStoreListener - Listener to invoke on each store (the arguments
+  /// are the address and the type of the stored value)
+  void InstallStoreListener(void (*P)(void* Addr, Type* Ty)) {
     StoreListener = P;
   }
   /// InstallAllocaListener - Listener to invoke on each alloca
@@ -30,16 +30,23 @@ public:
 	void* toReal(void* virt) override
 	{
 		uintptr_t virti = reinterpret_cast<uintptr_t>(virt);
+		// Consecutive accesses are usually to the same page
+		if (virti - last_virt.first < last_virt.second.size)
+			return reinterpret_cast<void*>(last_virt.second.start + (virti - last_virt.first));
 		auto it = find_start(virt_to_real, virti);
 		assert(it != virt_to_real.end() && "the requested address is out of range");
+		last_virt = *it;
 		ptrdiff_t offset = virti - it->first;
 		return reinterpret_cast<void*>(it->second.start+offset);
 	}
 	void* toVirtual(void* real) override
 	{
 		uintptr_t reali = reinterpret_cast<uintptr_t>(real);
+		if (reali - last_real.first < last_real.second.size)
+			return reinterpret_cast<void*>(last_real.second.start + (reali - last_real.first));
 		auto it = find_start(real_to_virt, reali);
 		assert(it != real_to_virt.end() && "the requested address is out of range");
+		last_real = *it;
 		ptrdiff_t offset = reali - it->first;
 		return reinterpret_cast<void*>(it->second.start+offset);
 	}
@@ -58,9 +65,11 @@ public:
 		assert(it != real_to_virt.end());
 		virt_to_real.erase(it->second.start);
 		real_to_virt.erase(it);
+		last_virt = *virt_to_real.begin();
+		last_real = *real_to_virt.begin();
 	}
 
-	VirtualAddressMap() {
+	VirtualAddressMap(): last_virt(0,Page(0,8)), last_real(0,Page(0,8)) {
 		virt_to_real.emplace(0,Page(0,8));
 		real_to_virt.emplace(0,Page(0,8));
 		next_virt = 8;
@@ -86,6 +95,9 @@ private:
 	uintptr_t next_virt;
 	std::map<uintptr_t, Page> virt_to_real;
 	std::map<uintptr_t, Page> real_to_virt;
+	// The pages found by the last lookups
+	std::pair<uintptr_t, Page> last_virt;
+	std::pair<uintptr_t, Page> last_real;
 };
 class DirectAddressMap : public AddressMapBase {
 public:
@@ -294,6 +294,7 @@ void initializeStructMemFuncLoweringPass(PassRegistry&);
 void initializeAllocaMergingPass(PassRegistry&);
 void initializeGlobalDepsAnalyzerPass(PassRegistry&);
 void initializeIdenticalCodeFoldingPass(PassRegistry&);
+void initializeSimilarFunctionMergingPass(PassRegistry&);
 void initializePointerAnalyzerPass(PassRegistry&);
 void initializeRegisterizePass(PassRegistry&);
 void initializeStructMemFuncLoweringPass(PassRegistry&);
@@ -0,0 +1,112 @@
+//===-- FunctionProfile.cpp - Profile guided function layout --------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/FunctionProfile.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace llvm;
+
+namespace cheerp {
+
+std::unique_ptr<FunctionProfile> FunctionProfile::read(StringRef path)
+{
+	ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(path);
+	if (!buffer)
+		report_fatal_error("cannot read profile " + path + ": " + buffer.getError().message(), false);
+	std::unique_ptr<FunctionProfile> profile(new FunctionProfile);
+	if (!profile->parse((*buffer)->getBuffer()))
+		report_fatal_error("invalid profile " + path, false);
+	return profile;
+}
+
+bool FunctionProfile::parse(StringRef data)
+{
+	while (!data.empty())
+	{
+		StringRef line;
+		std::tie(line, data) = data.split('\n');
+		line = line.trim();
+		if (line.empty() || line[0] == '#')
+			continue;
+		StringRef count, name;
+		std::tie(count, name) = line.split(' ');
+		uint64_t value;
+		name = name.trim();
+		if (count.getAsInteger(10, value) || name.empty())
+			return false;
+		// The dumps of many runs can be concatenated
+		counts[name] += value;
+	}
+	return true;
+}
+
+const char* const ProfileInstrumentation::countersName = "__cheerp_profile_counters";
+const char* const ProfileInstrumentation::namesMetadataName = "cheerp.profile.functions";
+
+bool ProfileInstrumentation::runOnModule(Module& M)
+{
+	std::vector<Function*> functions;
+	for (Function& F : M)
+	{
+		if (!F.isDeclaration() && F.getSection() == StringRef("asmjs"))
+			functions.push_back(&F);
+	}
+	if (functions.empty())
+		return false;
+
+	GlobalVariable* counters = createCounters(M, functions, /*inLinearMemory*/true);
+	for (uint32_t i = 0; i < functions.size(); i++)
+		addCounter(counters, *functions[i], i);
+	return true;
+}
+
+GlobalVariable* ProfileInstrumentation::createCounters(Module& M, ArrayRef<Function*> functions, bool inLinearMemory)
+{
+	LLVMContext& C = M.getContext();
+	ArrayType* countersTy = ArrayType::get(Type::getInt32Ty(C), functions.size());
+	GlobalVariable* counters = new GlobalVariable(M, countersTy, /*isConstant*/false,
+		GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy), countersName);
+	if (inLinearMemory)
+		counters->setSection("asmjs");
+
+	NamedMDNode* names = M.getOrInsertNamedMetadata(namesMetadataName);
+	for (Function* F : functions)
+		names->addOperand(MDNode::get(C, MDString::get(C, F->getName())));
+	return counters;
+}
+
+Value* ProfileInstrumentation::addCounter(GlobalVariable* counters, Function& F, uint32_t i)
+{
+	// The counters are 32 bit wide, asm.js can't increment 64 bit values
+	IRBuilder<> Builder(F.getEntryBlock().getFirstInsertionPt());
+	Value* counter = Builder.CreateConstInBoundsGEP2_32(counters, 0, i);
+	Value* count = Builder.CreateAdd(Builder.CreateLoad(counter), Builder.getInt32(1));
+	Builder.CreateStore(count, counter);
+	return count;
+}
+
+const char* ProfileInstrumentation::getPassName() const
+{
+	return "ProfileInstrumentation";
+}
+
+char ProfileInstrumentation::ID = 0;
+
+ModulePass* createProfileInstrumentationPass()
+{
+	return new ProfileInstrumentation();
+}
+
+}
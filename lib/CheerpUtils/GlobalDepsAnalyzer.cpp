@@ -720,6 +720,23 @@ void GlobalDepsAnalyzer::eraseFunction(llvm::Function* F) {
 	reachableGlobals.erase(F);
 }
 
+void GlobalDepsAnalyzer::collectExternallyUsedFunctions(const llvm::Module& M, std::unordered_set<const llvm::Function*>& functions) const
+{
+	functions.insert(asmJSExportedFuncions.begin(), asmJSExportedFuncions.end());
+	functions.insert(asmJSImportedFuncions.begin(), asmJSImportedFuncions.end());
+	functions.insert(constructorsNeeded.begin(), constructorsNeeded.end());
+	if (entryPoint)
+		functions.insert(entryPoint);
+	for (const NamedMDNode& namedNode : M.named_metadata())
+	{
+		StringRef name = namedNode.getName();
+		if (name != "jsexported_methods" && !(name.endswith("_methods") && name.startswith("class._Z")))
+			continue;
+		for (const MDNode* node : namedNode.operands())
+			functions.insert(cast<Function>(cast<ConstantAsMetadata>(node->getOperand(0))->getValue()));
+	}
+}
+
 }
 
 using namespace cheerp;
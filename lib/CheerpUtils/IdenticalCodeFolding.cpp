@@ -13,12 +13,18 @@
 #include "llvm/InitializePasses.h"
 #include "llvm/Cheerp/IdenticalCodeFolding.h"
 #include "llvm/Cheerp/GlobalDepsAnalyzer.h"
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
+#include <atomic>
+#include <memory>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 //#define DEBUG_VERBOSE 1
 
@@ -35,7 +41,8 @@ const char* IdenticalCodeFolding::getPassName() const
 	return "IdenticalCodeFolding";
 }
 
-IdenticalCodeFolding::IdenticalCodeFolding() : ModulePass(ID)
+IdenticalCodeFolding::IdenticalCodeFolding(unsigned numThreads) : ModulePass(ID), DL(nullptr),
+	numThreads(numThreads), PA(nullptr), asmjs(true)
 {
 }
 
@@ -47,17 +54,42 @@ void IdenticalCodeFolding::getAnalysisUsage(AnalysisUsage& AU) const
 	ModulePass::getAnalysisUsage(AU);
 }
 
+// Types which may be equivalent have the same hash
+uint64_t IdenticalCodeFolding::hashType(const llvm::Type* T, bool asmjs)
+{
+	// In asm.js all the integers and the pointers are equivalent
+	if (asmjs && T->isPointerTy())
+		T = Type::getInt32Ty(T->getContext());
+
+	HashAccumulator64 hash;
+	hash.add(T->getTypeID());
+	if (T->isIntegerTy() && !asmjs)
+		hash.add(T->getIntegerBitWidth());
+	else if (const ArrayType* at = dyn_cast<ArrayType>(T)) {
+		hash.add(at->getNumElements());
+		hash.add(hashType(at->getElementType(), asmjs));
+	}
+	else if (const StructType* st = dyn_cast<StructType>(T))
+		hash.add(st->getNumElements());
+	return hash.getHash();
+}
+
 // This function is based on
 // https://github.com/Microsoft/llvm/commit/6470102728c661adf204d0e361d30faa0a95667f
-uint64_t IdenticalCodeFolding::hashFunction(llvm::Function& F)
+IdenticalCodeFolding::FunctionHash IdenticalCodeFolding::hashFunction(const llvm::Function& F)
 {
+	const bool asmjs = F.getSection() == StringRef("asmjs");
 	HashAccumulator64 hash;
+	FunctionHash result;
 
 	hash.add(F.isVarArg());
 	hash.add(F.arg_size());
+	hash.add(hashType(F.getReturnType(), asmjs));
+	for (const Argument& arg : F.args())
+		hash.add(hashType(arg.getType(), asmjs));
 
-	SmallVector<BasicBlock*, 8> blocks;
-	SmallSet<BasicBlock*, 16> visited;
+	SmallVector<const BasicBlock*, 8> blocks;
+	SmallSet<const BasicBlock*, 16> visited;
 
 	// Walk the blocks in the same order as equivalentFunction(), accumulating
 	// the hash of the function "structure." (basic block and opcode sequence)
@@ -75,6 +107,33 @@ uint64_t IdenticalCodeFolding::hashFunction(llvm::Function& F)
 			if (ignoreInstruction(&Inst))
 				continue;
 			hash.add(Inst.getOpcode());
+			hash.add(hashType(Inst.getType(), asmjs));
+			if (auto cmp = dyn_cast<CmpInst>(&Inst))
+				hash.add(cmp->getPredicate());
+
+			// The operand types and the constants, hashed like
+			// equivalentConstant() compares them
+			for (const Use& op : Inst.operands()) {
+				hash.add(hashType(op->getType(), asmjs));
+				if (auto c = dyn_cast<ConstantInt>(op)) {
+					uint32_t bits = c->getBitWidth();
+					if (bits == 32 || bits == 64)
+						hash.add(c->getSExtValue());
+					else if (bits < 64)
+						hash.add(c->getZExtValue());
+				} else if (auto c = dyn_cast<ConstantFP>(op)) {
+					hash.add(hash_value(c->getValueAPF().bitcastToAPInt()));
+				}
+			}
+
+			// The callees are hashed by the caller, direct calls through a
+			// bitcast are compared like the other direct calls
+			if (auto ci = dyn_cast<CallInst>(&Inst)) {
+				const Value* callee = ci->getCalledValue();
+				if (isStaticIndirectFunction(callee))
+					callee = cast<ConstantExpr>(callee)->getOperand(0);
+				result.callees.push_back(dyn_cast<Function>(callee));
+			}
 
 			// In order to reduce the number of possible matches, hash the
 			// GEP's constant integer indices.
@@ -95,7 +154,36 @@ uint64_t IdenticalCodeFolding::hashFunction(llvm::Function& F)
 		}
 	}
 
-	return hash.getHash();
+	result.hash = hash.getHash();
+	return result;
+}
+
+void IdenticalCodeFolding::hashFunctions(const std::vector<const llvm::Function*>& functions, std::vector<FunctionHash>& hashes) const
+{
+	hashes.resize(functions.size());
+#if LLVM_ENABLE_THREADS
+	if (numThreads != 1) {
+		// Hashing only reads the IR, every worker fills the hashes of the
+		// functions it takes
+		std::atomic<uint32_t> nextFunction(0);
+		auto worker = [&]()
+		{
+			for (uint32_t i = nextFunction++; i < functions.size(); i = nextFunction++)
+				hashes[i] = hashFunction(*functions[i]);
+		};
+
+		unsigned threads = numThreads ? numThreads : std::thread::hardware_concurrency();
+		std::vector<std::thread> workers;
+		for (unsigned i = 1; i < threads && i < functions.size(); i++)
+			workers.emplace_back(worker);
+		worker();
+		for (std::thread& t : workers)
+			t.join();
+		return;
+	}
+#endif
+	for (uint32_t i = 0; i < functions.size(); i++)
+		hashes[i] = hashFunction(*functions[i]);
 }
 
 bool IdenticalCodeFolding::equivalentFunction(const llvm::Function* A, const llvm::Function* B)
@@ -106,24 +194,44 @@ bool IdenticalCodeFolding::equivalentFunction(const llvm::Function* A, const llv
 #endif
 
 	// Do not fold wasm/asmjs with generic JS functions.
-	if (A->getSection() != StringRef("asmjs") || B->getSection() != StringRef("asmjs"))
+	if (!A || !B || StringRef(A->getSection()) != StringRef(B->getSection()))
 		return false;
 
+	// The generic JS functions can only be compared when the pointer kinds
+	// are available
+	const bool wasAsmJS = asmjs;
+	asmjs = A->getSection() == StringRef("asmjs");
+	bool equivalent = (asmjs || PA) && equivalentFunctionBody(A, B);
+	asmjs = wasAsmJS;
+	return equivalent;
+}
+
+bool IdenticalCodeFolding::equivalentFunctionBody(const llvm::Function* A, const llvm::Function* B)
+{
 	// Mark the function pair as equivalent to deal with recursion. The
 	// right equivalence value is set when |equivalentFunction()| returns.
 	functionEquivalence[{A, B}] = true;
 
-	if (!A || !B || A->isVarArg() != B->isVarArg() || A->arg_size() != B->arg_size())
+	if (A->isVarArg() != B->isVarArg() || A->arg_size() != B->arg_size())
 		return false;
 
 	// Do not fold functions that have inequivalent function parameter types.
 	for (auto a = A->arg_begin(), b = B->arg_begin(); a != A->arg_end(); ++a, ++b) {
-		if (!equivalentType(a->getType(), b->getType()))
+		if (!equivalentType(a->getType(), b->getType()) || !equivalentPointerKind(&*a, &*b))
 			return false;
 	}
 
+	if (!equivalentType(A->getReturnType(), B->getReturnType()))
+		return false;
+	if (!asmjs && A->getReturnType()->isPointerTy() &&
+		PA->getPointerKindForReturn(A) != PA->getPointerKindForReturn(B))
+	{
+		return false;
+	}
+
+	// Different declarations are never equivalent
 	if (A->empty() || B->empty())
-		return A->empty() == B->empty();
+		return false;
 
 	SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 8> blocks;
 	SmallSet<const BasicBlock*, 16> visited;
@@ -213,11 +321,17 @@ bool IdenticalCodeFolding::equivalentInstruction(const llvm::Instruction* A, con
 	if (!A || !B || A->getOpcode() != B->getOpcode())
 		return false;
 
+	// In generic JS the type and the kind of the result decide the code
+	if (!asmjs && (!equivalentType(A->getType(), B->getType()) || !equivalentPointerKind(A, B)))
+		return false;
+
 	switch(A->getOpcode())
 	{
 		case Instruction::Alloca:
 		{
-			llvm::report_fatal_error("Allocas in wasm should be removed in the AllocaLowering pass. This is a bug");
+			if (asmjs)
+				llvm::report_fatal_error("Allocas in wasm should be removed in the AllocaLowering pass. This is a bug");
+			return equivalentOperand(cast<AllocaInst>(A)->getArraySize(), cast<AllocaInst>(B)->getArraySize());
 		}
 		case Instruction::Unreachable:
 		{
@@ -252,10 +366,15 @@ bool IdenticalCodeFolding::equivalentInstruction(const llvm::Instruction* A, con
 		case Instruction::FMul:
 		case Instruction::FSub:
 		case Instruction::FRem:
+		{
+			return equivalentOperand(A->getOperand(0), B->getOperand(0)) &&
+				equivalentOperand(A->getOperand(1), B->getOperand(1));
+		}
 		case Instruction::FCmp:
 		case Instruction::ICmp:
 		{
-			return equivalentOperand(A->getOperand(0), B->getOperand(0)) &&
+			return cast<CmpInst>(A)->getPredicate() == cast<CmpInst>(B)->getPredicate() &&
+				equivalentOperand(A->getOperand(0), B->getOperand(0)) &&
 				equivalentOperand(A->getOperand(1), B->getOperand(1));
 		}
 		case Instruction::Br:
@@ -272,6 +391,12 @@ bool IdenticalCodeFolding::equivalentInstruction(const llvm::Instruction* A, con
 		{
 			const SwitchInst* a = cast<SwitchInst>(A);
 			const SwitchInst* b = cast<SwitchInst>(B);
+			if (a->getNumCases() != b->getNumCases())
+				return false;
+			for (auto ca = a->case_begin(), cb = b->case_begin(); ca != a->case_end(); ++ca, ++cb) {
+				if (!equivalentConstant(ca.getCaseValue(), cb.getCaseValue()))
+					return false;
+			}
 			return equivalentOperand(a->getCondition(), b->getCondition());
 		}
 		case Instruction::VAArg:
@@ -294,10 +419,20 @@ bool IdenticalCodeFolding::equivalentInstruction(const llvm::Instruction* A, con
 			{
 				unsigned intrinsic = calledFunc->getIntrinsicID();
 
-				if (!cast<CallInst>(B)->getCalledFunction() ||
-					cast<CallInst>(B)->getCalledFunction()->getIntrinsicID() != intrinsic)
-				{
+				const Function* calledFuncB = cast<CallInst>(B)->getCalledFunction();
+				if (!calledFuncB || calledFuncB->getIntrinsicID() != intrinsic)
 					return false;
+
+				// The generic JS code of the intrinsics depends on the types
+				// of their operands
+				if (!asmjs && intrinsic != Intrinsic::not_intrinsic) {
+					if (calledFunc != calledFuncB)
+						return false;
+					for (unsigned i = 0; i < ci->getNumArgOperands(); i++) {
+						if (!equivalentOperand(ci->getArgOperand(i), cast<CallInst>(B)->getArgOperand(i)))
+							return false;
+					}
+					return true;
 				}
 
 				switch (calledFunc->getIntrinsicID())
@@ -365,11 +500,15 @@ bool IdenticalCodeFolding::equivalentInstruction(const llvm::Instruction* A, con
 			const PointerType* pTyB = cast<PointerType>(calledValueB->getType());
 			const FunctionType* fTyB = cast<FunctionType>(pTyB->getElementType());
 
-			if (fTy->getNumParams() != fTyB->getNumParams())
+			if (fTy->getNumParams() != fTyB->getNumParams() ||
+				ci->getNumArgOperands() != cast<CallInst>(B)->getNumArgOperands())
+			{
 				return false;
+			}
 
+			// Also compare the variadic arguments
 			for (auto opA = ci->op_begin(), opB = cast<CallInst>(B)->op_begin();
-					opA != ci->op_begin() + fTy->getNumParams(); ++opA, ++opB)
+					opA != ci->op_begin() + ci->getNumArgOperands(); ++opA, ++opB)
 			{
 				if (!equivalentOperand(opA->get(), opB->get()))
 					return false;
@@ -459,8 +598,8 @@ bool IdenticalCodeFolding::equivalentInstruction(const llvm::Instruction* A, con
 		{
 			const SelectInst* siA = cast<SelectInst>(A);
 			const SelectInst* siB = cast<SelectInst>(B);
-			return equivalentOperand(siA->getTrueValue(), siB->getTrueValue()) ||
-				equivalentOperand(siA->getFalseValue(), siB->getFalseValue()) ||
+			return equivalentOperand(siA->getTrueValue(), siB->getTrueValue()) &&
+				equivalentOperand(siA->getFalseValue(), siB->getFalseValue()) &&
 				equivalentOperand(siA->getCondition(), siB->getCondition());
 		}
 		case Instruction::SIToFP:
@@ -495,6 +634,9 @@ bool IdenticalCodeFolding::equivalentInstruction(const llvm::Instruction* A, con
 		}
 		default:
 		{
+			// Do not fold generic JS code which is not handled above
+			if (!asmjs)
+				return false;
 			A->dump();
 			llvm_unreachable("Unknown instruction");
 		}
@@ -528,11 +670,11 @@ bool IdenticalCodeFolding::equivalentOperand(const llvm::Value* A, const llvm::V
 	}
 
 	if (isa<Argument>(A) || isa<Argument>(B)) {
-		const Argument* a = cast<Argument>(A);
-		const Argument* b = cast<Argument>(B);
+		const Argument* a = dyn_cast<Argument>(A);
+		const Argument* b = dyn_cast<Argument>(B);
 		if (!a || !b)
 		    return false;
-		return a->getArgNo() == b->getArgNo();
+		return a->getArgNo() == b->getArgNo() && equivalentPointerKind(a, b);
 	}
 
 	A->dump();
@@ -631,6 +773,10 @@ bool IdenticalCodeFolding::equivalentConstant(const llvm::Constant* A, const llv
 	if (isa<UndefValue>(A) || isa<UndefValue>(B))
 		return isa<UndefValue>(A) && isa<UndefValue>(B);
 
+	// The other generic JS constants, like aggregates, must be the same
+	if (!asmjs)
+		return A == B;
+
 	A->dump();
 	B->dump();
 	llvm_unreachable("unknown constant");
@@ -646,6 +792,15 @@ bool IdenticalCodeFolding::equivalentType(const llvm::Type* A, const llvm::Type*
 	llvm::errs() << "TB: "; B->dump();
 #endif
 
+	if (A == B)
+		return true;
+
+	// The generic JS code depends on the exact types. Also, the kinds of the
+	// pointers in memory are computed for each type, so functions accessing
+	// different types can't be merged.
+	if (!asmjs)
+		return false;
+
 	if (A->isFloatTy() && B->isFloatTy())
 		return true;
 	if (A->isDoubleTy() && B->isDoubleTy())
@@ -685,8 +840,26 @@ bool IdenticalCodeFolding::equivalentType(const llvm::Type* A, const llvm::Type*
 	return false;
 }
 
+// Generic JS pointers are compiled differently for each kind
+bool IdenticalCodeFolding::equivalentPointerKind(const llvm::Value* A, const llvm::Value* B)
+{
+	if (asmjs || !A->getType()->isPointerTy())
+		return true;
+	return PA->getPointerKind(A) == PA->getPointerKind(B);
+}
+
 bool IdenticalCodeFolding::equivalentGep(const llvm::GetElementPtrInst* A, const llvm::GetElementPtrInst* B)
 {
+	if (!asmjs) {
+		if (A->getNumOperands() != B->getNumOperands())
+			return false;
+		for (unsigned i = 0; i < A->getNumOperands(); i++) {
+			if (!equivalentOperand(A->getOperand(i), B->getOperand(i)))
+				return false;
+		}
+		return true;
+	}
+
 	struct GepListener: public LinearMemoryHelper::GepListener
 	{
 		GepListener() : offset(0) {}
@@ -786,28 +959,79 @@ bool IdenticalCodeFolding::runOnModule(llvm::Module& module)
 	cheerp::GlobalDepsAnalyzer &GDA = getAnalysis<cheerp::GlobalDepsAnalyzer>();
 	DL = module.getDataLayout();
 
-	// First, compute an hash of each function.
-	std::unordered_map<uint64_t, std::vector<Function*>> functionHashes;
-	for (Function& F : module.getFunctionList()) {
-		if (F.isDeclaration() || F.getSection() != StringRef("asmjs"))
-			continue;
+	// The functions referenced by JS, by the writer or by GDA can't be removed
+	std::unordered_set<const Function*> keep;
+	GDA.collectExternallyUsedFunctions(module, keep);
 
-		// Do not remove functions that are exported to generic JS.
-		if (GDA.asmJSExports().find(&F) != GDA.asmJSExports().end())
+	// First, compute an hash of each function body.
+	std::vector<const Function*> defined;
+	for (const Function& F : module.getFunctionList()) {
+		if (!F.isDeclaration())
+			defined.push_back(&F);
+	}
+	std::vector<FunctionHash> hashes;
+	hashFunctions(defined, hashes);
+	DenseMap<const Function*, uint64_t> bodyHashes;
+	for (uint32_t i = 0; i < defined.size(); i++)
+		bodyHashes[defined[i]] = hashes[i].hash;
+
+	// The hash of a function also covers the bodies of its callees, so that
+	// only the functions calling equivalent code share a bucket.
+	std::unordered_map<uint64_t, uint32_t> bucketIndexes;
+	std::vector<std::vector<Function*>> buckets;
+	for (uint32_t i = 0; i < defined.size(); i++) {
+		Function* F = const_cast<Function*>(defined[i]);
+		if (keep.count(F))
+			continue;
+		if (F->getSection() != StringRef("asmjs") &&
+			(TypeSupport::isClientGlobal(F) || isFreeFunctionName(F->getName())))
+		{
 			continue;
+		}
+
+		HashAccumulator64 hash;
+		hash.add(hashes[i].hash);
+		for (const Function* callee : hashes[i].callees) {
+			if (!callee)
+				hash.add(0);
+			else if (callee->getIntrinsicID() != Intrinsic::not_intrinsic)
+				hash.add(callee->getIntrinsicID());
+			else if (bodyHashes.count(callee))
+				hash.add(bodyHashes[callee]);
+			else
+				hash.add(hash_value(callee->getName()));
+		}
 
-		uint64_t hash = hashFunction(F);
-		const auto& found = functionHashes.find(hash);
-		if (found != functionHashes.end())
-			found->second.push_back(&F);
-		else
-			functionHashes.insert({hash, {&F}});
+		auto inserted = bucketIndexes.insert({hash.getHash(), buckets.size()});
+		if (inserted.second)
+			buckets.emplace_back();
+		buckets[inserted.first->second].push_back(F);
 	}
 
-	// Second, compare the functions that have the same hash value.
-	for (auto item : functionHashes) {
-		auto& functions = item.second;
+	// The generic JS functions are compared using the pointer kinds, which
+	// are only computed when there is something to compare
+	bool needsPointerKinds = false;
+	for (const auto& bucket : buckets) {
+		if (bucket.size() < 2)
+			continue;
+		for (const Function* F : bucket)
+			needsPointerKinds |= F->getSection() != StringRef("asmjs");
+	}
+	// The pointer arithmetic is not lowered yet, so this analyzer is private
+	// to the pass and discarded once the functions are folded
+	std::unique_ptr<PointerAnalyzer> analyzer;
+	if (needsPointerKinds) {
+		analyzer.reset(new PointerAnalyzer());
+		analyzer->runOnModule(module);
+		analyzer->fullResolve();
+		PA = analyzer.get();
+	}
+	// The folded functions are deleted at the end, as the analyzer caches
+	// their values
+	std::vector<Function*> folded;
 
+	// Second, compare the functions that have the same hash value.
+	for (auto& functions : buckets) {
 		if (functions.size() < 2)
 			continue;
 
@@ -816,23 +1040,21 @@ bool IdenticalCodeFolding::runOnModule(llvm::Module& module)
 			DEBUG(dbgs() << " " << function->getName());
 		DEBUG(dbgs() << "\n");
 
-		std::unordered_map<Function*, Function*> fold;
+		// Every function is compared with one function of each equivalence
+		// class found so far. The last function of a class is kept.
+		std::vector<Function*> representatives;
 		std::vector<std::pair<Function*, Function*>> foldOrder;
 
-		for (unsigned i = 0; i < functions.size(); i++) {
-			assert(!fold.count(functions[i]));
-
-			for (unsigned j = 0; j < functions.size(); j++) {
-				if (i == j || fold.count(functions[j]))
-					continue;
-
+		for (auto F = functions.rbegin(); F != functions.rend(); ++F) {
+			Function* replacement = nullptr;
+			for (Function* G : representatives) {
 				visitedPhis.clear();
 
-				auto key = make_pair(functions[i], functions[j]);
+				auto key = make_pair(*F, G);
 				bool equivalent = false;
 				auto found = functionEquivalence.find(key);
 				if (found == functionEquivalence.end()) {
-					equivalent = equivalentFunction(functions[i], functions[j]);
+					equivalent = equivalentFunction(*F, G);
 					functionEquivalence[key] = equivalent;
 				} else {
 					equivalent = found->second;
@@ -843,26 +1065,21 @@ bool IdenticalCodeFolding::runOnModule(llvm::Module& module)
 #endif
 
 				if (equivalent) {
-					fold.insert({functions[i], functions[j]});
-					foldOrder.push_back({functions[i], functions[j]});
+					replacement = G;
 					break;
 				}
 			}
+			if (replacement)
+				foldOrder.push_back({*F, replacement});
+			else
+				representatives.push_back(*F);
 		}
 
 		DEBUG(dbgs() << "fold " << foldOrder.size() << " of " << functions.size() << '\n');
 		assert(foldOrder.size() < functions.size());
 
 		for (auto item : foldOrder) {
-			// Replace all equivalent functions with the same replacement.
 			Function* replacement = item.second;
-			for (;;) {
-				auto it = fold.find(replacement);
-				if (it == fold.end())
-					break;
-				replacement = it->second;
-			}
-
 			mergeTwoFunctions(item.first, replacement);
 
 			if (!replacement->getName().endswith("_icf")) {
@@ -871,14 +1088,14 @@ bool IdenticalCodeFolding::runOnModule(llvm::Module& module)
 				replacement->setName(replacement->getName() + "_icf");
 			}
 
-			if (GDA.asmJSExports().find(item.first) != GDA.asmJSExports().end())
-				GDA.insertAsmJSExport(replacement);
-
 			GDA.eraseFunction(item.first);
-			delete item.first;
+			folded.push_back(item.first);
 		}
 	}
 
+	PA = nullptr;
+	for (Function* F : folded)
+		delete F;
 	return true;
 }
 
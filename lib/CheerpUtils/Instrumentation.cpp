@@ -0,0 +1,175 @@
+//===-- Instrumentation.cpp - Runtime profiling of the output -------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/Instrumentation.h"
+#include "llvm/Cheerp/FunctionProfile.h"
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+using namespace llvm;
+
+namespace cheerp {
+
+const char* const Instrumentation::sampleName = "__cheerp_instrument_sample";
+const char* const Instrumentation::symbolsMetadataName = "cheerp.instrument.symbols";
+
+bool Instrumentation::isCounted(const Function& F) const
+{
+	uint32_t size = 0;
+	for (const BasicBlock& BB : F)
+		size += BB.size();
+	return size >= minSize;
+}
+
+Function* Instrumentation::createSampleFunction(Module& M) const
+{
+	// The samples are taken by the JS helper, which needs a JS function to
+	// be called from asm.js and wasm code
+	LLVMContext& C = M.getContext();
+	Type* int32Ty = Type::getInt32Ty(C);
+	FunctionType* sampleTy = FunctionType::get(Type::getVoidTy(C), int32Ty, /*isVarArg*/false);
+	Function* helper = cast<Function>(M.getOrInsertFunction("_ZN6client22cheerpInstrumentSampleEi", sampleTy));
+	Function* sample = Function::Create(sampleTy, GlobalValue::InternalLinkage, sampleName, &M);
+	IRBuilder<> Builder(BasicBlock::Create(C, "", sample));
+	Builder.CreateCall(helper, sample->arg_begin());
+	Builder.CreateRetVoid();
+	return sample;
+}
+
+bool Instrumentation::runOnModule(Module& M)
+{
+	std::vector<Function*> functions;
+	std::vector<Function*> counted;
+	bool hasLinearMemory = false;
+	for (Function& F : M)
+	{
+		if (F.getSection() == StringRef("asmjs"))
+			hasLinearMemory = true;
+		if (F.isDeclaration())
+			continue;
+		functions.push_back(&F);
+		if (isCounted(F))
+			counted.push_back(&F);
+	}
+	for (const GlobalVariable& GV : M.globals())
+		hasLinearMemory |= GV.getSection() == StringRef("asmjs");
+	if (functions.empty())
+		return false;
+
+	// The symbols are all the functions which can show up in the samples
+	LLVMContext& C = M.getContext();
+	NamedMDNode* symbols = M.getOrInsertNamedMetadata(symbolsMetadataName);
+	DenseMap<const Function*, uint32_t> symbolIds;
+	for (Function* F : functions)
+	{
+		symbolIds[F] = symbols->getNumOperands();
+		symbols->addOperand(MDNode::get(C, MDString::get(C, F->getName())));
+	}
+
+	if (!counted.empty())
+	{
+		GlobalVariable* counters = ProfileInstrumentation::createCounters(M, counted, hasLinearMemory);
+		Function* sample = createSampleFunction(M);
+		MDNode* unlikely = MDBuilder(C).createBranchWeights(1, SamplePeriod - 1);
+		for (uint32_t i = 0; i < counted.size(); i++)
+		{
+			Function* F = counted[i];
+			Instruction* count = cast<Instruction>(ProfileInstrumentation::addCounter(counters, *F, i));
+			// Keep the allocas in the entry block
+			Instruction* insertPoint = count->getNextNode()->getNextNode();
+			while (isa<AllocaInst>(insertPoint))
+				insertPoint = insertPoint->getNextNode();
+			IRBuilder<> Builder(insertPoint);
+			Value* sampled = Builder.CreateICmpEQ(Builder.CreateAnd(count, SamplePeriod - 1), Builder.getInt32(0));
+			Builder.SetInsertPoint(SplitBlockAndInsertIfThen(sampled, insertPoint, /*Unreachable*/false, unlikely));
+			Builder.CreateCall(sample, Builder.getInt32(symbolIds[F]));
+		}
+	}
+
+	if (!symbolMapPath.empty())
+		writeSymbolMap(functions);
+	return true;
+}
+
+void Instrumentation::writeSymbolMap(const std::vector<Function*>& functions) const
+{
+	std::error_code ErrorCode;
+	tool_output_file file(symbolMapPath.c_str(), ErrorCode, sys::fs::F_None);
+	if (ErrorCode)
+		report_fatal_error(ErrorCode.message(), false);
+
+	DenseMap<const Function*, DISubprogram> subprograms;
+	if (!functions.empty())
+	{
+		DebugInfoFinder finder;
+		finder.processModule(*functions[0]->getParent());
+		for (DISubprogram method : finder.subprograms())
+		{
+			if (const Function* F = method.getFunction())
+				subprograms[F] = method;
+		}
+	}
+
+	raw_ostream& os = file.os();
+	os << "[\n";
+	for (uint32_t id = 0; id < functions.size(); id++)
+	{
+		const Function* F = functions[id];
+		// The name without parameters, like ns::Class::method
+		std::string name;
+		demangler_iterator it(F->getName());
+		for (; it != demangler_iterator(); ++it)
+		{
+			if (!name.empty())
+				name += "::";
+			name += *it;
+		}
+		if (it.error() || name.empty())
+			name = F->getName();
+
+		os << "{\"name\":";
+		writeJSONString(os, name);
+		os << ",\"mangled\":";
+		writeJSONString(os, F->getName());
+		auto method = subprograms.find(F);
+		if (method != subprograms.end())
+		{
+			os << ",\"file\":";
+			writeJSONString(os, method->second.getFilename());
+			os << ",\"line\":" << method->second.getLineNumber();
+		}
+		os << '}' << (id + 1 < functions.size() ? ",\n" : "\n");
+	}
+	os << "]\n";
+	file.keep();
+}
+
+const char* Instrumentation::getPassName() const
+{
+	return "Instrumentation";
+}
+
+char Instrumentation::ID = 0;
+
+ModulePass* createInstrumentationPass(StringRef symbolMapPath, uint32_t minSize)
+{
+	return new Instrumentation(symbolMapPath, minSize);
+}
+
+}
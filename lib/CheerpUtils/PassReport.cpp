@@ -0,0 +1,246 @@
+//===-- PassReport.cpp - Time and memory report of the Cheerp passes ------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/PassReport.h"
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ToolOutputFile.h"
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+
+using namespace llvm;
+
+namespace cheerp {
+
+uint64_t PassReport::getPeakRSS()
+{
+#ifdef LLVM_ON_UNIX
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+#ifdef __APPLE__
+		// Reported in bytes
+		return usage.ru_maxrss / 1024;
+#else
+		return usage.ru_maxrss;
+#endif
+	}
+#endif
+	return 0;
+}
+
+static void countInstructions(const Module& M, uint32_t& functions, uint32_t& instructions)
+{
+	functions = 0;
+	instructions = 0;
+	for (const Function& F : M)
+	{
+		if (F.empty())
+			continue;
+		functions++;
+		for (const BasicBlock& BB : F)
+			instructions += BB.size();
+	}
+}
+
+void PassReport::Measure::begin(StringRef n)
+{
+	name = n;
+	start = Clock::now();
+	startRSS = getPeakRSS();
+	wallMs = 0;
+	peakRSSDelta = 0;
+}
+
+void PassReport::Measure::end()
+{
+	wallMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	peakRSSDelta = getPeakRSS() - startRSS;
+}
+
+void PassReport::beginPass(StringRef name, const Module& M)
+{
+	endPass(M);
+	passes.emplace_back();
+	PassMeasure& pass = passes.back();
+	countInstructions(M, pass.functions, pass.instructions);
+	pass.instructionsAfter = pass.instructions;
+	pass.begin(name);
+	passOpen = true;
+}
+
+void PassReport::endPass(const Module& M)
+{
+	if (!passOpen)
+		return;
+	while (!openPhases.empty())
+		endPhase();
+	PassMeasure& pass = passes.back();
+	pass.end();
+	uint32_t functions;
+	countInstructions(M, functions, pass.instructionsAfter);
+	passOpen = false;
+}
+
+void PassReport::beginPhase(StringRef name)
+{
+	if (!passOpen)
+		return;
+	std::vector<Measure>& phases = passes.back().phases;
+	// Nested phases are named after their parents
+	std::string fullName = openPhases.empty() ? name.str() : phases[openPhases.back()].name + "/" + name.str();
+	openPhases.push_back(phases.size());
+	phases.emplace_back();
+	phases.back().begin(fullName);
+}
+
+void PassReport::endPhase()
+{
+	if (openPhases.empty())
+		return;
+	passes.back().phases[openPhases.back()].end();
+	openPhases.pop_back();
+}
+
+void PassReport::addCounter(StringRef name, uint64_t value)
+{
+	if (!passOpen)
+		return;
+	passes.back().counters.push_back(std::make_pair(name.str(), value));
+}
+
+void PassReport::writeJSON(raw_ostream& os) const
+{
+	double totalMs = 0;
+	for (const PassMeasure& pass : passes)
+		totalMs += pass.wallMs;
+
+	os << "{\n";
+	os << "  \"totalWallMs\": " << format("%.3f", totalMs) << ",\n";
+	os << "  \"peakRSSKB\": " << getPeakRSS() << ",\n";
+	os << "  \"passes\": [";
+	for (uint32_t i = 0; i < passes.size(); i++)
+	{
+		const PassMeasure& pass = passes[i];
+		os << (i ? ",\n" : "\n") << "    {\"name\": ";
+		writeJSONString(os, pass.name);
+		os << ", \"wallMs\": " << format("%.3f", pass.wallMs);
+		os << ", \"peakRSSDeltaKB\": " << pass.peakRSSDelta;
+		os << ", \"functions\": " << pass.functions;
+		os << ", \"instructions\": " << pass.instructions;
+		os << ", \"instructionsAfter\": " << pass.instructionsAfter;
+		os << ",\n      \"phases\": [";
+		for (uint32_t j = 0; j < pass.phases.size(); j++)
+		{
+			const Measure& phase = pass.phases[j];
+			os << (j ? ",\n" : "\n") << "        {\"name\": ";
+			writeJSONString(os, phase.name);
+			os << ", \"wallMs\": " << format("%.3f", phase.wallMs);
+			os << ", \"peakRSSDeltaKB\": " << phase.peakRSSDelta << "}";
+		}
+		os << (pass.phases.empty() ? "]" : "\n      ]");
+		os << ",\n      \"counters\": {";
+		for (uint32_t j = 0; j < pass.counters.size(); j++)
+		{
+			os << (j ? ", " : "");
+			writeJSONString(os, pass.counters[j].first);
+			os << ": " << pass.counters[j].second;
+		}
+		os << "}}";
+	}
+	os << "\n  ]\n}\n";
+}
+
+namespace {
+
+class PassReportMarker : public ModulePass
+{
+public:
+	static char ID;
+	PassReportMarker(std::shared_ptr<PassReport> report, StringRef passName)
+		: ModulePass(ID), report(std::move(report)), passName(passName)
+	{
+	}
+	bool runOnModule(Module& M) override
+	{
+		report->beginPass(passName, M);
+		return false;
+	}
+	void getAnalysisUsage(AnalysisUsage& AU) const override
+	{
+		AU.setPreservesAll();
+	}
+	const char* getPassName() const override
+	{
+		return "PassReportMarker";
+	}
+private:
+	std::shared_ptr<PassReport> report;
+	std::string passName;
+};
+
+char PassReportMarker::ID = 0;
+
+class PassReportWriter : public ModulePass
+{
+public:
+	static char ID;
+	PassReportWriter(std::shared_ptr<PassReport> report, StringRef fileName)
+		: ModulePass(ID), report(std::move(report)), fileName(fileName)
+	{
+	}
+	bool runOnModule(Module& M) override
+	{
+		report->endPass(M);
+		std::error_code ErrorCode;
+		tool_output_file reportFile(fileName.c_str(), ErrorCode, sys::fs::F_Text);
+		if (ErrorCode)
+		{
+			// An error occurred opening the report file, bail out
+			report_fatal_error(ErrorCode.message(), false);
+			return false;
+		}
+		report->writeJSON(reportFile.os());
+		reportFile.keep();
+		return false;
+	}
+	void getAnalysisUsage(AnalysisUsage& AU) const override
+	{
+		AU.setPreservesAll();
+	}
+	const char* getPassName() const override
+	{
+		return "PassReportWriter";
+	}
+private:
+	std::shared_ptr<PassReport> report;
+	std::string fileName;
+};
+
+char PassReportWriter::ID = 0;
+
+}
+
+ModulePass* createPassReportMarker(std::shared_ptr<PassReport> report, StringRef passName)
+{
+	return new PassReportMarker(std::move(report), passName);
+}
+
+ModulePass* createPassReportWriter(std::shared_ptr<PassReport> report, StringRef fileName)
+{
+	return new PassReportWriter(std::move(report), fileName);
+}
+
+}
@@ -1300,8 +1300,27 @@ PointerConstantOffsetWrapper PointerResolverForOffsetVisitor::resolvePointerOffs
 		return offset;
 }
 
+// Locks the caches of the analyzer, unless it is frozen and they are only read
+class CacheLock
+{
+public:
+	CacheLock(sys::SmartMutex<true>& mutex, bool frozen) : mutex(frozen ? nullptr : &mutex)
+	{
+		if(this->mutex)
+			this->mutex->lock();
+	}
+	~CacheLock()
+	{
+		if(mutex)
+			mutex->unlock();
+	}
+private:
+	sys::SmartMutex<true>* mutex;
+};
+
 void PointerAnalyzer::prefetchFunc(const Function& F) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	for(const Argument & arg : F.getArgumentList())
 		if(arg.getType()->isPointerTy())
 			getFinalPointerKindWrapper(&arg);
@@ -1334,14 +1353,21 @@ void PointerAnalyzer::prefetchFunc(const Function& F) const
 
 const PointerKindWrapper& PointerAnalyzer::getFinalPointerKindWrapper(const Value* p) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	// If the values is already cached just return it
 	auto it = pointerKindData.valueMap.find(p);
 	if(it!=pointerKindData.valueMap.end())
 	{
 		assert(it->second.isKnown());
+		if(!frozen)
+			kindCacheHits++;
 		return it->second;
 	}
 
+	// Once frozen the caches are read without locking, filling them would race
+	if(frozen)
+		llvm::report_fatal_error("The pointer kind was not computed before freezing");
+	kindCacheMisses++;
 	PointerKindWrapper ret;
 	PointerKindWrapper& k = PointerUsageVisitor(pointerKindData, addressTakenCache).visitValue(ret, p, /*first*/ true);
 #ifndef NDEBUG
@@ -1376,6 +1402,7 @@ const PointerConstantOffsetWrapper& PointerAnalyzer::getFinalPointerConstantOffs
 
 POINTER_KIND PointerAnalyzer::getPointerKind(const Value* p) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	const PointerKindWrapper& k = getFinalPointerKindWrapper(p);
 
 	if (k!=INDIRECT)
@@ -1388,6 +1415,7 @@ POINTER_KIND PointerAnalyzer::getPointerKind(const Value* p) const
 
 POINTER_KIND PointerAnalyzer::getPointerKindForReturn(const Function* F) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	if(TypeSupport::hasByteLayout(F->getReturnType()->getPointerElementType()))
 		return BYTE_LAYOUT;
 
@@ -1414,6 +1442,7 @@ POINTER_KIND PointerAnalyzer::getPointerKindForReturn(const Function* F) const
 
 POINTER_KIND PointerAnalyzer::getPointerKindForStoredType(Type* pointerType) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	IndirectPointerKindConstraint c(STORED_TYPE_CONSTRAINT, pointerType->getPointerElementType());
 	auto it=pointerKindData.constraintsMap.find(c);
 	if(it==pointerKindData.constraintsMap.end())
@@ -1431,6 +1460,7 @@ POINTER_KIND PointerAnalyzer::getPointerKindForStoredType(Type* pointerType) con
 
 POINTER_KIND PointerAnalyzer::getPointerKindForArgumentTypeAndIndex( const TypeAndIndex& argTypeAndIndex ) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	if(TypeSupport::hasByteLayout(argTypeAndIndex.type))
 		return BYTE_LAYOUT;
 
@@ -1448,6 +1478,7 @@ POINTER_KIND PointerAnalyzer::getPointerKindForArgumentTypeAndIndex( const TypeA
 
 POINTER_KIND PointerAnalyzer::getPointerKindForMemberPointer(const TypeAndIndex& baseAndIndex) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	if(TypeSupport::hasByteLayout(cast<StructType>(baseAndIndex.type)->getElementType(baseAndIndex.index)->getPointerElementType()))
 		return BYTE_LAYOUT;
 
@@ -1485,6 +1516,7 @@ POINTER_KIND PointerAnalyzer::getPointerKindForMemberImpl(const TypeAndIndex& ba
 
 POINTER_KIND PointerAnalyzer::getPointerKindForMember(const TypeAndIndex& baseAndIndex) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	return getPointerKindForMemberImpl(baseAndIndex, pointerKindData, addressTakenCache);
 }
 
@@ -1538,51 +1570,47 @@ REGULAR_POINTER_PREFERENCE PointerAnalyzer::getRegularPreference(const IndirectP
 
 const ConstantInt* PointerAnalyzer::getConstantOffsetForPointer(const Value * v) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	auto it=pointerOffsetData.valueMap.find(v);
 	if(it==pointerOffsetData.valueMap.end())
 		return NULL;
 
-	if(!it->second.hasConstraints())
-	{
-		if(it->second.isInvalid() || it->second.isUninitialized())
-			return NULL;
-		else if(it->second.isValid())
-			return it->second.getPointerOffset();
-	}
-	assert(!it->second.isInvalid() && !it->second.isUnknown());
-	const PointerConstantOffsetWrapper& ret=PointerResolverForOffsetVisitor(pointerOffsetData, addressTakenCache).resolvePointerOffset(it->second);
-	if(ret.isInvalid())
-		return NULL;
-	else if(ret.isUninitialized())
-	{
-		Type* Int32Ty=IntegerType::get(v->getContext(), 32);
-		return cast<ConstantInt>(ConstantInt::get(Int32Ty, 0));
-	}
-	assert(ret.isValid());
-	assert(ret.getPointerOffset());
-	return ret.getPointerOffset();
+	if(frozen && it->second.hasConstraints())
+		return frozenOffsets.lookup(v);
+	return resolveConstantOffset(it->second, v->getContext());
 }
 
 const llvm::ConstantInt* PointerAnalyzer::getConstantOffsetForMember( const TypeAndIndex& baseAndIndex ) const
 {
+	CacheLock lock(cacheMutex, frozen);
 	auto it=pointerOffsetData.constraintsMap.find(IndirectPointerKindConstraint(BASE_AND_INDEX_CONSTRAINT, baseAndIndex));
 	if(it==pointerOffsetData.constraintsMap.end())
 		return NULL;
 
-	if(!it->second.hasConstraints())
+	if(frozen && it->second.hasConstraints())
 	{
-		if(it->second.isInvalid() || it->second.isUninitialized())
+		auto frozenIt=frozenMemberOffsets.find(baseAndIndex);
+		return frozenIt==frozenMemberOffsets.end() ? NULL : frozenIt->second;
+	}
+	return resolveConstantOffset(it->second, baseAndIndex.type->getContext());
+}
+
+const ConstantInt* PointerAnalyzer::resolveConstantOffset(const PointerConstantOffsetWrapper& o, LLVMContext& C) const
+{
+	if(!o.hasConstraints())
+	{
+		if(o.isInvalid() || o.isUninitialized())
 			return NULL;
-		else if(it->second.isValid())
-			return it->second.getPointerOffset();
+		else if(o.isValid())
+			return o.getPointerOffset();
 	}
-	assert(!it->second.isInvalid() && !it->second.isUnknown());
-	const PointerConstantOffsetWrapper& ret=PointerResolverForOffsetVisitor(pointerOffsetData, addressTakenCache).resolvePointerOffset(it->second);
+	assert(!o.isInvalid() && !o.isUnknown());
+	const PointerConstantOffsetWrapper& ret=PointerResolverForOffsetVisitor(pointerOffsetData, addressTakenCache).resolvePointerOffset(o);
 	if(ret.isInvalid())
 		return NULL;
 	else if(ret.isUninitialized())
 	{
-		Type* Int32Ty=IntegerType::get(baseAndIndex.type->getContext(), 32);
+		Type* Int32Ty=IntegerType::get(C, 32);
 		return cast<ConstantInt>(ConstantInt::get(Int32Ty, 0));
 	}
 	assert(ret.isValid());
@@ -1738,6 +1766,62 @@ void PointerAnalyzer::computeConstantOffsets(const Module& M)
 	}
 }
 
+void PointerAnalyzer::freeze(const Module& M)
+{
+	// Besides the values visited by prefetchFunc, the constants used by the
+	// code and the globals are queried too
+	llvm::SmallVector<const Value*, 16> worklist;
+	llvm::DenseSet<const Value*> visited;
+	auto addValue = [&](const Value* v)
+	{
+		if(visited.insert(v).second)
+			worklist.push_back(v);
+	};
+	for(const Function & F : M)
+	{
+		addressTakenCache.checkAddressTaken(&F);
+		addValue(&F);
+		for(const Argument & arg : F.getArgumentList())
+			addValue(&arg);
+		for(const BasicBlock & BB : F)
+			for(const Instruction & I : BB)
+				addValue(&I);
+	}
+	for(const GlobalVariable & GV : M.getGlobalList())
+		addValue(&GV);
+	while(!worklist.empty())
+	{
+		const Value* v = worklist.pop_back_val();
+		if(v->getType()->isPointerTy() || (isa<StoreInst>(v) && cast<StoreInst>(v)->getValueOperand()->getType()->isPointerTy()))
+			getFinalPointerKindWrapper(v);
+		if(const User* u = dyn_cast<User>(v))
+		{
+			for(const Use & op : u->operands())
+			{
+				if(isa<Constant>(op))
+					addValue(op);
+			}
+		}
+	}
+	// Resolve the kinds which were just computed
+	fullResolve();
+
+	for(const Value* v : visited)
+	{
+		auto it=pointerOffsetData.valueMap.find(v);
+		if(it!=pointerOffsetData.valueMap.end() && it->second.hasConstraints())
+			frozenOffsets[v] = resolveConstantOffset(it->second, M.getContext());
+	}
+	for(const auto& it : pointerOffsetData.constraintsMap)
+	{
+		if(it.first.kind != BASE_AND_INDEX_CONSTRAINT || !it.second.hasConstraints())
+			continue;
+		TypeAndIndex baseAndIndex(it.first.typePtr, it.first.i, TypeAndIndex::STRUCT_MEMBER);
+		frozenMemberOffsets[baseAndIndex] = resolveConstantOffset(it.second, M.getContext());
+	}
+	frozen = true;
+}
+
 #ifndef NDEBUG
 void PointerAnalyzer::dumpPointer(const Value* v, bool dumpOwnerFunc) const
 {
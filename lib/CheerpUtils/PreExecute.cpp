@@ -15,6 +15,7 @@
 #include "llvm/ExecutionEngine/Interpreter.h"
 #include "llvm/ExecutionEngine/FunctionMap.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Host.h"
@@ -41,9 +42,9 @@ const char* PreExecute::getPassName() const
 
 char PreExecute::ID = 0;
 
-static void StoreListener(void* Addr)
+static void StoreListener(void* Addr, Type* Ty)
 {
-    PreExecute::currentPreExecutePass->recordStore(Addr);
+    PreExecute::currentPreExecutePass->recordStore(Addr, Ty);
 }
 static void AllocaListener(Type* Ty,uint32_t Size, void* Addr)
 {
@@ -195,6 +196,148 @@ static GenericValue pre_execute_reallocate(FunctionType *FT,
   return currentEE->RPTOGV(ret);
 }
 
+// Deduce the type of the memory returned by malloc and operator new from the
+// casts of the returned pointer. When the pointer is returned, as in operator
+// new, the casts in the callers are used too. Returns false if the casts
+// disagree, and sets allocType to nullptr if there are no casts.
+static bool getRawAllocationType(Type*& allocType)
+{
+  ExecutionEngine *currentEE = PreExecute::currentPreExecutePass->currentEE;
+  allocType = nullptr;
+  SmallPtrSet<const Value*, 8> visited;
+  // The values holding the pointer, with the depth of their stack frame
+  SmallVector<std::pair<const Value*, unsigned>, 4> pending;
+  if (Instruction* call = currentEE->getCallInstruction(0))
+    pending.push_back(std::make_pair(call, 0u));
+  while (!pending.empty())
+  {
+    const Value* V = pending.back().first;
+    unsigned depth = pending.back().second;
+    pending.pop_back();
+    if (!visited.insert(V).second)
+      continue;
+    for (const User* U : V->users())
+    {
+      Type* castType = nullptr;
+      if (isa<BitCastInst>(U))
+        castType = U->getType();
+      else if (const IntrinsicInst* II = dyn_cast<IntrinsicInst>(U))
+      {
+        if (II->getIntrinsicID() == Intrinsic::cheerp_cast_user)
+          castType = U->getType();
+      }
+      else if (isa<PHINode>(U) || isa<SelectInst>(U))
+        pending.push_back(std::make_pair(U, depth));
+      else if (isa<ReturnInst>(U))
+      {
+        if (Instruction* call = currentEE->getCallInstruction(depth + 1))
+          pending.push_back(std::make_pair(call, depth + 1));
+      }
+      if (!castType)
+        continue;
+      if (allocType && allocType != castType->getPointerElementType())
+        return false;
+      allocType = castType->getPointerElementType();
+    }
+  }
+  return true;
+}
+
+static GenericValue pre_execute_fail_allocation(const char* reason)
+{
+  ExecutionEngine *currentEE = PreExecute::currentPreExecutePass->currentEE;
+  llvm::errs() << "warning: Could not pre-execute an allocation in " << currentEE->getCurrentCaller()->getName()
+      << ": " << reason << "\n";
+  currentEE->setFailed();
+  return currentEE->RPTOGV(nullptr);
+}
+
+static GenericValue pre_execute_raw_allocate(size_t size)
+{
+  ExecutionEngine *currentEE = PreExecute::currentPreExecutePass->currentEE;
+  llvm::Module *module = PreExecute::currentPreExecutePass->currentModule;
+  const DataLayout *DL = module->getDataLayout();
+  Type* type;
+  if (!getRawAllocationType(type))
+    return pre_execute_fail_allocation("the memory is used with different types");
+  bool untyped = !type;
+  if (untyped)
+    type = IntegerType::get(module->getContext(), 8);
+  // Allocations in the linear heap are not supported. The allocator of the
+  // asm.js and wasm code comes from the libc, which keeps its own headers and
+  // bookkeeping for every block: a global in the data section is not one of
+  // its blocks, and freeing or growing it at run time would corrupt the heap.
+  // The constructors allocating there are kept for run time.
+  if (currentEE->getCurrentCaller()->getSection() == StringRef("asmjs") ||
+      TypeSupport::isAsmJSPointer(type->getPointerTo()))
+    return pre_execute_fail_allocation("the memory is in the linear heap");
+  // The memory becomes an array of the type if it is still used at the end
+  uint32_t elementSize = DL->getTypeAllocSize(type);
+  if (size % elementSize)
+    return pre_execute_fail_allocation("the size is not a multiple of the type size");
+  size = std::max(size, (size_t)elementSize);
+  void* ret = PreExecute::currentPreExecutePass->allocator->allocate(size);
+  memset(ret, 0, size);
+
+#ifdef DEBUG_PRE_EXECUTE
+  llvm::errs() << "Allocating raw " << ret << " of size " << size << " and type " << *type << "\n";
+#endif
+
+  PreExecute::currentPreExecutePass->recordTypedAllocation(type, size, (char*)ret, /*hasCookie*/ false, /*asmjs*/ false);
+  if (untyped)
+  {
+    PreExecute::currentPreExecutePass->typedAllocations[(char*)ret].untyped = true;
+    PreExecute::currentPreExecutePass->hasUntypedAllocations = true;
+  }
+  return currentEE->RPTOGV(ret);
+}
+
+static GenericValue pre_execute_malloc(FunctionType *FT,
+                                       const std::vector<GenericValue> &Args) {
+  return pre_execute_raw_allocate((size_t)(Args[0].IntVal.getLimitedValue()));
+}
+
+static GenericValue pre_execute_calloc(FunctionType *FT,
+                                       const std::vector<GenericValue> &Args) {
+  // The memory of the allocator is already zeroed
+  size_t num=(size_t)(Args[0].IntVal.getLimitedValue());
+  size_t size=(size_t)(Args[1].IntVal.getLimitedValue());
+  return pre_execute_raw_allocate(num * size);
+}
+
+static GenericValue pre_execute_realloc(FunctionType *FT,
+                                        const std::vector<GenericValue> &Args) {
+  ExecutionEngine *currentEE = PreExecute::currentPreExecutePass->currentEE;
+  char *p = (char *)(currentEE->GVTORP(Args[0]));
+  size_t size=(size_t)(Args[1].IntVal.getLimitedValue());
+  if (!p)
+    return pre_execute_raw_allocate(size);
+  // The new memory keeps the type of the old one
+  auto it = PreExecute::currentPreExecutePass->typedAllocations.find(p);
+  if(it == PreExecute::currentPreExecutePass->typedAllocations.end())
+    return pre_execute_fail_allocation("the reallocated memory does not come from malloc");
+  AllocData oldData = it->second;
+  // See pre_execute_raw_allocate
+  if (oldData.asmjs)
+    return pre_execute_fail_allocation("the memory is in the linear heap");
+  const DataLayout *DL = PreExecute::currentPreExecutePass->currentModule->getDataLayout();
+  uint32_t elementSize = DL->getTypeAllocSize(oldData.allocType);
+  if (size % elementSize)
+    return pre_execute_fail_allocation("the size is not a multiple of the type size");
+  size = std::max(size, (size_t)elementSize);
+  void* ret = PreExecute::currentPreExecutePass->allocator->allocate(size);
+  memset(ret, 0, size);
+  memcpy(ret, p, std::min(size, oldData.size));
+
+#ifdef DEBUG_PRE_EXECUTE
+  llvm::errs() << "Reallocating raw " << ret << " of size " << size << " and type " << *oldData.allocType << "\n";
+#endif
+
+  PreExecute::currentPreExecutePass->recordTypedAllocation(oldData.allocType, size, (char*)ret, /*hasCookie*/ false, /*asmjs*/ false);
+  PreExecute::currentPreExecutePass->typedAllocations[(char*)ret].untyped = oldData.untyped;
+  return currentEE->RPTOGV(ret);
+}
+
 static GenericValue pre_execute_deallocate(FunctionType *FT,
                                            const std::vector<GenericValue> &Args) {
 #ifdef DEBUG_PRE_EXECUTE
@@ -466,8 +609,15 @@ static void* LazyFunctionCreator(const std::string& funcName)
     if (strncmp(funcName.c_str(), "llvm.cheerp.reallocate.", strlen("llvm.cheerp.reallocate."))==0)
         return (void*)(void(*)())pre_execute_reallocate;
     if (strncmp(funcName.c_str(), "llvm.cheerp.deallocate", strlen("llvm.cheerp.deallocate")) == 0 ||
-        strncmp(funcName.c_str(), "free", strlen("free")) == 0)
+        strncmp(funcName.c_str(), "free", strlen("free")) == 0 ||
+        funcName == "_ZdlPv" || funcName == "_ZdaPv")
         return (void*)(void(*)())pre_execute_deallocate;
+    if (funcName == "malloc" || funcName == "_Znwj" || funcName == "_Znaj")
+        return (void*)(void(*)())pre_execute_malloc;
+    if (funcName == "calloc")
+        return (void*)(void(*)())pre_execute_calloc;
+    if (funcName == "realloc")
+        return (void*)(void(*)())pre_execute_realloc;
     if (strncmp(funcName.c_str(), "llvm.cheerp.get.array.len.", strlen("llvm.cheerp.get.array.len."))==0)
         return (void*)(void(*)())pre_execute_get_array_len;
     if (strncmp(funcName.c_str(), "llvm.cheerp.element.distance.", strlen("llvm.cheerp.element.distance."))==0)
@@ -486,8 +636,25 @@ static void* LazyFunctionCreator(const std::string& funcName)
     return NULL;
 }
 
-void PreExecute::recordStore(void* Addr)
+void PreExecute::recordStore(void* Addr, Type* Ty)
 {
+    // The pointers stored in untyped memory could not become constants
+    if(hasUntypedAllocations && Ty->isPointerTy())
+    {
+        auto it = typedAllocations.upper_bound((char*)Addr);
+        if(it != typedAllocations.begin())
+        {
+            --it;
+            if(it->second.untyped && (char*)Addr < it->first + it->second.size)
+            {
+                llvm::errs() << "warning: Could not pre-execute a pointer store to memory without a type\n";
+                currentEE->setFailed();
+            }
+        }
+    }
+    // Constructors usually store to the same global many times in a row
+    if(Addr >= lastStoredGlobalStart && Addr < lastStoredGlobalEnd)
+        return;
     // Look for the address in the globals, if found keep note of this
     const GlobalValue* GV=currentEE->getGlobalValueAtAddress(Addr);
     if(!GV)
@@ -495,6 +662,8 @@ void PreExecute::recordStore(void* Addr)
     if(const GlobalVariable* GVar = dyn_cast<GlobalVariable>(GV))
     {
         modifiedGlobals.insert(std::make_pair(const_cast<GlobalVariable*>(GVar),nullptr));
+        lastStoredGlobalStart = (char*)currentEE->getPointerToGlobalIfAvailable(GVar);
+        lastStoredGlobalEnd = lastStoredGlobalStart + currentModule->getDataLayout()->getTypeAllocSize(GVar->getType()->getElementType());
         return;
     }
 }
@@ -802,6 +971,8 @@ bool PreExecute::runOnConstructor( llvm::Module& m, llvm::Function* func)
 
     modifiedGlobals.clear();
     typedAllocations.clear();
+    lastStoredGlobalStart = lastStoredGlobalEnd = nullptr;
+    hasUntypedAllocations = false;
 
 #ifdef DEBUG_PRE_EXECUTE
     currentEE->printMemoryStats();
@@ -851,8 +1022,10 @@ bool PreExecute::runOnModule(Module& m)
     std::string triple = sys::getDefaultTargetTriple();
     const Target *target = TargetRegistry::lookupTarget(triple, error);
 
-    TargetMachine* machine;
-    machine = target->createTargetMachine(triple, "", "", TargetOptions());
+    // The interpreter does not need a target machine
+    TargetMachine* machine = nullptr;
+    if (target)
+        machine = target->createTargetMachine(triple, "", "", TargetOptions());
 
     std::unique_ptr<Module> uniqM(&m);
 
@@ -875,10 +1048,11 @@ bool PreExecute::runOnModule(Module& m)
 
     std::vector<Constant*> newConstructors;
 
-    // Detach malloc, free, and realloc, so the interpreter will fail if it will
-    // encounter them
+    // Detach the libc heap functions, so the interpreter uses the allocator
+    // of the pass and the surviving memory becomes new globals
     FunctionDetacher FD(m);
     FD.detach("malloc");
+    FD.detach("calloc");
     FD.detach("free");
     FD.detach("realloc");
 
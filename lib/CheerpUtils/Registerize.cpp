@@ -14,11 +14,15 @@
 #include "llvm/Cheerp/GlobalDepsAnalyzer.h"
 #include "llvm/Cheerp/Registerize.h"
 #include "llvm/Cheerp/Utility.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/Debug.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 using namespace llvm;
 
@@ -47,16 +51,66 @@ bool Registerize::runOnModule(Module & M)
 	return false;
 }
 
-void Registerize::assignRegisters(Module & M, cheerp::PointerAnalyzer& PA)
+void Registerize::assignRegisters(Module & M, cheerp::PointerAnalyzer& PA, unsigned numThreads)
 {
 	assert(!RegistersAssigned);
-	for (Function& F: M)
-		assignRegistersToInstructions(F, PA);
+#if LLVM_ENABLE_THREADS
+	if (numThreads != 1)
+		assignRegistersInParallel(M, PA, numThreads);
+	else
+#endif
+	{
+		for (Function& F: M)
+			assignRegistersToInstructions(F, PA);
+	}
 #ifndef NDEBUG
 	RegistersAssigned = true;
 #endif
 }
 
+void Registerize::assignRegistersInParallel(Module & M, cheerp::PointerAnalyzer& PA, unsigned numThreads)
+{
+#if LLVM_ENABLE_THREADS
+	std::vector<Function*> functions;
+	for (Function& F: M)
+	{
+		if (!F.empty())
+			functions.push_back(&F);
+	}
+
+	std::atomic<uint32_t> nextFunction(0);
+	std::mutex mergeMutex;
+	auto worker = [&]()
+	{
+		// Functions are registerized independently, every worker collects its
+		// results in a private instance and merges them when it is done.
+		// The PointerAnalyzer is already safe to query from multiple threads.
+		Registerize local(useFloats, NoRegisterize, graphColoring, useInt64);
+		for (uint32_t i = nextFunction++; i < functions.size(); i = nextFunction++)
+			local.assignRegistersToInstructions(*functions[i], PA);
+
+		std::lock_guard<std::mutex> lock(mergeMutex);
+		registersMap.insert(local.registersMap.begin(), local.registersMap.end());
+		edgeRegistersMap.insert(local.edgeRegistersMap.begin(), local.edgeRegistersMap.end());
+		selfRefRegistersMap.insert(local.selfRefRegistersMap.begin(), local.selfRefRegistersMap.end());
+		for (auto& it: local.registersForFunctionMap)
+			registersForFunctionMap.insert(std::make_pair(it.first, std::move(it.second)));
+	};
+
+	unsigned threads = numThreads ? numThreads : std::thread::hardware_concurrency();
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads && i < functions.size(); i++)
+		workers.emplace_back(worker);
+	worker();
+	for (std::thread& t : workers)
+		t.join();
+#else
+	llvm_unreachable("parallel registerize requires LLVM_ENABLE_THREADS");
+#endif
+}
+
+thread_local Registerize::EdgeContext Registerize::edgeContext;
+
 const char* Registerize::getPassName() const
 {
 	return "CheerpRegisterize";
@@ -396,27 +450,32 @@ void Registerize::extendRangeForUsedOperands(Instruction& I, LiveRangesTy& liveR
 uint32_t Registerize::assignToRegisters(Function& F, const InstIdMapTy& instIdMap, const LiveRangesTy& liveRanges, const PointerAnalyzer& PA)
 {
 	llvm::SmallVector<RegisterRange, 4> registers;
-	// First try to assign all PHI operands to the same register as the PHI itself
-	for(auto it: liveRanges)
-	{
-		Instruction* I=it.first;
-		if(!isa<PHINode>(I))
-			continue;
-		handlePHI(*I, liveRanges, registers, PA);
-	}
-	// Assign a register to the remaining instructions
-	for(auto it: liveRanges)
+	if(graphColoring)
+		colorRegisters(liveRanges, registers, PA);
+	else
 	{
-		Instruction* I=it.first;
-		if(isa<PHINode>(I))
-			continue;
-		InstructionLiveRange& range=it.second;
-		// Move on if a register is already assigned
-		if(registersMap.count(I))
-			continue;
-		bool asmjs = I->getParent()->getParent()->getSection()==StringRef("asmjs");
-		uint32_t chosenRegister=findOrCreateRegister(registers, range, getRegKindFromType(I->getType(), asmjs), cheerp::needsSecondaryName(I, PA));
-		registersMap[I] = chosenRegister;
+		// First try to assign all PHI operands to the same register as the PHI itself
+		for(auto it: liveRanges)
+		{
+			Instruction* I=it.first;
+			if(!isa<PHINode>(I))
+				continue;
+			handlePHI(*I, liveRanges, registers, PA);
+		}
+		// Assign a register to the remaining instructions
+		for(auto it: liveRanges)
+		{
+			Instruction* I=it.first;
+			if(isa<PHINode>(I))
+				continue;
+			InstructionLiveRange& range=it.second;
+			// Move on if a register is already assigned
+			if(registersMap.count(I))
+				continue;
+			bool asmjs = I->getParent()->getParent()->getSection()==StringRef("asmjs");
+			uint32_t chosenRegister=findOrCreateRegister(registers, range, getRegKindFromType(I->getType(), asmjs), cheerp::needsSecondaryName(I, PA));
+			registersMap[I] = chosenRegister;
+		}
 	}
 	// Assign registers for temporary values required to break loops in PHIs
 	class RegisterizePHIHandler: public EndOfBlockPHIHandler
@@ -586,9 +645,167 @@ uint32_t Registerize::findOrCreateRegister(llvm::SmallVector<RegisterRange, 4>&
 	return registers.size()-1;
 }
 
+void Registerize::colorRegisters(const LiveRangesTy& liveRanges, llvm::SmallVector<RegisterRange, 4>& registers, const PointerAnalyzer& PA)
+{
+	// Every value not yet coalesced with others is a node of the interference graph
+	struct Node
+	{
+		LiveRange range;
+		REGISTER_KIND kind;
+		bool needsSecondaryName;
+		uint32_t parent;
+		uint32_t color;
+		Node(const LiveRange& r, REGISTER_KIND k, bool n, uint32_t p):range(r),kind(k),needsSecondaryName(n),parent(p),color(0xffffffff)
+		{
+		}
+	};
+	std::vector<Node> nodes;
+	std::vector<Instruction*> values;
+	DenseMap<const Instruction*, uint32_t> valueIds;
+	nodes.reserve(liveRanges.size());
+	values.reserve(liveRanges.size());
+	for(auto& it: liveRanges)
+	{
+		Instruction* I=it.first;
+		bool asmjs = I->getParent()->getParent()->getSection()==StringRef("asmjs");
+		valueIds[I] = nodes.size();
+		nodes.push_back(Node(it.second.range, getRegKindFromType(I->getType(), asmjs), cheerp::needsSecondaryName(I, PA), nodes.size()));
+		values.push_back(I);
+	}
+	auto findRoot = [&nodes](uint32_t n)
+	{
+		while(nodes[n].parent != n)
+		{
+			nodes[n].parent = nodes[nodes[n].parent].parent;
+			n = nodes[n].parent;
+		}
+		return n;
+	};
+
+	// Coalesce PHIs with their incoming values when they do not interfere,
+	// so that no copy is needed on the edges
+	for(uint32_t i=0;i<values.size();i++)
+	{
+		if(!isa<PHINode>(values[i]))
+			continue;
+		for(Value* op: values[i]->operands())
+		{
+			Instruction* usedI=dyn_cast<Instruction>(op);
+			if(!usedI || isInlineable(*usedI, PA))
+				continue;
+			assert(valueIds.count(usedI));
+			uint32_t phiRoot = findRoot(i);
+			uint32_t opRoot = findRoot(valueIds[usedI]);
+			if(phiRoot == opRoot || nodes[phiRoot].kind != nodes[opRoot].kind)
+				continue;
+			if(nodes[phiRoot].range.doesInterfere(nodes[opRoot].range))
+				continue;
+			nodes[opRoot].parent = phiRoot;
+			nodes[phiRoot].range.merge(nodes[opRoot].range);
+			nodes[phiRoot].needsSecondaryName |= nodes[opRoot].needsSecondaryName;
+			nodes[opRoot].range.clear();
+		}
+	}
+
+	// Build the interference graph with a sweep over the chunks of all the
+	// coalesced nodes, ordered by their start. Only nodes of the same kind
+	// may share a register, so the others are never connected.
+	struct Chunk
+	{
+		uint32_t start;
+		uint32_t end;
+		uint32_t node;
+		bool operator<(const Chunk& r) const
+		{
+			return start < r.start || (start == r.start && node < r.node);
+		}
+	};
+	std::vector<Chunk> chunks;
+	std::vector<uint32_t> roots;
+	for(uint32_t i=0;i<nodes.size();i++)
+	{
+		if(findRoot(i) != i)
+			continue;
+		roots.push_back(i);
+		for(const LiveRangeChunk& c: nodes[i].range)
+			chunks.push_back(Chunk{c.start, c.end, i});
+	}
+	std::sort(chunks.begin(), chunks.end());
+	std::vector<std::vector<uint32_t>> edges(nodes.size());
+	std::vector<Chunk> active[REGISTER_KIND_COUNT];
+	for(const Chunk& c: chunks)
+	{
+		std::vector<Chunk>& kindActive = active[nodes[c.node].kind];
+		uint32_t alive = 0;
+		for(const Chunk& a: kindActive)
+		{
+			if(a.end <= c.start)
+				continue;
+			kindActive[alive++] = a;
+			if(a.node == c.node)
+				continue;
+			edges[a.node].push_back(c.node);
+			edges[c.node].push_back(a.node);
+		}
+		kindActive.resize(alive);
+		kindActive.push_back(c);
+	}
+
+	// Color the nodes in program order, which is optimal when the live
+	// ranges are single intervals, using the lowest compatible register
+	std::sort(roots.begin(), roots.end(), [&nodes](uint32_t l, uint32_t r)
+		{
+			uint32_t lStart = nodes[l].range.empty() ? 0 : nodes[l].range.front().start;
+			uint32_t rStart = nodes[r].range.empty() ? 0 : nodes[r].range.front().start;
+			return lStart < rStart || (lStart == rStart && l < r);
+		});
+	std::vector<uint32_t> kindRegisters[REGISTER_KIND_COUNT];
+	std::vector<LiveRange> registerChunks;
+	std::vector<uint32_t> usedBy;
+	for(uint32_t n: roots)
+	{
+		Node& node = nodes[n];
+		for(uint32_t other: edges[n])
+		{
+			if(nodes[other].color != 0xffffffff)
+				usedBy[nodes[other].color] = n;
+		}
+		uint32_t chosenRegister = 0xffffffff;
+		for(uint32_t reg: kindRegisters[node.kind])
+		{
+			if(usedBy[reg] != n)
+			{
+				chosenRegister = reg;
+				break;
+			}
+		}
+		if(chosenRegister == 0xffffffff)
+		{
+			chosenRegister = registers.size();
+			registers.push_back(RegisterRange(LiveRange(), node.kind, false));
+			kindRegisters[node.kind].push_back(chosenRegister);
+			registerChunks.emplace_back();
+			usedBy.push_back(0xffffffff);
+		}
+		node.color = chosenRegister;
+		registers[chosenRegister].info.needsSecondaryName |= node.needsSecondaryName;
+		registerChunks[chosenRegister].append(node.range.begin(), node.range.end());
+	}
+	for(uint32_t i=0;i<registers.size();i++)
+	{
+		std::sort(registerChunks[i].begin(), registerChunks[i].end());
+		registers[i].range = std::move(registerChunks[i]);
+	}
+	for(uint32_t i=0;i<values.size();i++)
+		registersMap[values[i]] = nodes[findRoot(i)].color;
+}
+
 Registerize::REGISTER_KIND Registerize::getRegKindFromType(const llvm::Type* t, bool asmjs) const
 {
-	if(t->isIntegerTy())
+	// Native i64 values are only available in asm.js functions
+	if(asmjs && useInt64 && t->isIntegerTy(64))
+		return INTEGER64;
+	else if(t->isIntegerTy())
 		return INTEGER;
 	// We distinguish between FLOAT and DOUBLE only in asm.js functions
 	else if(asmjs && useFloats && t->isFloatTy())
@@ -1032,9 +1249,9 @@ void Registerize::invalidateLiveRangeForAllocas(llvm::Function& F)
 	}
 }
 
-ModulePass* createRegisterizePass(bool useFloats, bool NoRegisterize)
+ModulePass* createRegisterizePass(bool useFloats, bool NoRegisterize, bool graphColoring, bool useInt64)
 {
-	return new Registerize(useFloats, NoRegisterize);
+	return new Registerize(useFloats, NoRegisterize, graphColoring, useInt64);
 }
 
 }
@@ -0,0 +1,420 @@
+//===-- SimilarFunctionMerging.cpp - Merge near identical functions -------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/InitializePasses.h"
+#include "llvm/Cheerp/SimilarFunctionMerging.h"
+#include "llvm/Cheerp/GlobalDepsAnalyzer.h"
+#include "llvm/Cheerp/IdenticalCodeFolding.h"
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#define DEBUG_TYPE "SimilarFunctionMerging"
+
+using namespace llvm;
+
+namespace cheerp {
+
+char SimilarFunctionMerging::ID = 0;
+
+const char* SimilarFunctionMerging::getPassName() const
+{
+	return "SimilarFunctionMerging";
+}
+
+void SimilarFunctionMerging::getAnalysisUsage(AnalysisUsage& AU) const
+{
+	AU.addPreserved<GlobalDepsAnalyzer>();
+	AU.addRequired<GlobalDepsAnalyzer>();
+
+	ModulePass::getAnalysisUsage(AU);
+}
+
+const SimilarFunctionMerging::FunctionBody& SimilarFunctionMerging::getBody(Function* F)
+{
+	auto it = bodies.find(F);
+	if (it != bodies.end())
+		return it->second;
+
+	FunctionBody& body = bodies[F];
+	uint32_t index = 0;
+	for (const Argument& arg : F->args())
+		body.locals[&arg] = index++;
+	for (BasicBlock& BB : *F)
+	{
+		body.locals[&BB] = index++;
+		for (Instruction& I : BB)
+		{
+			if (isa<DbgInfoIntrinsic>(I))
+				continue;
+			body.locals[&I] = index++;
+			body.instructions.push_back(&I);
+		}
+	}
+	return body;
+}
+
+// Similar functions have the same hash, the constants only contribute their type
+uint64_t SimilarFunctionMerging::hashFunction(const FunctionBody& body)
+{
+	HashAccumulator64 hash;
+	hash.add(body.instructions.size());
+	for (const Instruction* I : body.instructions)
+	{
+		hash.add(body.locals.lookup(I->getParent()));
+		hash.add(I->getOpcode());
+		hash.add(reinterpret_cast<uintptr_t>(I->getType()));
+		if (const CmpInst* cmp = dyn_cast<CmpInst>(I))
+			hash.add(cmp->getPredicate());
+		for (const Use& op : I->operands())
+		{
+			auto local = body.locals.find(op.get());
+			if (local != body.locals.end())
+				hash.add(local->second);
+			else
+				hash.add(reinterpret_cast<uintptr_t>(op->getType()));
+		}
+	}
+	return hash.getHash();
+}
+
+bool SimilarFunctionMerging::similarFunctions(Function* A, Function* B, std::set<OperandPosition>& differences)
+{
+	if (A->getFunctionType() != B->getFunctionType() || A->getCallingConv() != B->getCallingConv())
+		return false;
+
+	const FunctionBody& bodyA = getBody(A);
+	const FunctionBody& bodyB = getBody(B);
+	if (bodyA.instructions.size() != bodyB.instructions.size())
+		return false;
+
+	// The locals are numbered in the same order, so equivalent locals have
+	// the same number
+	auto sameLocal = [&](const Value* a, const Value* b)
+	{
+		auto localA = bodyA.locals.find(a);
+		auto localB = bodyB.locals.find(b);
+		return localA != bodyA.locals.end() && localB != bodyB.locals.end() && localA->second == localB->second;
+	};
+
+	for (uint32_t i = 0; i < bodyA.instructions.size(); i++)
+	{
+		const Instruction* IA = bodyA.instructions[i];
+		const Instruction* IB = bodyB.instructions[i];
+		if (!sameLocal(IA->getParent(), IB->getParent()) || !IA->isSameOperationAs(IB))
+			return false;
+		if (const PHINode* phiA = dyn_cast<PHINode>(IA))
+		{
+			const PHINode* phiB = cast<PHINode>(IB);
+			for (uint32_t j = 0; j < phiA->getNumIncomingValues(); j++)
+			{
+				if (!sameLocal(phiA->getIncomingBlock(j), phiB->getIncomingBlock(j)))
+					return false;
+			}
+		}
+		for (uint32_t j = 0; j < IA->getNumOperands(); j++)
+		{
+			const Value* a = IA->getOperand(j);
+			const Value* b = IB->getOperand(j);
+			if (bodyA.locals.count(a) || bodyB.locals.count(b))
+			{
+				if (!sameLocal(a, b))
+					return false;
+			}
+			else if (a != b)
+			{
+				if (!canBeParameter(IA, j, a, b))
+					return false;
+				differences.insert(OperandPosition(i, j));
+			}
+		}
+	}
+	return true;
+}
+
+bool SimilarFunctionMerging::canBeParameter(const Instruction* I, uint32_t operand, const Value* A, const Value* B)
+{
+	if (!isa<Constant>(A) || !isa<Constant>(B) || isa<BlockAddress>(A) || isa<BlockAddress>(B))
+		return false;
+	Type* T = A->getType();
+	if (!T->isIntegerTy() && !T->isFloatingPointTy() && !T->isPointerTy())
+		return false;
+
+	// The functions passed as parameters must be in the function tables. The
+	// wasm intrinsics are not, the wasm writer replaces their calls with opcodes.
+	auto isAsmJSFunction = [](const Value* V)
+	{
+		const Function* F = dyn_cast<Function>(V);
+		return F && !F->isDeclaration() && F->getSection() == StringRef("asmjs") && !isWasmIntrinsic(F);
+	};
+	const Value* strippedA = A->stripPointerCastsSafe();
+	const Value* strippedB = B->stripPointerCastsSafe();
+	if (isa<Function>(strippedA) || isa<Function>(strippedB))
+	{
+		if (!isAsmJSFunction(strippedA) || !isAsmJSFunction(strippedB))
+			return false;
+	}
+
+	switch (I->getOpcode())
+	{
+		case Instruction::Switch:
+			// The case values must be constants
+			return operand == 0;
+		case Instruction::GetElementPtr:
+		{
+			// The struct member indexes must be constants
+			if (operand == 0)
+				return true;
+			gep_type_iterator it = gep_type_begin(I);
+			std::advance(it, operand - 1);
+			return !isa<StructType>(*it);
+		}
+		case Instruction::Call:
+		case Instruction::Invoke:
+		{
+			ImmutableCallSite CS(I);
+			const Function* callee = CS.getCalledFunction();
+			if (callee && callee->isIntrinsic())
+				return false;
+			// A different callee becomes an indirect call
+			if (CS.isCallee(&I->getOperandUse(operand)))
+				return isAsmJSFunction(A) && isAsmJSFunction(B);
+			return true;
+		}
+		case Instruction::Alloca:
+		case Instruction::IndirectBr:
+		case Instruction::LandingPad:
+		case Instruction::ShuffleVector:
+			return false;
+		default:
+			return true;
+	}
+}
+
+void SimilarFunctionMerging::mergeFunctions(const std::vector<Function*>& functions, const std::set<OperandPosition>& parameters)
+{
+	Function* base = functions[0];
+	const FunctionBody& baseBody = getBody(base);
+
+	// The shared body takes the original parameters, followed by the operands
+	// which are different
+	std::vector<Type*> argTypes(base->getFunctionType()->param_begin(), base->getFunctionType()->param_end());
+	for (const OperandPosition& p : parameters)
+		argTypes.push_back(baseBody.instructions[p.first]->getOperand(p.second)->getType());
+	FunctionType* mergedTy = FunctionType::get(base->getReturnType(), argTypes, false);
+	Function* merged = Function::Create(mergedTy, GlobalValue::InternalLinkage, base->getName() + "_merged", base->getParent());
+	merged->setCallingConv(base->getCallingConv());
+
+	ValueToValueMapTy VMap;
+	Function::arg_iterator newArg = merged->arg_begin();
+	for (Argument& arg : base->args())
+	{
+		newArg->setName(arg.getName());
+		VMap[&arg] = newArg++;
+	}
+	SmallVector<ReturnInst*, 8> returns;
+	CloneFunctionInto(merged, base, VMap, /*ModuleLevelChanges*/false, returns);
+	for (const OperandPosition& p : parameters)
+		cast<Instruction>(VMap[baseBody.instructions[p.first]])->setOperand(p.second, newArg++);
+
+	DEBUG(dbgs() << "merge " << functions.size() << " functions into " << merged->getName() <<
+			" with " << parameters.size() << " parameters\n");
+
+	// Replace the bodies with a call to the shared body
+	for (Function* F : functions)
+	{
+		Thunk thunk = { F, merged, {} };
+		const FunctionBody& body = getBody(F);
+		for (const OperandPosition& p : parameters)
+			thunk.operands.push_back(cast<Constant>(body.instructions[p.first]->getOperand(p.second)));
+		bodies.erase(F);
+
+		GlobalValue::LinkageTypes linkage = F->getLinkage();
+		F->deleteBody();
+		F->setLinkage(linkage);
+
+		IRBuilder<> Builder(BasicBlock::Create(F->getContext(), "", F));
+		std::vector<Value*> args;
+		for (Argument& arg : F->args())
+			args.push_back(&arg);
+		args.insert(args.end(), thunk.operands.begin(), thunk.operands.end());
+		CallInst* call = Builder.CreateCall(merged, args);
+		call->setCallingConv(merged->getCallingConv());
+		call->setTailCall();
+		if (call->getType()->isVoidTy())
+			Builder.CreateRetVoid();
+		else
+			Builder.CreateRet(call);
+		thunks.push_back(thunk);
+	}
+}
+
+void SimilarFunctionMerging::redirectCalls(const Thunk& thunk)
+{
+	std::vector<CallInst*> calls;
+	for (Use& U : thunk.F->uses())
+	{
+		CallInst* CI = dyn_cast<CallInst>(U.getUser());
+		if (CI && ImmutableCallSite(CI).isCallee(&U))
+			calls.push_back(CI);
+	}
+	for (CallInst* CI : calls)
+	{
+		std::vector<Value*> args(CI->op_begin(), CI->op_begin() + CI->getNumArgOperands());
+		args.insert(args.end(), thunk.operands.begin(), thunk.operands.end());
+		CallInst* call = CallInst::Create(thunk.merged, args, "", CI);
+		call->setCallingConv(CI->getCallingConv());
+		call->setAttributes(CI->getAttributes());
+		call->setTailCall(CI->isTailCall());
+		call->setDebugLoc(CI->getDebugLoc());
+		call->takeName(CI);
+		CI->replaceAllUsesWith(call);
+		CI->eraseFromParent();
+	}
+}
+
+bool SimilarFunctionMerging::runOnModule(Module& M)
+{
+	if (maxParameters == 0)
+		return false;
+
+	GlobalDepsAnalyzer& GDA = getAnalysis<GlobalDepsAnalyzer>();
+
+	// Bucket the candidates by hash, in module order. The smaller functions
+	// are never worth a thunk.
+	const uint32_t minInstructions = 6;
+	std::unordered_map<uint64_t, uint32_t> bucketIndexes;
+	std::vector<std::vector<Function*>> buckets;
+	for (Function& F : M)
+	{
+		if (F.isDeclaration() || F.isVarArg() || F.getSection() != StringRef("asmjs"))
+			continue;
+		const FunctionBody& body = getBody(&F);
+		if (body.instructions.size() < minInstructions)
+			continue;
+		auto inserted = bucketIndexes.insert({hashFunction(body), buckets.size()});
+		if (inserted.second)
+			buckets.emplace_back();
+		buckets[inserted.first->second].push_back(&F);
+	}
+
+	// Every group starts from the first remaining function of a bucket. The
+	// other functions are added starting from the ones with fewer
+	// differences, and the group is cut where it saves the most. A group of
+	// n functions with k parameters saves the n - 1 bodies it removes, minus
+	// twice the n thunks and extra call operands.
+	std::vector<std::pair<std::vector<Function*>, std::set<OperandPosition>>> groups;
+	for (std::vector<Function*>& remaining : buckets)
+	{
+		while (remaining.size() >= 2)
+		{
+			Function* base = remaining[0];
+			std::vector<std::pair<Function*, std::set<OperandPosition>>> candidates;
+			std::vector<Function*> rest;
+			for (uint32_t i = 1; i < remaining.size(); i++)
+			{
+				std::set<OperandPosition> differences;
+				if (similarFunctions(base, remaining[i], differences) && differences.size() <= maxParameters)
+					candidates.emplace_back(remaining[i], std::move(differences));
+				else
+					rest.push_back(remaining[i]);
+			}
+			std::stable_sort(candidates.begin(), candidates.end(),
+				[](const std::pair<Function*, std::set<OperandPosition>>& a, const std::pair<Function*, std::set<OperandPosition>>& b)
+				{
+					return a.second.size() < b.second.size();
+				});
+
+			const int64_t size = getBody(base).instructions.size();
+			std::vector<Function*> group(1, base);
+			std::set<OperandPosition> parameters;
+			std::vector<Function*> best;
+			std::set<OperandPosition> bestParameters;
+			int64_t bestSaving = 0;
+			for (auto& candidate : candidates)
+			{
+				std::set<OperandPosition> merged(parameters);
+				merged.insert(candidate.second.begin(), candidate.second.end());
+				if (merged.size() > maxParameters)
+				{
+					rest.push_back(candidate.first);
+					continue;
+				}
+				group.push_back(candidate.first);
+				parameters.swap(merged);
+				const int64_t n = group.size();
+				int64_t saving = (n - 1) * size - 2 * n * int64_t(parameters.size() + 2);
+				// Identical functions are left to IdenticalCodeFolding
+				if (saving > bestSaving && !parameters.empty())
+				{
+					best = group;
+					bestParameters = parameters;
+					bestSaving = saving;
+				}
+			}
+			for (uint32_t i = best.size() ? best.size() : 1; i < group.size(); i++)
+				rest.push_back(group[i]);
+			if (!best.empty())
+				groups.emplace_back(std::move(best), std::move(bestParameters));
+			remaining.swap(rest);
+		}
+	}
+	if (groups.empty())
+		return false;
+
+	for (const auto& group : groups)
+		mergeFunctions(group.first, group.second);
+	bodies.clear();
+
+	// Call the shared bodies directly, and remove the thunks which are no
+	// longer used. Removing a thunk may leave other thunks unused.
+	for (const Thunk& thunk : thunks)
+		redirectCalls(thunk);
+	std::unordered_set<const Function*> keep;
+	GDA.collectExternallyUsedFunctions(M, keep);
+	bool erased = true;
+	while (erased)
+	{
+		erased = false;
+		for (Thunk& thunk : thunks)
+		{
+			if (!thunk.F || !thunk.F->use_empty() || keep.count(thunk.F))
+				continue;
+			GDA.eraseFunction(thunk.F);
+			thunk.F->eraseFromParent();
+			thunk.F = nullptr;
+			erased = true;
+		}
+	}
+	thunks.clear();
+	return true;
+}
+
+ModulePass* createSimilarFunctionMergingPass(unsigned maxParameters)
+{
+	return new SimilarFunctionMerging(maxParameters);
+}
+
+}
+
+using namespace cheerp;
+
+INITIALIZE_PASS_BEGIN(SimilarFunctionMerging, "SimilarFunctionMerging", "Merge functions which only differ in a few constants",
+                      false, false)
+INITIALIZE_PASS_END(SimilarFunctionMerging, "SimilarFunctionMerging", "Merge functions which only differ in a few constants",
+                    false, false)
@@ -19,6 +19,7 @@
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Operator.h"
+#include "llvm/IR/TypeFinder.h"
 #include "llvm/Support/FormattedStream.h"
 
 using namespace llvm;
@@ -77,6 +78,30 @@ bool isValidVoidPtrSource(const Value* val, std::set<const PHINode*>& visitedPhi
 	return false;
 }
 
+/**
+ * Returns true if user is reached walking forward from I in the same block
+ * without crossing instructions with side effects. PHIs and users before I
+ * are never reached, since the walk stops at the terminator
+ */
+static bool reachesUserWithoutSideEffects(const Instruction& I, const Instruction& user)
+{
+	if(user.getParent() != I.getParent() || isa<PHINode>(user))
+		return false;
+	const Instruction* nextInst = &I;
+	// Limit to 10 nodes to avoid increased runtime.
+	for(int i = 0; i < 10; i++)
+	{
+		nextInst = nextInst->getNextNode();
+		if(!nextInst)
+			return false;
+		if(nextInst == &user)
+			return true;
+		if(isa<TerminatorInst>(nextInst) || nextInst->mayHaveSideEffects())
+			return false;
+	}
+	return false;
+}
+
 bool isInlineable(const Instruction& I, const PointerAnalyzer& PA)
 {
 	//Beside a few cases, instructions with a single use may be inlined
@@ -166,24 +191,36 @@ bool isInlineable(const Instruction& I, const PointerAnalyzer& PA)
 				if(I.use_empty() || (I.getType()->isPointerTy() && PA.getPointerKind(&I) == SPLIT_REGULAR))
 					return false;
 
-				// Skip all instructions that have no side effects.
-				const Instruction* nextInst = &I;
-				int i = 0;
-				do {
-					nextInst = nextInst->getNextNode();
-					assert(nextInst);
-					// Limit to 10 nodes to avoid increased runtime.
-					if (++i >= 10 || I.user_back()==nextInst)
-						break;
-				} while (!nextInst->mayHaveSideEffects());
-
-				if(I.user_back()!=nextInst)
+				const Instruction* user = I.user_back();
+				if(!reachesUserWithoutSideEffects(I, *user))
 					return false;
 				// To be inlineable this should be the value operand, not the pointer operand
-				if(isa<StoreInst>(nextInst))
-					return nextInst->getOperand(0)==&I;
-
-				return isa<ReturnInst>(nextInst);
+				if(isa<StoreInst>(user))
+					return user->getOperand(0)==&I;
+				// Narrow loads are inlined in the extension, which keeps its own
+				// local unless it is inlineable too. In wasm this folds the pair into
+				// a single extending load
+				if(isa<LoadInst>(I) && (isa<SExtInst>(user) || isa<ZExtInst>(user)))
+					return true;
+				return isa<ReturnInst>(user);
+			}
+			case Instruction::ZExt:
+			case Instruction::SExt:
+			{
+				// If the load is inlined in the extension it is evaluated where the
+				// extension is, so the extension can only be inlined if the same
+				// conditions used for loads hold for it
+				const LoadInst* LI = dyn_cast<LoadInst>(I.getOperand(0));
+				if(!LI || !isInlineable(*LI, PA))
+					return true;
+				if(I.use_empty())
+					return false;
+				const Instruction* user = I.user_back();
+				if(!reachesUserWithoutSideEffects(I, *user))
+					return false;
+				if(isa<StoreInst>(user))
+					return user->getOperand(0)==&I;
+				return isa<ReturnInst>(user);
 			}
 			case Instruction::Invoke:
 			case Instruction::Ret:
@@ -221,8 +258,6 @@ bool isInlineable(const Instruction& I, const PointerAnalyzer& PA)
 			case Instruction::FMul:
 			case Instruction::FCmp:
 			case Instruction::ICmp:
-			case Instruction::ZExt:
-			case Instruction::SExt:
 			case Instruction::Select:
 			case Instruction::ExtractValue:
 			case Instruction::URem:
@@ -246,6 +281,7 @@ bool isWasmIntrinsic(const llvm::Function* F)
 #define WASM_INTRINSIC(name, opcode, symbol) \
 		|| F->getName() == symbol
 WASM_INTRINSIC_LIST(WASM_INTRINSIC)
+WASM_MEMORY_INTRINSIC_LIST(WASM_INTRINSIC)
 #undef WASM_INTRINSIC
 	;
 }
@@ -263,6 +299,46 @@ uint32_t getIntFromValue(const Value* v)
 	return i->getZExtValue();
 }
 
+bool getInlineMemIntrinsicAccesses(const MemIntrinsic& MI, uint32_t maxWidth,
+		bool allowUnaligned, SmallVectorImpl<uint32_t>& widths)
+{
+	widths.clear();
+	if (MI.isVolatile())
+		return false;
+	const ConstantInt* length = dyn_cast<ConstantInt>(MI.getLength());
+	if (!length || length->getValue().ugt(MaxInlineMemIntrinsicAccesses * maxWidth))
+		return false;
+	if (const MemSetInst* MS = dyn_cast<MemSetInst>(&MI))
+	{
+		if (!isa<ConstantInt>(MS->getValue()))
+			return false;
+	}
+
+	uint32_t width = maxWidth;
+	if (!allowUnaligned)
+	{
+		uint32_t align = std::max(MI.getAlignment(), 1u);
+		while (width > align)
+			width /= 2;
+	}
+	// Accesses only get narrower, so every one of them is aligned to its own
+	// width relative to the destination
+	uint64_t remaining = length->getZExtValue();
+	while (remaining)
+	{
+		while (width > remaining)
+			width /= 2;
+		widths.push_back(width);
+		remaining -= width;
+		if (widths.size() > MaxInlineMemIntrinsicAccesses)
+			return false;
+	}
+	// Overlapping memmoves are only safe if everything is loaded first
+	if (isa<MemMoveInst>(MI) && widths.size() > 1)
+		return false;
+	return true;
+}
+
 std::string valueObjectName(const Value* v)
 {
 	std::ostringstream os;
@@ -334,6 +410,30 @@ Type* getGEPContainerType(const User* gep)
 	return containerType;
 }
 
+void writeJSONString(raw_ostream& os, StringRef s)
+{
+	os << '"';
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+			os << '\\';
+		os << c;
+	}
+	os << '"';
+}
+
+void prepareTypesForThreads(const Module& M)
+{
+	TypeFinder structTypes;
+	structTypes.run(M, /*onlyNamed*/ false);
+	for (StructType* st : structTypes)
+	{
+		st->getPointerTo();
+		if (st->isSized())
+			M.getDataLayout()->getStructLayout(st);
+	}
+}
+
 bool TypeSupport::isDerivedStructType(StructType* derivedType, StructType* baseType)
 {
 	if(derivedType->getNumElements() < baseType->getNumElements())
@@ -805,6 +905,7 @@ void initializeCheerpOpts(PassRegistry &Registry)
 	initializeAllocaMergingPass(Registry);
 	initializeGlobalDepsAnalyzerPass(Registry);
 	initializeIdenticalCodeFoldingPass(Registry);
+	initializeSimilarFunctionMergingPass(Registry);
 	initializePointerAnalyzerPass(Registry);
 	initializeRegisterizePass(Registry);
 	initializeStructMemFuncLoweringPass(Registry);
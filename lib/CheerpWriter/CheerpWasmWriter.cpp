@@ -13,10 +13,20 @@
 #include <limits>
 
 #include "Relooper.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Cheerp/NameGenerator.h"
 #include "llvm/Cheerp/WasmWriter.h"
 #include "llvm/Cheerp/Writer.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Type.h"
+#include "llvm/Support/LEB128.h"
+
+#if LLVM_ENABLE_THREADS
+#include <atomic>
+#include <thread>
+#endif
 
 using namespace cheerp;
 using namespace llvm;
@@ -65,8 +75,8 @@ BlockType* findSwitchBlockType(std::vector<BlockType>& blocks)
 namespace internal {
 
 // The methods encodeSLEB128 and encodeULEB128 are identical to the ones in
-// llvm/Support/LEB128.h, but require a parameter of type `WasmBuffer&`
-// instead of the llvm output stream.
+// llvm/Support/LEB128.h, but append the bytes directly to the `WasmBuffer`
+// instead of going through the llvm output stream.
 static inline void encodeSLEB128(int64_t Value, WasmBuffer& OS) {
 	bool More;
 	do {
@@ -77,7 +87,7 @@ static inline void encodeSLEB128(int64_t Value, WasmBuffer& OS) {
 					((Value == -1) && ((Byte & 0x40) != 0))));
 		if (More)
 			Byte |= 0x80; // Mark this byte to show that more bytes will follow.
-		OS << char(Byte);
+		OS.writeByte(Byte);
 	} while (More);
 }
 
@@ -88,25 +98,25 @@ static inline void encodeULEB128(uint64_t Value, WasmBuffer& OS,
 		Value >>= 7;
 		if (Value != 0 || Padding != 0)
 			Byte |= 0x80; // Mark this byte to show that more bytes will follow.
-		OS << char(Byte);
+		OS.writeByte(Byte);
 	} while (Value != 0);
 
 	// Pad with 0x80 and emit a null byte at the end.
 	if (Padding != 0) {
 		for (; Padding != 1; --Padding)
-			OS << '\x80';
-		OS << '\x00';
+			OS.writeByte(0x80);
+		OS.writeByte(0x00);
 	}
 }
 
 static inline void encodeF32(float f, WasmBuffer& stream)
 {
-	stream.write(reinterpret_cast<const char*>(&f), sizeof(float));
+	stream.writeBytes(reinterpret_cast<const char*>(&f), sizeof(float));
 }
 
 static inline void encodeF64(double f, WasmBuffer& stream)
 {
-	stream.write(reinterpret_cast<const char*>(&f), sizeof(double));
+	stream.writeBytes(reinterpret_cast<const char*>(&f), sizeof(double));
 }
 
 static inline void encodeRegisterKind(Registerize::REGISTER_KIND regKind, WasmBuffer& stream)
@@ -122,6 +132,9 @@ static inline void encodeRegisterKind(Registerize::REGISTER_KIND regKind, WasmBu
 		case Registerize::INTEGER:
 			encodeULEB128(0x7f, stream);
 			break;
+		case Registerize::INTEGER64:
+			encodeULEB128(0x7e, stream);
+			break;
 		default:
 			assert(false);
 	}
@@ -129,7 +142,9 @@ static inline void encodeRegisterKind(Registerize::REGISTER_KIND regKind, WasmBu
 
 static void encodeValType(const Type* t, WasmBuffer& stream)
 {
-	if (t->isIntegerTy() || t->isPointerTy())
+	if (t->isIntegerTy(64))
+		encodeULEB128(0x7e, stream);
+	else if (t->isIntegerTy() || t->isPointerTy())
 		encodeULEB128(0x7f, stream);
 	else if (t->isFloatTy())
 		encodeULEB128(0x7d, stream);
@@ -145,7 +160,9 @@ static void encodeValType(const Type* t, WasmBuffer& stream)
 
 static void encodeLiteralType(const Type* t, WasmBuffer& stream)
 {
-	if (t->isIntegerTy() || t->isPointerTy())
+	if (t->isIntegerTy(64))
+		encodeULEB128(0x42, stream);
+	else if (t->isIntegerTy() || t->isPointerTy())
 		encodeULEB128(0x41, stream);
 	else if(t->isFloatTy())
 		encodeULEB128(0x43, stream);
@@ -164,7 +181,7 @@ static void encodeOpcode(uint32_t opcode, const char* name,
 {
 	if (writer.cheerpMode == CHEERP_MODE_WASM) {
 		assert(opcode <= 255);
-		code << char(opcode);
+		code.writeByte(opcode);
 	} else {
 		assert(writer.cheerpMode == CHEERP_MODE_WAST);
 		code << name << '\n';
@@ -176,7 +193,20 @@ static void encodeS32Opcode(uint32_t opcode, const char* name,
 {
 	if (writer.cheerpMode == CHEERP_MODE_WASM) {
 		assert(opcode <= 255);
-		code << char(opcode);
+		code.writeByte(opcode);
+		encodeSLEB128(immediate, code);
+	} else {
+		assert(writer.cheerpMode == CHEERP_MODE_WAST);
+		code << name << ' ' << immediate << '\n';
+	}
+}
+
+static void encodeS64Opcode(uint32_t opcode, const char* name,
+		int64_t immediate, CheerpWasmWriter& writer, WasmBuffer& code)
+{
+	if (writer.cheerpMode == CHEERP_MODE_WASM) {
+		assert(opcode <= 255);
+		code.writeByte(opcode);
 		encodeSLEB128(immediate, code);
 	} else {
 		assert(writer.cheerpMode == CHEERP_MODE_WAST);
@@ -189,7 +219,7 @@ static void encodeU32Opcode(uint32_t opcode, const char* name,
 {
 	if (writer.cheerpMode == CHEERP_MODE_WASM) {
 		assert(opcode <= 255);
-		code << char(opcode);
+		code.writeByte(opcode);
 		encodeULEB128(immediate, code);
 	} else {
 		assert(writer.cheerpMode == CHEERP_MODE_WAST);
@@ -202,7 +232,7 @@ static void encodeU32U32Opcode(uint32_t opcode, const char* name,
 {
 	if (writer.cheerpMode == CHEERP_MODE_WASM) {
 		assert(opcode <= 255);
-		code << char(opcode);
+		code.writeByte(opcode);
 		encodeULEB128(i1, code);
 		encodeULEB128(i2, code);
 	} else {
@@ -213,10 +243,10 @@ static void encodeU32U32Opcode(uint32_t opcode, const char* name,
 
 }
 
-std::string string_to_hex(const std::string& input)
+std::string string_to_hex(StringRef input)
 {
 	static const char* const lut = "0123456789abcdef";
-	size_t len = input.length();
+	size_t len = input.size();
 
 	std::string output;
 	output.reserve(2 * len);
@@ -235,9 +265,7 @@ Section::Section(uint32_t sectionId, const char* sectionName, CheerpWasmWriter*
 	: sectionId(sectionId), sectionName(sectionName), writer(writer)
 {
 	if (writer->cheerpMode == CHEERP_MODE_WASM) {
-		std::stringstream header;
-		internal::encodeULEB128(sectionId, header);
-		writer->stream << header.str();
+		llvm::encodeULEB128(sectionId, writer->stream);
 
 		// Custom sections have a section name.
 		if (!sectionId) {
@@ -248,22 +276,36 @@ Section::Section(uint32_t sectionId, const char* sectionName, CheerpWasmWriter*
 }
 Section::~Section()
 {
-	std::string buf = str();
 	if (writer->cheerpMode == CHEERP_MODE_WASM) {
 #if WASM_DUMP_SECTIONS
 		uint64_t start = writer->stream.tell();
 		fprintf(stderr, "%10s id=0x%x start=0x%08lx end=0x%08lx size=0x%08lx\n",
-				sectionName, sectionId, start, start + buf.size(), buf.size());
+				sectionName, sectionId, start, start + size(), size());
 #if WASM_DUMP_SECTION_DATA
-		llvm::errs() << "section: " << string_to_hex(buf) << '\n';
+		llvm::errs() << "section: " << string_to_hex(str()) << '\n';
 #endif
 #endif
 
-		std::stringstream prefix;
-		internal::encodeULEB128(buf.size(), prefix);
-		writer->stream << prefix.str();
+		llvm::encodeULEB128(size(), writer->stream);
+	}
+	uint8_t id = sectionId;
+	writer->outputHash.update(id);
+	writer->outputHash.update(str());
+	writer->stream.write(data(), size());
+}
+
+void WasmBuffer::patchSizeULEB128(size_t pos)
+{
+	size_t size = bytes.size() - pos - 5;
+	assert(size <= UINT32_MAX);
+	uint8_t leb[5];
+	unsigned len = llvm::encodeULEB128(size, leb);
+	memcpy(&bytes[pos], leb, len);
+	if (len < 5)
+	{
+		memmove(&bytes[pos + len], &bytes[pos + 5], size);
+		bytes.resize(pos + len + size);
 	}
-	writer->stream << buf;
 }
 
 enum ConditionRenderMode {
@@ -271,6 +313,102 @@ enum ConditionRenderMode {
 	InvertCondition
 };
 
+// Compile the condition of the branch with the given id at the end of bb
+static void compileCondition(CheerpWasmWriter* writer, WasmBuffer& code, const BasicBlock* bb,
+		int branchId, ConditionRenderMode mode)
+{
+	const TerminatorInst* term=bb->getTerminator();
+
+	if(isa<BranchInst>(term))
+	{
+		const BranchInst* bi=cast<BranchInst>(term);
+		assert(bi->isConditional());
+		//The second branch is the default
+		assert(branchId==0);
+
+		const ICmpInst* I = dyn_cast<ICmpInst>(bi->getCondition());
+		if (mode == InvertCondition && I && isInlineable(*I, writer->PA)) {
+			const ICmpInst::Predicate p = I->getInversePredicate();
+			const ConstantInt* C;
+			// Optimize "if (a != 0)" to "if (a)", if only takes i32 values.
+			if (p == CmpInst::ICMP_NE && !I->getOperand(0)->getType()->isIntegerTy(64) &&
+					(C = dyn_cast<ConstantInt>(I->getOperand(1))) &&
+					C->getSExtValue() == 0) {
+				writer->compileOperand(code, I->getOperand(0));
+				return;
+			}
+			writer->compileICmp(*I, p, code);
+		} else {
+			writer->compileOperand(code, bi->getCondition());
+			if (mode == InvertCondition) {
+				// Invert result
+				writer->encodeS32Inst(0x41, "i32.const", 1, code);
+				writer->encodeInst(0x73, "i32.xor", code);
+			}
+		}
+	}
+	else if(isa<SwitchInst>(term))
+	{
+		const SwitchInst* si=cast<SwitchInst>(term);
+		assert(branchId > 0);
+		SwitchInst::ConstCaseIt it=si->case_begin();
+		for(int i=1;i<branchId;i++)
+			++it;
+		const BasicBlock* dest=it.getCaseSuccessor();
+		writer->compileOperand(code, si->getCondition());
+		writer->compileOperand(code, it.getCaseValue());
+		writer->encodePredicate(si->getCondition()->getType(), CmpInst::ICMP_EQ, code);
+		//We found the destination, there may be more cases for the same
+		//destination though
+		for(++it;it!=si->case_end();++it)
+		{
+			if(it.getCaseSuccessor()==dest)
+			{
+				//Also add this condition
+				writer->compileOperand(code, si->getCondition());
+				writer->compileOperand(code, it.getCaseValue());
+				writer->encodePredicate(si->getCondition()->getType(), CmpInst::ICMP_EQ, code);
+				writer->encodeInst(0x72, "i32.or", code);
+			}
+		}
+
+		// TODO optimize this by inverting the boolean logic above.
+		if (mode == InvertCondition) {
+			// Invert result
+			writer->encodeS32Inst(0x41, "i32.const", 1, code);
+			writer->encodeInst(0x73, "i32.xor", code);
+		}
+	}
+	else
+	{
+		term->dump();
+		llvm::report_fatal_error("Unsupported code found, please report a bug", false);
+	}
+}
+
+// Compile the index of the jump table of a switch, whose smallest case is min
+static void compileSwitchIndex(CheerpWasmWriter* writer, WasmBuffer& code, const SwitchInst* si, int64_t min)
+{
+	writer->compileOperand(code, si->getCondition());
+	uint32_t bitWidth = si->getCondition()->getType()->getIntegerBitWidth();
+	if (bitWidth != 32)
+	{
+		assert(bitWidth < 32);
+		writer->encodeS32Inst(0x41, "i32.const", getMaskForBitWidth(bitWidth), code);
+		writer->encodeInst(0x71, "i32.and", code);
+	}
+	if (min != 0)
+	{
+		writer->encodeS32Inst(0x41, "i32.const", min, code);
+		writer->encodeInst(0x6b, "i32.sub", code);
+		if (bitWidth != 32)
+		{
+			writer->encodeS32Inst(0x41, "i32.const", getMaskForBitWidth(bitWidth), code);
+			writer->encodeInst(0x71, "i32.and", code);
+		}
+	}
+}
+
 class CheerpWasmRenderInterface: public RenderInterface
 {
 private:
@@ -341,73 +479,7 @@ void CheerpWasmRenderInterface::indent()
 void CheerpWasmRenderInterface::renderCondition(const BasicBlock* bb, int branchId,
 		ConditionRenderMode mode)
 {
-	const TerminatorInst* term=bb->getTerminator();
-
-	if(isa<BranchInst>(term))
-	{
-		const BranchInst* bi=cast<BranchInst>(term);
-		assert(bi->isConditional());
-		//The second branch is the default
-		assert(branchId==0);
-
-		const ICmpInst* I = dyn_cast<ICmpInst>(bi->getCondition());
-		if (mode == InvertCondition && I && isInlineable(*I, writer->PA)) {
-			const ICmpInst::Predicate p = I->getInversePredicate();
-			const ConstantInt* C;
-			// Optimize "if (a != 0)" to "if (a)".
-			if (p == CmpInst::ICMP_NE &&
-					(C = dyn_cast<ConstantInt>(I->getOperand(1))) &&
-					C->getSExtValue() == 0) {
-				writer->compileOperand(code, I->getOperand(0));
-				return;
-			}
-			writer->compileICmp(*I, p, code);
-		} else {
-			writer->compileOperand(code, bi->getCondition());
-			if (mode == InvertCondition) {
-				// Invert result
-				writer->encodeS32Inst(0x41, "i32.const", 1, code);
-				writer->encodeInst(0x73, "i32.xor", code);
-			}
-		}
-	}
-	else if(isa<SwitchInst>(term))
-	{
-		const SwitchInst* si=cast<SwitchInst>(term);
-		assert(branchId > 0);
-		SwitchInst::ConstCaseIt it=si->case_begin();
-		for(int i=1;i<branchId;i++)
-			++it;
-		const BasicBlock* dest=it.getCaseSuccessor();
-		writer->compileOperand(code, si->getCondition());
-		writer->compileOperand(code, it.getCaseValue());
-		writer->encodeInst(0x46, "i32.eq", code);
-		//We found the destination, there may be more cases for the same
-		//destination though
-		for(++it;it!=si->case_end();++it)
-		{
-			if(it.getCaseSuccessor()==dest)
-			{
-				//Also add this condition
-				writer->compileOperand(code, si->getCondition());
-				writer->compileOperand(code, it.getCaseValue());
-				writer->encodeInst(0x46, "i32.eq", code);
-				writer->encodeInst(0x72, "i32.or", code);
-			}
-		}
-
-		// TODO optimize this by inverting the boolean logic above.
-		if (mode == InvertCondition) {
-			// Invert result
-			writer->encodeS32Inst(0x41, "i32.const", 1, code);
-			writer->encodeInst(0x73, "i32.xor", code);
-		}
-	}
-	else
-	{
-		term->dump();
-		llvm::report_fatal_error("Unsupported code found, please report a bug", false);
-	}
+	compileCondition(writer, code, bb, branchId, mode);
 }
 
 void CheerpWasmRenderInterface::renderLabelForSwitch(int labelId)
@@ -520,6 +592,10 @@ void CheerpWasmRenderInterface::renderSwitchBlockBegin(const SwitchInst* si, Blo
 	for (auto it : si->cases())
 	{
 		const BasicBlock* dest = it.getCaseSuccessor();
+		// The Relooper merges these cases with the default branch, so they
+		// do not have a block of their own
+		if (dest == si->getDefaultDest())
+			continue;
 		const auto& found = blockIndexMap.find(dest);
 
 		if (found == blockIndexMap.end())
@@ -555,24 +631,7 @@ void CheerpWasmRenderInterface::renderSwitchBlockBegin(const SwitchInst* si, Blo
 
 	// Wrap the br_table instruction in its own block.
 	writer->encodeU32Inst(0x02, "block", 0x40, code);
-	writer->compileOperand(code, si->getCondition());
-	uint32_t bitWidth = si->getCondition()->getType()->getIntegerBitWidth();
-	if (bitWidth != 32)
-	{
-		assert(bitWidth < 32);
-		writer->encodeS32Inst(0x41, "i32.const", getMaskForBitWidth(bitWidth), code);
-		writer->encodeInst(0x71, "i32.and", code);
-	}
-	if (min != 0)
-	{
-		writer->encodeS32Inst(0x41, "i32.const", min, code);
-		writer->encodeInst(0x6b, "i32.sub", code);
-		if (bitWidth != 32)
-		{
-			writer->encodeS32Inst(0x41, "i32.const", getMaskForBitWidth(bitWidth), code);
-			writer->encodeInst(0x71, "i32.and", code);
-		}
-	}
+	compileSwitchIndex(writer, code, si, min);
 
 	// Print the case labels and the default label.
 	writer->encodeBranchTable(code, table, caseBlocks);
@@ -825,43 +884,380 @@ void CheerpWasmRenderInterface::renderContinue()
 
 		breakIndex += blockTypes[blockTypes.size() - i - 1].depth;
 	}
-	breakIndex += 1;
-	writer->encodeU32Inst(0x0c, "br", breakIndex, code);
-}
-
-void CheerpWasmRenderInterface::renderContinue(int labelId)
-{
-	uint32_t breakIndex = 0;
-	uint32_t i = 0;
-	for (; i < blockTypes.size(); i++)
+	breakIndex += 1;
+	writer->encodeU32Inst(0x0c, "br", breakIndex, code);
+}
+
+void CheerpWasmRenderInterface::renderContinue(int labelId)
+{
+	uint32_t breakIndex = 0;
+	uint32_t i = 0;
+	for (; i < blockTypes.size(); i++)
+	{
+		BlockType& block = blockTypes[blockTypes.size() - i - 1];
+
+		if (block.label == labelId)
+			break;
+
+		breakIndex += block.depth;
+	}
+	assert(i < blockTypes.size() && "cannot find labelId in block types");
+	breakIndex += 1;
+	writer->encodeU32Inst(0x0c, "br", breakIndex, code);
+}
+
+void CheerpWasmRenderInterface::renderLabel(int labelId)
+{
+	writer->encodeS32Inst(0x41, "i32.const", labelId, code);
+	writer->encodeU32Inst(0x21, "set_local", labelLocal, code);
+}
+
+void CheerpWasmRenderInterface::renderIfOnLabel(int labelId, bool first)
+{
+	// TODO: Use first to optimize dispatch
+	writer->encodeS32Inst(0x41, "i32.const", labelId, code);
+	writer->encodeU32Inst(0x20, "get_local", labelLocal, code);
+	writer->encodeInst(0x46, "i32.eq", code);
+	indent();
+	writer->encodeU32Inst(0x04, "if", 0x40, code);
+	blockTypes.emplace_back(IF, 1);
+}
+
+// Renders the control flow of a function as nested blocks and loops, without
+// the label variable used by the Relooper. The code follows the dominator
+// tree: the blocks reached by more than one forward branch are placed right
+// after a wasm block that encloses all their predecessors, and a wasm loop is
+// opened on each block that is the target of a back edge. Only reducible
+// control flow can be rendered this way.
+class CheerpWasmStructurizer
+{
+private:
+	enum SCOPE_KIND { BLOCK_FOLLOWED_BY = 0, LOOP_HEADED_BY, IF_THEN_ELSE, PROLOGUE_OF };
+	struct Scope
+	{
+		SCOPE_KIND kind;
+		const BasicBlock* bb;
+	};
+	CheerpWasmWriter* writer;
+	WasmBuffer& code;
+	const Registerize& registerize;
+	DominatorTree DT;
+	// Reverse post order index of the reachable blocks
+	DenseMap<const BasicBlock*, uint32_t> order;
+	// Number of distinct forward predecessors of each block
+	DenseMap<const BasicBlock*, uint32_t> forwardPreds;
+	SmallPtrSet<const BasicBlock*, 8> loopHeaders;
+	// The scopes which enclose the code being rendered, the innermost last
+	std::vector<Scope> scopes;
+	bool supported;
+
+	static SmallVector<const BasicBlock*, 4> getUniqueSuccessors(const BasicBlock* bb);
+	DomTreeNode* getNode(const BasicBlock* bb) const
+	{
+		return DT.getNode(const_cast<BasicBlock*>(bb));
+	}
+	bool isBackEdge(const BasicBlock* from, const BasicBlock* to) const
+	{
+		return order.lookup(to) <= order.lookup(from);
+	}
+	bool endsWithSwitch(const BasicBlock* bb) const
+	{
+		return isa<SwitchInst>(bb->getTerminator()) && getUniqueSuccessors(bb).size() > 1;
+	}
+	// Returns true if the block is placed after a wasm block opened in the code of its
+	// immediate dominator, instead of being nested in the code of its only predecessor
+	bool isPlacedAfterBlock(const BasicBlock* bb) const
+	{
+		return forwardPreds.lookup(bb) > 1 || endsWithSwitch(getNode(bb)->getIDom()->getBlock());
+	}
+	bool isJump(const BasicBlock* from, const BasicBlock* to) const
+	{
+		return isBackEdge(from, to) || isPlacedAfterBlock(to);
+	}
+	bool hasPrologue(const BasicBlock* from, const BasicBlock* to) const
+	{
+		return to->getFirstNonPHI() != &to->front() &&
+			CheerpWriter::needsPointerKindConversionForBlocks(to, from, writer->PA, registerize);
+	}
+	uint32_t getDepth(SCOPE_KIND kind, const BasicBlock* bb) const;
+	void renderTree(const BasicBlock* bb, const BasicBlock* next);
+	void renderBlock(const BasicBlock* bb, const BasicBlock* next);
+	void renderBranch(const BasicBlock* from, const BasicBlock* to, const BasicBlock* next);
+	void renderConditionalBranch(const BasicBlock* bb, const BasicBlock* next);
+	void renderSwitch(const BasicBlock* bb, const BasicBlock* next);
+public:
+	const BasicBlock* lastDepth0Block;
+	CheerpWasmStructurizer(CheerpWasmWriter* w, WasmBuffer& code, const Function& F,
+			const Registerize& registerize);
+	// Returns false if the control flow of the function is not supported
+	bool isSupported() const
+	{
+		return supported;
+	}
+	void render(const Function& F)
+	{
+		assert(supported);
+		renderTree(&F.getEntryBlock(), nullptr);
+		assert(scopes.empty());
+	}
+};
+
+CheerpWasmStructurizer::CheerpWasmStructurizer(CheerpWasmWriter* w, WasmBuffer& code,
+		const Function& F, const Registerize& registerize)
+	:
+		writer(w),
+		code(code),
+		registerize(registerize),
+		supported(false),
+		lastDepth0Block(nullptr)
+{
+	// Exceptions and unusual terminators are left to the Relooper
+	for (const BasicBlock& bb: F)
+	{
+		const TerminatorInst* term = bb.getTerminator();
+		if (bb.isLandingPad() || !(isa<BranchInst>(term) || isa<SwitchInst>(term) ||
+				isa<ReturnInst>(term) || isa<UnreachableInst>(term)))
+			return;
+	}
+
+	ReversePostOrderTraversal<const Function*> RPOT(&F);
+	for (const BasicBlock* bb: RPOT)
+		order.insert(std::make_pair(bb, order.size()));
+	DT.recalculate(const_cast<Function&>(F));
+
+	for (const BasicBlock* bb: RPOT)
+	{
+		for (const BasicBlock* succ: getUniqueSuccessors(bb))
+		{
+			if (!isBackEdge(bb, succ))
+				forwardPreds[succ]++;
+			else if (DT.dominates(succ, bb))
+				loopHeaders.insert(succ);
+			else
+			{
+				// The loop has more than one entry, the control flow
+				// is irreducible
+				return;
+			}
+		}
+	}
+	supported = true;
+}
+
+SmallVector<const BasicBlock*, 4> CheerpWasmStructurizer::getUniqueSuccessors(const BasicBlock* bb)
+{
+	SmallVector<const BasicBlock*, 4> succs;
+	const TerminatorInst* term = bb->getTerminator();
+	for (uint32_t i = 0; i < term->getNumSuccessors(); i++)
+	{
+		const BasicBlock* succ = term->getSuccessor(i);
+		if (std::find(succs.begin(), succs.end(), succ) == succs.end())
+			succs.push_back(succ);
+	}
+	return succs;
+}
+
+uint32_t CheerpWasmStructurizer::getDepth(SCOPE_KIND kind, const BasicBlock* bb) const
+{
+	for (uint32_t i = 0; i < scopes.size(); i++)
+	{
+		const Scope& scope = scopes[scopes.size() - i - 1];
+		if (scope.kind == kind && scope.bb == bb)
+			return i;
+	}
+	llvm_unreachable("branch target is not in scope");
+}
+
+// Render bb and all the blocks it dominates. The code is followed by the code of next,
+// branches to it can fall through
+void CheerpWasmStructurizer::renderTree(const BasicBlock* bb, const BasicBlock* next)
+{
+	// The children that are placed after the code of bb, in reverse post order
+	SmallVector<const BasicBlock*, 4> placedAfter;
+	for (const DomTreeNode* child: *getNode(bb))
+	{
+		if (isPlacedAfterBlock(child->getBlock()))
+			placedAfter.push_back(child->getBlock());
+	}
+	std::sort(placedAfter.begin(), placedAfter.end(), [this](const BasicBlock* a, const BasicBlock* b)
+	{
+		return order.lookup(a) < order.lookup(b);
+	});
+
+	bool isLoop = loopHeaders.count(bb);
+	if (isLoop)
+	{
+		writer->encodeU32Inst(0x03, "loop", 0x40, code);
+		scopes.push_back(Scope{LOOP_HEADED_BY, bb});
+	}
+	// The last child encloses the other ones, since they can branch to it
+	for (auto it = placedAfter.rbegin(); it != placedAfter.rend(); ++it)
+	{
+		writer->encodeU32Inst(0x02, "block", 0x40, code);
+		scopes.push_back(Scope{BLOCK_FOLLOWED_BY, *it});
+	}
+	renderBlock(bb, placedAfter.empty() ? next : placedAfter.front());
+	for (uint32_t i = 0; i < placedAfter.size(); i++)
+	{
+		scopes.pop_back();
+		writer->encodeInst(0x0b, "end", code);
+		renderTree(placedAfter[i], i + 1 < placedAfter.size() ? placedAfter[i + 1] : next);
+	}
+	if (isLoop)
+	{
+		scopes.pop_back();
+		writer->encodeInst(0x0b, "end", code);
+	}
+}
+
+void CheerpWasmStructurizer::renderBlock(const BasicBlock* bb, const BasicBlock* next)
+{
+	// Like in the Relooper, a return at depth 0 leaves the value on the stack
+	lastDepth0Block = scopes.empty() ? bb : nullptr;
+	writer->compileBB(code, *bb);
+
+	const TerminatorInst* term = bb->getTerminator();
+	SmallVector<const BasicBlock*, 4> succs = getUniqueSuccessors(bb);
+	if (isa<ReturnInst>(term))
+	{
+		if (!lastDepth0Block)
+			writer->encodeInst(0x0f, "return", code);
+	}
+	else if (succs.size() == 1)
+		renderBranch(bb, succs[0], next);
+	else if (isa<BranchInst>(term))
+		renderConditionalBranch(bb, next);
+	else if (isa<SwitchInst>(term))
+		renderSwitch(bb, next);
+}
+
+// Render the edge from -> to, as the last code of from
+void CheerpWasmStructurizer::renderBranch(const BasicBlock* from, const BasicBlock* to, const BasicBlock* next)
+{
+	if (hasPrologue(from, to))
+		writer->compilePHIOfBlockFromOtherBlock(code, to, from);
+	if (isBackEdge(from, to))
+		writer->encodeU32Inst(0x0c, "br", getDepth(LOOP_HEADED_BY, to), code);
+	else if (!isPlacedAfterBlock(to))
+		renderTree(to, next);
+	else if (to != next)
+		writer->encodeU32Inst(0x0c, "br", getDepth(BLOCK_FOLLOWED_BY, to), code);
+}
+
+void CheerpWasmStructurizer::renderConditionalBranch(const BasicBlock* bb, const BasicBlock* next)
+{
+	const BranchInst* bi = cast<BranchInst>(bb->getTerminator());
+	const BasicBlock* ifTrue = bi->getSuccessor(0);
+	const BasicBlock* ifFalse = bi->getSuccessor(1);
+	// A jump without prologue becomes a br_if, the other edge follows it
+	bool brIfTrue = isJump(bb, ifTrue) && !hasPrologue(bb, ifTrue);
+	bool brIfFalse = isJump(bb, ifFalse) && !hasPrologue(bb, ifFalse);
+	if (brIfTrue)
+	{
+		compileCondition(writer, code, bb, 0, NormalCondition);
+		writer->encodeU32Inst(0x0d, "br_if", getDepth(isBackEdge(bb, ifTrue) ? LOOP_HEADED_BY : BLOCK_FOLLOWED_BY, ifTrue), code);
+		renderBranch(bb, ifFalse, next);
+	}
+	else if (brIfFalse && ifFalse != next)
+	{
+		compileCondition(writer, code, bb, 0, InvertCondition);
+		writer->encodeU32Inst(0x0d, "br_if", getDepth(isBackEdge(bb, ifFalse) ? LOOP_HEADED_BY : BLOCK_FOLLOWED_BY, ifFalse), code);
+		renderBranch(bb, ifTrue, next);
+	}
+	else
+	{
+		compileCondition(writer, code, bb, 0, NormalCondition);
+		writer->encodeU32Inst(0x04, "if", 0x40, code);
+		scopes.push_back(Scope{IF_THEN_ELSE, nullptr});
+		renderBranch(bb, ifTrue, next);
+		// A jump to the next block is implicit
+		if (!brIfFalse)
+		{
+			writer->encodeInst(0x05, "else", code);
+			renderBranch(bb, ifFalse, next);
+		}
+		scopes.pop_back();
+		writer->encodeInst(0x0b, "end", code);
+	}
+}
+
+void CheerpWasmStructurizer::renderSwitch(const BasicBlock* bb, const BasicBlock* next)
+{
+	const SwitchInst* si = cast<SwitchInst>(bb->getTerminator());
+	const BasicBlock* defaultDest = si->getDefaultDest();
+	int64_t max = std::numeric_limits<int64_t>::min();
+	int64_t min = std::numeric_limits<int64_t>::max();
+	for (auto& c: si->cases())
+	{
+		int64_t curr = c.getCaseValue()->getSExtValue();
+		max = std::max(max, curr);
+		min = std::min(min, curr);
+	}
+	// Same limits used by the Relooper to render a switch with a br_table
+	bool useTable = si->getCondition()->getType()->getIntegerBitWidth() <= 32 &&
+		min >= std::numeric_limits<int32_t>::min() &&
+		max <= std::numeric_limits<int32_t>::max() &&
+		max - min <= 128 * 1024;
+
+	if (!useTable)
+	{
+		// Check the destinations one by one, the condition of each one
+		// covers all its cases
+		for (const BasicBlock* dest: getUniqueSuccessors(bb))
+		{
+			if (dest == defaultDest)
+				continue;
+			uint32_t branchId = 1;
+			while (si->getSuccessor(branchId) != dest)
+				branchId++;
+			compileCondition(writer, code, bb, branchId, NormalCondition);
+			if (!hasPrologue(bb, dest))
+			{
+				writer->encodeU32Inst(0x0d, "br_if", getDepth(isBackEdge(bb, dest) ? LOOP_HEADED_BY : BLOCK_FOLLOWED_BY, dest), code);
+				continue;
+			}
+			writer->encodeU32Inst(0x04, "if", 0x40, code);
+			scopes.push_back(Scope{IF_THEN_ELSE, nullptr});
+			renderBranch(bb, dest, nullptr);
+			scopes.pop_back();
+			writer->encodeInst(0x0b, "end", code);
+		}
+		renderBranch(bb, defaultDest, next);
+		return;
+	}
+
+	// The edges with a prologue go through a block of their own, placed right
+	// after the br_table
+	SmallVector<const BasicBlock*, 4> prologueDests;
+	for (const BasicBlock* dest: getUniqueSuccessors(bb))
+	{
+		if (hasPrologue(bb, dest))
+			prologueDests.push_back(dest);
+	}
+	for (auto it = prologueDests.rbegin(); it != prologueDests.rend(); ++it)
+	{
+		writer->encodeU32Inst(0x02, "block", 0x40, code);
+		scopes.push_back(Scope{PROLOGUE_OF, *it});
+	}
+	auto getTableDepth = [&](const BasicBlock* dest)
 	{
-		BlockType& block = blockTypes[blockTypes.size() - i - 1];
-
-		if (block.label == labelId)
-			break;
+		if (std::find(prologueDests.begin(), prologueDests.end(), dest) != prologueDests.end())
+			return getDepth(PROLOGUE_OF, dest);
+		return getDepth(isBackEdge(bb, dest) ? LOOP_HEADED_BY : BLOCK_FOLLOWED_BY, dest);
+	};
+	uint32_t defaultDepth = getTableDepth(defaultDest);
+	std::vector<uint32_t> table(max - min + 1, defaultDepth);
+	for (auto& c: si->cases())
+		table[c.getCaseValue()->getSExtValue() - min] = getTableDepth(c.getCaseSuccessor());
+	compileSwitchIndex(writer, code, si, min);
+	writer->encodeBranchTable(code, table, defaultDepth);
 
-		breakIndex += block.depth;
+	for (uint32_t i = 0; i < prologueDests.size(); i++)
+	{
+		scopes.pop_back();
+		writer->encodeInst(0x0b, "end", code);
+		renderBranch(bb, prologueDests[i], i + 1 == prologueDests.size() ? next : nullptr);
 	}
-	assert(i < blockTypes.size() && "cannot find labelId in block types");
-	breakIndex += 1;
-	writer->encodeU32Inst(0x0c, "br", breakIndex, code);
-}
-
-void CheerpWasmRenderInterface::renderLabel(int labelId)
-{
-	writer->encodeS32Inst(0x41, "i32.const", labelId, code);
-	writer->encodeU32Inst(0x21, "set_local", labelLocal, code);
-}
-
-void CheerpWasmRenderInterface::renderIfOnLabel(int labelId, bool first)
-{
-	// TODO: Use first to optimize dispatch
-	writer->encodeS32Inst(0x41, "i32.const", labelId, code);
-	writer->encodeU32Inst(0x20, "get_local", labelLocal, code);
-	writer->encodeInst(0x46, "i32.eq", code);
-	indent();
-	writer->encodeU32Inst(0x04, "if", 0x40, code);
-	blockTypes.emplace_back(IF, 1);
 }
 
 void CheerpWasmWriter::encodeInst(uint32_t opcode, const char* name, WasmBuffer& code)
@@ -904,7 +1300,10 @@ void CheerpWasmWriter::encodeBinOp(const llvm::Instruction& I, WasmBuffer& code)
 		case Instruction::Ty: \
 		{ \
 			assert(t->isIntegerTy() || t->isPointerTy()); \
-			encodeInst(i32, "i32."#name, code); \
+			if (t->isIntegerTy(64)) \
+				encodeInst(i64, "i64."#name, code); \
+			else \
+				encodeInst(i32, "i32."#name, code); \
 			return; \
 		}
 		BINOPI( Add,   add, 0x6a, 0x7c)
@@ -957,6 +1356,12 @@ void CheerpWasmWriter::encodeS32Inst(uint32_t opcode, const char* name, int32_t
 	internal::encodeS32Opcode(opcode, name, immediate, *this, code);
 }
 
+void CheerpWasmWriter::encodeS64Inst(uint32_t opcode, const char* name, int64_t immediate, WasmBuffer& code)
+{
+	encodeBufferedSetLocal(code);
+	internal::encodeS64Opcode(opcode, name, immediate, *this, code);
+}
+
 void CheerpWasmWriter::encodeU32Inst(uint32_t opcode, const char* name, uint32_t immediate, WasmBuffer& code)
 {
 	// It should not be possible to have two consecutive set_local's with
@@ -1024,11 +1429,22 @@ void CheerpWasmWriter::encodeU32U32Inst(uint32_t opcode, const char* name, uint3
 			case 0x2d: // "i32.load8_u"
 			case 0x2e: // "i32.load16_s"
 			case 0x2f: // "i32.load16_u"
+			case 0x29: // "i64.load"
+			case 0x30: // "i64.load8_s"
+			case 0x31: // "i64.load8_u"
+			case 0x32: // "i64.load16_s"
+			case 0x33: // "i64.load16_u"
+			case 0x34: // "i64.load32_s"
+			case 0x35: // "i64.load32_u"
 			case 0x36: // "i32.store"
+			case 0x37: // "i64.store"
 			case 0x38: // "f32.store"
 			case 0x39: // "f64.store"
 			case 0x3a: // "i32.store8"
 			case 0x3b: // "i32.store16"
+			case 0x3c: // "i64.store8"
+			case 0x3d: // "i64.store16"
+			case 0x3e: // "i64.store32"
 				code << name;
 				if (i2)
 					code << " offset=" << i2;
@@ -1045,24 +1461,27 @@ void CheerpWasmWriter::encodeU32U32Inst(uint32_t opcode, const char* name, uint3
 
 void CheerpWasmWriter::encodePredicate(const llvm::Type* ty, const llvm::CmpInst::Predicate predicate, WasmBuffer& code)
 {
-	// TODO add i64 support.
 	assert(ty->isIntegerTy() || ty->isPointerTy());
+	bool is64 = ty->isIntegerTy(64);
 	switch(predicate)
 	{
-#define PREDICATE(Ty, name, opcode) \
+#define PREDICATE(Ty, name, i32, i64) \
 		case CmpInst::ICMP_##Ty: \
-			encodeInst(opcode, "i32."#name, code); \
+			if (is64) \
+				encodeInst(i64, "i64."#name, code); \
+			else \
+				encodeInst(i32, "i32."#name, code); \
 			break;
-		PREDICATE( EQ,   eq, 0x46);
-		PREDICATE( NE,   ne, 0x47);
-		PREDICATE(SLT, lt_s, 0x48);
-		PREDICATE(ULT, lt_u, 0x49);
-		PREDICATE(SGT, gt_s, 0x4a);
-		PREDICATE(UGT, gt_u, 0x4b);
-		PREDICATE(SLE, le_s, 0x4c);
-		PREDICATE(ULE, le_u, 0x4d);
-		PREDICATE(SGE, ge_s, 0x4e);
-		PREDICATE(UGE, ge_u, 0x4f);
+		PREDICATE( EQ,   eq, 0x46, 0x51);
+		PREDICATE( NE,   ne, 0x47, 0x52);
+		PREDICATE(SLT, lt_s, 0x48, 0x53);
+		PREDICATE(ULT, lt_u, 0x49, 0x54);
+		PREDICATE(SGT, gt_s, 0x4a, 0x55);
+		PREDICATE(UGT, gt_u, 0x4b, 0x56);
+		PREDICATE(SLE, le_s, 0x4c, 0x57);
+		PREDICATE(ULE, le_u, 0x4d, 0x58);
+		PREDICATE(SGE, ge_s, 0x4e, 0x59);
+		PREDICATE(UGE, ge_u, 0x4f, 0x5a);
 #undef PREDICATE
 		default:
 			llvm::errs() << "Handle predicate " << predicate << "\n";
@@ -1079,7 +1498,6 @@ void CheerpWasmWriter::encodeLoad(const llvm::Type* ty, uint32_t offset,
 		if(bitWidth == 1)
 			bitWidth = 8;
 
-		// TODO add support for i64.
 		switch (bitWidth)
 		{
 			// Currently assume unsigned, like Cheerp. We may optimize
@@ -1093,6 +1511,9 @@ void CheerpWasmWriter::encodeLoad(const llvm::Type* ty, uint32_t offset,
 			case 32:
 				encodeU32U32Inst(0x28, "i32.load", 0x2, offset, code);
 				break;
+			case 64:
+				encodeU32U32Inst(0x29, "i64.load", 0x3, offset, code);
+				break;
 			default:
 				llvm::errs() << "bit width: " << bitWidth << '\n';
 				llvm_unreachable("unknown integer bit width");
@@ -1107,6 +1528,105 @@ void CheerpWasmWriter::encodeLoad(const llvm::Type* ty, uint32_t offset,
 	}
 }
 
+bool CheerpWasmWriter::compileInlineMemIntrinsic(WasmBuffer& code, const MemIntrinsic& MI)
+{
+	// Unaligned accesses are valid in wasm, so always use the widest ones
+	SmallVector<uint32_t, MaxInlineMemIntrinsicAccesses> widths;
+	if (!getInlineMemIntrinsicAccesses(MI, 8, /*allowUnaligned*/true, widths))
+		return false;
+
+	uint32_t align = std::max(MI.getAlignment(), 1u);
+	const MemSetInst* MS = dyn_cast<MemSetInst>(&MI);
+	uint32_t offset = 0;
+	for (uint32_t width : widths)
+	{
+		// The alignment immediate is the log2 of the alignment
+		uint32_t alignLog2 = Log2_32(std::min(width, align));
+		uint32_t destOffset = compileLoadStorePointer(code, MI.getRawDest()) + offset;
+		if (MS)
+		{
+			uint64_t pattern = getMemsetPattern(*MS, width);
+			if (width == 8)
+				encodeS64Inst(0x42, "i64.const", pattern, code);
+			else
+				encodeS32Inst(0x41, "i32.const", (int32_t)pattern, code);
+		}
+		else
+		{
+			uint32_t srcOffset = compileLoadStorePointer(code, cast<MemTransferInst>(MI).getRawSource()) + offset;
+			switch (width)
+			{
+				case 1:
+					encodeU32U32Inst(0x2d, "i32.load8_u", alignLog2, srcOffset, code);
+					break;
+				case 2:
+					encodeU32U32Inst(0x2f, "i32.load16_u", alignLog2, srcOffset, code);
+					break;
+				case 4:
+					encodeU32U32Inst(0x28, "i32.load", alignLog2, srcOffset, code);
+					break;
+				case 8:
+					encodeU32U32Inst(0x29, "i64.load", alignLog2, srcOffset, code);
+					break;
+			}
+		}
+		switch (width)
+		{
+			case 1:
+				encodeU32U32Inst(0x3a, "i32.store8", alignLog2, destOffset, code);
+				break;
+			case 2:
+				encodeU32U32Inst(0x3b, "i32.store16", alignLog2, destOffset, code);
+				break;
+			case 4:
+				encodeU32U32Inst(0x36, "i32.store", alignLog2, destOffset, code);
+				break;
+			case 8:
+				encodeU32U32Inst(0x37, "i64.store", alignLog2, destOffset, code);
+				break;
+		}
+		offset += width;
+	}
+	return true;
+}
+
+bool CheerpWasmWriter::compileExtendingLoad(WasmBuffer& code, const Instruction& ext)
+{
+	const LoadInst* li = dyn_cast<LoadInst>(ext.getOperand(0));
+	if (!li || !isInlineable(*li, PA))
+		return false;
+	uint32_t bitWidth = li->getType()->getIntegerBitWidth();
+	bool is64 = ext.getType()->isIntegerTy(64);
+	// i1 values are not sign extended by narrow loads
+	if (bitWidth != 8 && bitWidth != 16 && !(bitWidth == 32 && is64))
+		return false;
+
+	bool isSigned = isa<SExtInst>(ext);
+	uint32_t offset = compileLoadStorePointer(code, li->getPointerOperand());
+#define EXTENDING_LOAD(width, align, i32s, i32u, i64s, i64u) \
+	case width: \
+		if (is64 && isSigned) \
+			encodeU32U32Inst(i64s, "i64.load" #width "_s", align, offset, code); \
+		else if (is64) \
+			encodeU32U32Inst(i64u, "i64.load" #width "_u", align, offset, code); \
+		else if (isSigned) \
+			encodeU32U32Inst(i32s, "i32.load" #width "_s", align, offset, code); \
+		else \
+			encodeU32U32Inst(i32u, "i32.load" #width "_u", align, offset, code); \
+		break;
+	switch (bitWidth)
+	{
+		EXTENDING_LOAD( 8, 0x0, 0x2c, 0x2d, 0x30, 0x31);
+		EXTENDING_LOAD(16, 0x1, 0x2e, 0x2f, 0x32, 0x33);
+		EXTENDING_LOAD(32, 0x2, 0x00, 0x00, 0x34, 0x35);
+		default:
+			llvm::errs() << "bit width: " << bitWidth << '\n';
+			llvm_unreachable("unknown integer bit width");
+	}
+#undef EXTENDING_LOAD
+	return true;
+}
+
 void CheerpWasmWriter::encodeWasmIntrinsic(WasmBuffer& code, const llvm::Function* F)
 {
 	if (false) {}
@@ -1115,6 +1635,15 @@ void CheerpWasmWriter::encodeWasmIntrinsic(WasmBuffer& code, const llvm::Functio
 		encodeInst(opcode, name, code);
 WASM_INTRINSIC_LIST(WASM_INTRINSIC)
 #undef WASM_INTRINSIC
+#define WASM_MEMORY_INTRINSIC(name, opcode, symbol) \
+	else if (F->getName() == symbol) \
+	{ \
+		encodeInst(opcode, name, code); \
+		if (cheerpMode == CHEERP_MODE_WASM) \
+			code.writeByte(0x00); \
+	}
+WASM_MEMORY_INTRINSIC_LIST(WASM_MEMORY_INTRINSIC)
+#undef WASM_MEMORY_INTRINSIC
 }
 
 bool CheerpWasmWriter::needsPointerKindConversion(const Instruction* phi, const Value* incoming)
@@ -1175,7 +1704,9 @@ void CheerpWasmWriter::compilePHIOfBlockFromOtherBlock(WasmBuffer& code, const B
 
 const char* CheerpWasmWriter::getTypeString(const Type* t)
 {
-	if(t->isIntegerTy() || t->isPointerTy())
+	if(t->isIntegerTy(64))
+		return "i64";
+	else if(t->isIntegerTy() || t->isPointerTy())
 		return "i32";
 	else if(t->isFloatTy())
 		return "f32";
@@ -1189,6 +1720,44 @@ const char* CheerpWasmWriter::getTypeString(const Type* t)
 	}
 }
 
+uint32_t CheerpWasmWriter::compileLoadStorePointer(WasmBuffer& code, const Value* ptrOp)
+{
+	// Inlined bitcasts produce no code, look through them to find a GEP
+	while (isBitCast(ptrOp))
+	{
+		const Instruction* I = dyn_cast<Instruction>(ptrOp);
+		if (I && !isInlineable(*I, PA))
+			break;
+		ptrOp = cast<User>(ptrOp)->getOperand(0);
+	}
+	if (!isGEP(ptrOp))
+	{
+		compileOperand(code, ptrOp);
+		return 0;
+	}
+	const auto O = dyn_cast<Instruction>(ptrOp);
+	if (O && !isInlineable(*O, PA))
+	{
+		uint32_t reg = registerize.getRegisterId(O);
+		uint32_t local = localMap.at(reg);
+		encodeU32Inst(0x20, "get_local", local, code);
+		return 0;
+	}
+	WasmGepWriter gepWriter(*this, code);
+	auto p = linearHelper.compileGEP(ptrOp, &gepWriter);
+	compileOperand(code, p);
+	if(!gepWriter.first)
+		encodeInst(0x6a, "i32.add", code);
+	// The immediate offset of loads and stores is an unsigned 32-bit
+	// integer. Negative immediate offsets are not supported.
+	if (gepWriter.constPart < 0) {
+		encodeS32Inst(0x41, "i32.const", gepWriter.constPart, code);
+		encodeInst(0x6a, "i32.add", code);
+		return 0;
+	}
+	return gepWriter.constPart;
+}
+
 void CheerpWasmWriter::compileGEP(WasmBuffer& code, const llvm::User* gep_inst, bool standalone)
 {
 	const auto I = dyn_cast<Instruction>(gep_inst);
@@ -1232,6 +1801,12 @@ void CheerpWasmWriter::encodeBranchTable(WasmBuffer& code, std::vector<uint32_t>
 
 void CheerpWasmWriter::compileSignedInteger(WasmBuffer& code, const llvm::Value* v, bool forComparison)
 {
+	// i64 values always use all the bits of their locals
+	if(v->getType()->isIntegerTy(64))
+	{
+		compileOperand(code, v);
+		return;
+	}
 	uint32_t shiftAmount = 32-v->getType()->getIntegerBitWidth();
 	if(const ConstantInt* C = dyn_cast<ConstantInt>(v))
 	{
@@ -1264,6 +1839,11 @@ void CheerpWasmWriter::compileSignedInteger(WasmBuffer& code, const llvm::Value*
 
 void CheerpWasmWriter::compileUnsignedInteger(WasmBuffer& code, const llvm::Value* v)
 {
+	if(v->getType()->isIntegerTy(64))
+	{
+		compileOperand(code, v);
+		return;
+	}
 	if(const ConstantInt* C = dyn_cast<ConstantInt>(v))
 	{
 		encodeS32Inst(0x41, "i32.const", C->getZExtValue(), code);
@@ -1298,6 +1878,8 @@ void CheerpWasmWriter::compileConstantExpr(WasmBuffer& code, const ConstantExpr*
 		case Instruction::IntToPtr:
 		{
 			compileOperand(code, ce->getOperand(0));
+			if (ce->getOperand(0)->getType()->isIntegerTy(64))
+				encodeInst(0xa7, "i32.wrap/i64", code);
 			break;
 		}
 		case Instruction::ICmp:
@@ -1311,6 +1893,8 @@ void CheerpWasmWriter::compileConstantExpr(WasmBuffer& code, const ConstantExpr*
 		case Instruction::PtrToInt:
 		{
 			compileOperand(code, ce->getOperand(0));
+			if (ce->getType()->isIntegerTy(64))
+				encodeInst(0xad, "i64.extend_u/i32", code);
 			break;
 		}
 		default:
@@ -1335,12 +1919,11 @@ bool CheerpWasmWriter::tryEncodeFloatAsInt(WasmBuffer& code, const ConstantFP* f
 
 	// Check that the integer bytes plus conversion byte is smaller than the
 	// original float/double in bytes.
-	std::stringstream tmp;
-	internal::encodeSLEB128(value, tmp);
-	if (f->getType()->isDoubleTy() && tmp.str().size() + 1 >= 8)
+	unsigned intSize = getSLEB128Size(value);
+	if (f->getType()->isDoubleTy() && intSize + 1 >= 8)
 		return false;
 
-	if (f->getType()->isFloatTy() && tmp.str().size() + 1 >= 4)
+	if (f->getType()->isFloatTy() && intSize + 1 >= 4)
 		return false;
 
 	// Verify that the value fits in the i32 range.
@@ -1386,11 +1969,9 @@ void CheerpWasmWriter::compileConstant(WasmBuffer& code, const Constant* c)
 	else if(const ConstantInt* i=dyn_cast<ConstantInt>(c))
 	{
 		assert(i->getType()->isIntegerTy() && i->getBitWidth() <= 64);
-		if (i->getBitWidth() == 64) {
-			assert(i->getSExtValue() <= INT32_MAX);
-			assert(i->getSExtValue() >= INT32_MIN);
-			encodeS32Inst(0x41, "i32.const", i->getSExtValue(), code);
-		} else if (i->getBitWidth() == 32)
+		if (i->getBitWidth() == 64)
+			encodeS64Inst(0x42, "i64.const", i->getSExtValue(), code);
+		else if (i->getBitWidth() == 32)
 			encodeS32Inst(0x41, "i32.const", i->getSExtValue(), code);
 		else
 			encodeS32Inst(0x41, "i32.const", i->getZExtValue(), code);
@@ -1643,8 +2224,24 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 		}
 		case Instruction::BitCast:
 		{
-			assert(I.getType()->isPointerTy());
 			compileOperand(code, I.getOperand(0));
+			const Type* srcTy = I.getOperand(0)->getType();
+			const Type* dstTy = I.getType();
+			if (dstTy->isPointerTy())
+				break;
+			if (dstTy->isIntegerTy(64) && srcTy->isDoubleTy())
+				encodeInst(0xbd, "i64.reinterpret/f64", code);
+			else if (dstTy->isDoubleTy() && srcTy->isIntegerTy(64))
+				encodeInst(0xbf, "f64.reinterpret/i64", code);
+			else if (dstTy->isIntegerTy(32) && srcTy->isFloatTy())
+				encodeInst(0xbc, "i32.reinterpret/f32", code);
+			else if (dstTy->isFloatTy() && srcTy->isIntegerTy(32))
+				encodeInst(0xbe, "f32.reinterpret/i32", code);
+			else
+			{
+				I.dump();
+				llvm_unreachable("unsupported bitcast");
+			}
 			break;
 		}
 		case Instruction::Br:
@@ -1746,7 +2343,10 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 					case Intrinsic::ctlz:
 					{
 						compileOperand(code, ci.getOperand(0));
-						encodeInst(0x67, "i32.clz", code);
+						if (ci.getType()->isIntegerTy(64))
+							encodeInst(0x79, "i64.clz", code);
+						else
+							encodeInst(0x67, "i32.clz", code);
 						return false;
 					}
 					case Intrinsic::invariant_start:
@@ -1765,9 +2365,13 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 					}
 					case Intrinsic::memmove:
 					{
+						if (compileInlineMemIntrinsic(code, cast<MemIntrinsic>(ci)))
+							return true;
 						compileOperand(code, ci.op_begin()->get());
 						compileOperand(code, (ci.op_begin() + 1)->get());
 						compileOperand(code, (ci.op_begin() + 2)->get());
+						if ((ci.op_begin() + 2)->get()->getType()->isIntegerTy(64))
+							encodeInst(0xa7, "i32.wrap/i64", code);
 						llvm::Function* f = module.getFunction("memmove");
 						uint32_t functionId = linearHelper.getFunctionIds().at(f);
 						encodeU32Inst(0x10, "call", functionId, code);
@@ -1776,9 +2380,13 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 					}
 					case Intrinsic::memcpy:
 					{
+						if (compileInlineMemIntrinsic(code, cast<MemIntrinsic>(ci)))
+							return true;
 						compileOperand(code, ci.op_begin()->get());
 						compileOperand(code, (ci.op_begin() + 1)->get());
 						compileOperand(code, (ci.op_begin() + 2)->get());
+						if ((ci.op_begin() + 2)->get()->getType()->isIntegerTy(64))
+							encodeInst(0xa7, "i32.wrap/i64", code);
 						llvm::Function* f = module.getFunction("memcpy");
 						uint32_t functionId = linearHelper.getFunctionIds().at(f);
 						encodeU32Inst(0x10, "call", functionId, code);
@@ -1787,9 +2395,13 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 					}
 					case Intrinsic::memset:
 					{
+						if (compileInlineMemIntrinsic(code, cast<MemIntrinsic>(ci)))
+							return true;
 						compileOperand(code, ci.op_begin()->get());
 						compileOperand(code, (ci.op_begin() + 1)->get());
 						compileOperand(code, (ci.op_begin() + 2)->get());
+						if ((ci.op_begin() + 2)->get()->getType()->isIntegerTy(64))
+							encodeInst(0xa7, "i32.wrap/i64", code);
 						llvm::Function* f = module.getFunction("memset");
 						uint32_t functionId = linearHelper.getFunctionIds().at(f);
 						encodeU32Inst(0x10, "call", functionId, code);
@@ -1829,10 +2441,14 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 				}
 			}
 
+			bool legalizeImport = isLegalizedImport(calledFunc);
+
 			for (auto op = ci.op_begin();
 					op != ci.op_begin() + fTy->getNumParams(); ++op)
 			{
 				compileOperand(code, op->get());
+				if (legalizeImport && op->get()->getType()->isIntegerTy(64))
+					encodeInst(0xb9, "f64.convert_s/i64", code);
 			}
 
 			if (calledFunc)
@@ -1879,6 +2495,11 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 
 			if(ci.getType()->isVoidTy())
 				return true;
+			if (legalizeImport && ci.getType()->isIntegerTy(64))
+			{
+				encodeU32Inst(0x21, "set_local", legalizedResultLocal, code);
+				encodeSaturatingF64ToI64(code, legalizedResultLocal);
+			}
 			break;
 		}
 		case Instruction::FCmp:
@@ -2004,32 +2625,8 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 		{
 			const LoadInst& li = cast<LoadInst>(I);
 			const Value* ptrOp=li.getPointerOperand();
-			uint32_t offset = 0;
 			// 1) The pointer
-			if (isGEP(ptrOp)) {
-				const auto O = dyn_cast<Instruction>(ptrOp);
-				if (O && !isInlineable(*O, PA)) {
-					uint32_t reg = registerize.getRegisterId(O);
-					uint32_t local = localMap.at(reg);
-					encodeU32Inst(0x20, "get_local", local, code);
-				} else {
-					WasmGepWriter gepWriter(*this, code);
-					auto p = linearHelper.compileGEP(ptrOp, &gepWriter);
-					compileOperand(code, p);
-					if(!gepWriter.first)
-						encodeInst(0x6a, "i32.add", code);
-					// The immediate offset of a load instruction is an unsigned
-					// 32-bit integer. Negative immediate offsets are not supported.
-					if (gepWriter.constPart < 0) {
-						encodeS32Inst(0x41, "i32.const", gepWriter.constPart, code);
-						encodeInst(0x6a, "i32.add", code);
-					} else {
-						offset = gepWriter.constPart;
-					}
-				}
-			} else {
-				compileOperand(code, ptrOp);
-			}
+			uint32_t offset = compileLoadStorePointer(code, ptrOp);
 			// 2) Load
 			encodeLoad(li.getType(), offset, code);
 			break;
@@ -2037,6 +2634,8 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 		case Instruction::PtrToInt:
 		{
 			compileOperand(code, I.getOperand(0));
+			if (I.getType()->isIntegerTy(64))
+				encodeInst(0xad, "i64.extend_u/i32", code);
 			break;
 		}
 		case Instruction::Store:
@@ -2044,34 +2643,18 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 			const StoreInst& si = cast<StoreInst>(I);
 			const Value* ptrOp=si.getPointerOperand();
 			const Value* valOp=si.getValueOperand();
-			uint32_t offset = 0;
 			// 1) The pointer
-			if (isGEP(ptrOp)) {
-				const auto O = dyn_cast<Instruction>(ptrOp);
-				if (O && !isInlineable(*O, PA)) {
-					uint32_t reg = registerize.getRegisterId(O);
-					uint32_t local = localMap.at(reg);
-					encodeU32Inst(0x20, "get_local", local, code);
-				} else {
-					WasmGepWriter gepWriter(*this, code);
-					auto p = linearHelper.compileGEP(ptrOp, &gepWriter);
-					compileOperand(code, p);
-					if(!gepWriter.first)
-						encodeInst(0x6a, "i32.add", code);
-					// The immediate offset of a store instruction is an unsigned
-					// 32-bit integer. Negative immediate offsets are not supported.
-					if (gepWriter.constPart < 0) {
-						encodeS32Inst(0x41, "i32.const", gepWriter.constPart, code);
-						encodeInst(0x6a, "i32.add", code);
-					} else {
-						offset = gepWriter.constPart;
-					}
-				}
-			} else {
-				compileOperand(code, ptrOp);
-			}
+			uint32_t offset = compileLoadStorePointer(code, ptrOp);
 			// 2) The value
-			compileOperand(code, valOp);
+			// Narrow stores ignore the upper bits of the value, so an inlined
+			// truncation to 8, 16 or 32 bits is folded into the store
+			const Value* storedOp = valOp;
+			if (const TruncInst* ti = dyn_cast<TruncInst>(valOp))
+			{
+				if (isInlineable(*ti, PA) && !ti->getType()->isIntegerTy(1))
+					storedOp = ti->getOperand(0);
+			}
+			compileOperand(code, storedOp);
 			// 3) Store
 			// When storing values with size less than 32-bit we need to truncate them
 			if(valOp->getType()->isIntegerTy())
@@ -2079,18 +2662,30 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 				uint32_t bitWidth = valOp->getType()->getIntegerBitWidth();
 				if(bitWidth == 1)
 					bitWidth = 8;
+				bool from64 = storedOp->getType()->isIntegerTy(64);
 
-				// TODO add support for i64.
 				switch (bitWidth)
 				{
 					case 8:
-						encodeU32U32Inst(0x3a, "i32.store8", 0x0, offset, code);
+						if (from64)
+							encodeU32U32Inst(0x3c, "i64.store8", 0x0, offset, code);
+						else
+							encodeU32U32Inst(0x3a, "i32.store8", 0x0, offset, code);
 						break;
 					case 16:
-						encodeU32U32Inst(0x3b, "i32.store16", 0x1, offset, code);
+						if (from64)
+							encodeU32U32Inst(0x3d, "i64.store16", 0x1, offset, code);
+						else
+							encodeU32U32Inst(0x3b, "i32.store16", 0x1, offset, code);
 						break;
 					case 32:
-						encodeU32U32Inst(0x36, "i32.store", 0x2, offset, code);
+						if (from64)
+							encodeU32U32Inst(0x3e, "i64.store32", 0x2, offset, code);
+						else
+							encodeU32U32Inst(0x36, "i32.store", 0x2, offset, code);
+						break;
+					case 64:
+						encodeU32U32Inst(0x37, "i64.store", 0x3, offset, code);
 						break;
 					default:
 						llvm::errs() << "bit width: " << bitWidth << '\n';
@@ -2112,6 +2707,12 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 		{
 			uint32_t bitWidth = I.getType()->getIntegerBitWidth();
 			compileOperand(code, I.getOperand(0));
+			if (I.getOperand(0)->getType()->isIntegerTy(64))
+			{
+				encodeInst(0xa7, "i32.wrap/i64", code);
+				if (bitWidth == 32)
+					break;
+			}
 			encodeS32Inst(0x41, "i32.const", getMaskForBitWidth(bitWidth), code);
 			encodeInst(0x71, "i32.and", code);
 			break;
@@ -2136,6 +2737,14 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 		}
 		case Instruction::SExt:
 		{
+			if (compileExtendingLoad(code, I))
+				break;
+			if (I.getType()->isIntegerTy(64))
+			{
+				compileSignedInteger(code, I.getOperand(0), /*forComparison*/ false);
+				encodeInst(0xac, "i64.extend_s/i32", code);
+				break;
+			}
 			uint32_t bitWidth = I.getOperand(0)->getType()->getIntegerBitWidth();
 			compileOperand(code, I.getOperand(0));
 			encodeS32Inst(0x41, "i32.const", 32-bitWidth, code);
@@ -2146,9 +2755,16 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 		}
 		case Instruction::FPToSI:
 		{
-			// TODO: add support for i64.
 			compileOperand(code, I.getOperand(0));
-			if (I.getOperand(0)->getType()->isFloatTy())
+			bool fromFloat = I.getOperand(0)->getType()->isFloatTy();
+			if (I.getType()->isIntegerTy(64))
+			{
+				if (fromFloat)
+					encodeInst(0xae, "i64.trunc_s/f32", code);
+				else
+					encodeInst(0xb0, "i64.trunc_s/f64", code);
+			}
+			else if (fromFloat)
 				encodeInst(0xa8, "i32.trunc_s/f32", code);
 			else
 				encodeInst(0xaa, "i32.trunc_s/f64", code);
@@ -2156,9 +2772,16 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 		}
 		case Instruction::FPToUI:
 		{
-			// TODO: add support for i64.
 			compileOperand(code, I.getOperand(0));
-			if (I.getOperand(0)->getType()->isFloatTy())
+			bool fromFloat = I.getOperand(0)->getType()->isFloatTy();
+			if (I.getType()->isIntegerTy(64))
+			{
+				if (fromFloat)
+					encodeInst(0xaf, "i64.trunc_u/f32", code);
+				else
+					encodeInst(0xb1, "i64.trunc_u/f64", code);
+			}
+			else if (fromFloat)
 				encodeInst(0xa9, "i32.trunc_u/f32", code);
 			else
 				encodeInst(0xab, "i32.trunc_u/f64", code);
@@ -2169,6 +2792,14 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 			assert(I.getOperand(0)->getType()->isIntegerTy());
 			compileOperand(code, I.getOperand(0));
 			uint32_t bitWidth = I.getOperand(0)->getType()->getIntegerBitWidth();
+			if (bitWidth == 64)
+			{
+				if (I.getType()->isDoubleTy())
+					encodeInst(0xb9, "f64.convert_s/i64", code);
+				else
+					encodeInst(0xb4, "f32.convert_s/i64", code);
+				break;
+			}
 			if(bitWidth != 32)
 			{
 				// Sign extend
@@ -2177,7 +2808,6 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 				encodeS32Inst(0x41, "i32.const", 32-bitWidth, code);
 				encodeInst(0x75, "i32.shr_s", code);
 			}
-			// TODO: add support for i64.
 			if (I.getType()->isDoubleTy()) {
 				encodeInst(0xb7, "f64.convert_s/i32", code);
 			} else {
@@ -2191,12 +2821,19 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 			assert(I.getOperand(0)->getType()->isIntegerTy());
 			compileOperand(code, I.getOperand(0));
 			uint32_t bitWidth = I.getOperand(0)->getType()->getIntegerBitWidth();
+			if (bitWidth == 64)
+			{
+				if (I.getType()->isDoubleTy())
+					encodeInst(0xba, "f64.convert_u/i64", code);
+				else
+					encodeInst(0xb5, "f32.convert_u/i64", code);
+				break;
+			}
 			if(bitWidth != 32)
 			{
 				encodeS32Inst(0x41, "i32.const", getMaskForBitWidth(bitWidth), code);
 				encodeInst(0x71, "i32.and", code);
 			}
-			// TODO: add support for i64.
 			if (I.getType()->isDoubleTy()) {
 				encodeInst(0xb8, "f64.convert_u/i32", code);
 			} else {
@@ -2223,6 +2860,14 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 		}
 		case Instruction::ZExt:
 		{
+			if (compileExtendingLoad(code, I))
+				break;
+			if (I.getType()->isIntegerTy(64))
+			{
+				compileUnsignedInteger(code, I.getOperand(0));
+				encodeInst(0xad, "i64.extend_u/i32", code);
+				break;
+			}
 			uint32_t bitWidth = I.getOperand(0)->getType()->getIntegerBitWidth();
 			compileOperand(code, I.getOperand(0));
 			encodeS32Inst(0x41, "i32.const", getMaskForBitWidth(bitWidth), code);
@@ -2232,6 +2877,8 @@ bool CheerpWasmWriter::compileInlineInstruction(WasmBuffer& code, const Instruct
 		case Instruction::IntToPtr:
 		{
 			compileOperand(code, I.getOperand(0));
+			if (I.getOperand(0)->getType()->isIntegerTy(64))
+				encodeInst(0xa7, "i32.wrap/i64", code);
 			break;
 		}
 		case Instruction::Unreachable:
@@ -2305,6 +2952,7 @@ void CheerpWasmWriter::compileMethodLocals(WasmBuffer& code, const vector<int>&
 		uint32_t groups = (uint32_t) locals.at(Registerize::INTEGER) > 0;
 		groups += (uint32_t) locals.at(Registerize::DOUBLE) > 0;
 		groups += (uint32_t) locals.at(Registerize::FLOAT) > 0;
+		groups += (uint32_t) locals.at(Registerize::INTEGER64) > 0;
 
 		// Local declarations are compressed into a vector whose entries
 		// consist of:
@@ -2329,6 +2977,11 @@ void CheerpWasmWriter::compileMethodLocals(WasmBuffer& code, const vector<int>&
 			internal::encodeULEB128(locals.at(Registerize::FLOAT), code);
 			internal::encodeRegisterKind(Registerize::FLOAT, code);
 		}
+
+		if (locals.at(Registerize::INTEGER64)) {
+			internal::encodeULEB128(locals.at(Registerize::INTEGER64), code);
+			internal::encodeRegisterKind(Registerize::INTEGER64, code);
+		}
 	} else {
 		code << "(local";
 
@@ -2347,6 +3000,11 @@ void CheerpWasmWriter::compileMethodLocals(WasmBuffer& code, const vector<int>&
 				code << " f32";
 		}
 
+		if (locals.at(Registerize::INTEGER64)) {
+			for (int i = 0; i < locals.at(Registerize::INTEGER64); i++)
+				code << " i64";
+		}
+
 		code << ")\n";
 	}
 }
@@ -2393,6 +3051,22 @@ void CheerpWasmWriter::compileMethodResult(WasmBuffer& code, const Type* ty)
 }
 
 void CheerpWasmWriter::compileMethod(WasmBuffer& code, const Function& F)
+{
+	if (cheerpMode != CHEERP_MODE_WASM || !peephole)
+	{
+		compileMethodBody(code, F);
+		return;
+	}
+
+	WasmBuffer body;
+	compileMethodBody(body, F);
+	WasmPeephole::Signature sig = { (uint32_t)F.arg_size(), !F.getReturnType()->isVoidTy() };
+	// Keep the body as it is if it can't be optimized
+	if (!peephole->optimize(body.str(), sig, code))
+		code.writeBytes(body.data(), body.size());
+}
+
+void CheerpWasmWriter::compileMethodBody(WasmBuffer& code, const Function& F)
 {
 	assert(!F.empty());
 	currentFun = &F;
@@ -2414,18 +3088,25 @@ void CheerpWasmWriter::compileMethod(WasmBuffer& code, const Function& F)
 	uint32_t numArgs = F.arg_size();
 	const llvm::BasicBlock* lastDepth0Block = nullptr;
 
-	Relooper* rl = nullptr;
+	std::unique_ptr<CheerpWasmStructurizer> structurizer;
+	std::unique_ptr<Relooper> rl;
 	bool needsLabel = false;
 
 	if (F.size() != 1) {
-		rl = CheerpWriter::runRelooperOnFunction(F, PA, registerize);
-		needsLabel = rl->needsLabel();
+		if (useStructurizer)
+			structurizer.reset(new CheerpWasmStructurizer(this, code, F, registerize));
+		// The Relooper handles the irreducible control flow
+		if (!structurizer || !structurizer->isSupported()) {
+			structurizer.reset();
+			rl.reset(CheerpWriter::runRelooperOnFunction(F, PA, registerize));
+			needsLabel = rl->needsLabel();
+		}
 	}
 
 	const std::vector<Registerize::RegisterInfo>& regsInfo = registerize.getRegistersForFunction(&F);
 	uint32_t localCount = regsInfo.size() + (int)needsLabel;
 
-	vector<int> locals(4, 0);
+	vector<int> locals(Registerize::REGISTER_KIND_COUNT, 0);
 	localMap.assign(localCount, 0);
 	uint32_t reg = 0;
 
@@ -2446,6 +3127,25 @@ void CheerpWasmWriter::compileMethod(WasmBuffer& code, const Function& F)
 		locals.at((int)Registerize::INTEGER)++;
 	}
 
+	// The results of JS imports returning i64 values go through an extra f64
+	// local, since the conversion reads them more than once
+	bool needsLegalizedResult = false;
+	for (const BasicBlock& BB : F)
+	{
+		for (const Instruction& I : BB)
+		{
+			const CallInst* ci = dyn_cast<CallInst>(&I);
+			if (ci && ci->getType()->isIntegerTy(64) && isLegalizedImport(ci->getCalledFunction()))
+				needsLegalizedResult = true;
+		}
+	}
+	if (needsLegalizedResult) {
+		// DOUBLE locals come right after the INTEGER ones
+		legalizedResultLocal = numArgs + locals.at((int)Registerize::INTEGER) +
+			locals.at((int)Registerize::DOUBLE);
+		locals.at((int)Registerize::DOUBLE)++;
+	}
+
 	// Add offset of other local groups to local lookup table.  Since INTEGER
 	// is the first group, the local for label does not require an offset.
 	reg = 0;
@@ -2462,6 +3162,11 @@ void CheerpWasmWriter::compileMethod(WasmBuffer& code, const Function& F)
 				offset += locals.at((int)Registerize::INTEGER);
 				offset += locals.at((int)Registerize::DOUBLE);
 				break;
+			case Registerize::INTEGER64:
+				offset += locals.at((int)Registerize::INTEGER);
+				offset += locals.at((int)Registerize::DOUBLE);
+				offset += locals.at((int)Registerize::FLOAT);
+				break;
 			case Registerize::OBJECT:
 				assert(false);
 				break;
@@ -2476,6 +3181,11 @@ void CheerpWasmWriter::compileMethod(WasmBuffer& code, const Function& F)
 		compileBB(code, *F.begin());
 		lastDepth0Block = &(*F.begin());
 	}
+	else if (structurizer)
+	{
+		structurizer->render(F);
+		lastDepth0Block = structurizer->lastDepth0Block;
+	}
 	else
 	{
 		const std::vector<Registerize::RegisterInfo>& regsInfo = registerize.getRegistersForFunction(&F);
@@ -2564,35 +3274,35 @@ void CheerpWasmWriter::compileImport(WasmBuffer& code, const Function& F)
 		// Encode the module name.
 		std::string moduleName = "imports";
 		internal::encodeULEB128(moduleName.size(), code);
-		code.write(moduleName.data(), moduleName.size());
+		code.writeBytes(moduleName.data(), moduleName.size());
 
 		// Encode the field name.
 		internal::encodeULEB128(fieldName.size(), code);
-		code.write(fieldName.data(), fieldName.size());
+		code.writeBytes(fieldName.data(), fieldName.size());
 
 		// Encode kind as 'Function' (= 0).
 		internal::encodeULEB128(0x00, code);
 
 		// Encode type index of function signature.
-		auto fTy = F.getFunctionType();
+		auto fTy = linearHelper.getLegalizedFunctionType(F.getFunctionType());
 		const auto& found = linearHelper.getFunctionTypeIndices().find(fTy);
 		assert(found != linearHelper.getFunctionTypeIndices().end());
 		internal::encodeULEB128(found->second, code);
 	} else {
 		code << "(func (import \"imports\" \"";
-		code.write(fieldName.data(), fieldName.size());
+		code.writeBytes(fieldName.data(), fieldName.size());
 		code << "\")";
 		uint32_t numArgs = F.arg_size();
+		const FunctionType* FTy = linearHelper.getLegalizedFunctionType(F.getFunctionType());
 		if(numArgs)
 		{
 			code << "(param";
-			llvm::FunctionType* FTy = F.getFunctionType();
 			for(uint32_t i = 0; i < numArgs; i++)
 				code << ' ' << getTypeString(FTy->getParamType(i));
 			code << ')';
 		}
-		if(!F.getReturnType()->isVoidTy())
-			code << "(result " << getTypeString(F.getReturnType()) << ')';
+		if(!FTy->getReturnType()->isVoidTy())
+			code << "(result " << getTypeString(FTy->getReturnType()) << ')';
 		code << ")\n";
 	}
 }
@@ -2624,7 +3334,7 @@ void CheerpWasmWriter::compileFunctionSection()
 	count = std::min(count, COMPILE_METHOD_LIMIT); // TODO
 
 	// Encode number of entries in the function section.
-	internal::encodeULEB128(count, section);
+	internal::encodeULEB128(count + linearHelper.legalizedExports().size(), section);
 
 	// Define function type ids
 	size_t i = 0;
@@ -2638,6 +3348,12 @@ void CheerpWasmWriter::compileFunctionSection()
 		if (++i >= COMPILE_METHOD_LIMIT)
 			break; // TODO
 	}
+
+	// The wrappers of the exports with i64 values
+	for (const Function* F : linearHelper.legalizedExports()) {
+		const FunctionType* fTy = linearHelper.getLegalizedFunctionType(F->getFunctionType());
+		internal::encodeULEB128(linearHelper.getFunctionTypeIndices().at(fTy), section);
+	}
 }
 
 
@@ -2689,7 +3405,17 @@ void CheerpWasmWriter::compileMemoryAndGlobalSection()
 	// defined in MiB and the wasm page size is 64 KiB. Thus, the wasm heap
 	// size parameter is defined as: heapSize << 20 >> 16 = heapSize << 4.
 	uint32_t minMemory = heapSize << 4;
-	uint32_t maxMemory = heapSize << 4;
+	uint32_t maxMemory = std::max(heapSize, maxHeapSize) << 4;
+
+	// A memory that can grow keeps the stack after the globals, make sure
+	// that they fit in the initial memory
+	uint32_t stackTop = linearHelper.getStackTop();
+	if (stackTop)
+	{
+		minMemory = std::max(minMemory, (linearHelper.getHeapStart() + WasmPage - 1) / WasmPage);
+		if (minMemory > maxMemory)
+			llvm::report_fatal_error("the globals and the stack do not fit in the maximum heap size", false);
+	}
 
 	// TODO use WasmPage variable instead of hardcoded '1>>16'.
 	assert(WasmPage == 64 * 1024);
@@ -2712,9 +3438,11 @@ void CheerpWasmWriter::compileMemoryAndGlobalSection()
 	{
 		Section section(0x06, "Global", this);
 
-		// Start the stack from the end of default memory
+		// Start the stack from the end of default memory, unless it has been
+		// placed after the globals
 		stackTopGlobal = usedGlobals++;
-		uint32_t stackTop = (minMemory * WasmPage);
+		if (!stackTop)
+			stackTop = (minMemory * WasmPage);
 
 		if (cheerpMode == CHEERP_MODE_WASM) {
 			// There is 1 global.
@@ -2761,7 +3489,7 @@ void CheerpWasmWriter::compileExportSection()
 	// Encode the memory.
 	std::string name = "memory";
 	internal::encodeULEB128(name.size(), section);
-	section.write(name.data(), name.size());
+	section.writeBytes(name.data(), name.size());
 	internal::encodeULEB128(0x02, section);
 	internal::encodeULEB128(0, section);
 
@@ -2770,12 +3498,12 @@ void CheerpWasmWriter::compileExportSection()
 		name = namegen.getName(F);
 
 		internal::encodeULEB128(name.size(), section);
-		section.write(name.data(), name.size());
+		section.writeBytes(name.data(), name.size());
 
 		// Encode the function index (where '0x00' means that this export is a
 		// function).
 		internal::encodeULEB128(0x00, section);
-		internal::encodeULEB128(linearHelper.getFunctionIds().find(F)->second, section);
+		internal::encodeULEB128(linearHelper.getExportedFunctionId(F), section);
 	}
 }
 
@@ -2829,7 +3557,7 @@ void CheerpWasmWriter::compileElementSection()
 	internal::encodeULEB128(0x0b, section);
 
 	// Encode the sequence of function indices.
-	std::stringstream elem;
+	WasmBuffer elem;
 	size_t count = 0;
 	for (const FunctionType* fTy: linearHelper.getFunctionTableOrder()) {
 		const auto table = linearHelper.getFunctionTables().find(fTy);
@@ -2839,51 +3567,213 @@ void CheerpWasmWriter::compileElementSection()
 			count++;
 		}
 	}
-	std::string buf = elem.str();
 	internal::encodeULEB128(count, section);
-	section << buf;
+	section.writeBytes(elem.data(), elem.size());
+}
+
+void CheerpWasmWriter::compileMethodsInParallel(std::vector<WasmBuffer>& bodies, const WasmBodyCache* cache)
+{
+#if LLVM_ENABLE_THREADS
+	prepareTypesForThreads(module);
+
+	const std::vector<const Function*>& functions = linearHelper.functions();
+	std::atomic<uint32_t> nextMethod(0);
+	auto worker = [&]()
+	{
+		// The per-method state (local map, buffered set_local) lives in the
+		// writer, so every worker compiles using its own copy.
+		CheerpWasmWriter writer(*this);
+		for (uint32_t i = nextMethod++; i < bodies.size(); i = nextMethod++)
+			writer.compileMethodCached(bodies[i], *functions[i], cache);
+	};
+
+	unsigned threads = numThreads ? numThreads : std::thread::hardware_concurrency();
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads && i < bodies.size(); i++)
+		workers.emplace_back(worker);
+	worker();
+	for (std::thread& t : workers)
+		t.join();
+#else
+	llvm_unreachable("parallel compilation requires LLVM_ENABLE_THREADS");
+#endif
+}
+
+void CheerpWasmWriter::compileMethodCached(WasmBuffer& code, const Function& F, const WasmBodyCache* cache)
+{
+	if (!cache)
+	{
+		compileMethod(code, F);
+		return;
+	}
+
+	std::string path = cache->getEntryPath(F);
+	if (std::unique_ptr<MemoryBuffer> body = cache->lookup(path))
+	{
+		code.writeBytes(body->getBufferStart(), body->getBufferSize());
+		return;
+	}
+
+	size_t start = code.size();
+	compileMethod(code, F);
+	cache->store(path, code.str().substr(start));
 }
 
 void CheerpWasmWriter::compileCodeSection()
 {
 	Section section(0x0a, "Code", this);
 
+	uint32_t count = linearHelper.functions().size();
+	count = std::min(count, COMPILE_METHOD_LIMIT);
+
 	if (cheerpMode == CHEERP_MODE_WASM) {
 		// Encode the number of methods in the code section.
-		uint32_t count = linearHelper.functions().size();
-		count = std::min(count, COMPILE_METHOD_LIMIT);
-		internal::encodeULEB128(count, section);
+		internal::encodeULEB128(count + linearHelper.legalizedExports().size(), section);
 #if WASM_DUMP_METHODS
 		llvm::errs() << "method count: " << count << '\n';
 #endif
 	}
 
+	std::unique_ptr<WasmBodyCache> cache;
+	if (cheerpMode == CHEERP_MODE_WASM && !bodyCacheDir.empty())
+	{
+		const uint32_t writerState[] = { useWasmLoader, stackTopGlobal, usedGlobals, COMPILE_METHOD_LIMIT, usePeephole, useStructurizer };
+		cache.reset(new WasmBodyCache(bodyCacheDir, module, linearHelper, registerize, globalDeps, writerState));
+	}
+
+	if (cheerpMode == CHEERP_MODE_WASM && usePeephole)
+	{
+		// The optimizer needs the stack effect of every call
+		auto getSignature = [](const FunctionType* fTy)
+		{
+			return WasmPeephole::Signature{ fTy->getNumParams(), !fTy->getReturnType()->isVoidTy() };
+		};
+		const auto& functionIds = linearHelper.getFunctionIds();
+		std::vector<WasmPeephole::Signature> functions(functionIds.size(), WasmPeephole::Signature{0, 0});
+		bool denseIds = true;
+		for (const auto& entry : functionIds)
+		{
+			if (entry.second < functions.size())
+				functions[entry.second] = getSignature(entry.first->getFunctionType());
+			else
+				denseIds = false;
+		}
+		std::vector<WasmPeephole::Signature> types;
+		for (const FunctionType* fTy : linearHelper.getFunctionTypes())
+			types.push_back(getSignature(fTy));
+		if (denseIds)
+			peephole = std::make_shared<const WasmPeephole>(std::move(functions), std::move(types));
+	}
+
+#if LLVM_ENABLE_THREADS
+	// Method bodies are independent buffers, so they can be compiled on
+	// multiple threads and then concatenated in the original order.
+	if (cheerpMode == CHEERP_MODE_WASM && numThreads != 1)
+	{
+		std::vector<WasmBuffer> bodies(count);
+		compileMethodsInParallel(bodies, cache.get());
+		size_t total = section.size();
+		for (const WasmBuffer& body: bodies)
+			total += body.size() + 5;
+		section.reserve(total);
+		for (WasmBuffer& body: bodies)
+		{
+			internal::encodeULEB128(body.size(), section);
+			section.writeBytes(body.data(), body.size());
+			body.release();
+		}
+		compileLegalizedExports(section);
+		return;
+	}
+#endif
+
 	size_t i = 0;
 
 	for (const Function* F: linearHelper.functions())
 	{
 		if (cheerpMode == CHEERP_MODE_WASM) {
-			std::stringstream method;
 #if WASM_DUMP_METHODS
 			llvm::errs() << i << " method name: " << F->getName() << '\n';
 #endif
-			compileMethod(method, *F);
-			std::string buf = method.str();
+			// Compile the method in place, and fill in its size afterwards.
+			size_t sizePos = section.reserveSizeULEB128();
+			compileMethodCached(section, *F, cache.get());
 #if WASM_DUMP_METHOD_DATA
+			StringRef buf = section.str().substr(sizePos + 5);
 			llvm::errs() << "method length: " << buf.size() << '\n';
 			llvm::errs() << "method: " << string_to_hex(buf) << '\n';
 #endif
-			internal::encodeULEB128(buf.size(), section);
-			section << buf;
+			section.patchSizeULEB128(sizePos);
 		} else {
 			compileMethod(section, *F);
 		}
 		if (++i == COMPILE_METHOD_LIMIT)
 			break; // TODO
 	}
+
+	if (cheerpMode == CHEERP_MODE_WASM)
+		compileLegalizedExports(section);
+}
+
+bool CheerpWasmWriter::isLegalizedImport(const Function* F) const
+{
+	return F && useWasmLoader && globalDeps.asmJSImports().count(F);
+}
+
+void CheerpWasmWriter::encodeSaturatingF64ToI64(WasmBuffer& code, uint32_t local)
+{
+	auto encodeF64Const = [this](double value, WasmBuffer& code)
+	{
+		encodeBufferedSetLocal(code);
+		if (cheerpMode == CHEERP_MODE_WASM) {
+			internal::encodeLiteralType(Type::getDoubleTy(Ctx), code);
+			internal::encodeF64(value, code);
+		} else {
+			code << "f64.const " << std::to_string(value) << '\n';
+		}
+	};
+	// i64.trunc_s/f64 traps on NaN and out of range values, which JS can
+	// produce. Clamp the value to the i64 range and turn NaN into 0, like a
+	// saturating conversion.
+	encodeU32Inst(0x20, "get_local", local, code);
+	encodeF64Const(-9223372036854775808.0, code);
+	encodeInst(0xa5, "f64.max", code);
+	encodeF64Const(9223372036854774784.0, code);
+	encodeInst(0xa4, "f64.min", code);
+	encodeF64Const(0., code);
+	encodeU32Inst(0x20, "get_local", local, code);
+	encodeU32Inst(0x20, "get_local", local, code);
+	encodeInst(0x61, "f64.eq", code);
+	encodeInst(0x1b, "select", code);
+	encodeInst(0xb0, "i64.trunc_s/f64", code);
+}
+
+void CheerpWasmWriter::compileLegalizedExports(WasmBuffer& section)
+{
+	// Convert the f64 values coming from JS to i64 and back, and forward the
+	// call to the exported function
+	for (const Function* F : linearHelper.legalizedExports())
+	{
+		size_t sizePos = section.reserveSizeULEB128();
+		// No locals
+		internal::encodeULEB128(0, section);
+		uint32_t numArgs = F->arg_size();
+		for (uint32_t i = 0; i < numArgs; i++)
+		{
+			if (F->getFunctionType()->getParamType(i)->isIntegerTy(64))
+				encodeSaturatingF64ToI64(section, i);
+			else
+				encodeU32Inst(0x20, "get_local", i, section);
+		}
+		encodeU32Inst(0x10, "call", linearHelper.getFunctionIds().at(F), section);
+		if (F->getReturnType()->isIntegerTy(64))
+			encodeInst(0xb9, "f64.convert_s/i64", section);
+		internal::encodeULEB128(0x0b, section);
+		section.patchSizeULEB128(sizePos);
+	}
 }
 
-void CheerpWasmWriter::encodeDataSectionChunk(WasmBuffer& data, uint32_t address, const std::string& buf)
+void CheerpWasmWriter::encodeDataSectionChunk(WasmBuffer& data, uint32_t address, StringRef buf)
 {
 	if (cheerpMode == CHEERP_MODE_WASM) {
 		// In the current version of WebAssembly, at most one memory is
@@ -2896,20 +3786,20 @@ void CheerpWasmWriter::encodeDataSectionChunk(WasmBuffer& data, uint32_t address
 		internal::encodeULEB128(0x0b, data);
 		// Prefix the number of bytes to the bytes vector.
 		internal::encodeULEB128(buf.size(), data);
-		data.write(buf.data(), buf.size());
+		data.writeBytes(buf.data(), buf.size());
 	} else {
 		data << "(data (i32.const " << address << ") \"" << buf << "\")\n";
 	}
 }
 
-uint32_t CheerpWasmWriter::encodeDataSectionChunks(WasmBuffer& data, uint32_t address, const std::string& buf)
+uint32_t CheerpWasmWriter::encodeDataSectionChunks(WasmBuffer& data, uint32_t address, StringRef buf)
 {
 	// Split data section buffer into chunks based on 6 (or more) zero bytes.
 	uint32_t chunks = 0;
 	size_t cur = 0, last = 0, end = 0;
-	std::string delimiter("\0\0\0\0\0\0\0", 6);
-	while ((cur = buf.find(delimiter, last)) != std::string::npos) {
-		std::string chunk = buf.substr(last, cur - last);
+	StringRef delimiter("\0\0\0\0\0\0\0", 6);
+	while ((cur = buf.find(delimiter, last)) != StringRef::npos) {
+		StringRef chunk = buf.substr(last, cur - last);
 		assert(chunk.size() == cur - last);
 		assert(address + last > end);
 		encodeDataSectionChunk(data, address + last, chunk);
@@ -2918,7 +3808,7 @@ uint32_t CheerpWasmWriter::encodeDataSectionChunks(WasmBuffer& data, uint32_t ad
 		end = address + last + chunk.size();
 
 		// Skip the delimiter and all consecutive zero bytes.
-		last = cur + delimiter.length();
+		last = cur + delimiter.size();
 		for (; last < buf.size() && buf[last] == 0; last++);
 	}
 
@@ -2935,7 +3825,7 @@ void CheerpWasmWriter::compileDataSection()
 {
 	Section section(0x0b, "Data", this);
 
-	std::stringstream data;
+	WasmBuffer data;
 	uint32_t count = 0;
 
 	auto globals = linearHelper.globals();
@@ -2946,6 +3836,10 @@ void CheerpWasmWriter::compileDataSection()
 		// Skip global variables that are zero-initialised.
 		if (!linearHelper.hasNonZeroInitialiser(GV))
 			continue;
+		// The lazily loaded globals are the last ones, and they are not
+		// part of the module
+		if (linearHelper.isLazyGlobal(GV))
+			break;
 		const Constant* init = GV->getInitializer();
 
 		uint32_t address = linearHelper.getGlobalVariableAddress(GV);
@@ -2953,7 +3847,7 @@ void CheerpWasmWriter::compileDataSection()
 		// Concatenate global variables into one big binary blob. This
 		// optimization omits the data section item header, and that will save
 		// a minimum of 5 bytes per global variable.
-		std::stringstream bytes;
+		WasmBuffer bytes;
 		WasmBytesWriter bytesWriter(bytes, *this);
 
 		for (; g != e; ++g) {
@@ -2961,21 +3855,21 @@ void CheerpWasmWriter::compileDataSection()
 
 			// Do not concatenate global variables that have no initialiser or
 			// are zero-initialised.
-			if (!linearHelper.hasNonZeroInitialiser(GV))
+			if (!linearHelper.hasNonZeroInitialiser(GV) || linearHelper.isLazyGlobal(GV))
 				break;
 			init = GV->getInitializer();
 
 			// Determine amount of padding bytes necessary for the alignment.
-			long written = bytes.tellp();
+			long written = bytes.tell();
 			uint32_t nextAddress = linearHelper.getGlobalVariableAddress(GV);
 			uint32_t padding = nextAddress - (address + written);
 			for (uint32_t i = 0; i < padding; i++)
-				bytes << (char)0;
+				bytes.writeByte(0);
 
 			linearHelper.compileConstantAsBytes(init,/* asmjs */ true, &bytesWriter);
 		}
 
-		std::string buf = bytes.str();
+		StringRef buf = bytes.str();
 
 		// Strip leading and trailing zeros.
 		size_t pos = 0, len = buf.size();
@@ -3003,8 +3897,7 @@ void CheerpWasmWriter::compileDataSection()
 	if (cheerpMode == CHEERP_MODE_WASM)
 		internal::encodeULEB128(count, section);
 
-	std::string buf = data.str();
-	section.write(buf.data(), buf.size());
+	section.writeBytes(data.data(), data.size());
 }
 
 void CheerpWasmWriter::compileNameSection()
@@ -3017,7 +3910,7 @@ void CheerpWasmWriter::compileNameSection()
 
 	// Assign names to functions
 	{
-		std::stringstream data;
+		WasmBuffer data;
 		uint32_t count = linearHelper.functions().size();
 		internal::encodeULEB128(count, data);
 
@@ -3026,14 +3919,12 @@ void CheerpWasmWriter::compileNameSection()
 			uint32_t functionId = linearHelper.getFunctionIds().at(F);
 			internal::encodeULEB128(functionId, data);
 			internal::encodeULEB128(F->getName().size(), data);
-			data << F->getName().str();
+			data << F->getName();
 		}
 
-		std::string buf = data.str();
-
 		internal::encodeULEB128(0x01, section);
-		internal::encodeULEB128(buf.size(), section);
-		section.write(buf.data(), buf.size());
+		internal::encodeULEB128(data.size(), section);
+		section.writeBytes(data.data(), data.size());
 	}
 }
 
@@ -3043,7 +3934,7 @@ void CheerpWasmWriter::compileModule()
 		stream << "(module\n";
 	} else {
 		assert(cheerpMode == CHEERP_MODE_WASM);
-		std::stringstream code;
+		WasmBuffer code;
 
 		// Magic number for wasm.
 		internal::encodeULEB128(0x00, code);
@@ -3056,31 +3947,27 @@ void CheerpWasmWriter::compileModule()
 		internal::encodeULEB128(0x00, code);
 		internal::encodeULEB128(0x00, code);
 
-		stream << code.str();
+		stream.write(code.data(), code.size());
 	}
 
-	compileTypeSection();
-
-	compileImportSection();
-
-	compileFunctionSection();
-
-	compileTableSection();
-
-	compileMemoryAndGlobalSection();
-
-	compileExportSection();
-
-	compileStartSection();
-
-	compileElementSection();
-
-	compileCodeSection();
-
-	compileDataSection();
+	auto compileSection = [this](const char* name, void (CheerpWasmWriter::*compile)())
+	{
+		PassReport::Phase phase(report, name);
+		(this->*compile)();
+	};
+	compileSection("TypeSection", &CheerpWasmWriter::compileTypeSection);
+	compileSection("ImportSection", &CheerpWasmWriter::compileImportSection);
+	compileSection("FunctionSection", &CheerpWasmWriter::compileFunctionSection);
+	compileSection("TableSection", &CheerpWasmWriter::compileTableSection);
+	compileSection("MemoryAndGlobalSection", &CheerpWasmWriter::compileMemoryAndGlobalSection);
+	compileSection("ExportSection", &CheerpWasmWriter::compileExportSection);
+	compileSection("StartSection", &CheerpWasmWriter::compileStartSection);
+	compileSection("ElementSection", &CheerpWasmWriter::compileElementSection);
+	compileSection("CodeSection", &CheerpWasmWriter::compileCodeSection);
+	compileSection("DataSection", &CheerpWasmWriter::compileDataSection);
 
 	if (prettyCode) {
-		compileNameSection();
+		compileSection("NameSection", &CheerpWasmWriter::compileNameSection);
 	}
 	
 	if (cheerpMode == CHEERP_MODE_WAST) {
@@ -3091,12 +3978,18 @@ void CheerpWasmWriter::compileModule()
 void CheerpWasmWriter::makeWasm()
 {
 	compileModule();
+
+	MD5::MD5Result result;
+	outputHash.final(result);
+	SmallString<32> hash;
+	MD5::stringifyResult(result, hash);
+	moduleHash = hash.str();
 }
 
 void CheerpWasmWriter::WasmBytesWriter::addByte(uint8_t byte)
 {
 	if (writer.cheerpMode == CHEERP_MODE_WASM) {
-		code.write(reinterpret_cast<char*>(&byte), 1);
+		code.writeByte(byte);
 	} else {
 		char buf[4];
 		snprintf(buf, 4, "\\%02x", byte);
@@ -3107,6 +4000,8 @@ void CheerpWasmWriter::WasmBytesWriter::addByte(uint8_t byte)
 void CheerpWasmWriter::WasmGepWriter::addValue(const llvm::Value* v, uint32_t size)
 {
 	writer.compileOperand(code, v);
+	if (v->getType()->isIntegerTy(64))
+		writer.encodeInst(0xa7, "i32.wrap/i64", code);
 	if (size > 1)
 	{
 		if (isPowerOf2_32(size))
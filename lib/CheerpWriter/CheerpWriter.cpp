@@ -12,14 +12,19 @@
 #include "Relooper.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Cheerp/FunctionProfile.h"
+#include "llvm/Cheerp/Instrumentation.h"
 #include "llvm/Cheerp/Utility.h"
 #include "llvm/Cheerp/Writer.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/Path.h"
+#include <atomic>
+#include <thread>
 
 using namespace llvm;
 using namespace std;
@@ -327,6 +332,43 @@ void CheerpWriter::compileVirtualcast( ImmutableCallSite callV )
       }
 }
 
+bool CheerpWriter::compileInlineMemIntrinsicAsmJS(const MemIntrinsic& MI)
+{
+	// Heap accesses must be aligned, so they are limited by the alignment
+	SmallVector<uint32_t, MaxInlineMemIntrinsicAccesses> widths;
+	if (!getInlineMemIntrinsicAccesses(MI, 4, /*allowUnaligned*/false, widths))
+		return false;
+
+	const MemSetInst* MS = dyn_cast<MemSetInst>(&MI);
+	auto compileAccess = [this](const Value* p, uint32_t width, uint32_t offset)
+	{
+		uint32_t shift = Log2_32(width);
+		stream << heapNames[width == 4 ? HEAP32 : width == 2 ? HEAP16 : HEAP8] << '[';
+		if (offset)
+		{
+			compileRawPointer(p, PARENT_PRIORITY::ADD_SUB);
+			stream << '+' << offset;
+		}
+		else
+			compileRawPointer(p, PARENT_PRIORITY::SHIFT);
+		stream << ">>" << shift << ']';
+	};
+	uint32_t offset = 0;
+	for (uint32_t i = 0; i < widths.size(); i++)
+	{
+		if (i)
+			stream << ';' << NewLine;
+		compileAccess(MI.getRawDest(), widths[i], offset);
+		stream << '=';
+		if (MS)
+			stream << (int32_t)getMemsetPattern(*MS, widths[i]);
+		else
+			compileAccess(cast<MemTransferInst>(MI).getRawSource(), widths[i], offset);
+		offset += widths[i];
+	}
+	return true;
+}
+
 /* Method that handles memcpy and memmove.
  * Since only immutable types are handled in the backend and we use TypedArray.set to make the copy
  * there is not need to handle memmove in a special way
@@ -485,24 +527,75 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 	}
 
 	// To implement cheerp_reallocate we need to strategies:
-	// 1) Immutable types are stored in typed array which cannot be resized, we need to make a new one
-	//    and copy the old data over
+	// 1) Immutable types are stored in typed array which cannot be resized. When growing we
+	//    allocate a buffer twice as big as needed and return a view of the requested size, so
+	//    that the next reallocations can just return a longer view of the same buffer
 	// 2) Objects and pointers are stored in a regular array and we can just resize them
-	if (info.getAllocType() == DynamicAllocInfo::cheerp_reallocate)
-	{
-		if (info.useTypedArray() || BYTE_LAYOUT == result)
+	if (info.getAllocType() == DynamicAllocInfo::cheerp_reallocate &&
+		(info.useTypedArray() || BYTE_LAYOUT == result))
+	{
+		bool byteLayout = !info.useTypedArray();
+		const char* length = byteLayout ? "byteLength" : "length";
+		stream << "(function(){";
+		stream << "var __old__=";
+		compilePointerBase(info.getMemoryArg());
+		stream << ';' << NewLine;
+		stream << "var __n__=";
+		if (byteLayout)
 		{
-			stream << "(function(){";
-			stream << "var __old__=";
-			compilePointerBase(info.getMemoryArg());
-			stream << ';' << NewLine;
-			//Allocated the new array (created below) in a temporary var
-			stream << "var __ret__=";
+			// Round up the size to make sure that any typed array can be initialized from the buffer
+			stream << "(((";
+			compileArraySize(info, /* shouldPrint */true, /* inBytes */true);
+			stream << ")+ 7) & (~7))";
 		}
+		else
+		{
+			stream << '(';
+			compileArraySize(info, /* shouldPrint */true);
+			stream << ')';
+		}
+		stream << ";var __ret__=null;" << NewLine;
+		// The views we create always start at the beginning of the buffer, the data past their
+		// end has never been written
+		stream << "if(__n__>__old__." << length << "&&__old__.byteOffset===0&&__n__";
+		if (!byteLayout)
+			stream << "*__old__.BYTES_PER_ELEMENT";
+		stream << "<=__old__.buffer.byteLength)" << NewLine;
+		stream << "return new ";
+		if (byteLayout)
+			stream << "DataView";
+		else
+			compileTypedArrayType(t);
+		stream << "(__old__.buffer,0,__n__);" << NewLine;
+		stream << "if(__n__>__old__." << length << ')' << NewLine;
+		if (byteLayout)
+			stream << "__ret__=new DataView(new ArrayBuffer(Math.max(__n__,__old__.byteLength*2)),0,__n__);";
+		else
+		{
+			stream << "__ret__=new ";
+			compileTypedArrayType(t);
+			stream << "(Math.max(__n__,__old__.length*2)).subarray(0,__n__);";
+		}
+		stream << NewLine << "else " << NewLine << "__ret__=new ";
+		if (byteLayout)
+			stream << "DataView(new ArrayBuffer(__n__));";
+		else
+		{
+			compileTypedArrayType(t);
+			stream << "(__n__);";
+		}
+		stream << NewLine;
+		//__ret__ now contains the new array, we need to copy over the data
+		if(byteLayout)
+			stream << "(new Int8Array(__ret__.buffer)).set((new Int8Array(__old__.buffer)).subarray(0, Math.min(__ret__.byteLength,__old__.byteLength)));" << NewLine;
+		else
+		{
+			//The amount of data to copy is limited by the shortest between the old and new array
+			stream << "__ret__.set(__old__.subarray(0, Math.min(__ret__.length,__old__.length)));" << NewLine;
+		}
+		stream << "return __ret__;})()";
 	}
-
-	
-	if (info.useTypedArray())
+	else if (info.useTypedArray())
 	{
 		stream << "new ";
 		compileTypedArrayType(t);
@@ -597,23 +690,6 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 		llvm::report_fatal_error("Unsupported type in allocation", false);
 	}
 
-	if (info.getAllocType() == DynamicAllocInfo::cheerp_reallocate)
-	{
-		if (info.useTypedArray() || result == BYTE_LAYOUT)
-		{
-			stream << ';' << NewLine;
-			//__ret__ now contains the new array, we need to copy over the data
-			if(result == BYTE_LAYOUT)
-				stream << "(new Int8Array(__ret__.buffer)).set((new Int8Array(__old__.buffer)).subarray(0, Math.min(__ret__.byteLength,__old__.byteLength)));" << NewLine;
-			else
-			{
-				//The amount of data to copy is limited by the shortest between the old and new array
-				stream << "__ret__.set(__old__.subarray(0, Math.min(__ret__.length,__old__.length)));" << NewLine;
-			}
-			stream << "return __ret__;})()";
-		}
-	}
-
 	if(needsRegular)
 	{
 		stream << ",o:0}";
@@ -704,6 +780,10 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::handleBuiltinCall(Immut
 			compileMemFunc(*(it), *(it+1), *(it+2));
 			return COMPILE_EMPTY;
 		}
+		else if (compileInlineMemIntrinsicAsmJS(cast<MemIntrinsic>(*callV.getInstruction())))
+		{
+			return cast<ConstantInt>(*(it+2))->isZero() ? COMPILE_EMPTY : COMPILE_OK;
+		}
 		else if (intrinsicId == Intrinsic::memcpy)
 		{
 			Function* memcpy = module.getFunction("memcpy");
@@ -734,6 +814,10 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::handleBuiltinCall(Immut
 	}
 	else if(intrinsicId==Intrinsic::memset)
 	{
+		if (asmjs && compileInlineMemIntrinsicAsmJS(cast<MemIntrinsic>(*callV.getInstruction())))
+		{
+			return cast<ConstantInt>(*(it+2))->isZero() ? COMPILE_EMPTY : COMPILE_OK;
+		}
 		if (asmjs) {
 			Function* memset = module.getFunction("memset");
 			assert(memset);
@@ -936,6 +1020,17 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::handleBuiltinCall(Immut
 		compileOperand(*it, LOWEST);
 		return COMPILE_OK;
 	}
+	else if(ident=="__wasm_current_memory" && asmjs)
+	{
+		// The asm.js heap never grows, report its size in wasm pages
+		stream << (heapSize << 4);
+		return COMPILE_OK;
+	}
+	else if(ident=="__wasm_grow_memory" && asmjs)
+	{
+		stream << "(-1)";
+		return COMPILE_OK;
+	}
 	else if(cheerp::isFreeFunctionName(ident) || intrinsicId==Intrinsic::cheerp_deallocate)
 	{
 		if (asmjs || TypeSupport::isAsmJSPointer((*it)->getType()))
@@ -1233,11 +1328,17 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::handleBuiltinCall(Immut
 		Function* fmalloc = module.getFunction("malloc");
 		if (!fmalloc)
 			llvm::report_fatal_error("missing malloc definition");
+		bool refreshHeap = !asmjs && wasmGrowMemory && !wasmFile.empty();
+		if(refreshHeap)
+			stream << "__refreshHeap(";
 		if(!asmjs)
 			stream << "__asm.";
 		stream << namegen.getName(fmalloc) << "(";
 		compileOperand(*it, PARENT_PRIORITY::LOWEST);
-		stream << ")|0";
+		stream << ")";
+		if(refreshHeap)
+			stream << ")";
+		stream << "|0";
 		return COMPILE_OK;
 	}
 	else if (asmjs && func->getIntrinsicID()==Intrinsic::cheerp_reallocate && (asmjs || TypeSupport::isAsmJSPointer(func->getReturnType())))
@@ -2725,6 +2826,8 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileTerminatorInstru
 						compileOperand(retVal, LOWEST);
 						stream << ')';
 						break;
+					case Registerize::INTEGER64:
+						llvm_unreachable("i64 registers are only used in wasm");
 					case Registerize::OBJECT:
 						POINTER_KIND k=PA.getPointerKindForReturn(ri.getParent()->getParent());
 						// For SPLIT_REGULAR we return the .d part and store the .o part into oSlot
@@ -3959,6 +4062,8 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileInlineableInstru
 						break;
 					case Registerize::OBJECT:
 						break;
+					case Registerize::INTEGER64:
+						llvm_unreachable("i64 registers are only used in wasm");
 				}
 				return COMPILE_OK;
 			}
@@ -4025,6 +4130,8 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileInlineableInstru
 							stream << namegen.getSecondaryName(&ci) << "=oSlot";
 						}
 						break;
+					case Registerize::INTEGER64:
+						llvm_unreachable("i64 registers are only used in wasm");
 				}
 			}
 			return COMPILE_OK;
@@ -4534,7 +4641,7 @@ void CheerpWriter::compileMethod(const Function& F)
 	}
 	else
 	{
-		Relooper* rl = runRelooperOnFunction(F, PA, registerize);
+		std::unique_ptr<Relooper> rl(runRelooperOnFunction(F, PA, registerize));
 		CheerpRenderInterface ri(this, NewLine, asmjs);
 		compileMethodLocals(F, rl->needsLabel());
 		rl->Render(&ri);
@@ -4560,7 +4667,8 @@ void CheerpWriter::compileMethod(const Function& F)
 					stream << " 0.";
 					break;
 				case Registerize::OBJECT:
-					llvm::errs() << "OBJECT register kind should not appear in asm.js functions\n";
+				case Registerize::INTEGER64:
+					llvm::errs() << "OBJECT and INTEGER64 register kinds should not appear in asm.js functions\n";
 					llvm::report_fatal_error("please report a bug");
 					break;
 			}
@@ -4571,6 +4679,75 @@ void CheerpWriter::compileMethod(const Function& F)
 	currentFun = NULL;
 }
 
+void CheerpWriter::compileMethods(const std::vector<const Function*>& functions)
+{
+#if LLVM_ENABLE_THREADS
+	if (numThreads != 1 && functions.size() > 1)
+	{
+		compileMethodsInParallel(functions);
+		return;
+	}
+#endif
+	for (const Function* F: functions)
+		compileMethod(*F);
+}
+
+void CheerpWriter::compileMethodsInParallel(const std::vector<const Function*>& functions)
+{
+#if LLVM_ENABLE_THREADS
+	prepareTypesForThreads(module);
+
+	// Every method is compiled into its own buffer, together with the source
+	// map segments relative to the beginning of the buffer
+	struct MethodCode
+	{
+		std::string code;
+		std::vector<SourceMapGenerator::Segment> segments;
+	};
+	std::vector<MethodCode> methods(functions.size());
+	std::atomic<uint32_t> nextMethod(0);
+	auto worker = [&]()
+	{
+		// The per-method state lives in the writer, so every worker
+		// compiles using its own copy
+		std::unique_ptr<SourceMapGenerator> recorder;
+		if (sourceMapGenerator)
+			recorder = SourceMapGenerator::createRecorder(*sourceMapGenerator);
+		CheerpWriter writer(*this);
+		writer.sourceMapGenerator = recorder.get();
+		for (uint32_t i = nextMethod++; i < functions.size(); i = nextMethod++)
+		{
+			raw_string_ostream code(methods[i].code);
+			writer.stream.redirect(code, recorder.get());
+			writer.compileMethod(*functions[i]);
+			code.flush();
+			if (recorder)
+				methods[i].segments = recorder->takeSegments();
+		}
+	};
+
+	unsigned threads = numThreads ? numThreads : std::thread::hardware_concurrency();
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads && i < functions.size(); i++)
+		workers.emplace_back(worker);
+	worker();
+	for (std::thread& t : workers)
+		t.join();
+
+	// Concatenate the methods in the original order, and rebase their
+	// segments at the current position of the source map
+	for (MethodCode& method: methods)
+	{
+		stream.getRawStream() << method.code;
+		if (sourceMapGenerator)
+			sourceMapGenerator->appendSegments(method.segments);
+		std::string().swap(method.code);
+	}
+#else
+	llvm_unreachable("parallel compilation requires LLVM_ENABLE_THREADS");
+#endif
+}
+
 CheerpWriter::GlobalSubExprInfo CheerpWriter::compileGlobalSubExpr(const GlobalDepsAnalyzer::SubExprVec& subExpr)
 {
 	for ( auto it = std::next(subExpr.begin()); it != subExpr.end(); ++it )
@@ -4763,6 +4940,10 @@ void CheerpWriter::compileGlobalsInitAsmJS()
 		uint32_t last_size = 0;
 		for ( const GlobalVariable* GV : linearHelper.globals() )
 		{
+			// The lazily loaded globals are the last ones, and they are
+			// not part of the memory file
+			if (linearHelper.isLazyGlobal(GV))
+				break;
 			if (GV->hasInitializer())
 			{
 				const Constant* init = GV->getInitializer();
@@ -4791,8 +4972,9 @@ void CheerpWriter::compileGlobalsInitAsmJS()
 			{
 				const Constant* init = GV->getInitializer();
 
-				// Skip global variables that are zero-initialised.
-				if (linearHelper.isZeroInitializer(init))
+				// Skip global variables that are zero-initialised or
+				// lazily loaded.
+				if (linearHelper.isZeroInitializer(init) || linearHelper.isLazyGlobal(GV))
 					continue;
 
 				stream  << heapNames[HEAP8] << ".set([";
@@ -4825,7 +5007,8 @@ void CheerpWriter::compileParamTypeAnnotationsAsmJS(const Function* F)
 				stream << '+' << namegen.getName(curArg);
 				break;
 			case Registerize::OBJECT:
-				llvm::errs() << "OBJECT register kind should not appear in asm.js functions\n";
+			case Registerize::INTEGER64:
+				llvm::errs() << "OBJECT and INTEGER64 register kinds should not appear in asm.js functions\n";
 				llvm::report_fatal_error("please report a bug");
 				break;
 		}
@@ -4974,6 +5157,9 @@ void CheerpWriter::compileAsmJSImports()
 			stream << namegen.getName(curArg);
 		}
 		stream << "){" << NewLine;
+		// The memory may have grown since the last time JS code run
+		if (wasmGrowMemory && !wasmFile.empty())
+			stream << "__refreshHeap();" << NewLine;
 		if (!F->getReturnType()->isVoidTy())
 			stream << "return ";
 		stream << namegen.getName(F) << '(';
@@ -5022,6 +5208,8 @@ void CheerpWriter::compileAsmJSExports()
 		}
 		else if (!F->getReturnType()->isVoidTy())
 			stream << "return ";
+		if (wasmGrowMemory && !wasmFile.empty())
+			stream << "__refreshHeap(";
 		stream << "__asm." << namegen.getName(F) << '(';
 		for(Function::const_arg_iterator curArg=A;curArg!=AE;++curArg)
 		{
@@ -5030,6 +5218,8 @@ void CheerpWriter::compileAsmJSExports()
 			stream << namegen.getName(curArg);
 		}
 		stream << ')';
+		if (wasmGrowMemory && !wasmFile.empty())
+			stream << ')';
 		if (retKind == SPLIT_REGULAR)
 		{
 			int shift =  getHeapShiftForType(cast<PointerType>(F->getReturnType())->getPointerElementType());
@@ -5069,6 +5259,201 @@ void CheerpWriter::compileFetchBuffer()
 	stream << "}" << NewLine;
 }
 
+void CheerpWriter::compileInstantiateWasm()
+{
+	stream << "function instantiateWasm(p,o) {" << NewLine;
+	if (wasmStreaming)
+	{
+		// Fall back to compiling the whole buffer on older engines, or when
+		// the server does not send the application/wasm MIME type
+		stream << "if ((typeof window !== 'undefined' || typeof self !== 'undefined') && typeof WebAssembly.instantiateStreaming === 'function')" << NewLine;
+		stream << "return WebAssembly.instantiateStreaming(fetch(p),o).catch(e=>fetchBuffer(p).then(r=>WebAssembly.instantiate(r,o)));" << NewLine;
+	}
+	stream << "return fetchBuffer(p).then(r=>WebAssembly.instantiate(r,o));" << NewLine;
+	stream << "}" << NewLine;
+}
+
+void CheerpWriter::compileInstantiateCachedWasm()
+{
+	// The compiled module is stored in IndexedDB, together with the hash of
+	// the build it comes from. Any failure, including engines that can't
+	// store compiled modules, just causes the module to be compiled again.
+	stream << "function instantiateCachedWasm(p,h,o) {" << NewLine;
+	stream << "var db=null;" << NewLine;
+	stream << "return new Promise((resolve, reject) => {" << NewLine;
+	stream << "if (typeof indexedDB === 'undefined') { resolve(null); return; }" << NewLine;
+	stream << "var req=indexedDB.open('cheerp-wasm-cache',1);" << NewLine;
+	stream << "req.onupgradeneeded=()=>req.result.createObjectStore('modules');" << NewLine;
+	stream << "req.onerror=()=>resolve(null);" << NewLine;
+	stream << "req.onsuccess=()=>{" << NewLine;
+	stream << "db=req.result;" << NewLine;
+	stream << "var get=db.transaction('modules').objectStore('modules').get(p);" << NewLine;
+	stream << "get.onerror=()=>resolve(null);" << NewLine;
+	stream << "get.onsuccess=()=>resolve(get.result && get.result.hash===h ? get.result.module : null);" << NewLine;
+	stream << "};" << NewLine;
+	stream << "}).catch(e=>null).then(m=>{" << NewLine;
+	stream << "if (m) return WebAssembly.instantiate(m,o).then(i=>({module:m,instance:i}));" << NewLine;
+	stream << "return instantiateWasm(p,o).then(r=>{" << NewLine;
+	stream << "try { if (db) db.transaction('modules','readwrite').objectStore('modules').put({hash:h,module:r.module},p); } catch(e) {}" << NewLine;
+	stream << "return r;" << NewLine;
+	stream << "});" << NewLine;
+	stream << "});" << NewLine;
+	stream << "}" << NewLine;
+}
+
+void CheerpWriter::compileRefreshHeapHelper()
+{
+	// Growing the memory detaches the old buffer, together with all the views on it
+	stream << "function __refreshHeap(r){" << NewLine;
+	stream << "if(__heap!==__asm.memory.buffer){" << NewLine;
+	stream << "__heap=__asm.memory.buffer;" << NewLine;
+	for (int i = HEAP8; i<=HEAPF64; i++)
+		stream << heapNames[i] << "=new " << typedArrayNames[i] << "(__heap);" << NewLine;
+	stream << '}' << NewLine;
+	stream << "return r;" << NewLine;
+	stream << '}' << NewLine;
+}
+
+void CheerpWriter::compileLoadLazyData()
+{
+	stream << "var __lazyData=null;" << NewLine;
+	stream << "function cheerpLoadLazyData(){" << NewLine;
+	stream << "if(__lazyData===null)" << NewLine;
+	stream << "__lazyData=fetchBuffer('" << sys::path::filename(lazyDataFile) << "').then(r=>{" << NewLine;
+	stream << heapNames[HEAP8] << ".set(new Uint8Array(r)," << linearHelper.getLazyDataStart() << ");" << NewLine;
+	stream << "});" << NewLine;
+	stream << "return __lazyData;" << NewLine;
+	stream << '}' << NewLine;
+}
+
+void CheerpWriter::compileCountersView(const GlobalVariable& counters)
+{
+	// Without linear memory the counters are a typed array
+	if(counters.getSection() != StringRef("asmjs"))
+	{
+		stream << namegen.getName(&counters);
+		return;
+	}
+	uint32_t start = linearHelper.getGlobalVariableAddress(&counters) >> 2;
+	uint32_t size = cast<ArrayType>(counters.getType()->getPointerElementType())->getNumElements();
+	stream << heapNames[HEAP32] << ".subarray(" << start << ',' << start + size << ')';
+}
+
+void CheerpWriter::compileProfileDump(const GlobalVariable& counters)
+{
+	const NamedMDNode* names = module.getNamedMetadata(ProfileInstrumentation::namesMetadataName);
+	assert(names);
+	stream << "function cheerpProfileDump(){" << NewLine;
+	if(!wasmFile.empty() && wasmGrowMemory)
+		stream << "__refreshHeap();" << NewLine;
+	stream << "var names=[";
+	for(unsigned i = 0; i < names->getNumOperands(); i++)
+	{
+		if(i)
+			stream << ',';
+		stream << '"';
+		compileEscapedString(stream.getRawStream(), cast<MDString>(names->getOperand(i)->getOperand(0))->getString(), /*forJSON*/false);
+		stream << '"';
+	}
+	stream << "];" << NewLine;
+	stream << "var counts=";
+	compileCountersView(counters);
+	stream << ";" << NewLine;
+	// The locals have long names, so they don't hide the heap
+	stream << "var result='';" << NewLine;
+	stream << "for(var index=0;index<names.length;index++)" << NewLine;
+	stream << "result+=(counts[index]>>>0)+' '+names[index]+'\\n';" << NewLine;
+	stream << "return result;" << NewLine;
+	stream << '}' << NewLine;
+}
+
+void CheerpWriter::compileInstrumentReport(const NamedMDNode& symbols, const GlobalVariable* counters)
+{
+	const uint32_t maxSamples = 4096;
+	// The key of each function in the stack traces: the wasm functions are
+	// shown by index, the JS and asm.js ones by name. The JS wrappers of the
+	// asm.js exports have the same name, and show up as an extra frame.
+	StringMap<uint32_t> symbolIds;
+	stream << "var __cheerpFrames={";
+	bool first = true;
+	for(unsigned i = 0; i < symbols.getNumOperands(); i++)
+	{
+		StringRef name = cast<MDString>(symbols.getOperand(i)->getOperand(0))->getString();
+		symbolIds[name] = i;
+		const Function* F = module.getFunction(name);
+		if(!F || F->empty())
+			continue;
+		if(!wasmFile.empty() && F->getSection() == StringRef("asmjs"))
+		{
+			auto it = linearHelper.getFunctionIds().find(F);
+			if(it == linearHelper.getFunctionIds().end())
+				continue;
+			stream << (first ? "" : ",") << "'#" << it->second << "':" << i;
+		}
+		else
+			stream << (first ? "" : ",") << '\'' << namegen.getName(F) << "':" << i;
+		first = false;
+	}
+	stream << "};" << NewLine;
+	stream << "var __cheerpSamples=[],__cheerpSampleCount=0;" << NewLine;
+	// Record the path of the sampled call, outermost frame first. Frames
+	// which are not compiled functions are skipped.
+	stream << "function cheerpInstrumentSample(id){" << NewLine;
+	stream << "var l=Error.stackTraceLimit;" << NewLine;
+	stream << "Error.stackTraceLimit=Infinity;" << NewLine;
+	stream << "var s=new Error().stack;" << NewLine;
+	stream << "Error.stackTraceLimit=l;" << NewLine;
+	stream << "var f=s?s.split('\\n'):[],p=[];" << NewLine;
+	stream << "for(var i=f.length-1;i>=0;i--){" << NewLine;
+	stream << "var m=/wasm-function\\[(\\d+)\\]/.exec(f[i]),k=m?'#'+m[1]:(m=/^\\s*at (?:new )?(?:[\\w$]+\\.)*([\\w$]+) |^([\\w$]+)@/.exec(f[i]))?m[1]||m[2]:'';" << NewLine;
+	stream << "if(__cheerpFrames.hasOwnProperty(k))p.push(__cheerpFrames[k]);" << NewLine;
+	stream << '}' << NewLine;
+	stream << "if(p[p.length-1]!==id)p.push(id);" << NewLine;
+	stream << "__cheerpSamples[__cheerpSampleCount++&" << maxSamples - 1 << "]=p;" << NewLine;
+	stream << '}' << NewLine;
+	stream << "function cheerpInstrumentReport(symbols){" << NewLine;
+	stream << "function symbolName(id){return symbols&&symbols[id]?symbols[id].name:'#'+id;}" << NewLine;
+	stream << "var result='';" << NewLine;
+	if(counters)
+	{
+		// Flat profile, by number of calls
+		const NamedMDNode* names = module.getNamedMetadata(ProfileInstrumentation::namesMetadataName);
+		assert(names);
+		if(!wasmFile.empty() && wasmGrowMemory)
+			stream << "__refreshHeap();" << NewLine;
+		stream << "var counts=";
+		compileCountersView(*counters);
+		stream << ";" << NewLine;
+		stream << "var symbolIds=[";
+		for(unsigned i = 0; i < names->getNumOperands(); i++)
+			stream << (i ? "," : "") << symbolIds.lookup(cast<MDString>(names->getOperand(i)->getOperand(0))->getString());
+		stream << "];" << NewLine;
+		stream << "var order=[];" << NewLine;
+		stream << "for(var index=0;index<counts.length;index++)if(counts[index])order.push(index);" << NewLine;
+		stream << "order.sort(function(left,right){return (counts[right]>>>0)-(counts[left]>>>0);});" << NewLine;
+		stream << "result+='calls function\\n';" << NewLine;
+		stream << "for(var index=0;index<order.length;index++)result+=(counts[order[index]]>>>0)+' '+symbolName(symbolIds[order[index]])+'\\n';" << NewLine;
+	}
+	// Call tree of the last samples, each node has the number of samples
+	// which went through it
+	stream << "var root={n:0,c:{}},samples=Math.min(__cheerpSampleCount," << maxSamples << ");" << NewLine;
+	stream << "for(var index=0;index<samples;index++){" << NewLine;
+	stream << "var path=__cheerpSamples[index],node=root;" << NewLine;
+	stream << "for(var depth=0;depth<path.length;depth++){node=node.c[path[depth]]||(node.c[path[depth]]={n:0,c:{}});node.n++;}" << NewLine;
+	stream << '}' << NewLine;
+	stream << "result+='\\ncall tree of '+samples+' samples, one every " << Instrumentation::SamplePeriod << " calls of each function\\n';" << NewLine;
+	stream << "function dump(node,indent){" << NewLine;
+	stream << "var keys=Object.keys(node.c).sort(function(left,right){return node.c[right].n-node.c[left].n;});" << NewLine;
+	stream << "for(var index=0;index<keys.length;index++){" << NewLine;
+	stream << "result+=indent+node.c[keys[index]].n+' '+symbolName(keys[index])+'\\n';" << NewLine;
+	stream << "dump(node.c[keys[index]],indent+'  ');" << NewLine;
+	stream << '}' << NewLine;
+	stream << '}' << NewLine;
+	stream << "dump(root,'');" << NewLine;
+	stream << "return result;" << NewLine;
+	stream << '}' << NewLine;
+}
+
 void CheerpWriter::makeJS()
 {
 	if (sourceMapGenerator) {
@@ -5134,8 +5519,20 @@ void CheerpWriter::makeJS()
 	compileNullPtrs();
 
 	// Utility function for loading files
-	if(!wasmFile.empty() || asmJSMem)
+	bool needLazyData = !lazyDataFile.empty() && linearHelper.hasLazyGlobals();
+	if(!wasmFile.empty() || asmJSMem || needLazyData)
 		compileFetchBuffer();
+	if(needLazyData)
+		compileLoadLazyData();
+	const GlobalVariable* counters = module.getGlobalVariable(ProfileInstrumentation::countersName, true);
+	if(counters)
+		compileProfileDump(*counters);
+	if(const NamedMDNode* symbols = module.getNamedMetadata(Instrumentation::symbolsMetadataName))
+		compileInstrumentReport(*symbols, counters);
+	if(!wasmFile.empty() && (wasmStreaming || !wasmModuleHash.empty()))
+		compileInstantiateWasm();
+	if(!wasmFile.empty() && !wasmModuleHash.empty())
+		compileInstantiateCachedWasm();
 
 	if (globalDeps.needAsmJS() && checkBounds)
 	{
@@ -5144,6 +5541,7 @@ void CheerpWriter::makeJS()
 
 	if (globalDeps.needAsmJS() && wasmFile.empty())
 	{
+		PassReport::Phase phase(report, "AsmJSModule");
 		// compile boilerplate
 		stream << "function asmJS(stdlib, ffi, __heap){" << NewLine;
 		stream << "\"use asm\";" << NewLine;
@@ -5168,12 +5566,15 @@ void CheerpWriter::makeJS()
 		for ( const GlobalVariable* GV : linearHelper.globals() )
 			compileGlobalAsmJS(*GV);
 
-		for ( const Function & F : module.getFunctionList() )
 		{
-			if (!F.empty() && F.getSection() == StringRef("asmjs"))
+			PassReport::Phase methodsPhase(report, "Methods");
+			std::vector<const Function*> asmJSFunctions;
+			for ( const Function & F : module.getFunctionList() )
 			{
-				compileMethod(F);
+				if (!F.empty() && F.getSection() == StringRef("asmjs"))
+					asmJSFunctions.push_back(&F);
 			}
+			compileMethods(asmJSFunctions);
 		}
 		compileMemmoveHelperAsmJS();
 
@@ -5234,34 +5635,45 @@ void CheerpWriter::makeJS()
 		compileGlobalsInitAsmJS();
 	}
 
-	for ( const Function & F : module.getFunctionList() )
-		if (!F.empty() && F.getSection() != StringRef("asmjs"))
-		{
+	{
+		PassReport::Phase phase(report, "GenericJSMethods");
+		std::vector<const Function*> genericJSFunctions;
+		for ( const Function & F : module.getFunctionList() )
+			if (!F.empty() && F.getSection() != StringRef("asmjs"))
+			{
 #ifdef CHEERP_DEBUG_POINTERS
-			dumpAllPointers(F, PA);
+				dumpAllPointers(F, PA);
 #endif //CHEERP_DEBUG_POINTERS
-			compileMethod(F);
-		}
-	for ( const GlobalVariable & GV : module.getGlobalList() )
+				genericJSFunctions.push_back(&F);
+			}
+		compileMethods(genericJSFunctions);
+	}
 	{
-		// Skip global ctors array
-		if (GV.getName() == "llvm.global_ctors")
-			continue;
-		if (GV.getSection() != StringRef("asmjs"))
-			compileGlobal(GV);
+		PassReport::Phase phase(report, "GenericJSGlobals");
+		for ( const GlobalVariable & GV : module.getGlobalList() )
+		{
+			// Skip global ctors array
+			if (GV.getName() == "llvm.global_ctors")
+				continue;
+			if (GV.getSection() != StringRef("asmjs"))
+				compileGlobal(GV);
+		}
 	}
 
-	for ( StructType * st : globalDeps.classesUsed() )
 	{
-		if ( st->getNumElements() > V8MaxLiteralProperties )
-			compileClassConstructor(st);
-	}
+		PassReport::Phase phase(report, "Classes");
+		for ( StructType * st : globalDeps.classesUsed() )
+		{
+			if ( st->getNumElements() > V8MaxLiteralProperties )
+				compileClassConstructor(st);
+		}
 
-	for ( StructType * st : globalDeps.classesWithBaseInfo() )
-		compileClassType(st);
+		for ( StructType * st : globalDeps.classesWithBaseInfo() )
+			compileClassType(st);
 
-	for ( Type * st : globalDeps.dynAllocArrays() )
-		compileArrayClassType(st);
+		for ( Type * st : globalDeps.dynAllocArrays() )
+			compileArrayClassType(st);
+	}
 
 	if ( globalDeps.needCreatePointerArray() )
 		compileArrayPointerType();
@@ -5281,6 +5693,8 @@ void CheerpWriter::makeJS()
 			stream << "var " << heapNames[i] << "=null;" << NewLine;
 		stream << "var __asm=null;" << NewLine;
 		stream << "var __heap=null;" << NewLine;
+		if (wasmGrowMemory)
+			compileRefreshHeapHelper();
 		compileAsmJSImports();
 		compileAsmJSExports();
 		stream << "function __dummy() { throw new Error('this should be unreachable'); };" << NewLine;
@@ -5304,9 +5718,22 @@ void CheerpWriter::makeJS()
 			for (StringRef &className : exportedClassNames)
 				stream << className << ".promise=" << NewLine;
 		}
-		stream << "fetchBuffer('" << sys::path::filename(wasmFile) << "').then(r=>" << NewLine;
-		stream << "WebAssembly.instantiate(r,importObject)" << NewLine;
-		stream << ",console.log).then(r=>{" << NewLine;
+		if (!wasmModuleHash.empty())
+		{
+			stream << "instantiateCachedWasm('" << sys::path::filename(wasmFile) << "','" << wasmModuleHash << "',importObject)" << NewLine;
+			stream << ".then(r=>{" << NewLine;
+		}
+		else if (wasmStreaming)
+		{
+			stream << "instantiateWasm('" << sys::path::filename(wasmFile) << "',importObject)" << NewLine;
+			stream << ".then(r=>{" << NewLine;
+		}
+		else
+		{
+			stream << "fetchBuffer('" << sys::path::filename(wasmFile) << "').then(r=>" << NewLine;
+			stream << "WebAssembly.instantiate(r,importObject)" << NewLine;
+			stream << ",console.log).then(r=>{" << NewLine;
+		}
 		stream << "var instance=r.instance;" << NewLine;
 		for (int i = HEAP8; i<=HEAPF64; i++)
 			stream << heapNames[i] << "=new " << typedArrayNames[i] << "(instance.exports.memory.buffer);" << NewLine;
@@ -5345,7 +5772,11 @@ void CheerpWriter::makeJS()
 	} else {
 		llvm::Function* entry = module.getFunction("_start");
 		if(entry)
+		{
 			stream << "__asm." << namegen.getName(entry) << "();" << NewLine;
+			if(wasmGrowMemory)
+				stream << "__refreshHeap();" << NewLine;
+		}
 	}
 
 	//Invoke the entry point
@@ -5356,6 +5787,8 @@ void CheerpWriter::makeJS()
 		else if (wasmFile.empty() && entryPoint->getSection() == StringRef("asmjs"))
 			stream << "__asm.";
 		stream << namegen.getName(entryPoint) << "();" << NewLine;
+		if (wasmGrowMemory && !wasmFile.empty() && entryPoint->getSection() == StringRef("asmjs"))
+			stream << "__refreshHeap();" << NewLine;
 	}
 	if (makeModule == MODULE_TYPE::COMMONJS)
 	{
@@ -5419,9 +5852,9 @@ Relooper* CheerpWriter::runRelooperOnFunction(const llvm::Function& F, const Poi
 	//TODO: Support exceptions
 	Function::const_iterator B=F.begin();
 	Function::const_iterator BE=F.end();
+	Relooper* rl=new Relooper();
 	//First run, create the corresponding relooper blocks
-	std::map<const BasicBlock*, /*relooper::*/Block*> relooperMap;
-	int BlockId = 1;
+	DenseMap<const BasicBlock*, /*relooper::*/Block*> relooperMap;
 	for(;B!=BE;++B)
 	{
 		if(B->isLandingPad())
@@ -5448,7 +5881,11 @@ Relooper* CheerpWriter::runRelooperOnFunction(const llvm::Function& F, const Poi
 				max = std::max(max,curr);
 				min = std::min(min,curr);
 			}
-			if (min >= std::numeric_limits<int32_t>::min() &&
+			//In wasm the br_table index must be an i32, i64 conditions use an if/else chain
+			bool wideCondition = F.getSection() == StringRef("asmjs") &&
+				si->getCondition()->getType()->getIntegerBitWidth() > 32;
+			if (!wideCondition &&
+				min >= std::numeric_limits<int32_t>::min() &&
 				max <= std::numeric_limits<int32_t>::max() && 
 				//NOTE: this number is the maximum allowed by V8 for wasm's br_table,
 				// it is not defined in the spec
@@ -5457,7 +5894,7 @@ Relooper* CheerpWriter::runRelooperOnFunction(const llvm::Function& F, const Poi
 				switchInst = si;
 			}
 		}
-		Block* rlBlock = new Block(&(*B), isSplittable, BlockId++, switchInst);
+		Block* rlBlock = rl->AddBlock(&(*B), isSplittable, switchInst);
 		relooperMap.insert(make_pair(&(*B),rlBlock));
 	}
 
@@ -5516,7 +5953,7 @@ Relooper* CheerpWriter::runRelooperOnFunction(const llvm::Function& F, const Poi
 				hasPrologue = needsPointerKindConversionForBlocks(bbTo, &(*B), PA, registerize);
 			}
 			//Use -1 for the default target
-			bool ret=relooperMap[&(*B)]->AddBranchTo(target, (i==defaultBranchId)?-1:i, hasPrologue);
+			bool ret=rl->AddBranch(relooperMap[&(*B)], target, (i==defaultBranchId)?-1:i, hasPrologue);
 
 			if(ret==false) //More than a path for a single block can only happen for switch
 			{
@@ -5525,16 +5962,7 @@ Relooper* CheerpWriter::runRelooperOnFunction(const llvm::Function& F, const Poi
 		}
 	}
 
-	B=F.begin();
-	BE=F.end();
-	//Third run, add the block to the relooper and run it
-	Relooper* rl=new Relooper(BlockId);
-	for(;B!=BE;++B)
-	{
-		if(B->isLandingPad())
-			continue;
-		rl->AddBlock(relooperMap[&(*B)]);
-	}
+	//The blocks have been added to the relooper while creating them, run it
 	rl->Calculate(relooperMap[&F.getEntryBlock()]);
 	return rl;
 }
@@ -9,6 +9,11 @@ llvm::cl::opt<std::string> WasmFile("cheerp-wasm-file", llvm::cl::Optional,
 llvm::cl::opt<std::string> AsmJSMemFile("cheerp-asmjs-mem-file", llvm::cl::Optional,
   llvm::cl::desc("If specified, the file name of the asm.js module initialized memory dump"), llvm::cl::value_desc("filename"));
 
+llvm::cl::opt<std::string> LazyDataFile("cheerp-lazy-data-file", llvm::cl::Optional,
+  llvm::cl::desc("If specified, the file name of the contents of the globals listed in -cheerp-lazy-data"), llvm::cl::value_desc("filename"));
+
+llvm::cl::list<std::string> LazyData("cheerp-lazy-data", llvm::cl::value_desc("list"), llvm::cl::desc("A list of linear memory globals whose contents are loaded by cheerpLoadLazyData()"), llvm::cl::CommaSeparated);
+
 llvm::cl::opt<std::string> SourceMap("cheerp-sourcemap", llvm::cl::Optional,
   llvm::cl::desc("If specified, the file name of the source map"), llvm::cl::value_desc("filename"));
 
@@ -25,6 +30,8 @@ llvm::cl::opt<bool> SymbolicGlobalsAsmJS("cheerp-asmjs-symbolic-globals", llvm::
 
 llvm::cl::opt<bool> NoRegisterize("cheerp-no-registerize", llvm::cl::desc("Disable registerize pass") );
 
+llvm::cl::opt<bool> RegisterizeColoring("cheerp-registerize-coloring", llvm::cl::desc("Assign registers by coloring an interference graph, usually needs fewer locals") );
+
 llvm::cl::opt<bool> NoNativeJavaScriptMath("cheerp-no-native-math", llvm::cl::desc("Disable native JavaScript math functions") );
 
 llvm::cl::opt<bool> NoJavaScriptMathImul("cheerp-no-math-imul", llvm::cl::desc("Disable JavaScript Math.imul") );
@@ -41,6 +48,40 @@ llvm::cl::list<std::string> ReservedNames("cheerp-reserved-names", llvm::cl::val
 
 llvm::cl::opt<unsigned> CheerpHeapSize("cheerp-linear-heap-size", llvm::cl::init(1), llvm::cl::desc("Desired heap size for the cheerp wasm/asmjs module (in MB)") );
 
-llvm::cl::opt<bool> CheerpNoICF("cheerp-no-icf", llvm::cl::init(0), llvm::cl::desc("Disable identical code folding for wasm/asmjs") );
+llvm::cl::opt<unsigned> CheerpHeapMaxSize("cheerp-linear-heap-max-size", llvm::cl::init(0), llvm::cl::desc("Maximum size the wasm memory can grow to (in MB). If larger than the heap size, the memory starts from the heap size and grows on demand") );
+
+llvm::cl::opt<unsigned> CheerpStackSize("cheerp-linear-stack-size", llvm::cl::init(1), llvm::cl::desc("Size of the stack for a wasm memory that can grow (in MB)") );
+
+llvm::cl::opt<bool> CheerpNoICF("cheerp-no-icf", llvm::cl::init(0), llvm::cl::desc("Disable identical code folding") );
+
+llvm::cl::opt<unsigned> CheerpMergeSimilarFunctions("cheerp-merge-similar-functions", llvm::cl::init(0), llvm::cl::desc("Merge the asm.js and wasm functions which differ in at most this many constants or callees into a shared body, which takes them as extra parameters (0 disables)") );
 
 llvm::cl::opt<bool> BoundsCheck("cheerp-bounds-check", llvm::cl::desc("Generate debug code for bounds-checking arrays") );
+
+llvm::cl::opt<unsigned> CheerpThreads("cheerp-threads", llvm::cl::init(1), llvm::cl::desc("Number of threads used to hash the functions for identical code folding, registerize functions and compile the wasm code section and the JS functions (0 means one per core)") );
+
+llvm::cl::alias WasmThreads("cheerp-wasm-threads", llvm::cl::desc("Alias for -cheerp-threads"), llvm::cl::aliasopt(CheerpThreads) );
+
+llvm::cl::opt<std::string> WasmCacheDir("cheerp-wasm-cache-dir", llvm::cl::Optional,
+  llvm::cl::desc("If specified, reuse the wasm function bodies cached in this directory"), llvm::cl::value_desc("path"));
+
+llvm::cl::opt<bool> WasmStreaming("cheerp-wasm-streaming", llvm::cl::desc("Compile the wasm module while it is downloaded, if the engine supports it") );
+
+llvm::cl::opt<bool> WasmCacheModule("cheerp-wasm-cache-module", llvm::cl::desc("Cache the compiled wasm module in IndexedDB, if the engine supports it") );
+
+llvm::cl::opt<std::string> CheerpPassReport("cheerp-pass-report", llvm::cl::Optional,
+  llvm::cl::desc("If specified, write a JSON report of the time and memory used by each backend pass to this file"), llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<bool> WasmNoPeephole("cheerp-wasm-no-peephole", llvm::cl::desc("Do not clean up the wasm function bodies after they are generated") );
+
+llvm::cl::opt<bool> WasmNoStructurizer("cheerp-wasm-no-structurizer", llvm::cl::desc("Use the Relooper for the control flow of all the wasm functions") );
+
+llvm::cl::opt<bool> CheerpProfileGenerate("cheerp-profile-generate", llvm::cl::desc("Count the calls of the asm.js and wasm functions, the profile is returned by cheerpProfileDump()") );
+
+llvm::cl::opt<std::string> CheerpProfileUse("cheerp-profile-use", llvm::cl::Optional,
+  llvm::cl::desc("If specified, order the asm.js and wasm functions using the profile in this file"), llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<std::string> CheerpInstrument("cheerp-instrument", llvm::cl::Optional,
+  llvm::cl::desc("If specified, count the calls and sample the call stacks of the functions for cheerpInstrumentReport(), and write their symbol map to this file"), llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<unsigned> CheerpInstrumentMinSize("cheerp-instrument-min-size", llvm::cl::init(64), llvm::cl::desc("Do not count the calls of the functions smaller than this many instructions, for which the counter would be as expensive as the body") );
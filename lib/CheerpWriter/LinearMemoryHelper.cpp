@@ -308,23 +308,36 @@ void LinearMemoryHelper::addGlobals()
 	// global variable list.
 	// 2. Sort non-zero initialised variables on alignment to reduce the number
 	// of padding bytes.
+	// 3. Move the lazily loaded variables after everything else, so that
+	// their contents are a contiguous block.
+	if (!LazyDataFile.empty())
+	{
+		for (const std::string& name: LazyData)
+		{
+			const GlobalVariable* G = module.getNamedGlobal(name);
+			if (G && G->getSection() == StringRef("asmjs") && hasNonZeroInitialiser(G))
+				lazyGlobals.insert(G);
+		}
+	}
+
+	auto sortOnAlignment = [targetData] (const GlobalVariable* a, const GlobalVariable* b) {
+		Type* aTy = a->getType()->getPointerElementType();
+		Type* bTy = b->getType()->getPointerElementType();
+		// Bigger alignment should be stored before smaller alignment.
+		return TypeSupport::getAlignmentAsmJS(targetData, aTy) >
+			TypeSupport::getAlignmentAsmJS(targetData, bTy);
+	};
+
 	for (const auto& G: module.globals())
 	{
 		if (G.getSection() != StringRef("asmjs")) continue;
 		if (!hasNonZeroInitialiser(&G)) continue;
+		if (lazyGlobals.count(&G)) continue;
 
 		asmjsGlobals.push_back(&G);
 	}
 
-	std::sort(asmjsGlobals.begin(), asmjsGlobals.end(),
-		[targetData] (const GlobalVariable* a, const GlobalVariable* b) {
-			Type* aTy = a->getType()->getPointerElementType();
-			Type* bTy = b->getType()->getPointerElementType();
-			// Bigger alignment should be stored before smaller alignment.
-			return TypeSupport::getAlignmentAsmJS(targetData, aTy) >
-				TypeSupport::getAlignmentAsmJS(targetData, bTy);
-		}
-	);
+	std::sort(asmjsGlobals.begin(), asmjsGlobals.end(), sortOnAlignment);
 
 	for (const auto& G: module.globals())
 	{
@@ -333,6 +346,14 @@ void LinearMemoryHelper::addGlobals()
 		asmjsGlobals.push_back(&G);
 	}
 
+	size_t firstLazy = asmjsGlobals.size();
+	for (const auto& G: module.globals())
+	{
+		if (lazyGlobals.count(&G))
+			asmjsGlobals.push_back(&G);
+	}
+	std::sort(asmjsGlobals.begin() + firstLazy, asmjsGlobals.end(), sortOnAlignment);
+
 	// Compute the global variable addresses.
 	for (const auto G: asmjsGlobals) {
 		Type* ty = G->getType();
@@ -342,6 +363,8 @@ void LinearMemoryHelper::addGlobals()
 		// The following is correct if alignment is a power of 2 (which it should be)
 		heapStart = (heapStart + alignment - 1) & ~(alignment - 1);
 		globalAddresses.emplace(G, heapStart);
+		if (firstLazy < asmjsGlobals.size() && G == asmjsGlobals[firstLazy])
+			lazyDataStart = heapStart;
 		heapStart += size;
 	}
 }
@@ -378,28 +401,59 @@ void LinearMemoryHelper::addFunctions()
 		unsorted.push_back(&F);
 	}
 
-	// Sort the list of functions by their usage.
-	std::sort(unsorted.begin(), unsorted.end(),
-		[] (Function* a, Function* b) {
-			return a->getNumUses() > b->getNumUses();
+	// Sort the list of functions by their usage. With a profile the executed
+	// functions come first, the most called ones at the front, and the never
+	// executed ones go to the end. Engines which compile lazily find the
+	// startup code together, and the function tables follow the same order.
+	struct FunctionOrder
+	{
+		Function* F;
+		// 0 for the executed functions, 1 for the ones not in the profile,
+		// 2 for the ones which never ran
+		uint32_t rank;
+		uint64_t calls;
+		uint32_t uses;
+	};
+	std::vector<FunctionOrder> order;
+	for (Function* F : unsorted)
+	{
+		FunctionOrder o = { F, 1, 0, F->getNumUses() };
+		if (profile && profile->hasCount(*F))
+		{
+			o.calls = profile->getCount(*F);
+			o.rank = o.calls ? 0 : 2;
+		}
+		order.push_back(o);
+	}
+	std::sort(order.begin(), order.end(),
+		[] (const FunctionOrder& a, const FunctionOrder& b) {
+			if (a.rank != b.rank)
+				return a.rank < b.rank;
+			if (a.calls != b.calls)
+				return a.calls > b.calls;
+			return a.uses > b.uses;
 		}
 	);
 
-	for (auto F : unsorted)
-		asmjsFunctions_.push_back(F);
+	for (const FunctionOrder& o : order)
+		asmjsFunctions_.push_back(o.F);
+
+	auto addFunctionType = [this](const FunctionType* fTy)
+	{
+		const auto& found = functionTypeIndices.find(fTy);
+		if (found == functionTypeIndices.end()) {
+			uint32_t idx = functionTypeIndices.size();
+			functionTypeIndices[fTy] = idx;
+			functionTypes.push_back(fTy);
+			assert(idx < functionTypes.size());
+		}
+	};
 
 	// Add the asm.js imports to the function type list. The non-imported
 	// asm.js functions will be added below.
 	if (!WasmLoader.empty()) {
 		for (const Function* F : globalDeps.asmJSImports()) {
-			const FunctionType* fTy = F->getFunctionType();
-			const auto& found = functionTypeIndices.find(fTy);
-			if (found == functionTypeIndices.end()) {
-				uint32_t idx = functionTypeIndices.size();
-				functionTypeIndices[fTy] = idx;
-				functionTypes.push_back(fTy);
-				assert(idx < functionTypes.size());
-			}
+			addFunctionType(getLegalizedFunctionType(F->getFunctionType()));
 			functionIds.insert(std::make_pair(F, functionIds.size()));
 		}
 	}
@@ -420,13 +474,22 @@ void LinearMemoryHelper::addFunctions()
 		}
 
 		functionIds.insert(std::make_pair(F, functionIds.size()));
+		addFunctionType(fTy);
+	}
 
-		const auto& found = functionTypeIndices.find(fTy);
-		if (found == functionTypeIndices.end()) {
-			uint32_t idx = functionTypeIndices.size();
-			functionTypeIndices[fTy] = idx;
-			functionTypes.push_back(fTy);
-			assert(idx < functionTypes.size());
+	// Exported functions with i64 values in their signature are called from
+	// JS through a wrapper, which is placed after all the other functions.
+	// Follow the module order to keep the ids stable.
+	if (mode == FunctionAddressMode::Wasm)
+	{
+		for (const Function& F : module.functions())
+		{
+			const FunctionType* fTy = F.getFunctionType();
+			if (!globalDeps.asmJSExports().count(&F) || getLegalizedFunctionType(fTy) == fTy)
+				continue;
+			legalizedExportIds.insert(std::make_pair(&F, functionIds.size() + legalizedExports_.size()));
+			legalizedExports_.push_back(&F);
+			addFunctionType(getLegalizedFunctionType(fTy));
 		}
 	}
 
@@ -468,14 +531,53 @@ void LinearMemoryHelper::addFunctions()
 	}
 }
 
+const FunctionType* LinearMemoryHelper::getLegalizedFunctionType(const FunctionType* fTy) const
+{
+	if (mode != FunctionAddressMode::Wasm)
+		return fTy;
+
+	Type* doubleTy = Type::getDoubleTy(module.getContext());
+	auto legalize = [doubleTy](Type* t)
+	{
+		return t->isIntegerTy(64) ? doubleTy : t;
+	};
+	bool changed = fTy->getReturnType()->isIntegerTy(64);
+	std::vector<Type*> params;
+	for (Type* t : fTy->params())
+	{
+		changed |= t->isIntegerTy(64);
+		params.push_back(legalize(t));
+	}
+	if (!changed)
+		return fTy;
+	return FunctionType::get(legalize(fTy->getReturnType()), params, fTy->isVarArg());
+}
+
+uint32_t LinearMemoryHelper::getExportedFunctionId(const Function* F) const
+{
+	auto it = legalizedExportIds.find(F);
+	if (it != legalizedExportIds.end())
+		return it->second;
+	return functionIds.at(F);
+}
+
 void LinearMemoryHelper::addHeapStart()
 {
+	// Align to 8 bytes
+	heapStart = (heapStart + 7) & ~7;
+
+	// A memory that can grow has no fixed end to start the stack from, and the
+	// heap must be free to expand upwards. Reserve the stack below the heap.
+	if (stackSize)
+	{
+		heapStart += (stackSize + 7) & ~7;
+		stackTop = heapStart;
+	}
+
 	GlobalVariable* heapStartVar = module.getNamedGlobal("_heapStart");
 
 	if (heapStartVar)
 	{
-		// Align to 8 bytes
-		heapStart = (heapStart + 7) & ~7;
 		ConstantInt* addr = ConstantInt::get(IntegerType::getInt32Ty(module.getContext()), heapStart, false);
 		Constant* heapInit = ConstantExpr::getIntToPtr(addr, heapStartVar->getType()->getElementType(), false);
 		heapStartVar->setInitializer(heapInit);
@@ -483,6 +585,31 @@ void LinearMemoryHelper::addHeapStart()
 	}
 }
 
+void LinearMemoryHelper::compileLazyData(raw_ostream& os) const
+{
+	struct StreamBytesWriter: public ByteListener
+	{
+		raw_ostream& os;
+		StreamBytesWriter(raw_ostream& os):os(os)
+		{
+		}
+		void addByte(uint8_t b) override {os << (char)b;};
+	};
+	StreamBytesWriter bytesWriter(os);
+	const auto& targetData = *module.getDataLayout();
+	uint32_t address = lazyDataStart;
+	for (const GlobalVariable* G: asmjsGlobals)
+	{
+		if (!isLazyGlobal(G))
+			continue;
+		// Zero fill the padding between the globals
+		for (uint32_t a = address; a < getGlobalVariableAddress(G); a++)
+			os << (char)0;
+		compileConstantAsBytes(G->getInitializer(), /* asmjs */ true, &bytesWriter);
+		address = getGlobalVariableAddress(G) + targetData.getTypeAllocSize(G->getType()->getPointerElementType());
+	}
+}
+
 uint32_t LinearMemoryHelper::getGlobalVariableAddress(const GlobalVariable* G) const
 {
 	assert(globalAddresses.count(G));
@@ -4,7 +4,7 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include <list>
+#include <deque>
 #include <stack>
 
 template <class T, class U> static bool contains(const T& container, const U& contained) {
@@ -25,9 +25,6 @@ Branch::Branch(int bId, bool hasPrologue) : Ancestor(NULL), Labeled(true), branc
                                             hasPrologue(hasPrologue) {
 }
 
-Branch::~Branch() {
-}
-
 void Branch::Render(Block *Target, bool SetLabel, RenderInterface* renderInterface) {
   if (SetLabel) renderInterface->renderLabel(Target->Id);
   if (Ancestor) {
@@ -59,22 +56,6 @@ Block::Block(const llvm::BasicBlock* b, bool s, int Id, const llvm::SwitchInst*
     IsSplittable(s)
 { }
 
-Block::~Block() {
-  for (BlockSet::iterator iter = ProcessedBranchesIn.begin(); iter != ProcessedBranchesIn.end(); iter++) {
-    delete *iter;
-  }
-  for (BlockBranchMap::iterator iter = ProcessedBranchesOut.begin(); iter != ProcessedBranchesOut.end(); iter++) {
-    delete iter->second;
-  }
-}
-
-bool Block::AddBranchTo(Block *Target, int branchId, bool hasPrologue) {
-  if(contains(BranchesOut, Target)) // cannot add more than one branch to the same target
-    return false;
-  BranchesOut[Target] = new Branch(branchId, hasPrologue);
-  return true;
-}
-
 void Block::Render(bool InLoop, RenderInterface* renderInterface) {
   if (IsCheckedMultipleEntry && InLoop) {
     renderInterface->renderLabel(0);
@@ -277,16 +258,26 @@ void LoopShape::Render(bool InLoop, RenderInterface* renderInterface) {
 
 // Relooper
 
-Relooper::Relooper(int BlockCount) : Root(NULL), MinSize(false), NeedsLabel(false), IdCounter(BlockCount) {
+Relooper::Relooper() : Root(NULL), MinSize(false), NeedsLabel(false), IdCounter(1) {
 }
 
 Relooper::~Relooper() {
-  for (unsigned i = 0; i < Blocks.size(); i++) delete Blocks[i];
-  for (unsigned i = 0; i < Shapes.size(); i++) delete Shapes[i];
+  // The memory belongs to the allocator, only run the destructors
+  for (unsigned i = 0; i < Blocks.size(); i++) Blocks[i]->~Block();
+  for (unsigned i = 0; i < Shapes.size(); i++) Shapes[i]->~Shape();
 }
 
-void Relooper::AddBlock(Block *New) {
+Block *Relooper::AddBlock(const llvm::BasicBlock* llvmBlock, bool splittable, const llvm::SwitchInst* llvmSwitchInst) {
+  Block *New = new (Allocator.Allocate<Block>()) Block(llvmBlock, splittable, IdCounter++, llvmSwitchInst);
   Blocks.push_back(New);
+  return New;
+}
+
+bool Relooper::AddBranch(Block *From, Block *Target, int branchId, bool hasPrologue) {
+  if(contains(From->BranchesOut, Target)) // cannot add more than one branch to the same target
+    return false;
+  From->BranchesOut[Target] = NewBranch(branchId, hasPrologue);
+  return true;
 }
 
 struct RelooperRecursor {
@@ -294,7 +285,7 @@ struct RelooperRecursor {
   RelooperRecursor(Relooper *ParentInit) : Parent(ParentInit) {}
 };
 
-typedef std::list<Block*> BlockList;
+typedef std::deque<Block*> BlockList;
 
 void Relooper::Calculate(Block *Entry) {
   // Scan and optimize the input
@@ -331,17 +322,15 @@ void Relooper::Calculate(Block *Entry) {
         // Split the node (for simplicity, we replace all the blocks, even though we could have reused the original)
         for (BlockSet::iterator iter = Original->BranchesIn.begin(); iter != Original->BranchesIn.end(); iter++) {
           Block *Prior = *iter;
-          Block *Split = new Block(Original->llvmBlock, Original->IsSplittable, Parent->IdCounter++, Original->llvmSwitchInst);
-          Parent->AddBlock(Split);
+          Block *Split = Parent->AddBlock(Original->llvmBlock, Original->IsSplittable, Original->llvmSwitchInst);
           Split->BranchesIn.insert(Prior);
           Branch *Details = Prior->BranchesOut[Original];
-          Prior->BranchesOut[Split] = new Branch(Details->branchId, Details->hasPrologue);
-          delete Details; // TODO: is this ok?
+          Prior->BranchesOut[Split] = Parent->NewBranch(Details->branchId, Details->hasPrologue);
           Prior->BranchesOut.erase(Original);
           for (BlockBranchMap::iterator iter = Original->BranchesOut.begin(); iter != Original->BranchesOut.end(); iter++) {
             Block *Post = iter->first;
             Branch *Details = iter->second;
-            Split->BranchesOut[Post] = new Branch(Details->branchId, Details->hasPrologue);
+            Split->BranchesOut[Post] = Parent->NewBranch(Details->branchId, Details->hasPrologue);
             Post->BranchesIn.insert(Split);
           }
           Splits.insert(Split);
@@ -379,11 +368,6 @@ void Relooper::Calculate(Block *Entry) {
   struct Analyzer : public RelooperRecursor {
     Analyzer(Relooper *Parent) : RelooperRecursor(Parent) {}
 
-    // Add a shape to the list of shapes in this Relooper calculation
-    void Notice(Shape *New) {
-      Parent->Shapes.push_back(New);
-    }
-
     // Create a list of entries from a block. If LimitTo is provided, only results in that set
     // will appear
     void GetBlocksOut(Block *Source, BlockSet& Entries, BlockSet *LimitTo=NULL) {
@@ -421,8 +405,7 @@ void Relooper::Calculate(Block *Entry) {
 
     Shape *MakeSimple(BlockSet &Blocks, Block *Inner, BlockSet &NextEntries) {
       PrintDebug("creating simple block with block #%d\n", Inner->Id);
-      SimpleShape *Simple = new SimpleShape(Parent->IdCounter++);
-      Notice(Simple);
+      SimpleShape *Simple = Parent->NewShape<SimpleShape>();
       Simple->Inner = Inner;
       Inner->Parent = Simple;
       if (Blocks.size() > 1) {
@@ -502,8 +485,7 @@ void Relooper::Calculate(Block *Entry) {
 
       // TODO: Optionally hoist additional blocks into the loop
 
-      LoopShape *Loop = new LoopShape(Parent->IdCounter++);
-      Notice(Loop);
+      LoopShape *Loop = Parent->NewShape<LoopShape>();
 
       // Solipsize the loop, replacing with break/continue and marking branches as Processed (will not affect later calculations)
       // A. Branches to the loop entries become a continue to this shape
@@ -525,7 +507,7 @@ void Relooper::Calculate(Block *Entry) {
     // ignore directly reaching the entry itself by another entry.
     //   @param Ignore - previous blocks that are irrelevant
     void FindIndependentGroups(BlockSet &Entries, BlockBlockSetMap& IndependentGroups, BlockSet *Ignore=NULL) {
-      typedef std::map<Block*, Block*> BlockBlockMap;
+      typedef llvm::DenseMap<Block*, Block*> BlockBlockMap;
 
       struct HelperClass {
         BlockBlockSetMap& IndependentGroups;
@@ -613,7 +595,8 @@ void Relooper::Calculate(Block *Entry) {
           for (BlockSet::iterator iter = Child->BranchesIn.begin(); iter != Child->BranchesIn.end(); iter++) {
             Block *Parent = *iter;
             if (Ignore && contains(*Ignore, Parent)) continue;
-            if (Helper.Ownership[Parent] != Helper.Ownership[Child]) {
+            Block *ParentOwner = Helper.Ownership[Parent];
+            if (ParentOwner != Helper.Ownership[Child]) {
               ToInvalidate.push_back(Child);
             }
           }
@@ -643,8 +626,7 @@ void Relooper::Calculate(Block *Entry) {
     Shape *MakeMultiple(BlockSet &Blocks, BlockSet& Entries, BlockBlockSetMap& IndependentGroups, Shape *Prev, BlockSet &NextEntries) {
       PrintDebug("creating multiple block with %d inner groups\n", IndependentGroups.size());
       bool Fused = !!(Shape::IsSimple(Prev));
-      MultipleShape *Multiple = new MultipleShape(Parent->IdCounter++);
-      Notice(Multiple);
+      MultipleShape *Multiple = Parent->NewShape<MultipleShape>();
       BlockSet CurrEntries;
       for (BlockBlockSetMap::iterator iter = IndependentGroups.begin(); iter != IndependentGroups.end(); iter++) {
         Block *CurrEntry = iter->first;
@@ -15,13 +15,13 @@ LLVM.
 #include <stdlib.h>
 
 #include <map>
-#include <deque>
 #include <set>
 #include <vector>
-#include <list>
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/Support/Allocator.h"
 
 struct Block;
 struct Shape;
@@ -79,44 +79,79 @@ struct Branch {
   bool hasPrologue;
 
   Branch(int bId, bool hasPrologue);
-  ~Branch();
 
   // Prints out the branch
   void Render(Block *Target, bool SetLabel, RenderInterface* renderInterface);
 };
 
+// Iterates over the live elements of an InsertOrderedSet or InsertOrderedMap.
+// Iterators are positions in the list of the container, so they stay valid
+// when other elements are inserted or erased, like std::list iterators
+template<typename Container, typename Value>
+struct InsertOrderedIterator
+{
+  Container* C;
+  size_t Pos;
+
+  InsertOrderedIterator(Container* C, size_t Pos) : C(C), Pos(Pos) {}
+  Value& operator*() const { return C->List[Pos]; }
+  Value* operator->() const { return &C->List[Pos]; }
+  InsertOrderedIterator& operator++() {
+    Pos = C->nextLive(Pos + 1);
+    return *this;
+  }
+  InsertOrderedIterator operator++(int) {
+    InsertOrderedIterator Ret = *this;
+    ++*this;
+    return Ret;
+  }
+  bool operator==(const InsertOrderedIterator& other) const {
+    // The end moves when elements are appended, compare it by value
+    bool AtEnd = Pos >= C->List.size();
+    bool OtherAtEnd = other.Pos >= other.C->List.size();
+    return (AtEnd || OtherAtEnd) ? AtEnd == OtherAtEnd : Pos == other.Pos;
+  }
+  bool operator!=(const InsertOrderedIterator& other) const { return !(*this == other); }
+};
+
 // like std::set, except that begin() -> end() iterates in the
 // order that elements were added to the set (not in the order
-// of operator<(T, T))
+// of operator<(T, T)). T must be a pointer type: erased elements are
+// left in the list as null entries, which the iterators skip
 template<typename T>
 struct InsertOrderedSet
 {
-  std::map<T, typename std::list<T>::iterator>  Map;
-  std::list<T>                                  List;
+  llvm::SmallDenseMap<T, unsigned, 4> Map; // element -> position in List
+  std::vector<T>                      List;
+  size_t                              First = 0; // position of the first live element
 
-  typedef typename std::list<T>::iterator iterator;
-  iterator begin() { return List.begin(); }
-  iterator end() { return List.end(); }
+  typedef InsertOrderedIterator<InsertOrderedSet, T> iterator;
+  iterator begin() { return iterator(this, First); }
+  iterator end() { return iterator(this, List.size()); }
+
+  size_t nextLive(size_t Pos) const {
+    while (Pos < List.size() && !List[Pos]) Pos++;
+    return Pos;
+  }
 
   void erase(const T& val) {
     auto it = Map.find(val);
     if (it != Map.end()) {
-      List.erase(it->second);
+      List[it->second] = nullptr;
       Map.erase(it);
+      First = nextLive(First);
     }
   }
 
   void erase(iterator position) {
-    Map.erase(*position);
-    List.erase(position);
+    erase(*position);
   }
 
   // cheating a bit, not returning the iterator
   void insert(const T& val) {
-    auto it = Map.find(val);
-    if (it == Map.end()) {
+    if (Map.insert(std::make_pair(val, List.size())).second) {
       List.push_back(val);
-      Map.insert(std::make_pair(val, --List.end()));
+      First = nextLive(First);
     }
   }
 
@@ -125,50 +160,46 @@ struct InsertOrderedSet
   void clear() {
     Map.clear();
     List.clear();
+    First = 0;
   }
 
   size_t count(const T& val) const { return Map.count(val); }
-
-  InsertOrderedSet() {}
-  InsertOrderedSet(const InsertOrderedSet& other) {
-    for (auto i : other.List) {
-      insert(i); // inserting manually creates proper iterators
-    }
-  }
-  InsertOrderedSet& operator=(const InsertOrderedSet& other) {
-    abort(); // TODO, watch out for iterators
-  }
 };
 
 // like std::map, except that begin() -> end() iterates in the
 // order that elements were added to the map (not in the order
-// of operator<(Key, Key))
+// of operator<(Key, Key)). Key must be a pointer type, see InsertOrderedSet
 template<typename Key, typename T>
 struct InsertOrderedMap
 {
-  std::map<Key, typename std::list<std::pair<Key,T>>::iterator> Map;
-  std::list<std::pair<Key,T>>                                   List;
+  llvm::SmallDenseMap<Key, unsigned, 4> Map; // key -> position in List
+  std::vector<std::pair<Key,T>>         List;
+  size_t                                First = 0; // position of the first live element
 
   T& operator[](const Key& k) {
-    auto it = Map.find(k);
-    if (it == Map.end()) {
+    auto it = Map.insert(std::make_pair(k, List.size()));
+    if (it.second) {
       List.push_back(std::make_pair(k, T()));
-      auto e = --List.end();
-      Map.insert(std::make_pair(k, e));
-      return e->second;
+      First = nextLive(First);
     }
-    return it->second->second;
+    return List[it.first->second].second;
   }
 
-  typedef typename std::list<std::pair<Key,T>>::iterator iterator;
-  iterator begin() { return List.begin(); }
-  iterator end() { return List.end(); }
+  typedef InsertOrderedIterator<InsertOrderedMap, std::pair<Key,T>> iterator;
+  iterator begin() { return iterator(this, First); }
+  iterator end() { return iterator(this, List.size()); }
+
+  size_t nextLive(size_t Pos) const {
+    while (Pos < List.size() && !List[Pos].first) Pos++;
+    return Pos;
+  }
 
   void erase(const Key& k) {
     auto it = Map.find(k);
     if (it != Map.end()) {
-      List.erase(it->second);
+      List[it->second] = std::make_pair(Key(), T());
       Map.erase(it);
+      First = nextLive(First);
     }
   }
 
@@ -178,14 +209,6 @@ struct InsertOrderedMap
 
   size_t size() const { return Map.size(); }
   size_t count(const Key& k) const { return Map.count(k); }
-
-  InsertOrderedMap() {}
-  InsertOrderedMap(InsertOrderedMap& other) {
-    abort(); // TODO, watch out for iterators
-  }
-  InsertOrderedMap& operator=(const InsertOrderedMap& other) {
-    abort(); // TODO, watch out for iterators
-  }
 };
 
 
@@ -199,7 +222,7 @@ struct Block {
   // when we recreate a loop, branches to the loop start become continues and are now
   // processed. When we calculate what shape to generate from a set of blocks, we ignore
   // processed branches.
-  // Blocks own the Branch objects they use, and destroy them when done.
+  // The Branch objects are allocated by the Relooper, together with the blocks.
   BlockBranchMap BranchesOut;
   BlockSet BranchesIn;
   BlockBranchMap ProcessedBranchesOut;
@@ -214,12 +237,6 @@ struct Block {
   bool IsSplittable;
 
   Block(const llvm::BasicBlock* llvmBlock, bool splittable, int Id, const llvm::SwitchInst* llvmSwitchInst = NULL);
-  ~Block();
-
-  /*
-   * Return false is a branch to the Target already exists
-   */
-  bool AddBranchTo(Block *Target, int branchId, bool hasPrologue);
 
   // Prints out the instructions code and branchings
   void Render(bool InLoop, RenderInterface* renderInterface);
@@ -330,19 +347,38 @@ struct LoopShape : public LabeledShape {
 //  3. Call Render().
 //
 // Implementation details: The Relooper instance has
-// ownership of the blocks and shapes, and frees them when done.
+// ownership of the blocks, branches and shapes. They are allocated
+// in its arena and freed all at once when it is destroyed.
 struct Relooper {
-  std::deque<Block*> Blocks;
-  std::deque<Shape*> Shapes;
+  llvm::BumpPtrAllocator Allocator;
+  std::vector<Block*> Blocks;
+  std::vector<Shape*> Shapes;
   Shape *Root;
   bool MinSize;
   bool NeedsLabel;
   int IdCounter;
 
-  Relooper(int BlockCount);
+  Relooper();
   ~Relooper();
 
-  void AddBlock(Block *New);
+  // Creates a new block with the next free id
+  Block *AddBlock(const llvm::BasicBlock* llvmBlock, bool splittable, const llvm::SwitchInst* llvmSwitchInst = NULL);
+
+  /*
+   * Return false is a branch to the Target already exists
+   */
+  bool AddBranch(Block *From, Block *Target, int branchId, bool hasPrologue);
+
+  Branch *NewBranch(int branchId, bool hasPrologue) {
+    return new (Allocator.Allocate<Branch>()) Branch(branchId, hasPrologue);
+  }
+
+  template<typename ShapeT>
+  ShapeT *NewShape() {
+    ShapeT *New = new (Allocator.Allocate<ShapeT>()) ShapeT(IdCounter++);
+    Shapes.push_back(New);
+    return New;
+  }
 
   // Calculates the shapes
   void Calculate(Block *Entry);
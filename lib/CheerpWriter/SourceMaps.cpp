@@ -23,11 +23,22 @@ namespace cheerp
 {
 
 SourceMapGenerator::SourceMapGenerator(const std::string& sourceMapName, const std::string& sourceMapPrefix, bool standAlone, llvm::LLVMContext& C, std::error_code& ErrorCode):
-	sourceMap(sourceMapName.c_str(), ErrorCode, sys::fs::F_None), sourceMapName(sourceMapName), sourceMapPrefix(sourceMapPrefix),
+	sourceMap(new tool_output_file(sourceMapName.c_str(), ErrorCode, sys::fs::F_None)), sourceMapName(sourceMapName), sourceMapPrefix(sourceMapPrefix),
 	Ctx(C), lastFile(0), lastLine(0), lastColumn(0), lastOffset(0), lineOffset(0), lastName(0), currentDebugLoc(nullptr), standAlone(standAlone), lineBegin(true)
 {
 }
 
+SourceMapGenerator::SourceMapGenerator(const SourceMapGenerator* parent):
+	sourceMapName(parent->sourceMapName), sourceMapPrefix(parent->sourceMapPrefix),
+	Ctx(parent->Ctx), lastFile(0), lastLine(0), lastColumn(0), lastOffset(0), lineOffset(0), lastName(0), currentDebugLoc(nullptr), standAlone(parent->standAlone), lineBegin(true)
+{
+}
+
+std::unique_ptr<SourceMapGenerator> SourceMapGenerator::createRecorder(const SourceMapGenerator& parent)
+{
+	return std::unique_ptr<SourceMapGenerator>(new SourceMapGenerator(&parent));
+}
+
 static char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
 void SourceMapGenerator::writeBase64VLQInt(int i)
@@ -44,12 +55,16 @@ void SourceMapGenerator::writeBase64VLQInt(int i)
 		i >>= 5;
 		if(i)
 			base64Char |= 0x20;
-		sourceMap.os() << base64Chars[base64Char];
+		sourceMap->os() << base64Chars[base64Char];
 	}
 	while(i);
 }
 
 void SourceMapGenerator::setFunctionName(const llvm::DISubprogram &method) {
+	if (!sourceMap) {
+		recordedSegments.emplace_back(Segment::FUNCTION_NAME, lineOffset, method);
+		return;
+	}
 	StringRef fileName = method.getFilename();
 	unsigned lineNumber = method.getLineNumber();
 	StringRef functionName = method.getLinkageName();
@@ -74,7 +89,7 @@ void SourceMapGenerator::setFunctionName(const llvm::DISubprogram &method) {
 	uint32_t currentColumn = 0;
 
 	if(!lineBegin)
-		sourceMap.os() << ',';
+		sourceMap->os() << ',';
 	lineBegin = false;
 
 	// Starting column in the generated code
@@ -99,6 +114,12 @@ void SourceMapGenerator::setFunctionName(const llvm::DISubprogram &method) {
 void SourceMapGenerator::setDebugLoc(const llvm::DebugLoc* debugLoc)
 {
 	currentDebugLoc = debugLoc;
+	if(!sourceMap)
+	{
+		// The file indices are assigned when the segments are appended
+		recordedSegments.emplace_back(Segment::DEBUG_LOC, lineOffset, DISubprogram(), debugLoc);
+		return;
+	}
 	if(debugLoc == nullptr)
 		return;
 	MDNode* file = debugLoc->getScope(Ctx);
@@ -114,7 +135,7 @@ void SourceMapGenerator::setDebugLoc(const llvm::DebugLoc* debugLoc)
 	uint32_t currentLine = debugLoc->getLine() - 1;
 	uint32_t currentColumn = debugLoc->getCol() - 1;
 	if(!lineBegin)
-		sourceMap.os() << ',';
+		sourceMap->os() << ',';
 	lineBegin = false;
 	// Starting column in the generated code
 	writeBase64VLQInt(lineOffset - lastOffset);
@@ -135,14 +156,21 @@ void SourceMapGenerator::setDebugLoc(const llvm::DebugLoc* debugLoc)
 void SourceMapGenerator::beginFile()
 {
 	// Output the prologue of the file
-	sourceMap.os() << "{\n";
-	sourceMap.os() << "\"version\": 3,\n";
-	sourceMap.os() << "\"mappings\": \"";
+	sourceMap->os() << "{\n";
+	sourceMap->os() << "\"version\": 3,\n";
+	sourceMap->os() << "\"mappings\": \"";
 }
 
 void SourceMapGenerator::finishLine()
 {
-	sourceMap.os() << ";";
+	if(!sourceMap)
+	{
+		// The last known debugLoc is repeated when the segments are appended
+		recordedSegments.emplace_back(Segment::NEW_LINE, lineOffset);
+		lineOffset = 0;
+		return;
+	}
+	sourceMap->os() << ";";
 	lastOffset = 0;
 	lineOffset = 0;
 	lineBegin = true;
@@ -154,16 +182,16 @@ void SourceMapGenerator::finishLine()
 void SourceMapGenerator::endFile()
 {
 	// Output the prologue of the file
-	sourceMap.os() << "\",\n";
+	sourceMap->os() << "\",\n";
 	// Output file names
 	SmallVector<StringRef, 10> files(fileMap.size());
 	for(auto mapItem: fileMap)
 		files[mapItem.second] = mapItem.first;
-	sourceMap.os() << "\"sources\": [";
+	sourceMap->os() << "\"sources\": [";
 	for(uint32_t i=0;i<files.size();i++)
 	{
 		if(i!=0)
-			sourceMap.os() << ',';
+			sourceMap->os() << ',';
 		// Fix slashes in the file path
 		std::string tmp;
 		StringRef string = files[i];
@@ -178,49 +206,87 @@ void SourceMapGenerator::endFile()
 				c='/';
 			tmp.push_back(c);
 		}
-		sourceMap.os() << '"' << tmp << '"';
+		sourceMap->os() << '"' << tmp << '"';
 	}
-	sourceMap.os() << "],\n";
+	sourceMap->os() << "],\n";
 	// Output the contents of source files, if required
-	sourceMap.os() << "\"sourcesContent\": [";
+	sourceMap->os() << "\"sourcesContent\": [";
 	for(uint32_t i=0;i<files.size();i++)
 	{
 		if(i!=0)
-			sourceMap.os() << ',';
+			sourceMap->os() << ',';
 		if(files[i][0] != '/' && !standAlone)
 		{
-			sourceMap.os() << "null";
+			sourceMap->os() << "null";
 			continue;
 		}
 		llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buf = llvm::MemoryBuffer::getFile(files[i], -1, false);
 		std::error_code EC = Buf.getError();
 		if (EC)
 		{
-			sourceMap.os() << "null";
+			sourceMap->os() << "null";
 			llvm::errs() << "warning: Could not open source file " << files[i] << "\n";
 			continue;
 		}
-		sourceMap.os() << '"';
-		CheerpWriter::compileEscapedString(sourceMap.os(), Buf.get()->getBuffer(), /*forJSON*/true);
-		sourceMap.os() << '"';
+		sourceMap->os() << '"';
+		CheerpWriter::compileEscapedString(sourceMap->os(), Buf.get()->getBuffer(), /*forJSON*/true);
+		sourceMap->os() << '"';
 	}
-	sourceMap.os() << "],\n";
+	sourceMap->os() << "],\n";
 	// Output the symbol names
 	SmallVector<StringRef, 10> functions(functionNameMap.size());
 	for(auto mapItem: functionNameMap)
 		functions[mapItem.second] = mapItem.first;
-	sourceMap.os() << "\"names\": [";
+	sourceMap->os() << "\"names\": [";
 	for(uint32_t i=0; i < functions.size(); i++)
 	{
 		if (i != 0)
-			sourceMap.os() << ',';
+			sourceMap->os() << ',';
 		// Add an underscore to the function name to match the generated symbol
 		// names in the JavaScript file.
-		sourceMap.os() << '"' << functions[i] << '"';
+		sourceMap->os() << '"' << functions[i] << '"';
+	}
+	sourceMap->os() << "]\n";
+	sourceMap->os() << "}\n";
+	sourceMap->keep();
+}
+
+std::vector<SourceMapGenerator::Segment> SourceMapGenerator::takeSegments()
+{
+	assert(!sourceMap && "Only recorders have segments");
+	recordedSegments.emplace_back(Segment::CODE_END, lineOffset);
+	std::vector<Segment> ret;
+	ret.swap(recordedSegments);
+	lineOffset = 0;
+	currentDebugLoc = nullptr;
+	return ret;
+}
+
+void SourceMapGenerator::appendSegments(const std::vector<Segment>& segments)
+{
+	// Replay the calls which the recorder received, so that the map is the
+	// same as if the code was generated in place
+	uint32_t offset = 0;
+	for(const Segment& s: segments)
+	{
+		addLineOffset(s.lineOffset - offset);
+		offset = s.lineOffset;
+		switch(s.kind)
+		{
+			case Segment::FUNCTION_NAME:
+				setFunctionName(s.method);
+				break;
+			case Segment::DEBUG_LOC:
+				setDebugLoc(s.debugLoc);
+				break;
+			case Segment::NEW_LINE:
+				finishLine();
+				offset = 0;
+				break;
+			case Segment::CODE_END:
+				break;
+		}
 	}
-	sourceMap.os() << "]\n";
-	sourceMap.os() << "}\n";
-	sourceMap.keep();
 }
 
 std::string SourceMapGenerator::getSourceMapName() const
@@ -478,16 +478,20 @@ void CheerpWriter::compileArrayPointerType()
 		<< NewLine;
 }
 
-bool CheerpWriter::needsUnsignedTruncation(std::unordered_set<const llvm::Value*> visited, const Value* v) const
+namespace {
+
+// How a value decides if it needs an explicit truncation to be used as unsigned
+enum TRUNCATION_RULE { TRUNCATION_NEVER = 0, TRUNCATION_ALWAYS, TRUNCATION_ANY_OPERAND, TRUNCATION_ALL_OPERANDS };
+
+// The operands that the rule depends on are returned in operands
+TRUNCATION_RULE getTruncationRule(const Value* v, SmallVectorImpl<const Value*>& operands)
 {
 	if(!v->getType()->isIntegerTy(8) && !v->getType()->isIntegerTy(16))
-		return true;
-	if(!visited.insert(v).second)
-		return false;
+		return TRUNCATION_ALWAYS;
 	if(isa<ConstantInt>(v))
 	{
 		// Constants are compiled as zero extended
-		return false;
+		return TRUNCATION_NEVER;
 	}
 	else if(const LoadInst* LI = dyn_cast<LoadInst>(v))
 	{
@@ -501,47 +505,113 @@ bool CheerpWriter::needsUnsignedTruncation(std::unordered_set<const llvm::Value*
 				// 1 element arrays are represented as normal JS arrays, but longer arrays are always typed arrays
 				// i8 and i16 typed arrays are unsigned, so we don't need the truncation
 				bool comesFromTypedArray = isa<ArrayType>(containerType) && cast<ArrayType>(containerType)->getNumElements() > 1;
-				return !comesFromTypedArray;
+				return comesFromTypedArray ? TRUNCATION_NEVER : TRUNCATION_ALWAYS;
 			}
 			else
 			{
 				ConstantInt* lastOperand = dyn_cast<ConstantInt>(cast<User>(ptr)->getOperand(numOp-1));
-				return !(lastOperand && lastOperand->getSExtValue() > 0);
+				return (lastOperand && lastOperand->getSExtValue() > 0) ? TRUNCATION_NEVER : TRUNCATION_ALWAYS;
 			}
 		}
 	}
 	else if(const PHINode* phi = dyn_cast<PHINode>(v))
 	{
 		for(uint32_t i=0;i<phi->getNumIncomingValues();i++)
-		{
-			const Value* incoming = phi->getIncomingValue(i);
-			if(needsUnsignedTruncation(visited, incoming))
-				return true;
-		}
-		return false;
+			operands.push_back(phi->getIncomingValue(i));
+		return TRUNCATION_ANY_OPERAND;
 	}
 	else if(const Instruction* I = dyn_cast<Instruction>(v))
 	{
 		if(I->getOpcode() == Instruction::And)
 		{
-			return needsUnsignedTruncation(visited, I->getOperand(0)) && needsUnsignedTruncation(visited, I->getOperand(1));
+			operands.append(I->op_begin(), I->op_end());
+			return TRUNCATION_ALL_OPERANDS;
 		}
 		else if(I->getOpcode() == Instruction::Xor || I->getOpcode() == Instruction::Or)
 		{
-			return needsUnsignedTruncation(visited, I->getOperand(0)) || needsUnsignedTruncation(visited, I->getOperand(1));
+			operands.append(I->op_begin(), I->op_end());
+			return TRUNCATION_ANY_OPERAND;
 		}
 		else if(I->getOpcode() == Instruction::Select)
 		{
-			return needsUnsignedTruncation(visited, I->getOperand(1)) || needsUnsignedTruncation(visited, I->getOperand(2));
+			operands.push_back(I->getOperand(1));
+			operands.push_back(I->getOperand(2));
+			return TRUNCATION_ANY_OPERAND;
 		}
 		else if(I->getOpcode() == Instruction::ZExt || I->getOpcode() == Instruction::LShr)
+			return TRUNCATION_NEVER;
+	}
+	return TRUNCATION_ALWAYS;
+}
+
+}
+
+bool CheerpWriter::evaluateUnsignedTruncation(const Value* v) const
+{
+	SmallVector<const Value*, 4> operands, unused;
+	TRUNCATION_RULE rule = getTruncationRule(v, operands);
+	if(rule == TRUNCATION_NEVER || rule == TRUNCATION_ALWAYS)
+		return rule == TRUNCATION_ALWAYS;
+	for(const Value* op: operands)
+	{
+		// Only instructions have operand dependent rules
+		bool opNeedsTruncation = isa<Instruction>(op) ? unsignedTruncationSet.count(op) : getTruncationRule(op, unused) == TRUNCATION_ALWAYS;
+		if(opNeedsTruncation && rule == TRUNCATION_ANY_OPERAND)
+			return true;
+		if(!opNeedsTruncation && rule == TRUNCATION_ALL_OPERANDS)
 			return false;
 	}
-	return true;
+	return rule == TRUNCATION_ALL_OPERANDS;
+}
+
+void CheerpWriter::computeUnsignedTruncation(const Function& F)
+{
+	// Compute the smallest set of values that satisfies the rules: a cycle of
+	// PHIs only needs the truncation if a value flowing into it does.
+	// Start from the values that need it regardless of their operands and
+	// propagate to the users until nothing changes.
+	unsignedTruncationFunction = &F;
+	unsignedTruncationSet.clear();
+	SmallVector<const Instruction*, 32> worklist;
+	for(const BasicBlock& BB: F)
+	{
+		for(const Instruction& I: BB)
+		{
+			if(evaluateUnsignedTruncation(&I))
+			{
+				unsignedTruncationSet.insert(&I);
+				worklist.push_back(&I);
+			}
+		}
+	}
+	while(!worklist.empty())
+	{
+		const Instruction* I = worklist.pop_back_val();
+		for(const User* U: I->users())
+		{
+			const Instruction* userInst = dyn_cast<Instruction>(U);
+			if(!userInst || unsignedTruncationSet.count(userInst))
+				continue;
+			if(evaluateUnsignedTruncation(userInst))
+			{
+				unsignedTruncationSet.insert(userInst);
+				worklist.push_back(userInst);
+			}
+		}
+	}
 }
 
-bool CheerpWriter::needsUnsignedTruncation(const Value* v) const
+bool CheerpWriter::needsUnsignedTruncation(const Value* v)
 {
-	std::unordered_set<const llvm::Value*> visited;
-	return needsUnsignedTruncation(visited, v);
+	const Instruction* I = dyn_cast<Instruction>(v);
+	if(!I)
+	{
+		SmallVector<const Value*, 4> operands;
+		return getTruncationRule(v, operands) == TRUNCATION_ALWAYS;
+	}
+	// The analysis is computed once for the whole function and then cached
+	const Function* F = I->getParent()->getParent();
+	if(F != unsignedTruncationFunction)
+		computeUnsignedTruncation(*F);
+	return unsignedTruncationSet.count(I);
 }
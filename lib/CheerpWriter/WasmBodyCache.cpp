@@ -0,0 +1,392 @@
+//===-- WasmBodyCache.cpp - On disk cache of wasm function bodies ---------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/WasmBodyCache.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace cheerp;
+using namespace llvm;
+
+// Bump this when the encoding of the function bodies changes, so that stale
+// entries are not reused.
+static const char* CACHE_FORMAT = "cheerp-wasm-body-11 " LLVM_VERSION_STRING;
+
+// Tags for back references, they never collide with type and value ids
+static const uint64_t TYPE_REF_TAG = UINT64_MAX - 1;
+static const uint64_t LOCAL_VALUE_TAG = UINT64_MAX;
+
+namespace {
+
+class FunctionHasher
+{
+private:
+	MD5 md5;
+	const DataLayout& DL;
+	const LinearMemoryHelper& linearHelper;
+	const Registerize& registerize;
+	const GlobalDepsAnalyzer& globalDeps;
+	// Arguments, blocks and instructions are identified by their position
+	DenseMap<const Value*, uint32_t> localIds;
+	// Types are encoded in full only the first time they are found
+	DenseMap<const Type*, uint32_t> typeIds;
+
+	void addType(const Type* t, bool nested);
+	void addValue(const Value* v);
+	void addInstruction(const Instruction& I);
+	void addEdgeRegisters(const Value* v, const BasicBlock* fromBB, const BasicBlock* toBB);
+public:
+	FunctionHasher(const DataLayout& DL, const LinearMemoryHelper& linearHelper, const Registerize& registerize,
+			const GlobalDepsAnalyzer& globalDeps)
+		: DL(DL), linearHelper(linearHelper), registerize(registerize), globalDeps(globalDeps)
+	{
+	}
+	void add(uint64_t v)
+	{
+		uint8_t buf[sizeof(v)];
+		memcpy(buf, &v, sizeof(v));
+		md5.update(buf);
+	}
+	void add(StringRef s)
+	{
+		add(s.size());
+		md5.update(s);
+	}
+	void addFunction(const Function& F);
+	void final(MD5::MD5Result& result)
+	{
+		md5.final(result);
+	}
+};
+
+void FunctionHasher::addType(const Type* t, bool nested)
+{
+	if (!nested)
+	{
+		auto it = typeIds.find(t);
+		if (it != typeIds.end())
+		{
+			add(TYPE_REF_TAG);
+			add(it->second);
+			return;
+		}
+		uint32_t id = typeIds.size();
+		typeIds[t] = id;
+	}
+
+	add(t->getTypeID());
+	switch (t->getTypeID())
+	{
+		case Type::IntegerTyID:
+			add(t->getIntegerBitWidth());
+			break;
+		case Type::PointerTyID:
+			// The pointed type decides the encoding of loads, stores and GEPs.
+			// The types reachable through its own pointers do not matter, and
+			// stopping there also breaks the cycles between types.
+			if (!nested)
+				addType(t->getPointerElementType(), true);
+			break;
+		case Type::StructTyID:
+		{
+			StructType* st = const_cast<StructType*>(cast<StructType>(t));
+			add(st->getNumElements());
+			bool sized = st->isSized();
+			add(sized);
+			const StructLayout* layout = sized ? DL.getStructLayout(st) : nullptr;
+			for (uint32_t i = 0; i < st->getNumElements(); i++)
+			{
+				if (layout)
+					add(layout->getElementOffset(i));
+				addType(st->getElementType(i), nested);
+			}
+			if (sized)
+				add(DL.getTypeAllocSize(st));
+			break;
+		}
+		case Type::ArrayTyID:
+			add(t->getArrayNumElements());
+			addType(t->getArrayElementType(), nested);
+			break;
+		case Type::VectorTyID:
+			add(t->getVectorNumElements());
+			addType(t->getVectorElementType(), nested);
+			break;
+		case Type::FunctionTyID:
+		{
+			const FunctionType* fTy = cast<FunctionType>(t);
+			add(fTy->isVarArg());
+			add(fTy->getNumParams());
+			addType(fTy->getReturnType(), true);
+			for (const Type* param : fTy->params())
+				addType(param, true);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void FunctionHasher::addValue(const Value* v)
+{
+	auto it = localIds.find(v);
+	if (it != localIds.end())
+	{
+		add(LOCAL_VALUE_TAG);
+		add(it->second);
+		return;
+	}
+
+	add(v->getValueID());
+	addType(v->getType(), false);
+	if (const Function* F = dyn_cast<Function>(v))
+	{
+		add(F->getName());
+		auto id = linearHelper.getFunctionIds().find(F);
+		add(id != linearHelper.getFunctionIds().end());
+		if (id != linearHelper.getFunctionIds().end())
+			add(id->second);
+		bool hasAddress = linearHelper.functionHasAddress(F);
+		add(hasAddress);
+		if (hasAddress)
+			add(linearHelper.getFunctionAddress(F));
+	}
+	else if (const GlobalVariable* GV = dyn_cast<GlobalVariable>(v))
+	{
+		add(linearHelper.getGlobalVariableAddress(GV));
+	}
+	else if (const GlobalValue* GV = dyn_cast<GlobalValue>(v))
+	{
+		add(GV->getName());
+	}
+	else if (const ConstantInt* CI = dyn_cast<ConstantInt>(v))
+	{
+		const APInt& value = CI->getValue();
+		for (unsigned i = 0; i < value.getNumWords(); i++)
+			add(value.getRawData()[i]);
+	}
+	else if (const ConstantFP* CF = dyn_cast<ConstantFP>(v))
+	{
+		APInt value = CF->getValueAPF().bitcastToAPInt();
+		for (unsigned i = 0; i < value.getNumWords(); i++)
+			add(value.getRawData()[i]);
+	}
+	else if (const ConstantDataSequential* CD = dyn_cast<ConstantDataSequential>(v))
+	{
+		add(CD->getRawDataValues());
+	}
+	else if (const Constant* C = dyn_cast<Constant>(v))
+	{
+		if (const ConstantExpr* CE = dyn_cast<ConstantExpr>(C))
+		{
+			add(CE->getOpcode());
+			if (CE->isCompare())
+				add(CE->getPredicate());
+			if (CE->hasIndices())
+			{
+				for (unsigned idx : CE->getIndices())
+					add(idx);
+			}
+		}
+		add(C->getNumOperands());
+		for (const Use& op : C->operands())
+			addValue(op.get());
+	}
+	// Metadata and inline asm only contribute their kind
+}
+
+void FunctionHasher::addInstruction(const Instruction& I)
+{
+	add(I.getOpcode());
+	addType(I.getType(), false);
+	add(I.getNumOperands());
+	for (const Use& op : I.operands())
+		addValue(op.get());
+
+	if (const CmpInst* ci = dyn_cast<CmpInst>(&I))
+	{
+		add(ci->getPredicate());
+	}
+	else if (const LoadInst* li = dyn_cast<LoadInst>(&I))
+	{
+		add(li->getAlignment());
+		add(li->isVolatile());
+	}
+	else if (const StoreInst* si = dyn_cast<StoreInst>(&I))
+	{
+		add(si->getAlignment());
+		add(si->isVolatile());
+	}
+	else if (const AllocaInst* ai = dyn_cast<AllocaInst>(&I))
+	{
+		addType(ai->getAllocatedType(), false);
+		add(ai->getAlignment());
+	}
+	else if (const PHINode* phi = dyn_cast<PHINode>(&I))
+	{
+		for (unsigned i = 0; i < phi->getNumIncomingValues(); i++)
+		{
+			addValue(phi->getIncomingBlock(i));
+			addEdgeRegisters(phi->getIncomingValue(i), phi->getIncomingBlock(i), phi->getParent());
+		}
+	}
+	else if (const ExtractValueInst* ev = dyn_cast<ExtractValueInst>(&I))
+	{
+		for (unsigned idx : ev->getIndices())
+			add(idx);
+	}
+	else if (const InsertValueInst* iv = dyn_cast<InsertValueInst>(&I))
+	{
+		for (unsigned idx : iv->getIndices())
+			add(idx);
+	}
+	else if (const CallInst* ci = dyn_cast<CallInst>(&I))
+	{
+		// Calls to JS imports convert their i64 values. Indirect calls use
+		// the type index of their signature, which moves when other
+		// functions add or remove signatures
+		if (const Function* calledFunc = ci->getCalledFunction())
+			add(globalDeps.asmJSImports().count(calledFunc));
+		else
+		{
+			const FunctionType* fTy = cast<FunctionType>(ci->getCalledValue()->getType()->getPointerElementType());
+			auto table = linearHelper.getFunctionTables().find(fTy);
+			add(table != linearHelper.getFunctionTables().end());
+			if (table != linearHelper.getFunctionTables().end())
+				add(table->second.typeIndex);
+		}
+	}
+
+	bool hasRegister = registerize.hasRegister(&I);
+	add(hasRegister);
+	if (hasRegister)
+		add(registerize.getRegisterId(&I));
+}
+
+void FunctionHasher::addEdgeRegisters(const Value* v, const BasicBlock* fromBB, const BasicBlock* toBB)
+{
+	// Incoming values of PHIs are compiled in the context of the edge, which
+	// may assign a temporary register to the values they use
+	const Instruction* I = dyn_cast<Instruction>(v);
+	if (!I)
+		return;
+	if (registerize.hasRegister(I))
+	{
+		add(registerize.getRegisterIdForEdge(I, fromBB, toBB));
+		return;
+	}
+	for (const Use& op : I->operands())
+		addEdgeRegisters(op.get(), fromBB, toBB);
+}
+
+void FunctionHasher::addFunction(const Function& F)
+{
+	// Number the local values first, so that forward references can be
+	// encoded as well
+	for (const Argument& arg : F.getArgumentList())
+		localIds.insert(std::make_pair(&arg, localIds.size()));
+	for (const BasicBlock& BB : F)
+	{
+		localIds.insert(std::make_pair(&BB, localIds.size()));
+		for (const Instruction& I : BB)
+			localIds.insert(std::make_pair(&I, localIds.size()));
+	}
+
+	addType(F.getFunctionType(), false);
+
+	const std::vector<Registerize::RegisterInfo>& regsInfo = registerize.getRegistersForFunction(&F);
+	add(regsInfo.size());
+	for (const Registerize::RegisterInfo& regInfo : regsInfo)
+		add(regInfo.regKind);
+
+	add(F.size());
+	for (const BasicBlock& BB : F)
+	{
+		add(BB.size());
+		for (const Instruction& I : BB)
+			addInstruction(I);
+	}
+}
+
+}
+
+WasmBodyCache::WasmBodyCache(const std::string& dir, const Module& M,
+		const LinearMemoryHelper& linearHelper, const Registerize& registerize,
+		const GlobalDepsAnalyzer& globalDeps, ArrayRef<uint32_t> writerState)
+	: dir(dir), DL(*M.getDataLayout()), linearHelper(linearHelper), registerize(registerize),
+		globalDeps(globalDeps)
+{
+	if (std::error_code ec = sys::fs::create_directories(dir))
+		llvm::errs() << "warning: cannot create the wasm cache directory " << dir << ": " << ec.message() << '\n';
+
+	FunctionHasher hasher(DL, linearHelper, registerize, globalDeps);
+	hasher.add(CACHE_FORMAT);
+	hasher.add(M.getDataLayoutStr());
+	for (uint32_t value : writerState)
+		hasher.add(value);
+
+	// Some intrinsics are lowered to calls to these functions
+	for (const char* name : {"memcpy", "memmove", "memset", "malloc", "realloc", "free"})
+	{
+		const Function* F = M.getFunction(name);
+		auto id = F ? linearHelper.getFunctionIds().find(F) : linearHelper.getFunctionIds().end();
+		hasher.add(id != linearHelper.getFunctionIds().end() ? id->second : UINT32_MAX);
+	}
+	hasher.final(moduleHash);
+}
+
+std::string WasmBodyCache::getEntryPath(const Function& F) const
+{
+	FunctionHasher hasher(DL, linearHelper, registerize, globalDeps);
+	hasher.add(StringRef(reinterpret_cast<const char*>(moduleHash), sizeof(moduleHash)));
+	hasher.addFunction(F);
+
+	MD5::MD5Result result;
+	hasher.final(result);
+	SmallString<32> hex;
+	MD5::stringifyResult(result, hex);
+	return dir + "/" + hex.str().str() + ".body";
+}
+
+std::unique_ptr<MemoryBuffer> WasmBodyCache::lookup(const std::string& path) const
+{
+	ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(path);
+	if (!buf)
+		return nullptr;
+	return std::move(*buf);
+}
+
+void WasmBodyCache::store(const std::string& path, StringRef body) const
+{
+	// Write to a temporary file and rename it, so that concurrent builds
+	// never observe a partially written entry
+	int fd;
+	SmallString<128> tmpPath;
+	if (sys::fs::createUniqueFile(path + "-%%%%%%%%", fd, tmpPath))
+		return;
+
+	raw_fd_ostream os(fd, /*shouldClose*/true);
+	os << body;
+	os.close();
+	if (os.has_error())
+	{
+		os.clear_error();
+		sys::fs::remove(tmpPath.str());
+		return;
+	}
+	if (sys::fs::rename(tmpPath.str(), path))
+		sys::fs::remove(tmpPath.str());
+}
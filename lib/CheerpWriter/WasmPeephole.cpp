@@ -0,0 +1,990 @@
+//===-- WasmPeephole.cpp - Cleanup of the wasm function bodies ------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2018 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/WasmPeephole.h"
+#include "llvm/Support/LEB128.h"
+#include <cassert>
+
+using namespace cheerp;
+using namespace llvm;
+
+namespace {
+
+enum Opcode : uint8_t
+{
+	UNREACHABLE = 0x00,
+	NOP = 0x01,
+	BLOCK = 0x02,
+	LOOP = 0x03,
+	IF = 0x04,
+	ELSE = 0x05,
+	END = 0x0b,
+	BR = 0x0c,
+	BR_IF = 0x0d,
+	BR_TABLE = 0x0e,
+	RETURN = 0x0f,
+	CALL = 0x10,
+	CALL_INDIRECT = 0x11,
+	DROP = 0x1a,
+	SELECT = 0x1b,
+	GET_LOCAL = 0x20,
+	SET_LOCAL = 0x21,
+	TEE_LOCAL = 0x22,
+	GET_GLOBAL = 0x23,
+	SET_GLOBAL = 0x24,
+	FIRST_LOAD = 0x28,
+	LAST_LOAD = 0x35,
+	FIRST_STORE = 0x36,
+	LAST_STORE = 0x3e,
+	CURRENT_MEMORY = 0x3f,
+	GROW_MEMORY = 0x40,
+	I32_CONST = 0x41,
+	I64_CONST = 0x42,
+	F32_CONST = 0x43,
+	F64_CONST = 0x44,
+	I32_EQZ = 0x45,
+	I32_EQ = 0x46,
+	I64_EQZ = 0x50,
+	I64_EQ = 0x51,
+	LAST_COMPARE = 0x66,
+	I32_AND = 0x71,
+	LAST_NUMERIC = 0xbf,
+};
+
+// Block type of the blocks without a result
+const uint8_t VOID_BLOCK = 0x40;
+// Branch target of the outermost label, the function body itself
+const uint32_t FUNCTION_TARGET = UINT32_MAX;
+const uint32_t NO_INDEX = UINT32_MAX;
+// Most bodies reach a fixed point in two or three iterations
+const uint32_t MAX_ITERATIONS = 8;
+// Limit of the number of locals of the wasm implementations
+const uint32_t MAX_LOCALS = 50000;
+
+struct Inst
+{
+	uint8_t opcode;
+	// Result type of block, loop and if
+	uint8_t blockType;
+	bool removed;
+	// Local, global, function or type index, memarg alignment, or the index
+	// of the block, loop or if targeted by br and br_if
+	uint32_t imm;
+	// Memarg offset, or the number of targets of br_table
+	uint32_t offset;
+	// Integer constants, floating point constants as raw bits, or the
+	// position of the br_table targets
+	uint64_t value;
+};
+
+class Reader
+{
+public:
+	Reader(StringRef data)
+		: p(reinterpret_cast<const uint8_t*>(data.begin())),
+		end(reinterpret_cast<const uint8_t*>(data.end())), error(false)
+	{
+	}
+	bool atEnd() const
+	{
+		return p == end;
+	}
+	bool hasError() const
+	{
+		return error;
+	}
+	uint8_t readByte()
+	{
+		if (p == end)
+		{
+			error = true;
+			return 0;
+		}
+		return *p++;
+	}
+	uint64_t readULEB128()
+	{
+		uint64_t value = 0;
+		unsigned shift = 0;
+		uint8_t byte;
+		do {
+			byte = readByte();
+			if (shift < 64)
+				value |= uint64_t(byte & 0x7f) << shift;
+			shift += 7;
+		} while ((byte & 0x80) && !error);
+		return value;
+	}
+	int64_t readSLEB128()
+	{
+		int64_t value = 0;
+		unsigned shift = 0;
+		uint8_t byte;
+		do {
+			byte = readByte();
+			if (shift < 64)
+				value |= int64_t(byte & 0x7f) << shift;
+			shift += 7;
+		} while ((byte & 0x80) && !error);
+		if (shift < 64 && (byte & 0x40))
+			value |= -(int64_t(1) << shift);
+		return value;
+	}
+	uint64_t readFixed(unsigned bytes)
+	{
+		uint64_t value = 0;
+		for (unsigned i = 0; i < bytes; i++)
+			value |= uint64_t(readByte()) << (8 * i);
+		return value;
+	}
+private:
+	const uint8_t* p;
+	const uint8_t* end;
+	bool error;
+};
+
+class FunctionBody
+{
+public:
+	FunctionBody(const std::vector<WasmPeephole::Signature>& functions,
+			const std::vector<WasmPeephole::Signature>& types, const WasmPeephole::Signature& sig)
+		: functions(functions), types(types), sig(sig)
+	{
+	}
+	bool decode(StringRef body);
+	bool optimize();
+	void encode(raw_ostream& out) const;
+
+private:
+	const std::vector<WasmPeephole::Signature>& functions;
+	const std::vector<WasmPeephole::Signature>& types;
+	const WasmPeephole::Signature& sig;
+
+	// Types of the locals which are not parameters
+	std::vector<uint8_t> localTypes;
+	std::vector<Inst> insts;
+	// Targets of all the br_table instructions
+	std::vector<uint32_t> tables;
+
+	// Computed by analyze, valid until the instructions change.
+	// For block, loop and if the index of their end, for end and else the
+	// index of the block, loop or if they belong to
+	std::vector<uint32_t> partner;
+	// Number of branches to each block, loop and if
+	std::vector<uint32_t> targetCount;
+	// Number of get_local of each local
+	std::vector<uint32_t> localReads;
+	// The stack height before each instruction, relative to the height at
+	// the start of its block, or -1 if the instruction is unreachable
+	std::vector<int32_t> heights;
+
+	bool getStackEffect(const Inst& I, uint32_t& pops, uint32_t& pushes) const;
+	static bool isPure(uint8_t opcode);
+	static bool isPureValue(uint8_t opcode)
+	{
+		return opcode == GET_LOCAL || opcode == GET_GLOBAL || (opcode >= I32_CONST && opcode <= F64_CONST);
+	}
+	static bool isStructured(uint8_t opcode)
+	{
+		return opcode == BLOCK || opcode == LOOP || opcode == IF;
+	}
+	// Number of values taken by a branch to target
+	uint32_t getBranchArity(uint32_t target) const
+	{
+		if (target == FUNCTION_TARGET)
+			return sig.results;
+		if (insts[target].opcode == LOOP)
+			return 0;
+		return insts[target].blockType != VOID_BLOCK;
+	}
+	// Returns the index of the first instruction of the code which computes
+	// the operand of inst i, or NO_INDEX if it can't be found.
+	uint32_t findOperand(uint32_t i, bool& pure) const;
+	void remove(uint32_t first, uint32_t last)
+	{
+		for (uint32_t i = first; i <= last; i++)
+			insts[i].removed = true;
+	}
+
+	bool analyze();
+	void compact();
+	bool removeDeadCode();
+	bool simplifyPairs();
+	bool removeFallthroughBranches();
+	bool removeUntargetedBlocks();
+	bool removeDeadStores();
+	bool convertDiamondsToSelect();
+	void removeUnusedLocals();
+};
+
+bool FunctionBody::decode(StringRef body)
+{
+	Reader r(body);
+	uint32_t groups = r.readULEB128();
+	for (uint32_t i = 0; i < groups && !r.hasError(); i++)
+	{
+		uint32_t count = r.readULEB128();
+		uint8_t type = r.readByte();
+		// Do not trust the counts before they are known to be valid
+		if (count > MAX_LOCALS)
+			return false;
+		localTypes.insert(localTypes.end(), count, type);
+	}
+
+	// Open blocks, loops and ifs
+	std::vector<uint32_t> open(1, FUNCTION_TARGET);
+	// The function body is a valid target, it can't use NO_INDEX to report
+	// the errors
+	auto readTarget = [&](uint32_t& target) -> bool
+	{
+		uint32_t depth = r.readULEB128();
+		if (depth >= open.size())
+			return false;
+		target = open[open.size() - 1 - depth];
+		return true;
+	};
+
+	while (!r.hasError())
+	{
+		if (r.atEnd())
+			return false;
+		Inst I = Inst();
+		I.opcode = r.readByte();
+		uint32_t index = insts.size();
+		switch (I.opcode)
+		{
+			case BLOCK:
+			case LOOP:
+			case IF:
+				I.blockType = r.readByte();
+				open.push_back(index);
+				break;
+			case ELSE:
+				if (open.size() == 1 || insts[open.back()].opcode != IF)
+					return false;
+				break;
+			case END:
+				if (open.size() == 1)
+				{
+					// The end of the function is not kept
+					return r.atEnd();
+				}
+				open.pop_back();
+				break;
+			case BR:
+			case BR_IF:
+				if (!readTarget(I.imm))
+					return false;
+				break;
+			case BR_TABLE:
+			{
+				I.value = tables.size();
+				// The default target is the last one
+				I.offset = r.readULEB128() + 1;
+				if (I.offset > body.size())
+					return false;
+				for (uint32_t i = 0; i < I.offset; i++)
+				{
+					uint32_t target;
+					if (!readTarget(target))
+						return false;
+					tables.push_back(target);
+				}
+				break;
+			}
+			case CALL:
+			case GET_LOCAL:
+			case SET_LOCAL:
+			case TEE_LOCAL:
+			case GET_GLOBAL:
+			case SET_GLOBAL:
+				I.imm = r.readULEB128();
+				break;
+			case CALL_INDIRECT:
+				I.imm = r.readULEB128();
+				if (r.readByte() != 0)
+					return false;
+				break;
+			case CURRENT_MEMORY:
+			case GROW_MEMORY:
+				if (r.readByte() != 0)
+					return false;
+				break;
+			case I32_CONST:
+			case I64_CONST:
+				I.value = r.readSLEB128();
+				break;
+			case F32_CONST:
+				I.value = r.readFixed(4);
+				break;
+			case F64_CONST:
+				I.value = r.readFixed(8);
+				break;
+			case UNREACHABLE:
+			case NOP:
+			case RETURN:
+			case DROP:
+			case SELECT:
+				break;
+			default:
+				if (I.opcode >= FIRST_LOAD && I.opcode <= LAST_STORE)
+				{
+					I.imm = r.readULEB128();
+					I.offset = r.readULEB128();
+				}
+				else if (I.opcode < I32_EQZ || I.opcode > LAST_NUMERIC)
+					return false;
+				break;
+		}
+		insts.push_back(I);
+	}
+	return false;
+}
+
+bool FunctionBody::getStackEffect(const Inst& I, uint32_t& pops, uint32_t& pushes) const
+{
+	uint8_t op = I.opcode;
+	pops = 0;
+	pushes = 0;
+	if (op == CALL || op == CALL_INDIRECT)
+	{
+		const std::vector<WasmPeephole::Signature>& sigs = op == CALL ? functions : types;
+		if (I.imm >= sigs.size())
+			return false;
+		pops = sigs[I.imm].params + (op == CALL_INDIRECT);
+		pushes = sigs[I.imm].results;
+		return true;
+	}
+	switch (op)
+	{
+		case NOP:
+			return true;
+		case DROP:
+		case SET_LOCAL:
+		case SET_GLOBAL:
+			pops = 1;
+			return true;
+		case SELECT:
+			pops = 3;
+			pushes = 1;
+			return true;
+		case GET_LOCAL:
+		case GET_GLOBAL:
+		case CURRENT_MEMORY:
+		case I32_CONST:
+		case I64_CONST:
+		case F32_CONST:
+		case F64_CONST:
+			pushes = 1;
+			return true;
+		case TEE_LOCAL:
+		case GROW_MEMORY:
+			pops = 1;
+			pushes = 1;
+			return true;
+		default:
+			break;
+	}
+	if (op >= FIRST_LOAD && op <= LAST_LOAD)
+	{
+		pops = 1;
+		pushes = 1;
+	}
+	else if (op >= FIRST_STORE && op <= LAST_STORE)
+	{
+		pops = 2;
+	}
+	else if (op >= I32_EQZ && op <= LAST_NUMERIC)
+	{
+		// Test, unary and conversion operators take one operand, comparisons
+		// and binary operators take two
+		bool unary = op == I32_EQZ || op == I64_EQZ || (op >= 0x67 && op <= 0x69) ||
+			(op >= 0x79 && op <= 0x7b) || (op >= 0x8b && op <= 0x91) ||
+			(op >= 0x99 && op <= 0x9f) || op >= 0xa7;
+		pops = unary ? 1 : 2;
+		pushes = 1;
+	}
+	else
+		return false;
+	return true;
+}
+
+bool FunctionBody::isPure(uint8_t op)
+{
+	if (isPureValue(op) || op == SELECT)
+		return true;
+	if (op < I32_EQZ || op > LAST_NUMERIC)
+		return false;
+	// Integer divisions and conversions from floating point may trap
+	bool mayTrap = (op >= 0x6d && op <= 0x70) || (op >= 0x7f && op <= 0x82) ||
+		(op >= 0xa8 && op <= 0xab) || (op >= 0xae && op <= 0xb1);
+	return !mayTrap;
+}
+
+uint32_t FunctionBody::findOperand(uint32_t i, bool& pure) const
+{
+	pure = true;
+	uint32_t needed = 1;
+	while (i-- > 0)
+	{
+		const Inst& I = insts[i];
+		if (I.removed)
+			continue;
+		uint32_t pops, pushes;
+		if (!getStackEffect(I, pops, pushes) || pushes > needed)
+			return NO_INDEX;
+		needed = needed - pushes + pops;
+		pure &= isPure(I.opcode);
+		if (needed == 0)
+			return i;
+	}
+	return NO_INDEX;
+}
+
+bool FunctionBody::analyze()
+{
+	uint32_t n = insts.size();
+	partner.assign(n, NO_INDEX);
+	targetCount.assign(n, 0);
+	localReads.assign(sig.params + localTypes.size(), 0);
+	heights.assign(n, -1);
+
+	struct Frame
+	{
+		uint32_t start;
+		int32_t base;
+		uint32_t results;
+		bool unreachable;
+	};
+	std::vector<Frame> frames;
+	frames.push_back(Frame{FUNCTION_TARGET, 0, sig.results, false});
+	int32_t height = 0;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		const Inst& I = insts[i];
+		assert(!I.removed);
+		heights[i] = frames.back().unreachable ? -1 : height - frames.back().base;
+		switch (I.opcode)
+		{
+			case IF:
+				height--;
+				// fallthrough
+			case BLOCK:
+			case LOOP:
+				frames.push_back(Frame{i, height, I.blockType != VOID_BLOCK, false});
+				break;
+			case ELSE:
+				partner[i] = frames.back().start;
+				height = frames.back().base;
+				frames.back().unreachable = false;
+				break;
+			case END:
+				partner[i] = frames.back().start;
+				partner[frames.back().start] = i;
+				height = frames.back().base + frames.back().results;
+				frames.pop_back();
+				break;
+			case BR:
+				if (I.imm != FUNCTION_TARGET)
+					targetCount[I.imm]++;
+				frames.back().unreachable = true;
+				break;
+			case BR_IF:
+				if (I.imm != FUNCTION_TARGET)
+					targetCount[I.imm]++;
+				height--;
+				break;
+			case BR_TABLE:
+				for (uint32_t t = 0; t < I.offset; t++)
+				{
+					uint32_t target = tables[I.value + t];
+					if (target != FUNCTION_TARGET)
+						targetCount[target]++;
+				}
+				frames.back().unreachable = true;
+				break;
+			case RETURN:
+			case UNREACHABLE:
+				frames.back().unreachable = true;
+				break;
+			default:
+			{
+				uint32_t pops, pushes;
+				if (!getStackEffect(I, pops, pushes))
+					return false;
+				height += pushes - pops;
+				if (I.opcode == GET_LOCAL || I.opcode == SET_LOCAL || I.opcode == TEE_LOCAL)
+				{
+					if (I.imm >= localReads.size())
+						return false;
+					if (I.opcode == GET_LOCAL)
+						localReads[I.imm]++;
+				}
+				break;
+			}
+		}
+	}
+	return frames.size() == 1;
+}
+
+void FunctionBody::compact()
+{
+	std::vector<uint32_t> newIndex(insts.size(), NO_INDEX);
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < insts.size(); i++)
+	{
+		if (insts[i].removed)
+			continue;
+		newIndex[i] = next;
+		insts[next++] = insts[i];
+	}
+	insts.resize(next);
+	auto remap = [&](uint32_t target)
+	{
+		if (target == FUNCTION_TARGET)
+			return target;
+		assert(newIndex[target] != NO_INDEX);
+		return newIndex[target];
+	};
+	for (Inst& I : insts)
+	{
+		if (I.opcode == BR || I.opcode == BR_IF)
+			I.imm = remap(I.imm);
+		else if (I.opcode == BR_TABLE)
+		{
+			for (uint32_t t = 0; t < I.offset; t++)
+				tables[I.value + t] = remap(tables[I.value + t]);
+		}
+	}
+}
+
+bool FunctionBody::removeDeadCode()
+{
+	// Everything after an unconditional control transfer is unreachable,
+	// until the end of the enclosing block or the start of the else branch
+	bool changed = false;
+	uint32_t n = insts.size();
+	for (uint32_t i = 0; i < n; i++)
+	{
+		uint8_t op = insts[i].opcode;
+		if (op != BR && op != BR_TABLE && op != RETURN && op != UNREACHABLE)
+			continue;
+		uint32_t depth = 0;
+		uint32_t j = i + 1;
+		for (; j < n; j++)
+		{
+			uint8_t next = insts[j].opcode;
+			if ((next == END || next == ELSE) && depth == 0)
+				break;
+			if (isStructured(next))
+				depth++;
+			else if (next == END)
+				depth--;
+			insts[j].removed = true;
+			changed = true;
+		}
+		i = j - 1;
+	}
+	return changed;
+}
+
+bool FunctionBody::simplifyPairs()
+{
+	bool changed = false;
+	uint32_t n = insts.size();
+	for (uint32_t i = 1; i < n; i++)
+	{
+		Inst& I = insts[i];
+		Inst& prev = insts[i - 1];
+		if (I.removed || prev.removed)
+			continue;
+		if (((I.opcode == I32_EQ && prev.opcode == I32_CONST) ||
+			(I.opcode == I64_EQ && prev.opcode == I64_CONST)) && prev.value == 0)
+		{
+			// x == 0 is x.eqz
+			I.opcode = I.opcode == I32_EQ ? I32_EQZ : I64_EQZ;
+			prev.removed = true;
+			changed = true;
+		}
+		else if (I.opcode == I32_AND && prev.opcode == I32_CONST && prev.value == 1 && i >= 2 &&
+			!insts[i - 2].removed && insts[i - 2].opcode >= I32_EQZ && insts[i - 2].opcode <= LAST_COMPARE)
+		{
+			// Comparisons already return 0 or 1
+			I.removed = true;
+			prev.removed = true;
+			changed = true;
+		}
+		else if (I.opcode == GET_LOCAL && prev.opcode == SET_LOCAL && I.imm == prev.imm)
+		{
+			// The stored value is still on the stack, this happens when the
+			// blocks which separated the two are removed
+			prev.opcode = TEE_LOCAL;
+			I.removed = true;
+			changed = true;
+		}
+		else if (I.opcode == DROP && prev.opcode == TEE_LOCAL)
+		{
+			prev.opcode = SET_LOCAL;
+			I.removed = true;
+			changed = true;
+		}
+		else if (((I.opcode == BR && getBranchArity(I.imm) == 0) || (I.opcode == RETURN && sig.results == 0)) &&
+			isPureValue(prev.opcode))
+		{
+			// The branch discards the value
+			prev.removed = true;
+			changed = true;
+		}
+		else if (I.opcode == IF && I.blockType == VOID_BLOCK && i + 2 < n &&
+			insts[i + 1].opcode == BR && insts[i + 2].opcode == END)
+		{
+			if (insts[i + 1].imm == i)
+			{
+				// The branch goes to the end of the if itself
+				I.opcode = DROP;
+			}
+			else
+			{
+				// The branch goes outside of the if, only its depth changes
+				I.opcode = BR_IF;
+				I.imm = insts[i + 1].imm;
+			}
+			remove(i + 1, i + 2);
+			changed = true;
+		}
+		else if (I.opcode == IF && I.blockType == VOID_BLOCK && i + 1 < n && (insts[i + 1].opcode == END ||
+			(insts[i + 1].opcode == ELSE && i + 2 < n && insts[i + 2].opcode == END)))
+		{
+			// Both branches are empty, only the condition is left
+			I.opcode = DROP;
+			remove(i + 1, insts[i + 1].opcode == END ? i + 1 : i + 2);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+bool FunctionBody::removeFallthroughBranches()
+{
+	bool changed = false;
+	uint32_t n = insts.size();
+	for (uint32_t i = 0; i < n; i++)
+	{
+		Inst& I = insts[i];
+		if (I.opcode != BR && I.opcode != BR_IF && I.opcode != RETURN)
+			continue;
+		uint32_t target = I.opcode == RETURN ? FUNCTION_TARGET : I.imm;
+		// A branch to a loop goes back to its start
+		if (target != FUNCTION_TARGET && insts[target].opcode == LOOP)
+			continue;
+		uint32_t arity = getBranchArity(target);
+		// br_if also takes the condition
+		if (heights[i] != (int32_t)(arity + (I.opcode == BR_IF)))
+			continue;
+		// The branch is useless if only the ends of blocks which do not
+		// return values are between it and the end of its target
+		bool reachesTarget = false;
+		bool hasInnerEnds = false;
+		for (uint32_t j = i + 1; ; j++)
+		{
+			if (j == n)
+			{
+				reachesTarget = target == FUNCTION_TARGET;
+				break;
+			}
+			if (insts[j].opcode != END)
+				break;
+			if (partner[j] == target)
+			{
+				reachesTarget = true;
+				break;
+			}
+			if (insts[partner[j]].blockType != VOID_BLOCK)
+				break;
+			hasInnerEnds = true;
+		}
+		if (reachesTarget && (!hasInnerEnds || arity == 0))
+		{
+			// Only the condition of br_if has to go
+			if (I.opcode == BR_IF)
+				I.opcode = DROP;
+			else
+				I.removed = true;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+bool FunctionBody::removeUntargetedBlocks()
+{
+	bool changed = false;
+	for (uint32_t i = 0; i < insts.size(); i++)
+	{
+		uint8_t op = insts[i].opcode;
+		if ((op == BLOCK || op == LOOP) && targetCount[i] == 0)
+		{
+			insts[i].removed = true;
+			insts[partner[i]].removed = true;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+bool FunctionBody::removeDeadStores()
+{
+	bool changed = false;
+	for (uint32_t i = 0; i < insts.size(); i++)
+	{
+		Inst& I = insts[i];
+		if ((I.opcode == SET_LOCAL || I.opcode == TEE_LOCAL) && localReads[I.imm] == 0)
+		{
+			changed = true;
+			if (I.opcode == TEE_LOCAL)
+			{
+				I.removed = true;
+				continue;
+			}
+			I.opcode = DROP;
+		}
+		if (I.opcode == DROP)
+		{
+			bool pure;
+			uint32_t first = findOperand(i, pure);
+			if (first != NO_INDEX && pure)
+			{
+				remove(first, i);
+				changed = true;
+			}
+		}
+	}
+	return changed;
+}
+
+bool FunctionBody::convertDiamondsToSelect()
+{
+	// Match
+	//   cond if A set_local x else B set_local x end
+	// where A and B are constants or locals, and turn it into
+	//   A B cond select set_local x
+	bool changed = false;
+	for (uint32_t i = 0; i + 6 < insts.size(); i++)
+	{
+		const Inst& I = insts[i];
+		if (I.opcode != IF || I.blockType != VOID_BLOCK || partner[i + 3] != i || insts[i + 3].opcode != ELSE ||
+			partner[i + 6] != i)
+			continue;
+		const Inst& A = insts[i + 1];
+		const Inst& setA = insts[i + 2];
+		const Inst& B = insts[i + 4];
+		const Inst& setB = insts[i + 5];
+		if (setA.opcode != SET_LOCAL || setB.opcode != SET_LOCAL || setA.imm != setB.imm)
+			continue;
+		auto isSimpleValue = [](const Inst& V)
+		{
+			return V.opcode == GET_LOCAL || (V.opcode >= I32_CONST && V.opcode <= F64_CONST);
+		};
+		if (!isSimpleValue(A) || !isSimpleValue(B))
+			continue;
+		bool pure;
+		uint32_t first = findOperand(i, pure);
+		if (first == NO_INDEX)
+			continue;
+		// A and B are now read before the condition is computed
+		bool conflict = false;
+		for (uint32_t j = first; j < i; j++)
+		{
+			const Inst& C = insts[j];
+			if (C.removed || (C.opcode != SET_LOCAL && C.opcode != TEE_LOCAL))
+				continue;
+			if ((A.opcode == GET_LOCAL && A.imm == C.imm) || (B.opcode == GET_LOCAL && B.imm == C.imm))
+				conflict = true;
+		}
+		if (conflict)
+			continue;
+
+		std::vector<Inst> rewritten;
+		rewritten.push_back(A);
+		rewritten.push_back(B);
+		for (uint32_t j = first; j < i; j++)
+		{
+			if (!insts[j].removed)
+				rewritten.push_back(insts[j]);
+		}
+		Inst select = Inst();
+		select.opcode = SELECT;
+		rewritten.push_back(select);
+		rewritten.push_back(setA);
+		// Nothing can branch inside the condition, so the instructions can be
+		// moved around in place
+		std::copy(rewritten.begin(), rewritten.end(), insts.begin() + first);
+		remove(first + rewritten.size(), i + 6);
+		changed = true;
+		i += 6;
+	}
+	return changed;
+}
+
+void FunctionBody::removeUnusedLocals()
+{
+	std::vector<bool> used(localTypes.size(), false);
+	for (const Inst& I : insts)
+	{
+		if ((I.opcode == GET_LOCAL || I.opcode == SET_LOCAL || I.opcode == TEE_LOCAL) && I.imm >= sig.params)
+			used[I.imm - sig.params] = true;
+	}
+	std::vector<uint32_t> newIndex(localTypes.size());
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < localTypes.size(); i++)
+	{
+		newIndex[i] = sig.params + next;
+		if (used[i])
+			localTypes[next++] = localTypes[i];
+	}
+	if (next == localTypes.size())
+		return;
+	localTypes.resize(next);
+	for (Inst& I : insts)
+	{
+		if ((I.opcode == GET_LOCAL || I.opcode == SET_LOCAL || I.opcode == TEE_LOCAL) && I.imm >= sig.params)
+			I.imm = newIndex[I.imm - sig.params];
+	}
+}
+
+bool FunctionBody::optimize()
+{
+	typedef bool (FunctionBody::*Pass)();
+	const Pass passes[] = {
+		&FunctionBody::removeDeadCode,
+		&FunctionBody::simplifyPairs,
+		&FunctionBody::removeFallthroughBranches,
+		&FunctionBody::removeUntargetedBlocks,
+		&FunctionBody::removeDeadStores,
+		&FunctionBody::convertDiamondsToSelect,
+	};
+	for (uint32_t iteration = 0; iteration < MAX_ITERATIONS; iteration++)
+	{
+		bool changed = false;
+		for (Pass pass : passes)
+		{
+			if (!analyze())
+				return false;
+			if ((this->*pass)())
+			{
+				compact();
+				changed = true;
+			}
+		}
+		if (!changed)
+			break;
+	}
+	removeUnusedLocals();
+	return true;
+}
+
+void FunctionBody::encode(raw_ostream& out) const
+{
+	// Locals of the same type are declared together
+	std::vector<std::pair<uint32_t, uint8_t>> groups;
+	for (uint8_t type : localTypes)
+	{
+		if (!groups.empty() && groups.back().second == type)
+			groups.back().first++;
+		else
+			groups.push_back(std::make_pair(1, type));
+	}
+	encodeULEB128(groups.size(), out);
+	for (const auto& group : groups)
+	{
+		encodeULEB128(group.first, out);
+		out << (char)group.second;
+	}
+
+	std::vector<uint32_t> open(1, FUNCTION_TARGET);
+	auto encodeTarget = [&](uint32_t target)
+	{
+		uint32_t depth = 0;
+		while (open[open.size() - 1 - depth] != target)
+			depth++;
+		encodeULEB128(depth, out);
+	};
+	for (uint32_t i = 0; i < insts.size(); i++)
+	{
+		const Inst& I = insts[i];
+		out << (char)I.opcode;
+		switch (I.opcode)
+		{
+			case BLOCK:
+			case LOOP:
+			case IF:
+				out << (char)I.blockType;
+				open.push_back(i);
+				break;
+			case END:
+				open.pop_back();
+				break;
+			case BR:
+			case BR_IF:
+				encodeTarget(I.imm);
+				break;
+			case BR_TABLE:
+				encodeULEB128(I.offset - 1, out);
+				for (uint32_t t = 0; t < I.offset; t++)
+					encodeTarget(tables[I.value + t]);
+				break;
+			case CALL:
+			case GET_LOCAL:
+			case SET_LOCAL:
+			case TEE_LOCAL:
+			case GET_GLOBAL:
+			case SET_GLOBAL:
+				encodeULEB128(I.imm, out);
+				break;
+			case CALL_INDIRECT:
+				encodeULEB128(I.imm, out);
+				out << (char)0;
+				break;
+			case CURRENT_MEMORY:
+			case GROW_MEMORY:
+				out << (char)0;
+				break;
+			case I32_CONST:
+			case I64_CONST:
+				encodeSLEB128(I.value, out);
+				break;
+			case F32_CONST:
+			case F64_CONST:
+				for (unsigned b = 0; b < (I.opcode == F32_CONST ? 4u : 8u); b++)
+					out << (char)(I.value >> (8 * b));
+				break;
+			default:
+				if (I.opcode >= FIRST_LOAD && I.opcode <= LAST_STORE)
+				{
+					encodeULEB128(I.imm, out);
+					encodeULEB128(I.offset, out);
+				}
+				break;
+		}
+	}
+	out << (char)END;
+}
+
+}
+
+bool WasmPeephole::optimize(StringRef body, const Signature& sig, raw_ostream& out) const
+{
+	FunctionBody function(functions, types, sig);
+	if (!function.decode(body) || !function.optimize())
+		return false;
+	function.encode(out);
+	return true;
+}
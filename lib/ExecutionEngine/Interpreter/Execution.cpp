@@ -19,6 +19,7 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
@@ -39,8 +40,41 @@ static cl::opt<bool> PrintVolatile("interpreter-print-volatile", cl::Hidden,
 //                     Various Helper Functions
 //===----------------------------------------------------------------------===//
 
+static GenericValue &getSlotValue(Value *V, ExecutionContext &SF) {
+  unsigned Slot = SF.Info->getSlot(V);
+  if (Slot >= SF.Values.size())
+    SF.Values.resize(SF.Info->NumSlots);
+  return SF.Values[Slot];
+}
+
 static void SetValue(Value *V, GenericValue Val, ExecutionContext &SF) {
-  SF.Values[V] = Val;
+  getSlotValue(V, SF) = std::move(Val);
+}
+
+// isAllocaAddress - Returns true if V points inside an alloca
+//
+static bool isAllocaAddress(const Value *V) {
+  while (true) {
+    V = V->stripPointerCastsSafe();
+    if (const GEPOperator *GEP = dyn_cast<GEPOperator>(V))
+      V = GEP->getPointerOperand();
+    else
+      return isa<AllocaInst>(V);
+  }
+}
+
+FunctionInfo::FunctionInfo(Function &F) : NumSlots(0) {
+  for (Argument &A : F.args())
+    Slots[&A] = NumSlots++;
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      if (!I.getType()->isVoidTy())
+        Slots[&I] = NumSlots++;
+      else if (StoreInst *SI = dyn_cast<StoreInst>(&I))
+        if (isAllocaAddress(SI->getPointerOperand()))
+          LocalStores.insert(SI);
+    }
+  }
 }
 
 //===----------------------------------------------------------------------===//
@@ -1064,10 +1098,10 @@ void Interpreter::visitStoreInst(StoreInst &I) {
   GenericValue SRC = getOperandValue(I.getPointerOperand(), SF);
   StoreValueToMemory(Val, (GenericValue *)GVTORP(SRC),
                      I.getOperand(0)->getType());
-  if (StoreListener)
+  if (StoreListener && !SF.Info->LocalStores.count(&I))
   {
     assert(ForPreExecute);
-    StoreListener(GVTORP(SRC));
+    StoreListener(GVTORP(SRC), I.getOperand(0)->getType());
   }
   if (I.isVolatile() && PrintVolatile)
     dbgs() << "Volatile store: " << I;
@@ -2116,14 +2150,19 @@ GenericValue Interpreter::getConstantExprValue (ConstantExpr *CE,
 }
 
 GenericValue Interpreter::getOperandValue(Value *V, ExecutionContext &SF) {
-  if (ConstantExpr *CE = dyn_cast<ConstantExpr>(V)) {
-    return getConstantExprValue(CE, SF);
-  } else if (Constant *CPV = dyn_cast<Constant>(V)) {
-    return getConstantValue(CPV);
-  } else if (GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
-    return RPTOGV(getPointerToGlobal(GV));
+  if (Constant *CPV = dyn_cast<Constant>(V)) {
+    auto It = ConstantValues.find(CPV);
+    if (It != ConstantValues.end())
+      return It->second;
+    GenericValue Result;
+    if (ConstantExpr *CE = dyn_cast<ConstantExpr>(V))
+      Result = getConstantExprValue(CE, SF);
+    else
+      Result = getConstantValue(CPV);
+    ConstantValues[CPV] = Result;
+    return Result;
   } else {
-    return SF.Values[V];
+    return getSlotValue(V, SF);
   }
 }
 
@@ -2131,6 +2170,13 @@ GenericValue Interpreter::getOperandValue(Value *V, ExecutionContext &SF) {
 //                        Dispatch and Execution Code
 //===----------------------------------------------------------------------===//
 
+FunctionInfo *Interpreter::getFunctionInfo(Function *F) {
+  std::unique_ptr<FunctionInfo> &Info = FunctionInfos[F];
+  if (!Info)
+    Info.reset(new FunctionInfo(*F));
+  return Info.get();
+}
+
 //===----------------------------------------------------------------------===//
 // callFunction - Execute the specified function...
 //
@@ -2153,6 +2199,8 @@ void Interpreter::callFunction(Function *F,
   }
 
   // Get pointers to first LLVM BB & Instruction in function.
+  StackFrame.Info      = getFunctionInfo(F);
+  StackFrame.Values.resize(StackFrame.Info->NumSlots);
   StackFrame.CurBB     = F->begin();
   StackFrame.CurInst   = StackFrame.CurBB->begin();
 
@@ -2189,7 +2237,7 @@ DEBUG(
     if (!isa<CallInst>(I) && !isa<InvokeInst>(I) && 
         I.getType() != Type::VoidTy) {
       dbgs() << "  --> ";
-      const GenericValue &Val = SF.Values[&I];
+      const GenericValue &Val = getSlotValue(&I, SF);
       switch (I.getType()->getTypeID()) {
       default: llvm_unreachable("Invalid GenericValue Type");
       case Type::VoidTyID:    dbgs() << "void"; break;
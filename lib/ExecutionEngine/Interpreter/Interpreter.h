@@ -14,6 +14,8 @@
 #ifndef LLVM_LIB_EXECUTIONENGINE_INTERPRETER_INTERPRETER_H
 #define LLVM_LIB_EXECUTIONENGINE_INTERPRETER_INTERPRETER_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/GenericValue.h"
 #include "llvm/ExecutionEngine/FunctionMap.h"
@@ -28,7 +30,6 @@
 namespace llvm {
 
 class IntrinsicLowering;
-struct FunctionInfo;
 template<typename T> class generic_gep_type_iterator;
 class ConstantExpr;
 typedef generic_gep_type_iterator<User::const_op_iterator> gep_type_iterator;
@@ -59,6 +60,31 @@ public:
 
 typedef std::vector<GenericValue> ValuePlaneTy;
 
+// FunctionInfo - The pre-decoded form of a function. Every argument and
+// instruction gets a slot in the ValuePlane of the stack frames running the
+// function. The instructions inserted while running (e.g. by the intrinsic
+// lowering) get a new slot the first time they are seen.
+//
+struct FunctionInfo {
+  DenseMap<const Value *, unsigned> Slots;
+  unsigned NumSlots;
+  // Stores to an alloca of the function itself, which can never modify a
+  // global and are not notified to the StoreListener. Stores to the heap are
+  // still notified: their address can't be told from the one of a global
+  // without the lookup done by the listener, which also needs them to reject
+  // pointers stored in memory without a type
+  SmallPtrSet<const StoreInst *, 16> LocalStores;
+
+  explicit FunctionInfo(Function &F);
+
+  unsigned getSlot(const Value *V) {
+    auto It = Slots.insert(std::make_pair(V, NumSlots));
+    if (It.second)
+      NumSlots++;
+    return It.first->second;
+  }
+};
+
 // ExecutionContext struct - This struct represents one stack frame currently
 // executing.
 //
@@ -68,15 +94,17 @@ struct ExecutionContext {
   BasicBlock::iterator  CurInst;    // The next instruction to execute
   CallSite             Caller;     // Holds the call that called subframes.
                                    // NULL if main func or debugger invoked fn
-  std::map<Value *, GenericValue> Values; // LLVM values used in this invocation
+  FunctionInfo         *Info;      // The slots of CurFunction
+  ValuePlaneTy         Values;     // LLVM values used in this invocation
   std::vector<GenericValue>  VarArgs; // Values passed through an ellipsis
   AllocaHolder Allocas;            // Track memory allocated by alloca
 
-  ExecutionContext() : CurFunction(nullptr), CurBB(nullptr), CurInst(nullptr) {}
+  ExecutionContext() : CurFunction(nullptr), CurBB(nullptr), CurInst(nullptr),
+                       Info(nullptr) {}
 
   ExecutionContext(ExecutionContext &&O)
       : CurFunction(O.CurFunction), CurBB(O.CurBB), CurInst(O.CurInst),
-        Caller(O.Caller), Values(std::move(O.Values)),
+        Caller(O.Caller), Info(O.Info), Values(std::move(O.Values)),
         VarArgs(std::move(O.VarArgs)), Allocas(std::move(O.Allocas)) {}
 
   ExecutionContext &operator=(ExecutionContext &&O) {
@@ -84,6 +112,7 @@ struct ExecutionContext {
     CurBB = O.CurBB;
     CurInst = O.CurInst;
     Caller = O.Caller;
+    Info = O.Info;
     Values = std::move(O.Values);
     VarArgs = std::move(O.VarArgs);
     Allocas = std::move(O.Allocas);
@@ -102,6 +131,13 @@ class Interpreter : public ExecutionEngine, public InstVisitor<Interpreter> {
   // function record.
   std::vector<ExecutionContext> ECStack;
 
+  // The pre-decoded functions, built the first time they are called
+  DenseMap<const Function *, std::unique_ptr<FunctionInfo>> FunctionInfos;
+
+  // The values of the constant operands, computed the first time they are
+  // used. The addresses of globals and functions never change while running.
+  DenseMap<const Constant *, GenericValue> ConstantValues;
+
   // AtExitHandlers - List of functions to call when the program exits,
   // registered with the atexit() library function.
   std::vector<Function*> AtExitHandlers;
@@ -145,7 +181,12 @@ public:
   }
 
   bool hasFailed() const override { return CleanAbort; }
-  void resetFailed() override { ECStack.clear(); CleanAbort = false; }
+  void setFailed() override { CleanAbort = true; }
+  void resetFailed() override {
+    ECStack.clear();
+    ConstantValues.clear();
+    CleanAbort = false;
+  }
 
   // Methods used to execute code:
   // Place a call on the stack
@@ -228,8 +269,15 @@ public:
       return nullptr;
     return ECStack[ECStack.size()-1].CurFunction;
   }
+  Instruction* getCallInstruction(unsigned Depth) override {
+    if (ECStack.size() < Depth + 2)
+      return nullptr;
+    return ECStack[ECStack.size()-Depth-2].Caller.getInstruction();
+  }
 
 private:  // Helper functions
+  FunctionInfo *getFunctionInfo(Function *F);
+
   GenericValue executeGEPOperation(Value *Ptr, gep_type_iterator I,
                                    gep_type_iterator E, ExecutionContext &SF);
 
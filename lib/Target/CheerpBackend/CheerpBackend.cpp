@@ -25,12 +25,16 @@
 #include "llvm/Cheerp/AllocaLowering.h"
 #include "llvm/Cheerp/AllocateArrayLowering.h"
 #include "llvm/Cheerp/IdenticalCodeFolding.h"
+#include "llvm/Cheerp/SimilarFunctionMerging.h"
 #include "llvm/Cheerp/PointerPasses.h"
 #include "llvm/Cheerp/CFGPasses.h"
 #include "llvm/Cheerp/Registerize.h"
 #include "llvm/Cheerp/ResolveAliases.h"
 #include "llvm/Cheerp/SourceMaps.h"
 #include "llvm/Cheerp/CommandLine.h"
+#include "llvm/Cheerp/FunctionProfile.h"
+#include "llvm/Cheerp/Instrumentation.h"
+#include "llvm/Cheerp/PassReport.h"
 
 using namespace llvm;
 
@@ -43,11 +47,12 @@ namespace {
   class CheerpWritePass : public ModulePass {
   private:
     formatted_raw_ostream &Out;
+    cheerp::PassReport* report;
     static char ID;
     void getAnalysisUsage(AnalysisUsage& AU) const;
   public:
-    explicit CheerpWritePass(formatted_raw_ostream &o) :
-      ModulePass(ID), Out(o) { }
+    explicit CheerpWritePass(formatted_raw_ostream &o, cheerp::PassReport* report) :
+      ModulePass(ID), Out(o), report(report) { }
     bool runOnModule(Module &M);
     const char *getPassName() const {
 	return "CheerpWritePass";
@@ -61,7 +66,11 @@ bool CheerpWritePass::runOnModule(Module& M)
   cheerp::GlobalDepsAnalyzer &GDA = getAnalysis<cheerp::GlobalDepsAnalyzer>();
   cheerp::Registerize &registerize = getAnalysis<cheerp::Registerize>();
   cheerp::AllocaStoresExtractor &allocaStoresExtractor = getAnalysis<cheerp::AllocaStoresExtractor>();
-  cheerp::LinearMemoryHelper linearHelper(M, cheerp::LinearMemoryHelper::FunctionAddressMode::AsmJS, GDA);
+  std::unique_ptr<cheerp::FunctionProfile> profile;
+  if (!CheerpProfileUse.empty())
+    profile = cheerp::FunctionProfile::read(CheerpProfileUse);
+  cheerp::LinearMemoryHelper linearHelper(M, cheerp::LinearMemoryHelper::FunctionAddressMode::AsmJS, GDA,
+                                          0, profile.get());
   std::unique_ptr<cheerp::SourceMapGenerator> sourceMapGenerator;
   GDA.forceTypedArrays = ForceTypedArrays;
   if (!SourceMap.empty())
@@ -75,11 +84,22 @@ bool CheerpWritePass::runOnModule(Module& M)
        return false;
     }
   }
-  PA.fullResolve();
-  PA.computeConstantOffsets(M);
+  {
+    cheerp::PassReport::Phase phase(report, "PointerAnalyzer::fullResolve");
+    PA.fullResolve();
+    PA.computeConstantOffsets(M);
+  }
   // Destroy the stores here, we need them to properly compute the pointer kinds, but we want to optimize them away before registerize
   allocaStoresExtractor.destroyStores();
-  registerize.assignRegisters(M, PA);
+  {
+    // The kinds are only read from now on, also by multiple threads
+    cheerp::PassReport::Phase phase(report, "PointerAnalyzer::freeze");
+    PA.freeze(M);
+  }
+  {
+    cheerp::PassReport::Phase phase(report, "Registerize::assignRegisters");
+    registerize.assignRegisters(M, PA, CheerpThreads);
+  }
 
   std::error_code ErrorCode;
   llvm::tool_output_file memFile(AsmJSMemFile, ErrorCode, sys::fs::F_None);
@@ -89,12 +109,34 @@ bool CheerpWritePass::runOnModule(Module& M)
     memOut.reset(new formatted_raw_ostream(memFile.os()));
   }
 
+  // The writer emits many small tokens, flush them to the file in large blocks
+  Out.SetBufferSize(1 << 20);
+
   cheerp::NameGenerator namegen(M, GDA, registerize, PA, ReservedNames, PrettyCode);
   cheerp::CheerpWriter writer(M, Out, PA, registerize, GDA, linearHelper, namegen, allocaStoresExtractor, memOut.get(), AsmJSMemFile,
           sourceMapGenerator.get(), PrettyCode, MakeModule, NoRegisterize, !NoNativeJavaScriptMath,
           !NoJavaScriptMathImul, !NoJavaScriptMathFround, !NoCredits, MeasureTimeToMain, CheerpHeapSize,
-          BoundsCheck, SymbolicGlobalsAsmJS, std::string(), ForceTypedArrays);
+          BoundsCheck, SymbolicGlobalsAsmJS, std::string(), ForceTypedArrays, false, StringRef(), false, LazyDataFile,
+          report, CheerpThreads);
   writer.makeJS();
+  if (report)
+  {
+    report->addCounter("PointerAnalyzer.kindCacheHits", PA.getKindCacheHits());
+    report->addCounter("PointerAnalyzer.kindCacheMisses", PA.getKindCacheMisses());
+  }
+  if (linearHelper.hasLazyGlobals())
+  {
+    std::error_code LazyErrorCode;
+    llvm::tool_output_file lazyFile(LazyDataFile.c_str(), LazyErrorCode, sys::fs::F_None);
+    if (LazyErrorCode)
+    {
+      // An error occurred opening the lazy data file, bail out
+      llvm::report_fatal_error(LazyErrorCode.message(), false);
+      return false;
+    }
+    linearHelper.compileLazyData(lazyFile.os());
+    lazyFile.keep();
+  }
   if (ErrorCode)
   {
     if(!AsmJSMemFile.empty())
@@ -129,25 +171,45 @@ bool CheerpTargetMachine::addPassesToEmitFile(PassManagerBase &PM,
                                            bool DisableVerify,
                                            AnalysisID StartAfter,
                                            AnalysisID StopAfter) {
-  PM.add(createAllocaLoweringPass());
-  PM.add(createResolveAliasesPass());
-  PM.add(createFreeAndDeleteRemovalPass());
-  PM.add(cheerp::createGlobalDepsAnalyzerPass());
+  // When a report is requested every pass is preceded by a marker that
+  // starts measuring it
+  std::shared_ptr<cheerp::PassReport> report;
+  if (!CheerpPassReport.empty())
+    report = std::make_shared<cheerp::PassReport>();
+  auto addPass = [&](Pass* P)
+  {
+    if (report)
+      PM.add(cheerp::createPassReportMarker(report, P->getPassName()));
+    PM.add(P);
+  };
+  addPass(createAllocaLoweringPass());
+  addPass(createResolveAliasesPass());
+  addPass(createFreeAndDeleteRemovalPass());
+  // The instrumented builds already count the calls for cheerpProfileDump()
+  if (!CheerpInstrument.empty())
+    addPass(cheerp::createInstrumentationPass(CheerpInstrument, CheerpInstrumentMinSize));
+  else if (CheerpProfileGenerate)
+    addPass(cheerp::createProfileInstrumentationPass());
+  addPass(cheerp::createGlobalDepsAnalyzerPass());
   if (!CheerpNoICF)
-    PM.add(cheerp::createIdenticalCodeFoldingPass());
-  PM.add(createPointerArithmeticToArrayIndexingPass());
-  PM.add(createPointerToImmutablePHIRemovalPass());
-  PM.add(createGEPOptimizerPass());
-  PM.add(cheerp::createRegisterizePass(!NoJavaScriptMathFround, NoRegisterize));
-  PM.add(cheerp::createPointerAnalyzerPass());
-  PM.add(cheerp::createAllocaMergingPass());
-  PM.add(createIndirectCallOptimizerPass());
-  PM.add(createAllocaArraysPass());
-  PM.add(cheerp::createAllocaArraysMergingPass());
-  PM.add(createDelayAllocasPass());
-  PM.add(createRemoveFwdBlocksPass());
+    addPass(cheerp::createIdenticalCodeFoldingPass(CheerpThreads));
+  if (CheerpMergeSimilarFunctions)
+    addPass(cheerp::createSimilarFunctionMergingPass(CheerpMergeSimilarFunctions));
+  addPass(createPointerArithmeticToArrayIndexingPass());
+  addPass(createPointerToImmutablePHIRemovalPass());
+  addPass(createGEPOptimizerPass());
+  addPass(cheerp::createRegisterizePass(!NoJavaScriptMathFround, NoRegisterize, RegisterizeColoring));
+  addPass(cheerp::createPointerAnalyzerPass());
+  addPass(cheerp::createAllocaMergingPass());
+  addPass(createIndirectCallOptimizerPass());
+  addPass(createAllocaArraysPass());
+  addPass(cheerp::createAllocaArraysMergingPass());
+  addPass(createDelayAllocasPass());
+  addPass(createRemoveFwdBlocksPass());
   // Keep this pass last, it is going to remove stores to memory from the LLVM visible code, so further optimizing afterwards will break
-  PM.add(cheerp::createAllocaStoresExtractor());
-  PM.add(new CheerpWritePass(o));
+  addPass(cheerp::createAllocaStoresExtractor());
+  addPass(new CheerpWritePass(o, report.get()));
+  if (report)
+    PM.add(cheerp::createPassReportWriter(report, CheerpPassReport));
   return false;
 }
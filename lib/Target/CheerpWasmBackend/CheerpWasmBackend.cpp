@@ -32,8 +32,12 @@
 #include "llvm/Cheerp/ResolveAliases.h"
 #include "llvm/Cheerp/SourceMaps.h"
 #include "llvm/Cheerp/IdenticalCodeFolding.h"
+#include "llvm/Cheerp/SimilarFunctionMerging.h"
 #include "llvm/Cheerp/LinearMemoryHelper.h"
 #include "llvm/Cheerp/CommandLine.h"
+#include "llvm/Cheerp/FunctionProfile.h"
+#include "llvm/Cheerp/Instrumentation.h"
+#include "llvm/Cheerp/PassReport.h"
 #include "llvm/Cheerp/Utility.h"
 
 using namespace llvm;
@@ -49,11 +53,12 @@ namespace {
   private:
     formatted_raw_ostream &Out;
     cheerp::CheerpMode cheerpMode;
+    cheerp::PassReport* report;
     static char ID;
     void getAnalysisUsage(AnalysisUsage& AU) const;
   public:
-    explicit CheerpWasmWritePass(formatted_raw_ostream &o, cheerp::CheerpMode cheerpMode) :
-      ModulePass(ID), Out(o), cheerpMode(cheerpMode) { }
+    explicit CheerpWasmWritePass(formatted_raw_ostream &o, cheerp::CheerpMode cheerpMode, cheerp::PassReport* report) :
+      ModulePass(ID), Out(o), cheerpMode(cheerpMode), report(report) { }
     bool runOnModule(Module &M);
     const char *getPassName() const {
 	return "CheerpWasmWritePass";
@@ -67,24 +72,63 @@ bool CheerpWasmWritePass::runOnModule(Module& M)
   cheerp::GlobalDepsAnalyzer &GDA = getAnalysis<cheerp::GlobalDepsAnalyzer>();
   cheerp::Registerize &registerize = getAnalysis<cheerp::Registerize>();
   cheerp::AllocaStoresExtractor &allocaStoresExtractor = getAnalysis<cheerp::AllocaStoresExtractor>();
-  cheerp::LinearMemoryHelper linearHelper(M, cheerp::LinearMemoryHelper::FunctionAddressMode::Wasm, GDA);
+  // When the memory can grow the stack is placed after the globals
+  bool growMemory = CheerpHeapMaxSize > CheerpHeapSize;
+  std::unique_ptr<cheerp::FunctionProfile> profile;
+  if (!CheerpProfileUse.empty())
+    profile = cheerp::FunctionProfile::read(CheerpProfileUse);
+  cheerp::LinearMemoryHelper linearHelper(M, cheerp::LinearMemoryHelper::FunctionAddressMode::Wasm, GDA,
+                                          growMemory ? CheerpStackSize << 20 : 0, profile.get());
 
-  PA.fullResolve();
-  PA.computeConstantOffsets(M);
+  {
+    cheerp::PassReport::Phase phase(report, "PointerAnalyzer::fullResolve");
+    PA.fullResolve();
+    PA.computeConstantOffsets(M);
+  }
   // Destroy the stores here, we need them to properly compute the pointer kinds, but we want to optimize them away before registerize
   allocaStoresExtractor.destroyStores();
-  registerize.assignRegisters(M, PA);
+  {
+    // The kinds are only read from now on, also by multiple threads
+    cheerp::PassReport::Phase phase(report, "PointerAnalyzer::freeze");
+    PA.freeze(M);
+  }
+  {
+    cheerp::PassReport::Phase phase(report, "Registerize::assignRegisters");
+    registerize.assignRegisters(M, PA, CheerpThreads);
+  }
 
   // Build the ordered list of reserved names
   std::vector<std::string> reservedNames(ReservedNames.begin(), ReservedNames.end());
   std::sort(reservedNames.begin(), reservedNames.end());
 
+  // The lazily loaded globals are fetched by the JS loader
+  if (linearHelper.hasLazyGlobals())
+  {
+    if (WasmLoader.empty())
+    {
+      llvm::report_fatal_error("lazily loaded globals require -cheerp-wasm-loader", false);
+      return false;
+    }
+    std::error_code ErrorCode;
+    llvm::tool_output_file lazyFile(LazyDataFile.c_str(), ErrorCode, sys::fs::F_None);
+    if (ErrorCode)
+    {
+      // An error occurred opening the lazy data file, bail out
+      llvm::report_fatal_error(ErrorCode.message(), false);
+      return false;
+    }
+    linearHelper.compileLazyData(lazyFile.os());
+    lazyFile.keep();
+  }
+
   if (WasmLoader.empty())
   {
     cheerp::NameGenerator namegen(M, GDA, registerize, PA, reservedNames, PrettyCode);
     cheerp::CheerpWasmWriter writer(M, Out, PA, registerize, GDA, linearHelper, namegen,
-                                    M.getContext(), CheerpHeapSize, !WasmLoader.empty(),
-                                    PrettyCode, cheerpMode);
+                                    M.getContext(), CheerpHeapSize, CheerpHeapMaxSize, !WasmLoader.empty(),
+                                    PrettyCode, cheerpMode, CheerpThreads, WasmCacheDir, report,
+                                    !WasmNoPeephole, !WasmNoStructurizer);
+    cheerp::PassReport::Phase phase(report, "Wasm");
     writer.makeWasm();
   }
   else
@@ -107,18 +151,29 @@ bool CheerpWasmWritePass::runOnModule(Module& M)
     std::error_code ErrorCode;
     llvm::tool_output_file jsFile(WasmLoader.c_str(), ErrorCode, sys::fs::F_None);
     llvm::formatted_raw_ostream jsOut(jsFile.os());
+    // The writer emits many small tokens, flush them to the file in large blocks
+    jsOut.SetBufferSize(1 << 20);
 
     cheerp::NameGenerator namegen(M, GDA, registerize, PA, reservedNames, PrettyCode);
     cheerp::CheerpWasmWriter wasmWriter(M, Out, PA, registerize, GDA, linearHelper, namegen,
-                                    M.getContext(), CheerpHeapSize, !WasmLoader.empty(),
-                                    PrettyCode, cheerpMode);
-    wasmWriter.makeWasm();
+                                    M.getContext(), CheerpHeapSize, CheerpHeapMaxSize, !WasmLoader.empty(),
+                                    PrettyCode, cheerpMode, CheerpThreads, WasmCacheDir, report,
+                                    !WasmNoPeephole, !WasmNoStructurizer);
+    {
+      cheerp::PassReport::Phase phase(report, "Wasm");
+      wasmWriter.makeWasm();
+    }
 
     cheerp::CheerpWriter writer(M, jsOut, PA, registerize, GDA, linearHelper, namegen, allocaStoresExtractor, nullptr, std::string(),
             sourceMapGenerator, PrettyCode, MakeModule, NoRegisterize, !NoNativeJavaScriptMath,
             !NoJavaScriptMathImul, !NoJavaScriptMathFround, !NoCredits, MeasureTimeToMain, CheerpHeapSize,
-            BoundsCheck, SymbolicGlobalsAsmJS, WasmFile, ForceTypedArrays);
-    writer.makeJS();
+            BoundsCheck, SymbolicGlobalsAsmJS, WasmFile, ForceTypedArrays,
+            WasmStreaming, WasmCacheModule ? wasmWriter.getModuleHash() : std::string(), growMemory,
+            LazyDataFile, report, CheerpThreads);
+    {
+      cheerp::PassReport::Phase phase(report, "Loader");
+      writer.makeJS();
+    }
     if (ErrorCode)
     {
        // An error occurred opening the wasm loader file, bail out
@@ -129,6 +184,11 @@ bool CheerpWasmWritePass::runOnModule(Module& M)
     jsFile.keep();
     delete sourceMapGenerator;
   }
+  if (report)
+  {
+    report->addCounter("PointerAnalyzer.kindCacheHits", PA.getKindCacheHits());
+    report->addCounter("PointerAnalyzer.kindCacheMisses", PA.getKindCacheMisses());
+  }
   return false;
 }
 
@@ -152,35 +212,55 @@ bool CheerpBaseTargetMachine::addPassesToEmitFile(PassManagerBase &PM,
                                            bool DisableVerify,
                                            AnalysisID StartAfter,
                                            AnalysisID StopAfter) {
-  PM.add(createAllocaLoweringPass());
-  PM.add(createResolveAliasesPass());
-  PM.add(createFreeAndDeleteRemovalPass());
-  PM.add(cheerp::createGlobalDepsAnalyzerPass());
+  // When a report is requested every pass is preceded by a marker that
+  // starts measuring it
+  std::shared_ptr<cheerp::PassReport> report;
+  if (!CheerpPassReport.empty())
+    report = std::make_shared<cheerp::PassReport>();
+  auto addPass = [&](Pass* P)
+  {
+    if (report)
+      PM.add(cheerp::createPassReportMarker(report, P->getPassName()));
+    PM.add(P);
+  };
+  addPass(createAllocaLoweringPass());
+  addPass(createResolveAliasesPass());
+  addPass(createFreeAndDeleteRemovalPass());
+  // The instrumented builds already count the calls for cheerpProfileDump()
+  if (!CheerpInstrument.empty())
+    addPass(cheerp::createInstrumentationPass(CheerpInstrument, CheerpInstrumentMinSize));
+  else if (CheerpProfileGenerate)
+    addPass(cheerp::createProfileInstrumentationPass());
+  addPass(cheerp::createGlobalDepsAnalyzerPass());
   if (!CheerpNoICF)
-    PM.add(cheerp::createIdenticalCodeFoldingPass());
-  PM.add(createPointerArithmeticToArrayIndexingPass());
-  PM.add(createPointerToImmutablePHIRemovalPass());
-  PM.add(createGEPOptimizerPass());
-  PM.add(cheerp::createRegisterizePass(true, false));
-  PM.add(cheerp::createPointerAnalyzerPass());
-  PM.add(cheerp::createAllocaMergingPass());
-  PM.add(createIndirectCallOptimizerPass());
-  PM.add(createAllocaArraysPass());
-  PM.add(cheerp::createAllocaArraysMergingPass());
-  PM.add(createDelayAllocasPass());
-  PM.add(createRemoveFwdBlocksPass());
+    addPass(cheerp::createIdenticalCodeFoldingPass(CheerpThreads));
+  if (CheerpMergeSimilarFunctions)
+    addPass(cheerp::createSimilarFunctionMergingPass(CheerpMergeSimilarFunctions));
+  addPass(createPointerArithmeticToArrayIndexingPass());
+  addPass(createPointerToImmutablePHIRemovalPass());
+  addPass(createGEPOptimizerPass());
+  addPass(cheerp::createRegisterizePass(true, false, RegisterizeColoring, true));
+  addPass(cheerp::createPointerAnalyzerPass());
+  addPass(cheerp::createAllocaMergingPass());
+  addPass(createIndirectCallOptimizerPass());
+  addPass(createAllocaArraysPass());
+  addPass(cheerp::createAllocaArraysMergingPass());
+  addPass(createDelayAllocasPass());
+  addPass(createRemoveFwdBlocksPass());
   // Keep this pass last, it is going to remove stores to memory from the LLVM visible code, so further optimizing afterwards will break
-  PM.add(cheerp::createAllocaStoresExtractor());
-  PM.add(createCheerpWritePass(o));
+  addPass(cheerp::createAllocaStoresExtractor());
+  addPass(createCheerpWritePass(o, report.get()));
+  if (report)
+    PM.add(cheerp::createPassReportWriter(report, CheerpPassReport));
   return false;
 }
 
-ModulePass* CheerpWastTargetMachine::createCheerpWritePass(formatted_raw_ostream& o)
+ModulePass* CheerpWastTargetMachine::createCheerpWritePass(formatted_raw_ostream& o, cheerp::PassReport* report)
 {
-	return new CheerpWasmWritePass(o, cheerp::CHEERP_MODE_WAST);
+	return new CheerpWasmWritePass(o, cheerp::CHEERP_MODE_WAST, report);
 }
 
-ModulePass* CheerpWasmTargetMachine::createCheerpWritePass(formatted_raw_ostream& o)
+ModulePass* CheerpWasmTargetMachine::createCheerpWritePass(formatted_raw_ostream& o, cheerp::PassReport* report)
 {
-	return new CheerpWasmWritePass(o, cheerp::CHEERP_MODE_WASM);
+	return new CheerpWasmWritePass(o, cheerp::CHEERP_MODE_WASM, report);
 }
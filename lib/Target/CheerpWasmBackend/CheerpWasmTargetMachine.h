@@ -14,6 +14,7 @@
 
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetSubtargetInfo.h"
+#include "llvm/Cheerp/PassReport.h"
 #include "llvm/IR/DataLayout.h"
 
 namespace llvm {
@@ -53,17 +54,17 @@ public:
                                    bool DisableVerify,
                                    AnalysisID StartAfter,
                                    AnalysisID StopAfter) override;
-  virtual ModulePass* createCheerpWritePass(formatted_raw_ostream &o) = 0;
+  virtual ModulePass* createCheerpWritePass(formatted_raw_ostream &o, cheerp::PassReport* report) = 0;
 };
 
 struct CheerpWastTargetMachine : public CheerpBaseTargetMachine {
 	using CheerpBaseTargetMachine::CheerpBaseTargetMachine;
-  virtual ModulePass* createCheerpWritePass(formatted_raw_ostream &o);
+  virtual ModulePass* createCheerpWritePass(formatted_raw_ostream &o, cheerp::PassReport* report);
 };
 
 struct CheerpWasmTargetMachine : public CheerpBaseTargetMachine {
 	using CheerpBaseTargetMachine::CheerpBaseTargetMachine;
-  virtual ModulePass* createCheerpWritePass(formatted_raw_ostream &o);
+  virtual ModulePass* createCheerpWritePass(formatted_raw_ostream &o, cheerp::PassReport* report);
 };
 
 extern Target TheCheerpWastBackendTarget;
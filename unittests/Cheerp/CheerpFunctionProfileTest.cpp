@@ -0,0 +1,92 @@
+//===- llvm/unittest/Cheerp/CheerpFunctionProfileTest.cpp -----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/FunctionProfile.h"
+#include "llvm/Cheerp/Instrumentation.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/SourceMgr.h"
+#include "gtest/gtest.h"
+
+namespace llvm {
+namespace {
+
+using namespace cheerp;
+
+TEST(CheerpTest, FunctionProfileTest) {
+
+	LLVMContext C;
+	Module M("profile", C);
+	FunctionType* fTy = FunctionType::get(Type::getVoidTy(C), false);
+	Function* hot = Function::Create(fTy, GlobalValue::ExternalLinkage, "_Z3hotv", &M);
+	Function* cold = Function::Create(fTy, GlobalValue::ExternalLinkage, "_Z4coldv", &M);
+	Function* unknown = Function::Create(fTy, GlobalValue::ExternalLinkage, "_Z7unknownv", &M);
+
+	/** Comments and empty lines are skipped, repeated functions are summed **/
+	FunctionProfile profile;
+	EXPECT_TRUE( profile.parse("# first run\n12 _Z3hotv\n0 _Z4coldv\n\n# second run\n30 _Z3hotv\n") );
+	EXPECT_TRUE( profile.hasCount(*hot) );
+	EXPECT_EQ( 42u, profile.getCount(*hot) );
+	EXPECT_TRUE( profile.hasCount(*cold) );
+	EXPECT_EQ( 0u, profile.getCount(*cold) );
+	EXPECT_FALSE( profile.hasCount(*unknown) );
+	EXPECT_EQ( 0u, profile.getCount(*unknown) );
+
+	/** Lines without a count or a name are not valid **/
+	EXPECT_FALSE( FunctionProfile().parse("_Z3hotv\n") );
+	EXPECT_FALSE( FunctionProfile().parse("12\n") );
+}
+
+const char* InstrumentedIR =
+	"define i32 @small(i32 %a) section \"asmjs\" {\n"
+	"  ret i32 %a\n"
+	"}\n"
+	"define i32 @big(i32 %a) section \"asmjs\" {\n"
+	"  %p = alloca i32\n"
+	"  store i32 %a, i32* %p\n"
+	"  %b = load i32* %p\n"
+	"  %c = call i32 @small(i32 %b)\n"
+	"  ret i32 %c\n"
+	"}\n";
+
+TEST(CheerpTest, InstrumentationTest) {
+
+	LLVMContext C;
+	SMDiagnostic Err;
+
+	std::unique_ptr<Module> M = parseAssemblyString(InstrumentedIR, Err, C);
+	ASSERT_TRUE( M.get() );
+	Function* small = M->getFunction("small");
+	Function* big = M->getFunction("big");
+
+	Instrumentation instrumentation(StringRef(), /*minSize*/4);
+	EXPECT_TRUE( instrumentation.runOnModule(*M) );
+
+	/** Every function is a symbol, only the big one is counted **/
+	EXPECT_EQ( 2u, M->getNamedMetadata(Instrumentation::symbolsMetadataName)->getNumOperands() );
+	EXPECT_EQ( 1u, M->getNamedMetadata(ProfileInstrumentation::namesMetadataName)->getNumOperands() );
+	GlobalVariable* counters = M->getGlobalVariable(ProfileInstrumentation::countersName, true);
+	ASSERT_TRUE( counters );
+	EXPECT_EQ( StringRef("asmjs"), counters->getSection() );
+	EXPECT_EQ( 1u, small->size() );
+
+	/** The sample is taken in a separate block, the allocas stay in the entry block **/
+	Function* sample = M->getFunction(Instrumentation::sampleName);
+	ASSERT_TRUE( sample );
+	EXPECT_TRUE( StringRef(sample->getSection()).empty() );
+	EXPECT_EQ( 3u, big->size() );
+	EXPECT_TRUE( isa<AllocaInst>(big->getEntryBlock().getFirstNonPHI()->getNextNode()->getNextNode()->getNextNode()) );
+	const BasicBlock* sampled = big->getEntryBlock().getTerminator()->getSuccessor(0);
+	EXPECT_EQ( sample, cast<CallInst>(sampled->begin())->getCalledFunction() );
+}
+
+}
+}
@@ -0,0 +1,99 @@
+//===- llvm/unittest/Cheerp/CheerpInlineableTest.cpp ----------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/PointerAnalyzer.h"
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/SourceMgr.h"
+#include "gtest/gtest.h"
+
+namespace llvm {
+namespace {
+
+using namespace cheerp;
+
+const char* InlineableIR =
+	"define i32 @ret(i8* %p) {\n"
+	"  %v = load i8* %p\n"
+	"  %e = sext i8 %v to i32\n"
+	"  ret i32 %e\n"
+	"}\n"
+	"define void @store(i8* %p, i32* %q) {\n"
+	"  %v = load i8* %p\n"
+	"  %e = zext i8 %v to i32\n"
+	"  store i32 %e, i32* %q\n"
+	"  ret void\n"
+	"}\n"
+	"define void @clobbered(i8* %p, i32* %q) {\n"
+	"  %v = load i8* %p\n"
+	"  %e = sext i8 %v to i32\n"
+	"  store i8 0, i8* %p\n"
+	"  store i32 %e, i32* %q\n"
+	"  ret void\n"
+	"}\n"
+	"define i32 @arith(i8* %p, i32* %q) {\n"
+	"  %v = load i8* %p\n"
+	"  %e = sext i8 %v to i32\n"
+	"  %a = add i32 %e, 1\n"
+	"  ret i32 %a\n"
+	"}\n"
+	"define i32 @loop(i8* %p) {\n"
+	"entry:\n"
+	"  br label %body\n"
+	"body:\n"
+	"  %s = phi i32 [ 0, %entry ], [ %e, %body ]\n"
+	"  %v = load i8* %p\n"
+	"  %e = sext i8 %v to i32\n"
+	"  %c = icmp eq i32 %s, 0\n"
+	"  br i1 %c, label %body, label %exit\n"
+	"exit:\n"
+	"  ret i32 %s\n"
+	"}\n";
+
+const Instruction* getInstByName(const Function* F, StringRef name)
+{
+	for (const BasicBlock& BB : *F)
+		for (const Instruction& I : BB)
+			if (I.getName() == name)
+				return &I;
+	return nullptr;
+}
+
+TEST(CheerpTest, InlineableTest) {
+
+	LLVMContext C;
+	SMDiagnostic Err;
+
+	std::unique_ptr<Module> M = parseAssemblyString(InlineableIR, Err, C);
+	ASSERT_TRUE( M.get() );
+
+	PointerAnalyzer PA;
+
+	/** A load extended right before a return or a store is folded **/
+	EXPECT_TRUE( isInlineable(*getInstByName(M->getFunction("ret"), "v"), PA) );
+	EXPECT_TRUE( isInlineable(*getInstByName(M->getFunction("store"), "v"), PA) );
+
+	/** A store between the extension and its use clobbers the loaded memory,
+	 *  the extension keeps its own local and the load is inlined in it **/
+	EXPECT_TRUE( isInlineable(*getInstByName(M->getFunction("clobbered"), "v"), PA) );
+	EXPECT_FALSE( isInlineable(*getInstByName(M->getFunction("clobbered"), "e"), PA) );
+
+	/** The extension of an inlined load is not inlined further into an arithmetic user **/
+	EXPECT_TRUE( isInlineable(*getInstByName(M->getFunction("arith"), "v"), PA) );
+	EXPECT_FALSE( isInlineable(*getInstByName(M->getFunction("arith"), "e"), PA) );
+
+	/** A PHI user in the same block is never reached walking forward **/
+	EXPECT_TRUE( isInlineable(*getInstByName(M->getFunction("loop"), "v"), PA) );
+	EXPECT_FALSE( isInlineable(*getInstByName(M->getFunction("loop"), "e"), PA) );
+}
+
+}
+}
@@ -0,0 +1,112 @@
+//===- llvm/unittest/Cheerp/CheerpMemIntrinsicTest.cpp --------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/SourceMgr.h"
+#include "gtest/gtest.h"
+
+namespace llvm {
+namespace {
+
+using namespace cheerp;
+
+const char* MemIntrinsicsIR =
+	"declare void @llvm.memcpy.p0i8.p0i8.i32(i8*, i8*, i32, i32, i1)\n"
+	"declare void @llvm.memmove.p0i8.p0i8.i32(i8*, i8*, i32, i32, i1)\n"
+	"declare void @llvm.memset.p0i8.i32(i8*, i8, i32, i32, i1)\n"
+	"define void @f(i8* %d, i8* %s, i32 %n, i8 %v) {\n"
+	"  call void @llvm.memcpy.p0i8.p0i8.i32(i8* %d, i8* %s, i32 32, i32 8, i1 false)\n"
+	"  call void @llvm.memcpy.p0i8.p0i8.i32(i8* %d, i8* %s, i32 15, i32 1, i1 false)\n"
+	"  call void @llvm.memcpy.p0i8.p0i8.i32(i8* %d, i8* %s, i32 %n, i32 8, i1 false)\n"
+	"  call void @llvm.memcpy.p0i8.p0i8.i32(i8* %d, i8* %s, i32 256, i32 8, i1 false)\n"
+	"  call void @llvm.memcpy.p0i8.p0i8.i32(i8* %d, i8* %s, i32 16, i32 8, i1 true)\n"
+	"  call void @llvm.memmove.p0i8.p0i8.i32(i8* %d, i8* %s, i32 4, i32 4, i1 false)\n"
+	"  call void @llvm.memmove.p0i8.p0i8.i32(i8* %d, i8* %s, i32 12, i32 4, i1 false)\n"
+	"  call void @llvm.memset.p0i8.i32(i8* %d, i8 -85, i32 7, i32 4, i1 false)\n"
+	"  call void @llvm.memset.p0i8.i32(i8* %d, i8 %v, i32 8, i32 8, i1 false)\n"
+	"  call void @llvm.memset.p0i8.i32(i8* %d, i8 0, i32 0, i32 1, i1 false)\n"
+	"  ret void\n"
+	"}\n";
+
+std::vector<const MemIntrinsic*> getMemIntrinsics(const Function* F)
+{
+	std::vector<const MemIntrinsic*> ret;
+	for (const BasicBlock& BB : *F)
+		for (const Instruction& I : BB)
+			if (const MemIntrinsic* MI = dyn_cast<MemIntrinsic>(&I))
+				ret.push_back(MI);
+	return ret;
+}
+
+std::vector<uint32_t> getAccesses(const MemIntrinsic* MI, uint32_t maxWidth, bool allowUnaligned, bool& inlined)
+{
+	SmallVector<uint32_t, MaxInlineMemIntrinsicAccesses> widths;
+	inlined = getInlineMemIntrinsicAccesses(*MI, maxWidth, allowUnaligned, widths);
+	return std::vector<uint32_t>(widths.begin(), widths.end());
+}
+
+TEST(CheerpTest, InlineMemIntrinsicTest) {
+
+	LLVMContext C;
+	SMDiagnostic Err;
+
+	std::unique_ptr<Module> M = parseAssemblyString(MemIntrinsicsIR, Err, C);
+	ASSERT_TRUE( M.get() );
+
+	std::vector<const MemIntrinsic*> MIs = getMemIntrinsics(M->getFunction("f"));
+	ASSERT_EQ( 10u, MIs.size() );
+
+	bool inlined;
+	typedef std::vector<uint32_t> Widths;
+
+	/** Aligned memcpy: word sized accesses **/
+	EXPECT_EQ( Widths({8, 8, 8, 8}), getAccesses(MIs[0], 8, true, inlined) );
+	EXPECT_TRUE( inlined );
+	EXPECT_EQ( Widths({4, 4, 4, 4, 4, 4, 4, 4}), getAccesses(MIs[0], 4, false, inlined) );
+	EXPECT_TRUE( inlined );
+
+	/** Unaligned memcpy: the tail is narrower, heap accesses follow the alignment **/
+	EXPECT_EQ( Widths({8, 4, 2, 1}), getAccesses(MIs[1], 8, true, inlined) );
+	EXPECT_TRUE( inlined );
+	EXPECT_EQ( Widths(15, 1), getAccesses(MIs[1], 4, false, inlined) );
+	EXPECT_TRUE( inlined );
+
+	/** Unknown, large or volatile copies are left to the library **/
+	getAccesses(MIs[2], 8, true, inlined);
+	EXPECT_FALSE( inlined );
+	getAccesses(MIs[3], 8, true, inlined);
+	EXPECT_FALSE( inlined );
+	getAccesses(MIs[4], 8, true, inlined);
+	EXPECT_FALSE( inlined );
+
+	/** memmove is only expanded when a single access is enough **/
+	EXPECT_EQ( Widths({4}), getAccesses(MIs[5], 8, true, inlined) );
+	EXPECT_TRUE( inlined );
+	getAccesses(MIs[6], 8, true, inlined);
+	EXPECT_FALSE( inlined );
+
+	/** memset needs a constant value **/
+	EXPECT_EQ( Widths({4, 2, 1}), getAccesses(MIs[7], 4, false, inlined) );
+	EXPECT_TRUE( inlined );
+	EXPECT_EQ( 0xababababu, getMemsetPattern(cast<MemSetInst>(*MIs[7]), 4) );
+	EXPECT_EQ( 0xababu, getMemsetPattern(cast<MemSetInst>(*MIs[7]), 2) );
+	getAccesses(MIs[8], 8, true, inlined);
+	EXPECT_FALSE( inlined );
+
+	/** Empty intrinsics need no access at all **/
+	EXPECT_TRUE( getAccesses(MIs[9], 8, true, inlined).empty() );
+	EXPECT_TRUE( inlined );
+}
+
+}
+}
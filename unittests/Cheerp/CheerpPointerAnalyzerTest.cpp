@@ -147,5 +147,58 @@ TEST(CheerpTest, PointerAnalyzerTest) {
 #endif
 }
 
+TEST(CheerpTest, PointerAnalyzerFreezeTest) {
+
+	LLVMContext C;
+	SMDiagnostic Err;
+
+	std::unique_ptr<Module> M = parseIRFile( "test1.ll", Err, C );
+	ASSERT_TRUE( M.get() );
+
+	// The pointers used by the code, including the constants
+	std::vector<const Value*> pointers;
+	for ( const Function & F : *M )
+	{
+		for ( const Argument & arg : F.getArgumentList() )
+			if ( arg.getType()->isPointerTy() )
+				pointers.push_back(&arg);
+		for ( const BasicBlock & BB : F )
+			for ( const Instruction & I : BB )
+			{
+				if ( I.getType()->isPointerTy() )
+					pointers.push_back(&I);
+				for ( const Use & op : I.operands() )
+					if ( isa<Constant>(op) && op->getType()->isPointerTy() )
+						pointers.push_back(op);
+			}
+	}
+	ASSERT_FALSE( pointers.empty() );
+
+	// Both analyzers are resolved like in the backends, one of them is frozen
+	PointerAnalyzer lazy;
+	PointerAnalyzer frozen;
+	for ( const Function & F : *M )
+	{
+		lazy.prefetchFunc(F);
+		frozen.prefetchFunc(F);
+	}
+	lazy.fullResolve();
+	frozen.fullResolve();
+	frozen.freeze(*M);
+	uint64_t misses = frozen.getKindCacheMisses();
+
+	/** The frozen analyzer gives the same kinds, without visiting anything **/
+	for ( const Value * p : pointers )
+		EXPECT_EQ( lazy.getPointerKind(p), frozen.getPointerKind(p) );
+	EXPECT_EQ( misses, frozen.getKindCacheMisses() );
+
+#ifdef GTEST_HAS_DEATH_TEST
+	/** Values created after freezing are never visited, even without assertions **/
+	const GlobalVariable * GV = &*M->global_begin();
+	Constant * cast = ConstantExpr::getBitCast(const_cast<GlobalVariable*>(GV), Type::getInt16PtrTy(C));
+	EXPECT_DEATH( frozen.getPointerKind(cast), "not computed before freezing" );
+#endif
+}
+
 }
 }
@@ -0,0 +1,176 @@
+//===- llvm/unittest/Cheerp/CheerpPreExecuteTest.cpp ----------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CheerpTestIR.h"
+#include "llvm/Cheerp/PreExecute.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/ExecutionEngine/Interpreter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/SourceMgr.h"
+#include "gtest/gtest.h"
+
+namespace llvm {
+namespace {
+
+using namespace cheerp;
+
+// A container filled by a constructor, which is grown and freed at run time.
+std::string containerIR(bool asmjs)
+{
+	StringRef section = asmjs ? " section \"asmjs\"" : "";
+	return cheerpIR(asmjs ? "wasm" : "genericjs",
+		Twine("@vec = global i32* null") + (asmjs ? "," : "") + section + "\n"
+		"@llvm.global_ctors = appending global [1 x { i32, void ()* }] [{ i32, void ()* } { i32 65535, void ()* @init }]\n"
+		"declare i8* @malloc(i32)\n"
+		"declare i32* @llvm.cheerp.reallocate.p0i32.p0i32(i32*, i32)\n"
+		"declare void @llvm.cheerp.deallocate.p0i32(i32*)\n"
+		"define internal void @init()" + section + " {\n"
+		"  %m = call i8* @malloc(i32 16)\n"
+		"  %v = bitcast i8* %m to i32*\n"
+		"  %p = getelementptr i32* %v, i32 1\n"
+		"  store i32 42, i32* %p\n"
+		"  store i32* %v, i32** @vec\n"
+		"  ret void\n"
+		"}\n"
+		"define void @webMain()" + section + " {\n"
+		"  %v = load i32** @vec\n"
+		"  %g = call i32* @llvm.cheerp.reallocate.p0i32.p0i32(i32* %v, i32 32)\n"
+		"  call void @llvm.cheerp.deallocate.p0i32(i32* %g)\n"
+		"  ret void\n"
+		"}\n");
+}
+
+// Constructors run in a row, the first one fails after storing to a global.
+const std::string constructorsIR = cheerpIR("genericjs",
+	"@a = global i32 0\n"
+	"@arr = global [4 x i32] zeroinitializer\n"
+	"@ptr = global i32* null\n"
+	"@ptr2 = global i32* null\n"
+	"@llvm.global_ctors = appending global [3 x { i32, void ()* }] [{ i32, void ()* } { i32 65535, void ()* @fail }, { i32, void ()* } { i32 65535, void ()* @first }, { i32, void ()* } { i32 65535, void ()* @second }]\n"
+	"declare i8* @malloc(i32)\n"
+	"declare void @unknown()\n"
+	"define internal void @fail() {\n"
+	"  store i32 1, i32* getelementptr ([4 x i32]* @arr, i32 0, i32 1)\n"
+	"  call void @unknown()\n"
+	"  ret void\n"
+	"}\n"
+	"define internal void @first() {\n"
+	"  %m = call i8* @malloc(i32 8)\n"
+	"  %v = bitcast i8* %m to i32*\n"
+	"  store i32 5, i32* %v\n"
+	"  %p = getelementptr i32* %v, i32 1\n"
+	"  store i32 6, i32* %p\n"
+	"  store i32* %v, i32** @ptr\n"
+	"  store i32 10, i32* @a\n"
+	"  store i32 3, i32* getelementptr ([4 x i32]* @arr, i32 0, i32 1)\n"
+	"  ret void\n"
+	"}\n"
+	"define internal void @second() {\n"
+	"  %v = load i32** @ptr\n"
+	"  %x = load i32* %v\n"
+	"  store i32 %x, i32* getelementptr ([4 x i32]* @arr, i32 0, i32 2)\n"
+	"  store i32 20, i32* @a\n"
+	"  %m = call i8* @malloc(i32 4)\n"
+	"  %w = bitcast i8* %m to i32*\n"
+	"  store i32 7, i32* %w\n"
+	"  store i32* %w, i32** @ptr2\n"
+	"  ret void\n"
+	"}\n"
+	"define void @webMain() {\n"
+	"  call void @unknown()\n"
+	"  ret void\n"
+	"}\n");
+
+// The values of the global which becomes the memory of ptr, a single
+// element is not promoted to an array
+std::vector<uint64_t> getPointedArray(Module& M, StringRef ptr)
+{
+	std::vector<uint64_t> values;
+	Constant* init = M.getGlobalVariable(ptr)->getInitializer();
+	if (isa<ConstantExpr>(init))
+		init = cast<ConstantExpr>(init)->getOperand(0);
+	GlobalVariable* memory = dyn_cast<GlobalVariable>(init);
+	if (!memory)
+		return values;
+	Constant* memoryInit = memory->getInitializer();
+	if (ConstantInt* CI = dyn_cast<ConstantInt>(memoryInit))
+		values.push_back(CI->getZExtValue());
+	else
+		for (uint32_t i = 0; i < cast<ArrayType>(memoryInit->getType())->getNumElements(); i++)
+			values.push_back(cast<ConstantInt>(memoryInit->getAggregateElement(i))->getZExtValue());
+	return values;
+}
+
+TEST(CheerpTest, PreExecuteTest) {
+
+	LLVMContext C;
+	SMDiagnostic Err;
+
+	/** The memory of the generic JS container becomes a global array **/
+	std::unique_ptr<Module> M = parseAssemblyString(containerIR(/*asmjs*/false), Err, C);
+	ASSERT_TRUE( M.get() );
+	std::unique_ptr<PreExecute> preExecute(new PreExecute());
+	EXPECT_TRUE( preExecute->runOnModule(*M) );
+	EXPECT_FALSE( M->getGlobalVariable("llvm.global_ctors") );
+	Constant* vec = M->getGlobalVariable("vec")->getInitializer();
+	ASSERT_FALSE( vec->isNullValue() );
+	ASSERT_TRUE( isa<ConstantExpr>(vec) );
+	GlobalVariable* memory = dyn_cast<GlobalVariable>(cast<ConstantExpr>(vec)->getOperand(0));
+	ASSERT_TRUE( memory );
+	ArrayType* memoryTy = dyn_cast<ArrayType>(memory->getType()->getElementType());
+	ASSERT_TRUE( memoryTy );
+	EXPECT_EQ( 4u, memoryTy->getNumElements() );
+	EXPECT_TRUE( memoryTy->getElementType()->isIntegerTy(32) );
+	EXPECT_EQ( 42u, cast<ConstantInt>(memory->getInitializer()->getAggregateElement(1))->getZExtValue() );
+
+	/** Allocations in the linear heap are not pre-executed, the constructor runs at run time **/
+	M = parseAssemblyString(containerIR(/*asmjs*/true), Err, C);
+	ASSERT_TRUE( M.get() );
+	preExecute.reset(new PreExecute());
+	EXPECT_FALSE( preExecute->runOnModule(*M) );
+	GlobalVariable* ctors = M->getGlobalVariable("llvm.global_ctors");
+	ASSERT_TRUE( ctors );
+	EXPECT_EQ( M->getFunction("init"), ctors->getInitializer()->getAggregateElement(0u)->getAggregateElement(1) );
+	EXPECT_TRUE( M->getGlobalVariable("vec")->getInitializer()->isNullValue() );
+}
+
+TEST(CheerpTest, PreExecuteConstructorsTest) {
+
+	LLVMContext C;
+	SMDiagnostic Err;
+
+	std::unique_ptr<Module> M = parseAssemblyString(constructorsIR, Err, C);
+	ASSERT_TRUE( M.get() );
+	std::unique_ptr<PreExecute> preExecute(new PreExecute());
+	EXPECT_TRUE( preExecute->runOnModule(*M) );
+
+	/** Only the failed constructor is left **/
+	GlobalVariable* ctors = M->getGlobalVariable("llvm.global_ctors");
+	ASSERT_TRUE( ctors );
+	EXPECT_EQ( 1u, cast<ArrayType>(ctors->getType()->getElementType())->getNumElements() );
+	EXPECT_EQ( M->getFunction("fail"), ctors->getInitializer()->getAggregateElement(0u)->getAggregateElement(1) );
+
+	/** Every constructor records the globals it stores to, even if the previous one did too **/
+	EXPECT_EQ( 20u, cast<ConstantInt>(M->getGlobalVariable("a")->getInitializer())->getZExtValue() );
+	Constant* arr = M->getGlobalVariable("arr")->getInitializer();
+	EXPECT_EQ( 0u, cast<ConstantInt>(arr->getAggregateElement(0u))->getZExtValue() );
+	EXPECT_EQ( 3u, cast<ConstantInt>(arr->getAggregateElement(1))->getZExtValue() );
+	EXPECT_EQ( 5u, cast<ConstantInt>(arr->getAggregateElement(2))->getZExtValue() );
+	EXPECT_EQ( 0u, cast<ConstantInt>(arr->getAggregateElement(3))->getZExtValue() );
+
+	/** The heap memory of both constructors becomes global arrays **/
+	EXPECT_EQ( std::vector<uint64_t>({5, 6}), getPointedArray(*M, "ptr") );
+	EXPECT_EQ( std::vector<uint64_t>({7}), getPointedArray(*M, "ptr2") );
+}
+
+}
+}
@@ -0,0 +1,219 @@
+//===- llvm/unittest/Cheerp/CheerpRelooperTest.cpp ------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "../../lib/CheerpWriter/Relooper.h"
+#include "llvm/Cheerp/PointerAnalyzer.h"
+#include "llvm/Cheerp/Registerize.h"
+#include "llvm/Cheerp/Writer.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "gtest/gtest.h"
+
+namespace llvm {
+namespace {
+
+using namespace cheerp;
+
+// Render the shapes in a compact textual form
+class TextRenderInterface: public RenderInterface
+{
+	raw_string_ostream out;
+public:
+	TextRenderInterface(std::string& s): out(s)
+	{
+	}
+	std::string& str()
+	{
+		return out.str();
+	}
+	void renderBlock(const BasicBlock* bb) override { out << bb->getName() << ';'; }
+	void renderIfOnLabel(int labelId, bool first) override { out << (first ? "" : "else ") << "if(label==" << labelId << "){"; }
+	void renderLabelForSwitch(int labelId) override { out << 'L' << labelId << ':'; }
+	void renderSwitchOnLabel(IdShapeMap& idShapeMap) override { out << "switch(label){"; }
+	void renderCaseOnLabel(int labelId) override { out << "case " << labelId << ":{"; }
+	void renderSwitchBlockBegin(const SwitchInst* switchInst, BlockBranchMap& branchesOut) override { out << "switch(" << switchInst->getParent()->getName() << "){"; }
+	void renderCaseBlockBegin(const BasicBlock* caseBlock, int branchId) override { out << "case " << branchId << ":{"; }
+	void renderDefaultBlockBegin(bool empty) override { out << "default:{"; }
+	void renderIfBlockBegin(const BasicBlock* condBlock, int branchId, bool first) override
+	{
+		out << (first ? "" : "}else ") << "if(" << condBlock->getName() << '#' << branchId << "){";
+	}
+	void renderIfBlockBegin(const BasicBlock* condBlock, const std::vector<int>& skipBranchIds, bool first) override
+	{
+		out << (first ? "" : "}else ") << "if(!(" << condBlock->getName();
+		for (int id: skipBranchIds)
+			out << '#' << id;
+		out << ")){";
+	}
+	void renderElseBlockBegin() override { out << "}else{"; }
+	void renderBlockEnd(bool empty) override { out << '}'; }
+	void renderBlockPrologue(const BasicBlock* blockTo, const BasicBlock* blockFrom) override {}
+	void renderWhileBlockBegin() override { out << "while(1){"; }
+	void renderWhileBlockBegin(int labelId) override { out << 'L' << labelId << ":while(1){"; }
+	void renderDoBlockBegin() override { out << "do{"; }
+	void renderDoBlockBegin(int labelId) override { out << 'L' << labelId << ":do{"; }
+	void renderDoBlockEnd() override { out << "}while(0);"; }
+	void renderBreak() override { out << "break;"; }
+	void renderBreak(int labelId) override { out << "break L" << labelId << ';'; }
+	void renderContinue() override { out << "continue;"; }
+	void renderContinue(int labelId) override { out << "continue L" << labelId << ';'; }
+	void renderLabel(int labelId) override { out << "label=" << labelId << ';'; }
+};
+
+// Build a function with the given successors for each block. Blocks with
+// more than two successors end with a switch.
+static Function* buildFunction(Module& M, StringRef name, const std::vector<std::vector<unsigned>>& succs)
+{
+	LLVMContext& C = M.getContext();
+	Type* i32Ty = Type::getInt32Ty(C);
+	Type* argTys[] = { i32Ty, Type::getInt1Ty(C) };
+	FunctionType* fTy = FunctionType::get(Type::getVoidTy(C), argTys, false);
+	Function* F = Function::Create(fTy, GlobalValue::ExternalLinkage, name, &M);
+	Value* selector = F->arg_begin();
+	Value* cond = std::next(F->arg_begin());
+	std::vector<BasicBlock*> blocks;
+	for (unsigned i = 0; i < succs.size(); i++)
+		blocks.push_back(BasicBlock::Create(C, "b" + Twine(i), F));
+	IRBuilder<> IRB(C);
+	for (unsigned i = 0; i < succs.size(); i++)
+	{
+		IRB.SetInsertPoint(blocks[i]);
+		const std::vector<unsigned>& s = succs[i];
+		if (s.empty())
+			IRB.CreateRetVoid();
+		else if (s.size() == 1)
+			IRB.CreateBr(blocks[s[0]]);
+		else if (s.size() == 2)
+			IRB.CreateCondBr(cond, blocks[s[0]], blocks[s[1]]);
+		else
+		{
+			SwitchInst* si = IRB.CreateSwitch(selector, blocks[s[0]], s.size() - 1);
+			for (unsigned j = 1; j < s.size(); j++)
+				si->addCase(ConstantInt::get(cast<IntegerType>(i32Ty), j), blocks[s[j]]);
+		}
+	}
+	return F;
+}
+
+static std::string reloop(const Function& F)
+{
+	PointerAnalyzer PA;
+	Registerize registerize;
+	std::unique_ptr<Relooper> rl(CheerpWriter::runRelooperOnFunction(F, PA, registerize));
+	std::string s;
+	TextRenderInterface ri(s);
+	rl->Render(&ri);
+	return ri.str();
+}
+
+// A switch based interpreter: the dispatch block jumps to the handlers, which
+// go back to the dispatcher, jump into each other or leave the function
+static std::vector<std::vector<unsigned>> makeInterpreter(unsigned handlers, uint32_t seed)
+{
+	std::vector<std::vector<unsigned>> succs(handlers + 3);
+	unsigned dispatch = 1;
+	unsigned exit = handlers + 2;
+	succs[0] = { dispatch };
+	succs[dispatch].push_back(exit);
+	for (unsigned i = 0; i < handlers; i++)
+	{
+		unsigned h = i + 2;
+		succs[dispatch].push_back(h);
+		seed = seed * 1103515245 + 12345;
+		switch ((seed >> 16) % 4)
+		{
+			case 0:
+				succs[h] = { dispatch, exit };
+				break;
+			case 1:
+				succs[h] = { dispatch, 2 + (seed >> 8) % handlers };
+				break;
+			default:
+				succs[h] = { dispatch };
+				break;
+		}
+	}
+	return succs;
+}
+
+// A random CFG with mostly forward branches and some back edges. A
+// conditional branch never has the same block on both sides
+static std::vector<std::vector<unsigned>> makeRandomCFG(unsigned size, uint32_t seed)
+{
+	std::vector<std::vector<unsigned>> succs(size);
+	for (unsigned i = 0; i + 1 < size; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		unsigned r = (seed >> 16) % 8;
+		if (r < 4 || (r < 7 && i + 2 >= size))
+			succs[i] = { i + 1 };
+		else if (r < 7)
+			succs[i] = { i + 1, i + 2 + (seed >> 8) % std::min(8u, size - i - 2) };
+		else
+			succs[i] = { i + 1, (seed >> 4) % (i + 1) };
+	}
+	return succs;
+}
+
+TEST(CheerpTest, RelooperTest) {
+
+	LLVMContext C;
+	Module M("relooper", C);
+
+	/** If/else diamond, the small returning block is duplicated **/
+	Function* diamond = buildFunction(M, "diamond", { {1, 2}, {3}, {3}, {} });
+	EXPECT_EQ( "b0;if(b0#0){b1;b3;}else{b2;b3;}", reloop(*diamond) );
+
+	/** Loop with a conditional exit **/
+	Function* loop = buildFunction(M, "loop", { {1}, {2, 3}, {1}, {} });
+	EXPECT_EQ( "b0;while(1){b1;if(!(b1#0)){break;}b2;}b3;", reloop(*loop) );
+
+	/** Two entries into a loop need the label variable **/
+	Function* irreducible = buildFunction(M, "irreducible", { {1, 2}, {2, 3}, {1}, {} });
+	EXPECT_EQ( "b0;if(b0#0){label=2;}else{label=3;}while(1){if(label==2){label=0;b1;if(b1#0){label=3;continue;}else{break;}}else if(label==3){label=0;b2;label=2;continue;}}b3;", reloop(*irreducible) );
+
+	/** Large CFGs are relooped deterministically **/
+	Function* interpreter = buildFunction(M, "interpreter", makeInterpreter(200, 1));
+	Function* random = buildFunction(M, "random", makeRandomCFG(500, 2));
+	std::string interpreterCode = reloop(*interpreter);
+	std::string randomCode = reloop(*random);
+	EXPECT_EQ( interpreterCode, reloop(*interpreter) );
+	EXPECT_EQ( randomCode, reloop(*random) );
+	EXPECT_NE( std::string::npos, interpreterCode.find("b201;") );
+	EXPECT_NE( std::string::npos, randomCode.find("b499;") );
+}
+
+// Time the Relooper on synthetic CFGs of growing size. Run it with
+// --gtest_also_run_disabled_tests
+TEST(CheerpTest, DISABLED_RelooperScaling) {
+
+	LLVMContext C;
+	Module M("relooper", C);
+	PointerAnalyzer PA;
+	Registerize registerize;
+	for (unsigned size = 250; size <= 4000; size *= 2)
+	{
+		Function* interpreter = buildFunction(M, ("interpreter" + Twine(size)).str(), makeInterpreter(size, size));
+		Function* random = buildFunction(M, ("random" + Twine(size)).str(), makeRandomCFG(size * 2, size));
+		for (Function* F: { interpreter, random })
+		{
+			TimeRecord start = TimeRecord::getCurrentTime(true);
+			std::unique_ptr<Relooper> rl(CheerpWriter::runRelooperOnFunction(*F, PA, registerize));
+			TimeRecord end = TimeRecord::getCurrentTime(false);
+			outs() << F->getName() << ": " << F->size() << " blocks, " << format("%.3f", end.getWallTime() - start.getWallTime()) << "s\n";
+		}
+	}
+}
+
+}
+}
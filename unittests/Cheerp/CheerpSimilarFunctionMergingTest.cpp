@@ -0,0 +1,182 @@
+//===- llvm/unittest/Cheerp/CheerpSimilarFunctionMergingTest.cpp ----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CheerpTestIR.h"
+#include "llvm/Cheerp/GlobalDepsAnalyzer.h"
+#include "llvm/Cheerp/SimilarFunctionMerging.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Target/TargetLibraryInfo.h"
+#include "gtest/gtest.h"
+
+namespace llvm {
+namespace {
+
+using namespace cheerp;
+
+const uint32_t bodySize = 16;
+
+// The body shared by the test functions, %x is the operand which differs
+std::string similarBody(StringRef name, StringRef x)
+{
+	std::string body = ("define i32 @" + name + "(i32 %a) section \"asmjs\" {\n"
+		"  %b = add i32 %a, 1\n"
+		"  %c = mul i32 %b, %a\n"
+		"  %d = xor i32 %c, " + x + "\n"
+		"  %e = sub i32 %d, %b\n"
+		"  %f0 = mul i32 %e, 3\n").str();
+	// Enough code to be worth merging
+	for (uint32_t i = 0; i < bodySize; i++)
+		body += "  %f" + std::to_string(i + 1) + " = add i32 %f" + std::to_string(i) + ", %a\n";
+	return body + "  ret i32 %f" + std::to_string(bodySize) + "\n}\n";
+}
+
+// A body with a call to callee, the pairs of functions which are compared
+// have a different number of additions to keep them apart
+std::string callerBody(StringRef name, StringRef callee, uint32_t additions)
+{
+	std::string body = ("define double @" + name + "(double %a) section \"asmjs\" {\n"
+		"  %b = fadd double %a, 1.0\n"
+		"  %c = fmul double %b, %a\n"
+		"  %d = call double @" + callee + "(double %c)\n"
+		"  %e = fsub double %d, %b\n"
+		"  %f0 = fmul double %e, 3.0\n").str();
+	for (uint32_t i = 0; i < bodySize + additions; i++)
+		body += "  %f" + std::to_string(i + 1) + " = fadd double %f" + std::to_string(i) + ", %a\n";
+	return body + "  ret double %f" + std::to_string(bodySize + additions) + "\n}\n";
+}
+
+std::string leafBody(StringRef name)
+{
+	return ("define double @" + name + "(double %a) section \"asmjs\" {\n"
+		"  ret double %a\n"
+		"}\n").str();
+}
+
+const CallInst* getOnlyCall(const Function* F)
+{
+	const CallInst* found = nullptr;
+	for (const BasicBlock& BB : *F)
+		for (const Instruction& I : BB)
+			if (const CallInst* CI = dyn_cast<CallInst>(&I))
+			{
+				if (found)
+					return nullptr;
+				found = CI;
+			}
+	return found;
+}
+
+TEST(CheerpTest, SimilarFunctionMergingTest) {
+
+	LLVMContext C;
+	SMDiagnostic Err;
+
+	std::string IR = cheerpIR("wasm",
+		"@table = global i32 (i32)* @constant2, section \"asmjs\"\n"
+		"@out = global double 0.0, section \"asmjs\"\n"
+		"declare double @external(double)\n");
+	// A constant difference
+	IR += similarBody("constant1", "7");
+	IR += similarBody("constant2", "9");
+	// A callee difference
+	IR += leafBody("leaf1");
+	IR += leafBody("leaf2");
+	IR += callerBody("callee1", "leaf1", 0);
+	IR += callerBody("callee2", "leaf2", 0);
+	// The wasm intrinsics and the JS functions are not in the function tables
+	IR += leafBody("ceil");
+	IR += leafBody("floor");
+	IR += callerBody("intrinsic1", "ceil", 1);
+	IR += callerBody("intrinsic2", "floor", 1);
+	IR += callerBody("external1", "leaf1", 2);
+	IR += callerBody("external2", "external", 2);
+	IR +=
+		"define void @webMain() section \"asmjs\" {\n"
+		"  %a = call i32 @constant1(i32 1)\n"
+		"  %b = call i32 @constant2(i32 2)\n"
+		"  %c = call double @callee1(double 1.0)\n"
+		"  %d = call double @callee2(double 2.0)\n"
+		"  %e = call double @intrinsic1(double 1.0)\n"
+		"  %f = call double @intrinsic2(double 2.0)\n"
+		"  %g = call double @external1(double 1.0)\n"
+		"  %h = call double @external2(double 2.0)\n"
+		"  %i = load i32 (i32)** @table\n"
+		"  %j = call i32 %i(i32 3)\n"
+		"  store double %h, double* @out\n"
+		"  ret void\n"
+		"}\n";
+
+	std::unique_ptr<Module> M = parseAssemblyString(IR, Err, C);
+	ASSERT_TRUE( M.get() );
+
+	legacy::PassManager PM;
+	PM.add(new TargetLibraryInfo(Triple(M->getTargetTriple())));
+	PM.add(new DataLayoutPass());
+	PM.add(createGlobalDepsAnalyzerPass());
+	PM.add(createSimilarFunctionMergingPass(1));
+	PM.run(*M);
+
+	const Function* webMain = M->getFunction("webMain");
+	ASSERT_TRUE( webMain );
+	std::vector<const CallInst*> calls;
+	for (const Instruction& I : webMain->getEntryBlock())
+		if (const CallInst* CI = dyn_cast<CallInst>(&I))
+			calls.push_back(CI);
+	ASSERT_EQ( 9u, calls.size() );
+
+	/** A constant difference becomes a parameter, the calls pass it to the shared body **/
+	const Function* constants = M->getFunction("constant1_merged");
+	ASSERT_TRUE( constants );
+	EXPECT_EQ( 2u, constants->arg_size() );
+	EXPECT_EQ( constants, calls[0]->getCalledFunction() );
+	EXPECT_EQ( constants, calls[1]->getCalledFunction() );
+	EXPECT_EQ( 7u, cast<ConstantInt>(calls[0]->getArgOperand(1))->getZExtValue() );
+	EXPECT_EQ( 9u, cast<ConstantInt>(calls[1]->getArgOperand(1))->getZExtValue() );
+
+	/** The unused function is removed, the one in a table becomes a thunk **/
+	EXPECT_FALSE( M->getFunction("constant1") );
+	const Function* thunk = M->getFunction("constant2");
+	ASSERT_TRUE( thunk );
+	EXPECT_EQ( 1u, thunk->size() );
+	const CallInst* thunkCall = getOnlyCall(thunk);
+	ASSERT_TRUE( thunkCall );
+	EXPECT_EQ( constants, thunkCall->getCalledFunction() );
+	EXPECT_EQ( thunk->arg_begin(), thunkCall->getArgOperand(0) );
+	EXPECT_EQ( 9u, cast<ConstantInt>(thunkCall->getArgOperand(1))->getZExtValue() );
+
+	/** A callee difference becomes an indirect call **/
+	const Function* callees = M->getFunction("callee1_merged");
+	ASSERT_TRUE( callees );
+	EXPECT_EQ( callees, calls[2]->getCalledFunction() );
+	EXPECT_EQ( callees, calls[3]->getCalledFunction() );
+	EXPECT_EQ( M->getFunction("leaf1"), calls[2]->getArgOperand(1) );
+	EXPECT_EQ( M->getFunction("leaf2"), calls[3]->getArgOperand(1) );
+	const CallInst* indirect = getOnlyCall(callees);
+	ASSERT_TRUE( indirect );
+	EXPECT_FALSE( indirect->getCalledFunction() );
+
+	/** The wasm intrinsics and the JS functions can't be called indirectly **/
+	EXPECT_FALSE( M->getFunction("intrinsic1_merged") );
+	EXPECT_FALSE( M->getFunction("external1_merged") );
+	EXPECT_EQ( M->getFunction("intrinsic1"), calls[4]->getCalledFunction() );
+	EXPECT_EQ( M->getFunction("intrinsic2"), calls[5]->getCalledFunction() );
+	EXPECT_EQ( M->getFunction("external1"), calls[6]->getCalledFunction() );
+	EXPECT_EQ( M->getFunction("external2"), calls[7]->getCalledFunction() );
+	EXPECT_EQ( M->getFunction("ceil"), getOnlyCall(M->getFunction("intrinsic1"))->getCalledFunction() );
+}
+
+}
+}
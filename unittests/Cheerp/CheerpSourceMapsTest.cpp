@@ -0,0 +1,112 @@
+//===- llvm/unittest/Cheerp/CheerpSourceMapsTest.cpp ----------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/SourceMaps.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Dwarf.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "gtest/gtest.h"
+
+namespace llvm {
+namespace {
+
+using namespace cheerp;
+
+// The code of a method, as the calls received by the generator
+static void generateMethod(SourceMapGenerator& g, const DISubprogram& method, const DebugLoc& first, const DebugLoc& second)
+{
+	g.setFunctionName(method);
+	g.addLineOffset(12);
+	g.finishLine();
+	g.addLineOffset(1);
+	g.setDebugLoc(&first);
+	g.addLineOffset(7);
+	g.setDebugLoc(&second);
+	g.addLineOffset(3);
+	g.finishLine();
+	g.setDebugLoc(nullptr);
+	g.addLineOffset(2);
+}
+
+static std::string readFile(const std::string& path)
+{
+	ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(path);
+	EXPECT_FALSE(buf.getError());
+	return buf ? buf.get()->getBuffer().str() : std::string();
+}
+
+TEST(CheerpTest, SourceMapsTest) {
+
+	LLVMContext C;
+	Module M("sourcemaps", C);
+	DIBuilder DIB(M);
+	DICompileUnit CU = DIB.createCompileUnit(dwarf::DW_LANG_C_plus_plus, "a.cpp", "src", "cheerp", false, "", 0);
+	DIFile fileA = DIB.createFile("a.cpp", "src");
+	DIFile fileB = DIB.createFile("b.cpp", "src");
+	DICompositeType fTy = DIB.createSubroutineType(fileA, DIB.getOrCreateTypeArray(None));
+	DISubprogram methodA = DIB.createFunction(CU, "a", "_Z1av", fileA, 3, fTy, false, true, 3);
+	DISubprogram methodB = DIB.createFunction(CU, "b", "_Z1bv", fileB, 10, fTy, false, true, 10);
+	DIB.finalize();
+	DebugLoc locA1 = DebugLoc::get(4, 2, methodA);
+	DebugLoc locA2 = DebugLoc::get(5, 6, methodA);
+	DebugLoc locB1 = DebugLoc::get(11, 1, methodB);
+	DebugLoc locB2 = DebugLoc::get(12, 3, methodB);
+
+	SmallString<128> serialPath;
+	SmallString<128> recordedPath;
+	ASSERT_FALSE(sys::fs::createTemporaryFile("serial", "map", serialPath));
+	ASSERT_FALSE(sys::fs::createTemporaryFile("recorded", "map", recordedPath));
+	std::string serialName = serialPath.str();
+	std::string recordedName = recordedPath.str();
+	std::string prefix;
+	std::error_code EC;
+
+	/** The methods are generated in place **/
+	{
+		SourceMapGenerator g(serialName, prefix, false, C, EC);
+		ASSERT_FALSE(EC);
+		g.beginFile();
+		g.addLineOffset(20);
+		generateMethod(g, methodA, locA1, locA2);
+		generateMethod(g, methodB, locB1, locB2);
+		g.addLineOffset(4);
+		g.finishLine();
+		g.endFile();
+	}
+
+	/** The methods are recorded in reverse order, and appended in order **/
+	{
+		SourceMapGenerator g(recordedName, prefix, false, C, EC);
+		ASSERT_FALSE(EC);
+		std::unique_ptr<SourceMapGenerator> recorder = SourceMapGenerator::createRecorder(g);
+		generateMethod(*recorder, methodB, locB1, locB2);
+		std::vector<SourceMapGenerator::Segment> segmentsB = recorder->takeSegments();
+		generateMethod(*recorder, methodA, locA1, locA2);
+		std::vector<SourceMapGenerator::Segment> segmentsA = recorder->takeSegments();
+		EXPECT_EQ( SourceMapGenerator::Segment::CODE_END, segmentsA.back().kind );
+		EXPECT_EQ( 2u, segmentsA.back().lineOffset );
+		g.beginFile();
+		g.addLineOffset(20);
+		g.appendSegments(segmentsA);
+		g.appendSegments(segmentsB);
+		g.addLineOffset(4);
+		g.finishLine();
+		g.endFile();
+	}
+
+	EXPECT_EQ( readFile(serialName), readFile(recordedName) );
+	sys::fs::remove(serialName);
+	sys::fs::remove(recordedName);
+}
+
+}
+}
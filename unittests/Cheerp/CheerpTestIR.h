@@ -0,0 +1,33 @@
+//===- CheerpTestIR.h - IR shared by the Cheerp unit tests ----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Builds the textual IR of the test modules for the Cheerp targets.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_UNITTESTS_CHEERP_CHEERPTESTIR_H
+#define LLVM_UNITTESTS_CHEERP_CHEERPTESTIR_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include <string>
+
+namespace llvm {
+
+// Prefixes body with the datalayout and the triple of the Cheerp target for
+// the given environment, "wasm" or "genericjs"
+inline std::string cheerpIR(StringRef environment, const Twine& body)
+{
+	return (Twine("target datalayout = \"b-e-p:32:8-i16:8-i32:8-i64:8-f32:8-f64:8-a:0:8-f80:8-n8:8:8-S8\"\n"
+		"target triple = \"cheerp-leaningtech-webbrowser-") + environment + "\"\n" + body).str();
+}
+
+}
+
+#endif
@@ -0,0 +1,228 @@
+//===- llvm/unittest/Cheerp/CheerpWasmPeepholeTest.cpp --------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/WasmPeephole.h"
+#include "gtest/gtest.h"
+
+namespace llvm {
+namespace {
+
+using namespace cheerp;
+
+template<size_t N>
+std::string bytes(const char (&data)[N])
+{
+	return std::string(data, N - 1);
+}
+
+std::string optimize(const std::string& body, uint32_t params, uint32_t results, bool& optimized)
+{
+	WasmPeephole peephole({}, {});
+	std::string out;
+	raw_string_ostream stream(out);
+	optimized = peephole.optimize(body, WasmPeephole::Signature{params, results}, stream);
+	return stream.str();
+}
+
+TEST(CheerpTest, WasmPeepholeTest) {
+
+	bool optimized;
+
+	/** Dead stores, useless branches and blocks, and unused locals are removed **/
+	const std::string deadCode = bytes(
+		"\x01\x02\x7f"              // two i32 locals
+		"\x02\x40"                  // block
+		"\x20\x00\x21\x01"          //   get_local 0, set_local 1
+		"\x0c\x00"                  //   br 0
+		"\x0b"                      // end
+		"\x20\x00\x41\x00\x46"      // get_local 0, i32.const 0, i32.eq
+		"\x0b");
+	EXPECT_EQ( bytes("\x00\x20\x00\x45\x0b"), optimize(deadCode, 1, 1, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** An if/else which only assigns a local becomes a select **/
+	const std::string diamond = bytes(
+		"\x01\x01\x7f"              // one i32 local
+		"\x20\x00\x04\x40"          // get_local 0, if
+		"\x41\x05\x21\x02"          //   i32.const 5, set_local 2
+		"\x05"                      // else
+		"\x20\x01\x21\x02"          //   get_local 1, set_local 2
+		"\x0b"                      // end
+		"\x20\x02\x0b");            // get_local 2
+	// The local is then forwarded to its only read and removed
+	EXPECT_EQ( bytes("\x00\x41\x05\x20\x01\x20\x00\x1b\x0b"), optimize(diamond, 2, 1, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** Unknown code is left alone **/
+	EXPECT_TRUE( optimize(bytes("\x00\xfe\x0b"), 0, 0, optimized).empty() );
+	EXPECT_FALSE( optimized );
+}
+
+TEST(CheerpTest, WasmPeepholeLocalForwardingTest) {
+
+	bool optimized;
+
+	/** A set_local and a get_local separated by a useless block or loop become a tee_local **/
+	const std::string acrossBlock = bytes(
+		"\x01\x01\x7f"              // one i32 local
+		"\x02\x40"                  // block
+		"\x20\x00\x41\x01\x6a"      //   get_local 0, i32.const 1, i32.add
+		"\x21\x01"                  //   set_local 1
+		"\x0b"                      // end
+		"\x20\x01\x0b");            // get_local 1
+	// The tee_local is then dead, and the local unused
+	EXPECT_EQ( bytes("\x00\x20\x00\x41\x01\x6a\x0b"), optimize(acrossBlock, 1, 1, optimized) );
+	EXPECT_TRUE( optimized );
+
+	const std::string acrossLoop = bytes(
+		"\x01\x01\x7f"              // one i32 local
+		"\x03\x40"                  // loop
+		"\x20\x00\x41\x01\x6a"      //   get_local 0, i32.const 1, i32.add
+		"\x21\x01"                  //   set_local 1
+		"\x0b"                      // end
+		"\x20\x01\x0b");            // get_local 1
+	EXPECT_EQ( bytes("\x00\x20\x00\x41\x01\x6a\x0b"), optimize(acrossLoop, 1, 1, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** A loop which is a branch target keeps them apart **/
+	const std::string acrossTargetedLoop = bytes(
+		"\x01\x01\x7f"              // one i32 local
+		"\x41\x07\x21\x01"          // i32.const 7, set_local 1
+		"\x03\x40"                  // loop
+		"\x20\x00\x41\x01\x6b"      //   get_local 0, i32.const 1, i32.sub
+		"\x22\x00\x0d\x00"          //   tee_local 0, br_if 0
+		"\x0b"                      // end
+		"\x20\x01\x0b");            // get_local 1
+	EXPECT_EQ( acrossTargetedLoop, optimize(acrossTargetedLoop, 1, 1, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** Different locals are not forwarded **/
+	const std::string otherLocal = bytes(
+		"\x01\x02\x7f"              // two i32 locals
+		"\x20\x00\x21\x01"          // get_local 0, set_local 1
+		"\x20\x02\x20\x01\x6a"      // get_local 2, get_local 1, i32.add
+		"\x0b");
+	EXPECT_EQ( otherLocal, optimize(otherLocal, 1, 1, optimized) );
+	EXPECT_TRUE( optimized );
+}
+
+TEST(CheerpTest, WasmPeepholeTeeFoldingTest) {
+
+	bool optimized;
+
+	/** A tee_local whose value is dropped becomes a set_local **/
+	const std::string dropped = bytes(
+		"\x01\x01\x7f"              // one i32 local
+		"\x20\x00\x22\x01\x1a"      // get_local 0, tee_local 1, drop
+		"\x20\x00\x41\x02\x36\x02\x00" // get_local 0, i32.const 2, i32.store
+		"\x20\x01\x0b");            // get_local 1
+	EXPECT_EQ( bytes("\x01\x01\x7f\x20\x00\x21\x01\x20\x00\x41\x02\x36\x02\x00\x20\x01\x0b"),
+		optimize(dropped, 1, 1, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** A tee_local whose value is used stays **/
+	const std::string used = bytes(
+		"\x01\x01\x7f"              // one i32 local
+		"\x20\x00\x20\x00\x22\x01"  // get_local 0, get_local 0, tee_local 1
+		"\x36\x02\x00"              // i32.store
+		"\x20\x01\x0b");            // get_local 1
+	EXPECT_EQ( used, optimize(used, 1, 1, optimized) );
+	EXPECT_TRUE( optimized );
+}
+
+TEST(CheerpTest, WasmPeepholeDeadStoresTest) {
+
+	bool optimized;
+
+	/** Stores to an unread local are removed from both branches, and then the if **/
+	const std::string branches = bytes(
+		"\x01\x01\x7f"              // one i32 local
+		"\x20\x00\x04\x40"          // get_local 0, if
+		"\x41\x05\x21\x01"          //   i32.const 5, set_local 1
+		"\x05"                      // else
+		"\x20\x00\x21\x01"          //   get_local 0, set_local 1
+		"\x0b"                      // end
+		"\x0b");
+	EXPECT_EQ( bytes("\x00\x0b"), optimize(branches, 1, 0, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** A value which may trap is still computed **/
+	const std::string trapping = bytes(
+		"\x01\x01\x7f"              // one i32 local
+		"\x20\x00\x04\x40"          // get_local 0, if
+		"\x20\x00\x28\x02\x00"      //   get_local 0, i32.load
+		"\x21\x01"                  //   set_local 1
+		"\x0b"                      // end
+		"\x0b");
+	EXPECT_EQ( bytes("\x00\x20\x00\x04\x40\x20\x00\x28\x02\x00\x1a\x0b\x0b"),
+		optimize(trapping, 1, 0, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** A store read by the next iteration of a loop stays **/
+	const std::string loop = bytes(
+		"\x01\x01\x7f"              // one i32 local
+		"\x03\x40"                  // loop
+		"\x20\x01\x41\x01\x6a"      //   get_local 1, i32.const 1, i32.add
+		"\x21\x01"                  //   set_local 1
+		"\x20\x00\x0d\x00"          //   get_local 0, br_if 0
+		"\x0b"                      // end
+		"\x0b");
+	EXPECT_EQ( loop, optimize(loop, 1, 0, optimized) );
+	EXPECT_TRUE( optimized );
+}
+
+TEST(CheerpTest, WasmPeepholeBrIfFallthroughTest) {
+
+	bool optimized;
+
+	/** A br_if to the end which follows it only drops its condition **/
+	const std::string toEnd = bytes(
+		"\x00"                      // no locals
+		"\x02\x40"                  // block
+		"\x20\x00\x41\x01\x36\x02\x00" //   get_local 0, i32.const 1, i32.store
+		"\x20\x00\x0d\x00"          //   get_local 0, br_if 0
+		"\x0b"                      // end
+		"\x0b");
+	EXPECT_EQ( bytes("\x00\x20\x00\x41\x01\x36\x02\x00\x0b"), optimize(toEnd, 1, 0, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** Also to the end of the function, but a condition which may trap is kept **/
+	const std::string toFunctionEnd = bytes(
+		"\x00"                      // no locals
+		"\x20\x00\x28\x02\x00"      // get_local 0, i32.load
+		"\x0d\x00"                  // br_if 0
+		"\x0b");
+	EXPECT_EQ( bytes("\x00\x20\x00\x28\x02\x00\x1a\x0b"), optimize(toFunctionEnd, 1, 0, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** A br_if to a loop goes back to its start **/
+	const std::string toLoop = bytes(
+		"\x00"                      // no locals
+		"\x03\x40"                  // loop
+		"\x20\x00\x41\x01\x6b"      //   get_local 0, i32.const 1, i32.sub
+		"\x22\x00\x0d\x00"          //   tee_local 0, br_if 0
+		"\x0b"                      // end
+		"\x0b");
+	EXPECT_EQ( toLoop, optimize(toLoop, 1, 0, optimized) );
+	EXPECT_TRUE( optimized );
+
+	/** A br_if which skips some code stays **/
+	const std::string skipping = bytes(
+		"\x00"                      // no locals
+		"\x02\x40"                  // block
+		"\x20\x00\x0d\x00"          //   get_local 0, br_if 0
+		"\x20\x00\x41\x01\x36\x02\x00" //   get_local 0, i32.const 1, i32.store
+		"\x0b"                      // end
+		"\x0b");
+	EXPECT_EQ( skipping, optimize(skipping, 1, 0, optimized) );
+	EXPECT_TRUE( optimized );
+}
+
+}
+}
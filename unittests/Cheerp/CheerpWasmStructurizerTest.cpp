@@ -0,0 +1,321 @@
+//===- llvm/unittest/Cheerp/CheerpWasmStructurizerTest.cpp ----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CheerpTestIR.h"
+#include "llvm/Cheerp/AllocaMerging.h"
+#include "llvm/Cheerp/GlobalDepsAnalyzer.h"
+#include "llvm/Cheerp/LinearMemoryHelper.h"
+#include "llvm/Cheerp/NameGenerator.h"
+#include "llvm/Cheerp/PointerAnalyzer.h"
+#include "llvm/Cheerp/Registerize.h"
+#include "llvm/Cheerp/WasmWriter.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Target/TargetLibraryInfo.h"
+#include "gtest/gtest.h"
+
+namespace llvm {
+namespace {
+
+using namespace cheerp;
+
+// Write the module as wast, like the wasm backend does
+class WastWriterPass: public ModulePass
+{
+	std::string& out;
+	bool useStructurizer;
+public:
+	static char ID;
+	WastWriterPass(std::string& out, bool useStructurizer): ModulePass(ID), out(out), useStructurizer(useStructurizer)
+	{
+	}
+	void getAnalysisUsage(AnalysisUsage& AU) const override
+	{
+		AU.addRequired<GlobalDepsAnalyzer>();
+		AU.addRequired<PointerAnalyzer>();
+		AU.addRequired<Registerize>();
+		AU.addRequired<AllocaStoresExtractor>();
+	}
+	bool runOnModule(Module& M) override
+	{
+		PointerAnalyzer& PA = getAnalysis<PointerAnalyzer>();
+		GlobalDepsAnalyzer& GDA = getAnalysis<GlobalDepsAnalyzer>();
+		Registerize& registerize = getAnalysis<Registerize>();
+		LinearMemoryHelper linearHelper(M, LinearMemoryHelper::FunctionAddressMode::Wasm, GDA);
+		PA.fullResolve();
+		PA.computeConstantOffsets(M);
+		getAnalysis<AllocaStoresExtractor>().destroyStores();
+		PA.freeze(M);
+		registerize.assignRegisters(M, PA);
+
+		raw_string_ostream s(out);
+		formatted_raw_ostream stream(s);
+		NameGenerator namegen(M, GDA, registerize, PA, std::vector<std::string>(), /*makeReadableNames*/ false);
+		CheerpWasmWriter writer(M, stream, PA, registerize, GDA, linearHelper, namegen, M.getContext(),
+				/*heapSize*/ 1, /*maxHeapSize*/ 0, /*useWasmLoader*/ false, /*prettyCode*/ false,
+				CHEERP_MODE_WAST, /*numThreads*/ 1, std::string(), nullptr, /*usePeephole*/ false, useStructurizer);
+		writer.makeWasm();
+		stream.flush();
+		return false;
+	}
+};
+
+char WastWriterPass::ID = 0;
+
+std::string compileWast(const std::string& IR, bool useStructurizer)
+{
+	LLVMContext C;
+	SMDiagnostic Err;
+	std::unique_ptr<Module> M = parseAssemblyString(IR, Err, C);
+	if (!M)
+		return std::string();
+
+	std::string out;
+	legacy::PassManager PM;
+	PM.add(new TargetLibraryInfo(Triple(M->getTargetTriple())));
+	PM.add(new DataLayoutPass());
+	PM.add(createGlobalDepsAnalyzerPass());
+	PM.add(createRegisterizePass(/*useFloats*/ true, /*NoRegisterize*/ false, /*graphColoring*/ false, /*useInt64*/ true));
+	PM.add(createPointerAnalyzerPass());
+	PM.add(createAllocaStoresExtractor());
+	PM.add(new WastWriterPass(out, useStructurizer));
+	PM.run(*M);
+	return out;
+}
+
+// The code of a function in the wast output
+std::string getFunctionCode(const std::string& wast, const std::string& name)
+{
+	size_t begin = wast.find("(func $" + name + " ");
+	if (begin == std::string::npos)
+		return std::string();
+	size_t end = wast.find("\n)\n", begin);
+	return wast.substr(begin, end - begin);
+}
+
+// Number of instructions in the code which start with the given opcode
+uint32_t countInsts(const std::string& code, StringRef opcode)
+{
+	uint32_t count = 0;
+	SmallVector<StringRef, 64> lines;
+	StringRef(code).split(lines, "\n");
+	for (StringRef line: lines)
+	{
+		line = line.ltrim();
+		if (line == opcode || line.startswith((opcode + " ").str()))
+			count++;
+	}
+	return count;
+}
+
+// Returns true if every block, loop and if is closed by its own end
+bool isNested(const std::string& code)
+{
+	int32_t depth = 0;
+	SmallVector<StringRef, 64> lines;
+	StringRef(code).split(lines, "\n");
+	for (StringRef line: lines)
+	{
+		line = line.ltrim();
+		if (line.startswith("block") || line.startswith("loop") || line.startswith("if"))
+			depth++;
+		else if (line == "end" && --depth < 0)
+			return false;
+	}
+	return depth == 0;
+}
+
+const std::string StructurizerIR = cheerpIR("wasm",
+	// The exits of the loop go on to the same code, one through the other
+	"define i32 @multiExit(i32 %n) section \"asmjs\" {\n"
+	"entry:\n"
+	"  br label %header\n"
+	"header:\n"
+	"  %i = phi i32 [ 0, %entry ], [ %next, %latch ]\n"
+	"  %done = icmp sge i32 %i, %n\n"
+	"  br i1 %done, label %exit1, label %body\n"
+	"body:\n"
+	"  %found = icmp eq i32 %i, 42\n"
+	"  br i1 %found, label %exit2, label %latch\n"
+	"latch:\n"
+	"  %next = add i32 %i, 1\n"
+	"  br label %header\n"
+	"exit1:\n"
+	"  %a = mul i32 %i, 3\n"
+	"  %big = icmp sgt i32 %a, 100\n"
+	"  br i1 %big, label %exit2, label %tail\n"
+	"exit2:\n"
+	"  %e = phi i32 [ %n, %body ], [ %a, %exit1 ]\n"
+	"  %b = add i32 %e, 5\n"
+	"  br label %tail\n"
+	"tail:\n"
+	"  %r = phi i32 [ %a, %exit1 ], [ %b, %exit2 ]\n"
+	"  %r2 = xor i32 %r, %n\n"
+	"  ret i32 %r2\n"
+	"}\n"
+	// A diamond in the loop, the merge node is the latch
+	"define i32 @mergeInLoop(i32 %n) section \"asmjs\" {\n"
+	"entry:\n"
+	"  br label %header\n"
+	"header:\n"
+	"  %i = phi i32 [ 0, %entry ], [ %next, %merge ]\n"
+	"  %s = phi i32 [ 0, %entry ], [ %s2, %merge ]\n"
+	"  %odd = and i32 %i, 1\n"
+	"  %isOdd = icmp ne i32 %odd, 0\n"
+	"  br i1 %isOdd, label %then, label %else\n"
+	"then:\n"
+	"  %a = mul i32 %s, 3\n"
+	"  br label %merge\n"
+	"else:\n"
+	"  %b = add i32 %s, %i\n"
+	"  br label %merge\n"
+	"merge:\n"
+	"  %s2 = phi i32 [ %a, %then ], [ %b, %else ]\n"
+	"  %next = add i32 %i, 1\n"
+	"  %more = icmp slt i32 %next, %n\n"
+	"  br i1 %more, label %header, label %exit\n"
+	"exit:\n"
+	"  ret i32 %s2\n"
+	"}\n"
+	// The cases going straight to join assign its phi first
+	"define i32 @tableWithPrologue(i32 %x) section \"asmjs\" {\n"
+	"entry:\n"
+	"  switch i32 %x, label %other [\n"
+	"    i32 0, label %join\n"
+	"    i32 1, label %join\n"
+	"    i32 2, label %two\n"
+	"    i32 3, label %other\n"
+	"  ]\n"
+	"two:\n"
+	"  %t = mul i32 %x, 7\n"
+	"  br label %join\n"
+	"other:\n"
+	"  %o = add i32 %x, 100\n"
+	"  br label %join\n"
+	"join:\n"
+	"  %r = phi i32 [ 10, %entry ], [ 10, %entry ], [ %t, %two ], [ %o, %other ]\n"
+	"  %r2 = mul i32 %r, %x\n"
+	"  %r3 = add i32 %r2, 1\n"
+	"  ret i32 %r3\n"
+	"}\n"
+	"define i32 @switch64(i64 %x) section \"asmjs\" {\n"
+	"entry:\n"
+	"  switch i64 %x, label %def [\n"
+	"    i64 0, label %a\n"
+	"    i64 4294967296, label %b\n"
+	"  ]\n"
+	"a:\n"
+	"  br label %join\n"
+	"b:\n"
+	"  br label %join\n"
+	"def:\n"
+	"  br label %join\n"
+	"join:\n"
+	"  %r = phi i32 [ 1, %a ], [ 2, %b ], [ 3, %def ]\n"
+	"  ret i32 %r\n"
+	"}\n"
+	"define i32 @sparseSwitch(i32 %x) section \"asmjs\" {\n"
+	"entry:\n"
+	"  switch i32 %x, label %def [\n"
+	"    i32 0, label %a\n"
+	"    i32 1000000, label %b\n"
+	"  ]\n"
+	"a:\n"
+	"  br label %join\n"
+	"b:\n"
+	"  br label %join\n"
+	"def:\n"
+	"  br label %join\n"
+	"join:\n"
+	"  %r = phi i32 [ 1, %a ], [ 2, %b ], [ 3, %def ]\n"
+	"  ret i32 %r\n"
+	"}\n"
+	// A loop with two entries, one of its switch cases goes to the default
+	"define i32 @irreducible(i32 %x) section \"asmjs\" {\n"
+	"entry:\n"
+	"  %c = icmp eq i32 %x, 0\n"
+	"  br i1 %c, label %left, label %right\n"
+	"left:\n"
+	"  %l = phi i32 [ %x, %entry ], [ %r1, %right ]\n"
+	"  %l1 = add i32 %l, 3\n"
+	"  switch i32 %l1, label %right [\n"
+	"    i32 5, label %exit\n"
+	"    i32 6, label %right\n"
+	"  ]\n"
+	"right:\n"
+	"  %r = phi i32 [ 1, %entry ], [ %l1, %left ], [ %l1, %left ]\n"
+	"  %r1 = mul i32 %r, 5\n"
+	"  %c2 = icmp sgt i32 %r1, 1000\n"
+	"  br i1 %c2, label %exit, label %left\n"
+	"exit:\n"
+	"  %e = phi i32 [ %l1, %left ], [ %r1, %right ]\n"
+	"  ret i32 %e\n"
+	"}\n"
+	"define void @webMain() section \"asmjs\" {\n"
+	"  %a = call i32 @multiExit(i32 10)\n"
+	"  %b = call i32 @mergeInLoop(i32 10)\n"
+	"  %c = call i32 @tableWithPrologue(i32 2)\n"
+	"  %d = call i32 @switch64(i64 4294967296)\n"
+	"  %e = call i32 @sparseSwitch(i32 1000000)\n"
+	"  %f = call i32 @irreducible(i32 0)\n"
+	"  ret void\n"
+	"}\n");
+
+TEST(CheerpTest, WasmStructurizerTest) {
+
+	std::string structured = compileWast(StructurizerIR, /*useStructurizer*/ true);
+	std::string relooped = compileWast(StructurizerIR, /*useStructurizer*/ false);
+	ASSERT_FALSE( structured.empty() );
+	ASSERT_FALSE( relooped.empty() );
+	for (const char* name: { "multiExit", "mergeInLoop", "tableWithPrologue", "switch64", "sparseSwitch", "irreducible" })
+	{
+		EXPECT_TRUE( isNested(getFunctionCode(structured, name)) ) << name;
+		EXPECT_TRUE( isNested(getFunctionCode(relooped, name)) ) << name;
+	}
+
+	/** The exits of a loop do not need the label variable of the Relooper **/
+	std::string multiExit = getFunctionCode(structured, "multiExit");
+	EXPECT_NE( std::string::npos, multiExit.find("(local i32)\n") );
+	EXPECT_NE( std::string::npos, getFunctionCode(relooped, "multiExit").find("(local i32 i32)\n") );
+	EXPECT_EQ( 1u, countInsts(multiExit, "loop") );
+
+	/** The merge node in the loop follows a block which encloses the diamond **/
+	std::string mergeInLoop = getFunctionCode(structured, "mergeInLoop");
+	EXPECT_NE( std::string::npos, mergeInLoop.find("loop\nblock\n") );
+	EXPECT_EQ( 1u, countInsts(mergeInLoop, "if") );
+	EXPECT_EQ( 1u, countInsts(mergeInLoop, "br_if") );
+
+	/** The cases with a prologue go through a block placed after the br_table **/
+	std::string tableWithPrologue = getFunctionCode(structured, "tableWithPrologue");
+	EXPECT_NE( std::string::npos, tableWithPrologue.find("br_table 0 0 1 2 2\nend\ni32.const 10\nset_local 1\nbr 2\nend\n") );
+
+	/** i64 and very sparse switches use a chain of br_if **/
+	std::string switch64 = getFunctionCode(structured, "switch64");
+	EXPECT_EQ( 0u, countInsts(switch64, "br_table") );
+	EXPECT_EQ( 2u, countInsts(switch64, "i64.eq") );
+	EXPECT_EQ( 2u, countInsts(switch64, "br_if") );
+	std::string sparseSwitch = getFunctionCode(structured, "sparseSwitch");
+	EXPECT_EQ( 0u, countInsts(sparseSwitch, "br_table") );
+	EXPECT_EQ( 2u, countInsts(sparseSwitch, "i32.eq") );
+	EXPECT_EQ( 2u, countInsts(sparseSwitch, "br_if") );
+
+	/** Irreducible control flow is left to the Relooper **/
+	std::string irreducible = getFunctionCode(structured, "irreducible");
+	EXPECT_EQ( getFunctionCode(relooped, "irreducible"), irreducible );
+	EXPECT_EQ( 1u, countInsts(irreducible, "br_table") );
+}
+
+}
+}